@@ -2,6 +2,7 @@
 #include "6502_defines.h"
 #include "cpu.h"
 #include "util.h"
+#include <string.h>
 #include <sys/types.h>
 
 u8 opcode_id_table[NUM_6502_OPCODES][ADDRMODE_COUNT] = {
@@ -29,9 +30,9 @@ u8 opcode_id_table[NUM_6502_OPCODES][ADDRMODE_COUNT] = {
      0x00}, // BPL
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
      0x00}, // BRK
-    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x70, 0x00, 0x00,
-     0x00}, // BVC
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x50, 0x00, 0x00,
+     0x00}, // BVC
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x70, 0x00, 0x00,
      0x00}, // BVS
     {0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
      0x00}, // CLC
@@ -47,27 +48,27 @@ u8 opcode_id_table[NUM_6502_OPCODES][ADDRMODE_COUNT] = {
      0x00}, // CPX
     {0x00, 0xC0, 0xCC, 0x00, 0x00, 0xC4, 0x00, 0x00, 0x00, 0x00, 0x00,
      0x00}, // CPY
-    {0xC6, 0x00, 0xCE, 0xDE, 0x00, 0xC6, 0xD6, 0x00, 0x00, 0x00, 0x00,
+    {0x00, 0x00, 0xCE, 0xDE, 0x00, 0xC6, 0xD6, 0x00, 0x00, 0x00, 0x00,
      0x00}, // DEC
     {0xCA, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
      0x00}, // DEX
     {0x88, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
      0x00}, // DEY
-    {0x00, 0xC9, 0xCD, 0xDD, 0xD9, 0xC5, 0xD5, 0x00, 0x00, 0x00, 0xC1,
-     0xD1}, // EOR
-    {0xE6, 0x00, 0xEE, 0xFE, 0x00, 0xE6, 0xF6, 0x00, 0x00, 0x00, 0x00,
+    {0x00, 0x49, 0x4D, 0x5D, 0x59, 0x45, 0x55, 0x00, 0x00, 0x00, 0x41,
+     0x51}, // EOR
+    {0x00, 0x00, 0xEE, 0xFE, 0x00, 0xE6, 0xF6, 0x00, 0x00, 0x00, 0x00,
      0x00}, // INC
     {0xE8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
      0x00}, // INX
     {0xC8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
      0x00}, // INY
-    {0x00, 0x4C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6C, 0x00,
+    {0x00, 0x00, 0x4C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6C, 0x00,
      0x00}, // JMP
-    {0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    {0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
      0x00}, // JSR
     {0x00, 0xA9, 0xAD, 0xBD, 0xB9, 0xA5, 0xB5, 0x00, 0x00, 0x00, 0xA1,
      0xB1}, // LDA
-    {0x00, 0xA2, 0xAE, 0xBE, 0x00, 0xA6, 0xB6, 0x00, 0x00, 0x00, 0x00,
+    {0x00, 0xA2, 0xAE, 0x00, 0xBE, 0xA6, 0x00, 0xB6, 0x00, 0x00, 0x00,
      0x00}, // LDX
     {0x00, 0xA0, 0xAC, 0xBC, 0x00, 0xA4, 0xB4, 0x00, 0x00, 0x00, 0x00,
      0x00}, // LDY
@@ -103,7 +104,7 @@ u8 opcode_id_table[NUM_6502_OPCODES][ADDRMODE_COUNT] = {
      0x00}, // SEI
     {0x00, 0x00, 0x8D, 0x9D, 0x99, 0x85, 0x95, 0x00, 0x00, 0x00, 0x81,
      0x91}, // STA
-    {0x00, 0x00, 0x8E, 0x00, 0x00, 0x86, 0x96, 0x00, 0x00, 0x00, 0x00,
+    {0x00, 0x00, 0x8E, 0x00, 0x00, 0x86, 0x00, 0x96, 0x00, 0x00, 0x00,
      0x00}, // STX
     {0x00, 0x00, 0x8C, 0x00, 0x00, 0x84, 0x94, 0x00, 0x00, 0x00, 0x00,
      0x00}, // STY
@@ -121,6 +122,69 @@ u8 opcode_id_table[NUM_6502_OPCODES][ADDRMODE_COUNT] = {
      0x00} // TYA
 };
 
+// base cycle counts for each (instruction, mode), laid out exactly like the
+// opcode_id_table. these are the cycles before any page crossing or taken
+// branch penalties.
+u8 opcode_cycle_table[NUM_6502_OPCODES][ADDRMODE_COUNT] = {
+    //   Imp, Imm, Abs, AbsX, AbsY, ZP, ZPX, ZPY, Rel, Ind, IdxInd, IndIdx
+    {0, 2, 4, 4, 4, 3, 4, 0, 0, 0, 6, 5}, // ADC
+    {0, 2, 4, 4, 4, 3, 4, 0, 0, 0, 6, 5}, // AND
+    {2, 0, 6, 7, 0, 5, 6, 0, 0, 0, 0, 0}, // ASL
+    {0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, // BCC
+    {0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, // BCS
+    {0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, // BEQ
+    {0, 0, 4, 0, 0, 3, 0, 0, 0, 0, 0, 0}, // BIT
+    {0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, // BMI
+    {0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, // BNE
+    {0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, // BPL
+    {7, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // BRK
+    {0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, // BVC
+    {0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, // BVS
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // CLC
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // CLD
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // CLI
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // CLV
+    {0, 2, 4, 4, 4, 3, 4, 0, 0, 0, 6, 5}, // CMP
+    {0, 2, 4, 0, 0, 3, 0, 0, 0, 0, 0, 0}, // CPX
+    {0, 2, 4, 0, 0, 3, 0, 0, 0, 0, 0, 0}, // CPY
+    {0, 0, 6, 7, 0, 5, 6, 0, 0, 0, 0, 0}, // DEC
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // DEX
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // DEY
+    {0, 2, 4, 4, 4, 3, 4, 0, 0, 0, 6, 5}, // EOR
+    {0, 0, 6, 7, 0, 5, 6, 0, 0, 0, 0, 0}, // INC
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // INX
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // INY
+    {0, 0, 3, 0, 0, 0, 0, 0, 0, 5, 0, 0}, // JMP
+    {0, 0, 6, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // JSR
+    {0, 2, 4, 4, 4, 3, 4, 0, 0, 0, 6, 5}, // LDA
+    {0, 2, 4, 0, 4, 3, 0, 4, 0, 0, 0, 0}, // LDX
+    {0, 2, 4, 4, 0, 3, 4, 0, 0, 0, 0, 0}, // LDY
+    {2, 0, 6, 7, 0, 5, 6, 0, 0, 0, 0, 0}, // LSR
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // NOP
+    {0, 2, 4, 4, 4, 3, 4, 0, 0, 0, 6, 5}, // ORA
+    {3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // PHA
+    {3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // PHP
+    {4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // PLA
+    {4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // PLP
+    {2, 0, 6, 7, 0, 5, 6, 0, 0, 0, 0, 0}, // ROL
+    {2, 0, 6, 7, 0, 5, 6, 0, 0, 0, 0, 0}, // ROR
+    {6, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // RTI
+    {6, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // RTS
+    {0, 2, 4, 4, 4, 3, 4, 0, 0, 0, 6, 5}, // SBC
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // SEC
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // SED
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // SEI
+    {0, 0, 4, 5, 5, 3, 4, 0, 0, 0, 6, 6}, // STA
+    {0, 0, 4, 0, 0, 3, 0, 4, 0, 0, 0, 0}, // STX
+    {0, 0, 4, 0, 0, 3, 4, 0, 0, 0, 0, 0}, // STY
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // TAX
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // TAY
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // TSX
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // TXA
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, // TXS
+    {2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0} // TYA
+};
+
 // arg contains the addressing type and value, lexeme contains the instruction
 // id offset by INSTRUCTION_MASK.
 //
@@ -130,7 +194,7 @@ uint make_opcode(Arg argument, Lexeme instruction_id, u8 dest[MAX_OPCODE_LEN]) {
   // in theory, the lookup table instructions should be ordered the same way
   // they are in the Lexeme table. (just offset by the instruction mask.)
   int opcode_offset = instruction_id - INSTRUCTION_MASK;
-  if (opcode_offset < 0 || opcode_offset > NUM_6502_OPCODES) {
+  if (opcode_offset < 0 || opcode_offset >= NUM_6502_OPCODES) {
     error("INVALID INSTRUCTION LEXEME PASSED TO make_opcode(). [lexeme: %d]\n",
           instruction_id);
   }
@@ -139,7 +203,9 @@ uint make_opcode(Arg argument, Lexeme instruction_id, u8 dest[MAX_OPCODE_LEN]) {
   u8 opcode_id = opcode_id_table[opcode_offset][argument.mode];
   dest[0] = opcode_id;
 
-  if (opcode_id == 0x00) {
+  // BRK is the one instruction that really does encode to 0x00, everything else
+  // with a zero in the table is an invalid addressing mode.
+  if (opcode_id == 0x00 && !(instruction_id == BRK && argument.mode == Implicit)) {
     error("INVALID OPCODE ID SELECTED FROM THE TABLE!\nYou tried to "
           "select: %d with addrmode %d. Exiting...\n",
           instruction_id, argument.mode);
@@ -209,6 +275,7 @@ uint make_opcode(Arg argument, Lexeme instruction_id, u8 dest[MAX_OPCODE_LEN]) {
 
   case Indirect: {
     dest[1] = value_list[0];
+    dest[2] = value_list[1];
     return 3;
   } break;
 
@@ -225,4 +292,64 @@ uint make_opcode(Arg argument, Lexeme instruction_id, u8 dest[MAX_OPCODE_LEN]) {
   default: {
   } break;
   }
+
+  return 1;
+}
+
+// how many bytes each addressing mode takes up, including the opcode id.
+const u8 addrmode_len_table[ADDRMODE_COUNT] = {
+    //   Imp,  Imm,   Abs,  AbsX, AbsY,   ZP,  ZPX,  ZPY, Rel, Ind, IdxInd,
+    //   IndIdx
+    1, 2, 3, 3, 3, 2, 2, 2, 2, 3, 2, 2};
+
+DecodeEntry decode_table[256] = {0};
+
+// the opcode_id_table maps (instruction, mode) -> opcode id, so just walk it
+// once and write every slot back into the reverse table. anything that's never
+// written stays as LEXEME_NULL, which the users of the table treat as an
+// illegal opcode.
+void init_decode_table() {
+  memset(decode_table, 0, sizeof(decode_table));
+
+  for (int i = 0; i < NUM_6502_OPCODES; i++) {
+    for (int mode = 0; mode < ADDRMODE_COUNT; mode++) {
+      u8 opcode_id = opcode_id_table[i][mode];
+      if (opcode_id == 0x00) {
+        continue;
+      }
+
+      decode_table[opcode_id] = (DecodeEntry){
+          .instruction = (Lexeme)(i + INSTRUCTION_MASK),
+          .mode = (AddrMode)mode,
+          .len = addrmode_len_table[mode],
+          .cycles = opcode_cycle_table[i][mode],
+      };
+    }
+  }
+
+  // the zero slots in the table mean "invalid", so BRK never gets picked up by
+  // the loop above.
+  decode_table[0x00] = (DecodeEntry){.instruction = BRK,
+                                     .mode = Implicit,
+                                     .len = 1,
+                                     .cycles = instruction_cycles(BRK, Implicit)};
+}
+
+bool has_addrmode(Lexeme instruction_id, AddrMode mode) {
+  int opcode_offset = instruction_id - INSTRUCTION_MASK;
+  if (opcode_offset < 0 || opcode_offset >= NUM_6502_OPCODES) {
+    return false;
+  }
+  if (instruction_id == BRK) {
+    return mode == Implicit;
+  }
+  return opcode_id_table[opcode_offset][mode] != 0x00;
+}
+
+u8 instruction_cycles(Lexeme instruction_id, AddrMode mode) {
+  int opcode_offset = instruction_id - INSTRUCTION_MASK;
+  if (opcode_offset < 0 || opcode_offset >= NUM_6502_OPCODES) {
+    return 0;
+  }
+  return opcode_cycle_table[opcode_offset][mode];
 }
@@ -10,4 +10,26 @@
 #define MAX_OPCODE_LEN 3
 #define NUM_6502_OPCODES 80
 
+// one slot in the reverse (opcode id -> instruction) table. an instruction of
+// LEXEME_NULL means the opcode id is illegal.
+typedef struct DecodeEntry {
+  Lexeme instruction;
+  AddrMode mode;
+  u8 len;    // full instruction length, opcode id included.
+  u8 cycles; // base cycles, from the opcode_cycle_table.
+} DecodeEntry;
+
+extern u8 opcode_id_table[NUM_6502_OPCODES][ADDRMODE_COUNT];
+extern u8 opcode_cycle_table[NUM_6502_OPCODES][ADDRMODE_COUNT];
+extern const u8 addrmode_len_table[ADDRMODE_COUNT];
+extern DecodeEntry decode_table[256];
+
 uint make_opcode(Arg argument, Lexeme instruction_id, u8 dest[MAX_OPCODE_LEN]);
+// can the instruction be encoded with this addressing mode at all?
+bool has_addrmode(Lexeme instruction_id, AddrMode mode);
+// base cycle count of the (instruction, mode) pair.
+u8 instruction_cycles(Lexeme instruction_id, AddrMode mode);
+
+// fill the decode_table from the opcode_id_table. call this once before using
+// the decode_table.
+void init_decode_table();
@@ -11,26 +11,46 @@ Node make_node(NodeType type, NodeIndex left, NodeIndex right, NodeData data) {
   return (Node){type, left, right, data};
 }
 
+// nodes are never freed one at a time, only all at once by clean_ast, so the
+// next free slot is always just the end.
+NodeIndex ast_len = 1; // skip NULL.
+
 NodeIndex add_node(Node n) {
-  // skip NULL.
-  for (int i = 1; i < AST_LEN; i++) {
-    Node target_node = ast[i];
-    if (target_node.type ==
-        NT_NULL) { // if the node's type is zeroed, then it was likely just
-                   // alloced or cleared in the overarching array.
-      ast[i] = n;
-      return i;
-    }
+  if (ast_len >= AST_LEN) {
+    fprintf(stderr, "Too many nodes in the AST. Exiting...\n");
+    exit(1);
+  }
+
+  ast[ast_len] = n;
+  return ast_len++;
+}
+
+SourcePos node_pos[AST_LEN] = {0};
+SourceFile source_files[SOURCE_FILES_LEN] = {0};
+u16 num_source_files = 0;
+
+u16 add_source_file(const char *path, const char *text, bool owned) {
+  if (num_source_files >= SOURCE_FILES_LEN) {
+    fprintf(stderr, "Too many source files. Exiting...\n");
+    exit(1);
   }
 
-  fprintf(stderr, "Too many nodes in the AST. Exiting...\n");
-  exit(1);
+  source_files[num_source_files] =
+      (SourceFile){path, text, strlen(text), owned};
+  return num_source_files++;
 }
 
 // called by the greater clean() function.
 void clean_ast() {
-  // TODO: optimize this, it's not necessary to blank out the whole ast space
-  // if we keep track of the maximum index used in the AST.
-  memset(ast, 0,
-         sizeof(Node) * AST_LEN); // blank out the ast array full of nodes.
+  // only blank out the part of the ast space that's actually been used.
+  memset(ast, 0, sizeof(Node) * ast_len);
+  memset(node_pos, 0, sizeof(SourcePos) * ast_len);
+  ast_len = 1;
+
+  for (u16 i = 0; i < num_source_files; i++) {
+    if (source_files[i].owned) {
+      free((char *)source_files[i].text);
+    }
+  }
+  num_source_files = 0;
 }
@@ -2,6 +2,7 @@
 
 #include "arguments.h"
 #include "defines.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef u16 NodeIndex; // let the indexing into the node array be 16 bits wide.
@@ -43,6 +44,21 @@ typedef enum NodeType {
   // one argument in an instruction or pragma.
   NT_ARGUMENT,
 
+  // an assembler directive, like ".bound 8". the PragmaType goes in the data
+  // field and the argument (if it has one) in the left slot.
+  NT_PRAGMA,
+
+  // a run of data bytes from .byte, .word, .fill or .incbin. the data field
+  // is the SpanIndex, the bytes themselves live in the span table.
+  NT_DATA,
+
+  // these two only show up inside a .macro or .rept body, everywhere else
+  // they're expanded into an NT_DATA while parsing. the call keeps a MacroCall
+  // pointer in the data field, the .rept keeps its count there and the body
+  // in the left slot.
+  NT_MACRO_CALL,
+  NT_REPT,
+
   NT_STATEMENT_LIST,
 
   NT_BLOCK, // this is more than just another statement list. we need to keep
@@ -60,6 +76,16 @@ typedef enum BinopType {
   BO_COUNT,
 } BinopType;
 
+typedef enum PragmaType {
+  PR_NULL = 0,
+  PR_BOUND, // .bound N, the loop headed by the next label runs at most N times.
+  PR_ORG,   // .org $addr, place everything after this at addr.
+  PR_BANK,  // .bank N, everything after this goes in bank N, see bank.h.
+  PR_ENDM,  // the end of a .macro body.
+  PR_ENDR,  // the end of a .rept body.
+  PR_COUNT,
+} PragmaType;
+
 typedef enum DataType {
   DT_INVALID = 0, // invalid datatype, for recognizing non-taken slots in the
                   // symbol table.
@@ -67,6 +93,7 @@ typedef enum DataType {
   DT_VOID,
   DT_INT,
   DT_CHAR,
+  DT_MACRO, // the value is the index into the macro table.
   DT_COUNT,
 } DataType;
 
@@ -82,8 +109,32 @@ typedef struct Node {
 // the ast array itself and ast management functionality, along with node type
 // defines.
 extern Node ast[AST_LEN]; // store the literal values in a row.
+extern NodeIndex ast_len;  // one past the last node in use.
+
+// where a statement came from. kept next to the ast instead of in the Node, so
+// the nodes stay 128 bits.
+typedef struct SourcePos {
+  u16 file;        // index into source_files.
+  u32 line;        // 1-based.
+  u32 line_start;  // offset of the start of the line in the file's text.
+} SourcePos;
+
+typedef struct SourceFile {
+  const char *path; // NULL for the text handed straight to parse().
+  const char *text;
+  u32 len;
+  bool owned; // the text is ours to free in clean_ast.
+} SourceFile;
+
+#define SOURCE_FILES_LEN 256
+
+// only statement nodes get a position, everything else is left zeroed.
+extern SourcePos node_pos[AST_LEN];
+extern SourceFile source_files[SOURCE_FILES_LEN];
+extern u16 num_source_files;
 
 // then, helpers for managing the ast itself.
 Node make_node(NodeType type, NodeIndex left, NodeIndex right, NodeData data);
 NodeIndex add_node(Node n);
+u16 add_source_file(const char *path, const char *text, bool owned);
 void clean_ast();
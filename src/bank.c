@@ -0,0 +1,170 @@
+#include "bank.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "map.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void select_write(void *ctx, u16 address, u8 value) {
+  bank_switch(ctx, value);
+}
+
+void banks_init(Banks *b, MemoryMap *m, const u8 *bytes, uint count) {
+  if (count == 0) {
+    error("There have to be some banks to switch between.");
+  }
+  memset(b, 0, sizeof(Banks));
+  b->map = m;
+  b->bytes = bytes;
+  b->count = count;
+  b->select = (Device){NULL, select_write, b};
+  map_rom(m, BANK_WINDOW >> 8, BANK_PAGES, bytes);
+  map_device(m, BANK_WINDOW >> 8, BANK_PAGES, &b->select);
+}
+
+void bank_switch(Banks *b, uint bank) {
+  bank %= b->count;
+  if (bank == b->current) {
+    return;
+  }
+  // only the read side, the writes all go to the register whichever bank's
+  // in. a page table entry for each page of the window.
+  u8 *bytes = (u8 *)b->bytes + (size_t)bank * BANK_SIZE;
+  u8 **read = &b->map->read[BANK_WINDOW >> 8];
+  for (uint i = 0; i < BANK_PAGES; i++) {
+    read[i] = bytes + (i << 8);
+  }
+  b->current = bank;
+  b->switches++;
+}
+
+void test_bank() {
+  printf("\n\nTESTING BANK\n\n\n");
+
+  static Core c;
+  static MemoryMap m;
+  static Banks b;
+
+  // the same call into each bank in turn, the fourth time round the bank
+  // number wraps back to 0.
+  u8 *image = assemble_source("  ldx #$00\n"
+                              "loop:\n"
+                              "  stx $8000\n"
+                              "  jsr $8000\n"
+                              "  inx\n"
+                              "  cpx #$04\n"
+                              "  bne loop\n"
+                              "  brk\n"
+                              ".bank 0\n"
+                              "  lda #$10\n"
+                              "  sta $0200,X\n"
+                              "  rts\n"
+                              ".bank 2\n"
+                              "  jmp far\n"
+                              "  .org $bff0\n"
+                              "far:\n"
+                              "  lda #$12\n"
+                              "  sta $0200,X\n"
+                              "  rts\n"
+                              ".bank 1\n"
+                              "  lda #$11\n"
+                              "  sta $0200,X\n"
+                              "  rts\n");
+
+  ASSERT(layout_banks == 3 && layout_end == 0x060e,
+         "three banks, and the 64k part ends before them");
+  ASSERT(lookup_symbol("far")->value == 0xbff0 &&
+             layout_bank_image[2 * BANK_SIZE + 0x3ff0] == 0xa9 &&
+             layout_bank_image[2 * BANK_SIZE + 0x3ff1] == 0x12,
+         "a .org inside a bank stays inside it");
+  ASSERT(layout_bank_image[BANK_SIZE + 1] == 0x11 && image[0x8000] == 0x00,
+         "each bank's bytes are in its own place, not the 64k");
+
+  core_init(&c);
+  map_init(&m, c.memory);
+  banks_init(&b, &m, layout_bank_image, layout_banks);
+  c.map = &m;
+  core_load(&c, image + layout_origin, layout_origin,
+            layout_end - layout_origin);
+  core_reset(&c, layout_origin);
+  StopReason r = core_run(&c, (RunBudget){0});
+  ASSERT(r == SR_BRK && memcmp(&c.memory[0x0200], "\x10\x11\x12\x10", 4) == 0,
+         "every call went to the bank picked for it");
+  ASSERT(b.switches == 3 && b.current == 0,
+         "picking the bank that's already in is free");
+  ASSERT(layout_bank_image[0] == 0xa9 && layout_bank_image[1] == 0x10,
+         "the stores to the register didn't land in the banks");
+
+  // the code outside the banks has to stay out of the window, before it or
+  // after it.
+  ASSERT(!assembly_fails("  .fill $7a00, $ea\n"
+                         ".bank 0\n"
+                         "  rts\n"),
+         "the fixed code can go right up to the window");
+  ASSERT(assembly_fails("  .fill $7a01, $ea\n"
+                        ".bank 0\n"
+                        "  rts\n"),
+         "but not a byte into it");
+  ASSERT(!assembly_fails("  nop\n"
+                         "  .org $c000\n"
+                         "  rts\n"
+                         ".bank 0\n"
+                         "  rts\n"),
+         "and past the window's fine");
+  ASSERT(!assembly_fails("  .fill $7a01, $ea\n"),
+         "without any banks the window's just memory");
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING BANK, SUCCESS!\n\n\n");
+}
+
+#define BENCH_BANK_SWITCHES 10000000
+#define BENCH_BANK_COUNT 32
+
+void bench_bank() {
+  static MemoryMap m;
+  static Banks b;
+  static u8 memory[0x10000];
+  u8 *bytes = calloc(BENCH_BANK_COUNT, BANK_SIZE);
+  map_init(&m, memory);
+  banks_init(&b, &m, bytes, BENCH_BANK_COUNT);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < BENCH_BANK_SWITCHES; i++) {
+    bank_switch(&b, i * 7);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double switched =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  // against copying the bank into the window, what it would be without the
+  // map.
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < BENCH_BANK_SWITCHES / 100; i++) {
+    memcpy(memory + BANK_WINDOW,
+           bytes + (size_t)(i * 7 % BENCH_BANK_COUNT) * BANK_SIZE, BANK_SIZE);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double copied =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  double switch_ns = switched / b.switches * 1e9;
+  double copy_ns = copied / (BENCH_BANK_SWITCHES / 100) * 1e9;
+  printf("bank: %.1fns a switch, %.1fns copying the bank in instead (%.0fx)\n",
+         switch_ns, copy_ns, copy_ns / switch_ns);
+  free(bytes);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "defines.h"
+#include "map.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// bank switching on top of a map (see map.h), for programs bigger than the
+// 64k. the assembler puts everything after a .bank N into bank N, at the
+// window. at run time the window's pages read one bank at a time, and a write
+// anywhere in the window picks the bank, like the UxROM carts on the NES. a
+// switch points the window's pages at another bank's bytes, nothing's copied.
+
+#define BANK_SIZE 0x4000
+#define BANK_PAGES (BANK_SIZE >> 8)
+#define BANK_WINDOW 0x8000
+#define BANKS_LEN 256
+
+typedef struct Banks {
+  MemoryMap *map;
+  const u8 *bytes; // count banks of BANK_SIZE, one after the other.
+  uint count;
+  uint current;
+  u64 switches;
+  Device select; // the write side of the window.
+} Banks;
+
+// map the window to bank 0 with the register over it. bytes has to last as
+// long as the map does.
+void banks_init(Banks *b, MemoryMap *m, const u8 *bytes, uint count);
+
+// a write of n picks bank n, wrapped around the count like the carts do.
+void bank_switch(Banks *b, uint bank);
+
+void test_bank();
+void bench_bank();
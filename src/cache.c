@@ -0,0 +1,343 @@
+#include "cache.h"
+
+#include "ast.h"
+#include "defines.h"
+#include "object.h"
+#include "parse.h"
+#include "span.h"
+#include "util.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the first line of every dependency list, bumped along with the objects.
+#define CACHE_MAGIC "6502CACHE 1"
+
+char *cache_dir = ".asmcache";
+
+typedef struct Dependency {
+  char path[CACHE_PATH_LEN];
+  u64 hash;
+} Dependency;
+
+static Dependency deps[CACHE_DEPS_LEN];
+static uint num_deps = 0;
+
+// big enough for anything the parser could have read in the first place.
+static char file_buffer[INPUT_LEN];
+
+u64 hash_bytes(u64 hash, const void *bytes, size_t len) {
+  const u8 *b = bytes;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= b[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+u64 cache_key(const char *source_path, const char *text, size_t len) {
+  char absolute[PATH_MAX];
+  if (realpath(source_path, absolute) == NULL) {
+    error("Could not find %s to work out its cache key.", source_path);
+  }
+  u32 version = OBJECT_VERSION;
+  u64 hash = hash_bytes(CACHE_HASH_SEED, &version, sizeof(version));
+  // the terminator too, so the path and the text can't run into each other.
+  hash = hash_bytes(hash, absolute, strlen(absolute) + 1);
+  return hash_bytes(hash, text, len);
+}
+
+void note_dependency(const char *path, const void *bytes, size_t len) {
+  char absolute[PATH_MAX];
+  if (realpath(path, absolute) == NULL) {
+    error("Could not find %s to note it as a dependency.", path);
+  }
+  for (uint i = 0; i < num_deps; i++) {
+    if (strcmp(deps[i].path, absolute) == 0) {
+      return;
+    }
+  }
+  if (num_deps >= CACHE_DEPS_LEN) {
+    error("Too many included files, the limit is %d.", CACHE_DEPS_LEN);
+  }
+  if (strlen(absolute) >= CACHE_PATH_LEN) {
+    error("The include path %s is too long.", absolute);
+  }
+
+  Dependency *d = &deps[num_deps++];
+  strcpy(d->path, absolute);
+  d->hash = hash_bytes(CACHE_HASH_SEED, bytes, len);
+}
+
+void clean_dependencies() { num_deps = 0; }
+
+// returns false if the file isn't there, a missing include is just a miss.
+static bool hash_file(const char *path, u64 *hash) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  size_t len = fread(file_buffer, 1, INPUT_LEN, f);
+  bool ok = !ferror(f);
+  fclose(f);
+
+  *hash = hash_bytes(CACHE_HASH_SEED, file_buffer, len);
+  return ok;
+}
+
+static void entry_path(u64 key, const char *extension, char *out) {
+  snprintf(out, CACHE_PATH_LEN, "%s/%016llx.%s", cache_dir,
+           (unsigned long long)key, extension);
+}
+
+// copy through a temporary and rename it into place, so nothing ever sees half
+// of a file. other processes might be doing the same thing at the same time.
+static bool copy_file(const char *from, const char *to) {
+  FILE *in = fopen(from, "rb");
+  if (in == NULL) {
+    return false;
+  }
+
+  char tmp[CACHE_PATH_LEN + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", to, (int)getpid());
+  FILE *out = fopen(tmp, "wb");
+  if (out == NULL) {
+    fclose(in);
+    return false;
+  }
+
+  bool ok = true;
+  size_t len;
+  while ((len = fread(file_buffer, 1, INPUT_LEN, in)) > 0) {
+    ok &= fwrite(file_buffer, 1, len, out) == len;
+  }
+  ok &= !ferror(in);
+  fclose(in);
+  ok &= fclose(out) == 0;
+
+  if (!ok || rename(tmp, to) != 0) {
+    remove(tmp);
+    return false;
+  }
+  return true;
+}
+
+bool cache_fetch(const char *source_path, const char *object_path) {
+  size_t len = read_into_buf(source_path, file_buffer, INPUT_LEN);
+  u64 key = cache_key(source_path, file_buffer, len);
+
+  char path[CACHE_PATH_LEN];
+  entry_path(key, "deps", path);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+
+  char line[CACHE_PATH_LEN + 32];
+  bool valid = fgets(line, sizeof(line), f) != NULL &&
+               strcmp(line, CACHE_MAGIC "\n") == 0;
+
+  // every line after is "hash path" for one included file.
+  while (valid && fgets(line, sizeof(line), f) != NULL) {
+    unsigned long long expected;
+    int path_at;
+    if (sscanf(line, "%16llx %n", &expected, &path_at) != 1) {
+      valid = false;
+      break;
+    }
+    char *dep = line + path_at;
+    dep[strcspn(dep, "\n")] = '\0';
+
+    u64 hash;
+    valid = hash_file(dep, &hash) && hash == expected;
+  }
+  fclose(f);
+
+  if (!valid) {
+    return false;
+  }
+  entry_path(key, "o", path);
+  return copy_file(path, object_path);
+}
+
+void cache_store(u64 key, const char *object_path) {
+  if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST) {
+    error("Could not make the cache directory %s.", cache_dir);
+  }
+
+  // the object goes in first, the entry only counts once its dependency list
+  // is there.
+  char path[CACHE_PATH_LEN];
+  entry_path(key, "o", path);
+  if (!copy_file(object_path, path)) {
+    error("Could not copy %s into the cache.", object_path);
+  }
+
+  entry_path(key, "deps", path);
+  char tmp[CACHE_PATH_LEN + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    error("Could not write the cache entry %s.", path);
+  }
+  fprintf(f, "%s\n", CACHE_MAGIC);
+  for (uint i = 0; i < num_deps; i++) {
+    fprintf(f, "%016llx %s\n", (unsigned long long)deps[i].hash,
+            deps[i].path);
+  }
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    remove(tmp);
+    error("Could not write the cache entry %s.", path);
+  }
+}
+
+static void write_file(const char *path, const char *text) {
+  FILE *f = fopen(path, "w");
+  ASSERT(f != NULL, "write a test file");
+  fputs(text, f);
+  fclose(f);
+}
+
+void test_cache() {
+  printf("\n\nTESTING CACHE\n\n\n");
+
+  char *old_dir = cache_dir;
+  cache_dir = "/tmp/6502_cache_test";
+  char *source = "/tmp/6502_cache_src.s";
+  char *include = "/tmp/6502_cache_inc.s";
+  char *object = "/tmp/6502_cache_src.o";
+  char *fetched = "/tmp/6502_cache_fetched.o";
+
+  {
+    ASSERT(hash_bytes(CACHE_HASH_SEED, "a", 1) == 0xaf63dc4c8601ec8cULL,
+           "fnv-1a matches the reference value");
+  }
+
+  char *text = ".include \"/tmp/6502_cache_inc.s\"\n";
+  write_file(source, text);
+  write_file(include, "nop\n");
+  write_file(object, "pretend this is an object");
+
+  ASSERT(cache_key(source, "nop", 3) != cache_key(source, "rts", 3),
+         "different sources get different keys");
+  u64 key = cache_key(source, text, strlen(text));
+
+  {
+    clean_dependencies();
+    note_dependency(include, "nop\n", 4);
+    note_dependency(include, "nop\n", 4);
+    ASSERT(num_deps == 1, "an include is only noted once");
+
+    remove(fetched);
+    ASSERT(!cache_fetch(source, fetched), "nothing cached yet");
+    cache_store(key, object);
+    ASSERT(cache_fetch(source, fetched), "hit after storing");
+
+    FILE *f = fopen(fetched, "r");
+    char buf[64] = {0};
+    ASSERT(f != NULL && fgets(buf, sizeof(buf), f) != NULL &&
+               strcmp(buf, "pretend this is an object") == 0,
+           "the fetched object is the stored one");
+    fclose(f);
+  }
+
+  {
+    // the source is the same, but what it includes isn't.
+    write_file(include, "rts\n");
+    ASSERT(!cache_fetch(source, fetched), "a changed include is a miss");
+    remove(include);
+    ASSERT(!cache_fetch(source, fetched), "a missing include is a miss");
+  }
+
+  char path[CACHE_PATH_LEN];
+  entry_path(key, "o", path);
+  remove(path);
+  entry_path(key, "deps", path);
+  remove(path);
+
+  {
+    // an .incbin is a dependency too. the path is relative to the source,
+    // not to wherever the tests were run from.
+    char *blob = "/tmp/6502_cache_blob.bin";
+    text = "  .incbin \"6502_cache_blob.bin\"\n";
+    write_file(source, text);
+    write_file(blob, "\x01\x02\x03\x04");
+    key = cache_key(source, text, strlen(text));
+
+    clean_ast();
+    clean_spans();
+    clean_dependencies();
+    parse_path = source;
+    parse(text);
+    parse_path = NULL;
+    char absolute[PATH_MAX];
+    ASSERT(num_deps == 1 && realpath(blob, absolute) != NULL &&
+               strcmp(deps[0].path, absolute) == 0,
+           "the .incbin is noted by its absolute path");
+
+    cache_store(key, object);
+    ASSERT(cache_fetch(source, fetched), "hit with the same blob");
+    write_file(blob, "\x01\x02\x03\x05");
+    ASSERT(!cache_fetch(source, fetched), "a changed .incbin is a miss");
+
+    remove(blob);
+    clean_spans();
+    clean_ast();
+    entry_path(key, "o", path);
+    remove(path);
+    entry_path(key, "deps", path);
+    remove(path);
+  }
+  {
+    // the same source in two directories, each with its own inc.s next to
+    // it. the second one can't get the first one's object.
+    char *sources[2] = {"/tmp/6502_cache_a/m.s", "/tmp/6502_cache_b/m.s"};
+    char *includes[2] = {"/tmp/6502_cache_a/inc.s", "/tmp/6502_cache_b/inc.s"};
+    text = ".include \"inc.s\"\n";
+    mkdir("/tmp/6502_cache_a", 0755);
+    mkdir("/tmp/6502_cache_b", 0755);
+    write_file(sources[0], text);
+    write_file(sources[1], text);
+    write_file(includes[0], "nop\n");
+    write_file(includes[1], "brk\n");
+
+    u64 keys[2];
+    for (uint i = 0; i < 2; i++) {
+      keys[i] = cache_key(sources[i], text, strlen(text));
+    }
+    ASSERT(keys[0] != keys[1], "the same text in two places has two keys");
+
+    clean_dependencies();
+    note_dependency(includes[0], "nop\n", 4);
+    cache_store(keys[0], object);
+    ASSERT(cache_fetch(sources[0], fetched) &&
+               !cache_fetch(sources[1], fetched),
+           "so the other directory's source misses");
+
+    for (uint i = 0; i < 2; i++) {
+      remove(sources[i]);
+      remove(includes[i]);
+    }
+    rmdir("/tmp/6502_cache_a");
+    rmdir("/tmp/6502_cache_b");
+    entry_path(keys[0], "o", path);
+    remove(path);
+    entry_path(keys[0], "deps", path);
+    remove(path);
+  }
+  rmdir(cache_dir);
+  remove(source);
+  remove(object);
+  remove(fetched);
+
+  clean_dependencies();
+  cache_dir = old_dir;
+
+  printf("\n\nDONE TESTING CACHE, SUCCESS!\n\n\n");
+}
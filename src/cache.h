@@ -0,0 +1,43 @@
+#pragma once
+
+#include "defines.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CACHE_DEPS_LEN 64
+#define CACHE_PATH_LEN 512
+
+// the modules' objects, kept in a directory and keyed by a hash of the
+// source's absolute path and its bytes. the path's in it because the includes
+// are found from the source's directory, so the same text somewhere else can
+// pull in different files. every entry also lists the files the source pulled
+// in with .include or .incbin and the hash each one had, so it only counts as
+// a hit if those are all still the same. the files are listed by their
+// absolute paths, so the entry means the same thing whatever directory it's
+// checked from.
+extern char *cache_dir;
+
+// fnv-1a, 64 bits. start with hash = CACHE_HASH_SEED.
+#define CACHE_HASH_SEED 0xcbf29ce484222325ULL
+u64 hash_bytes(u64 hash, const void *bytes, size_t len);
+
+// the key for a source unit, where it is and its bytes, plus the version of
+// the object format.
+u64 cache_key(const char *source_path, const char *text, size_t len);
+
+// the parser calls this for every file it includes or .incbins, with what it
+// read from it.
+void note_dependency(const char *path, const void *bytes, size_t len);
+void clean_dependencies();
+
+// copy the cached object for the source into object_path. returns false if
+// there's nothing usable in the cache.
+bool cache_fetch(const char *source_path, const char *object_path);
+
+// remember the object just assembled from the source with the given key, along
+// with everything noted since the last clean_dependencies.
+void cache_store(u64 key, const char *object_path);
+
+void test_cache();
@@ -0,0 +1,418 @@
+#include "condition.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// the compiler's a recursive descent straight over the text, each rule
+// emitting its code as it goes. depth is how many values the code so far
+// leaves on the stack.
+typedef struct Compiler {
+  const char *text;
+  const char *at;
+  Condition *cond;
+  uint depth;
+} Compiler;
+
+static void skip_space(Compiler *k) {
+  while (isspace(*k->at)) {
+    k->at++;
+  }
+}
+
+// eat tok if it's next.
+static bool accept(Compiler *k, const char *tok) {
+  skip_space(k);
+  size_t len = strlen(tok);
+  if (strncmp(k->at, tok, len) == 0) {
+    k->at += len;
+    return true;
+  }
+  return false;
+}
+
+static void emit(Compiler *k, u8 byte) {
+  if (k->cond->len >= CONDITION_CODE_LEN) {
+    error("The condition \"%s\" is too long.", k->text);
+  }
+  k->cond->code[k->cond->len++] = byte;
+}
+
+static void emit_push(Compiler *k, ConditionOp op, u16 value) {
+  if (++k->depth > CONDITION_STACK_LEN) {
+    error("The condition \"%s\" nests too deep.", k->text);
+  }
+  emit(k, op);
+  emit(k, value & 0xff);
+  if (op != CO_REGISTER) {
+    emit(k, value >> 8);
+  }
+}
+
+// the binary ops take two values and leave one.
+static void emit_op(Compiler *k, ConditionOp op) {
+  emit(k, op);
+  k->depth--;
+}
+
+static u16 number(Compiler *k) {
+  char *end;
+  unsigned long value;
+  if (*k->at == '$') {
+    value = strtoul(k->at + 1, &end, 16);
+  } else if (*k->at == '%') {
+    value = strtoul(k->at + 1, &end, 2);
+  } else {
+    value = strtoul(k->at, &end, 10);
+  }
+  if (end == k->at || (end == k->at + 1 && !isdigit(*k->at))) {
+    error("Expected a number in the condition \"%s\" at \"%s\".", k->text,
+          k->at);
+  }
+  if (value > 0xffff) {
+    error("%lu doesn't fit in 16 bits, in the condition \"%s\".", value,
+          k->text);
+  }
+  k->at = end;
+  return value;
+}
+
+static const char *register_names[] = {
+    [CR_A] = "A", [CR_X] = "X", [CR_Y] = "Y",
+    [CR_SP] = "SP", [CR_P] = "P", [CR_PC] = "PC",
+};
+
+static void operand(Compiler *k) {
+  skip_space(k);
+  if (accept(k, "#")) {
+    emit_push(k, CO_CONST, number(k));
+  } else if (*k->at == '$' || *k->at == '%') {
+    emit_push(k, CO_LOAD, number(k));
+  } else if (isdigit(*k->at)) {
+    emit_push(k, CO_CONST, number(k));
+  } else if (isalpha(*k->at) || *k->at == '_') {
+    char name[64];
+    uint len = 0;
+    while ((isalnum(*k->at) || *k->at == '_') && len < sizeof(name) - 1) {
+      name[len++] = *k->at++;
+    }
+    name[len] = '\0';
+
+    for (uint r = 0; r <= CR_PC; r++) {
+      if (strcasecmp(name, register_names[r]) == 0) {
+        emit_push(k, CO_REGISTER, r);
+        return;
+      }
+    }
+    Symbol *s = lookup_symbol(name);
+    if (s == NULL || s->type != DT_INT) {
+      error("There's no register or label %s, in the condition \"%s\".", name,
+            k->text);
+    }
+    emit_push(k, CO_LOAD, s->value);
+  } else {
+    error("Expected a register, a number or a label in the condition \"%s\" "
+          "at \"%s\".",
+          k->text, k->at);
+  }
+}
+
+static void any(Compiler *k);
+
+static void comparison(Compiler *k) {
+  if (accept(k, "!")) {
+    comparison(k);
+    emit(k, CO_NOT);
+    return;
+  }
+  if (accept(k, "(")) {
+    any(k);
+    if (!accept(k, ")")) {
+      error("Missing a ) in the condition \"%s\".", k->text);
+    }
+    return;
+  }
+
+  operand(k);
+  // the two character ones first, so < doesn't eat the start of <=.
+  static const struct {
+    const char *tok;
+    ConditionOp op;
+  } ops[] = {{"==", CO_EQ}, {"!=", CO_NE}, {"<=", CO_LE},
+             {">=", CO_GE}, {"<", CO_LT},  {">", CO_GT}};
+  for (uint i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (accept(k, ops[i].tok)) {
+      operand(k);
+      emit_op(k, ops[i].op);
+      return;
+    }
+  }
+  // just an operand is true when it isn't zero.
+}
+
+static void all(Compiler *k) {
+  comparison(k);
+  while (accept(k, "&&")) {
+    comparison(k);
+    emit_op(k, CO_AND);
+  }
+}
+
+static void any(Compiler *k) {
+  all(k);
+  while (accept(k, "||")) {
+    all(k);
+    emit_op(k, CO_OR);
+  }
+}
+
+void condition_compile(Condition *cond, const char *text) {
+  memset(cond, 0, sizeof(Condition));
+  Compiler k = {text, text, cond, 0};
+  any(&k);
+  skip_space(&k);
+  if (*k.at != '\0') {
+    error("Extra garbage at the end of the condition \"%s\": \"%s\".", text,
+          k.at);
+  }
+}
+
+bool condition_holds(const Condition *cond, Registers r, const u8 *memory) {
+  u16 stack[CONDITION_STACK_LEN];
+  uint sp = 0;
+  const u8 *code = cond->code;
+  for (uint i = 0; i < cond->len;) {
+    switch (code[i]) {
+    case CO_CONST:
+      stack[sp++] = code[i + 1] | (code[i + 2] << 8);
+      i += 3;
+      continue;
+    case CO_LOAD:
+      stack[sp++] = memory[(u16)(code[i + 1] | (code[i + 2] << 8))];
+      i += 3;
+      continue;
+    case CO_REGISTER: {
+      u16 regs[] = {[CR_A] = r.a,   [CR_X] = r.x, [CR_Y] = r.y,
+                    [CR_SP] = r.sp, [CR_P] = r.p, [CR_PC] = r.pc};
+      stack[sp++] = regs[code[i + 1]];
+      i += 2;
+      continue;
+    }
+    case CO_NOT:
+      stack[sp - 1] = !stack[sp - 1];
+      i++;
+      continue;
+    }
+
+    u16 y = stack[--sp], x = stack[sp - 1];
+    switch (code[i]) {
+    case CO_EQ:
+      x = x == y;
+      break;
+    case CO_NE:
+      x = x != y;
+      break;
+    case CO_LT:
+      x = x < y;
+      break;
+    case CO_LE:
+      x = x <= y;
+      break;
+    case CO_GT:
+      x = x > y;
+      break;
+    case CO_GE:
+      x = x >= y;
+      break;
+    case CO_AND:
+      x = x && y;
+      break;
+    case CO_OR:
+      x = x || y;
+      break;
+    }
+    stack[sp - 1] = x;
+    i++;
+  }
+  return sp > 0 && stack[sp - 1] != 0;
+}
+
+void add_condition(Conditions *conds, WatchKind kind, u16 address,
+                   const char *text) {
+  if (conds->len >= CONDITIONS_LEN) {
+    error("Too many conditions, the limit is %d.", CONDITIONS_LEN);
+  }
+  ConditionalStop *s = &conds->stops[conds->len++];
+  s->kind = kind;
+  s->address = address;
+  condition_compile(&s->cond, text);
+}
+
+bool condition_stops(const Core *c, WatchKind kind, u16 address) {
+  const Conditions *conds = c->conditions;
+  if (conds == NULL) {
+    return true;
+  }
+  bool any = false;
+  for (uint i = 0; i < conds->len; i++) {
+    const ConditionalStop *s = &conds->stops[i];
+    if (s->kind == kind && s->address == address) {
+      if (condition_holds(&s->cond, core_registers(c), c->memory)) {
+        return true;
+      }
+      any = true;
+    }
+  }
+  return !any;
+}
+
+void test_condition() {
+  printf("\n\nTESTING CONDITION\n\n\n");
+
+  static Core c;
+  static Conditions conds;
+
+  {
+    core_init(&c);
+    c.a = 0x10;
+    c.x = 4;
+    c.memory[0x0200] = 0x7f;
+    Registers r = core_registers(&c);
+    static const struct {
+      const char *text;
+      bool holds;
+    } cases[] = {
+        {"A==#$10 && X>3", true},
+        {"A == #16 && X > 4", false},
+        {"a!=#$10 || x>=4", true},
+        {"!(X<=3) && $0200==#$7f", true},
+        {"$0200 < #%10000000 && !Y", true},
+        {"PC", false},
+        {"(A==#$11 || X==4) && (SP==#$00 || Y==0)", true},
+    };
+    bool all_right = true;
+    for (uint i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+      Condition cond;
+      condition_compile(&cond, cases[i].text);
+      if (condition_holds(&cond, r, c.memory) != cases[i].holds) {
+        printf("%s came out wrong.\n", cases[i].text);
+        all_right = false;
+      }
+    }
+    ASSERT(all_right, "conditions compile and evaluate");
+  }
+
+  // a counter going up through a watched byte, with a condition on the
+  // breakpoint and one on the watchpoint.
+  char *source = "  ldx #$00\n"
+                 "loop:\n"
+                 "  inx\n"
+                 "  stx counter\n"
+                 "  lda counter\n"
+                 "  cpx #$08\n"
+                 "  bne loop\n"
+                 "  brk\n"
+                 "counter:\n"
+                 "  .byte $00\n";
+  for (uint plain = 0; plain < 2; plain++) {
+    core_init(&c);
+    assemble_into(&c, source);
+    memset(&conds, 0, sizeof(conds));
+    c.conditions = &conds;
+    Symbol *loop = lookup_symbol("loop");
+    Symbol *counter = lookup_symbol("counter");
+    StopReason (*run)(Core *, RunBudget) = plain ? core_run_plain : core_run;
+
+    set_breakpoint(&c, loop->value);
+    add_condition(&conds, WK_EXECUTE, loop->value, "X==5");
+    StopReason r = run(&c, (RunBudget){0});
+    ASSERT(r == SR_BREAKPOINT && c.x == 5 && c.pc == loop->value,
+           "a conditional breakpoint only stops when it holds");
+    clear_breakpoint(&c, loop->value);
+
+    set_watchpoint(&c, counter->value, WK_WRITE);
+    r = run(&c, (RunBudget){0});
+    ASSERT(r == SR_WATCHPOINT && c.watched == counter->value &&
+               c.watched_write && c.x == 6 && c.a == 5 &&
+               c.pc == counter->value - 8,
+           "a write watchpoint stops right after the store");
+    clear_watchpoint(&c, counter->value, WK_WRITE);
+
+    set_watchpoint(&c, counter->value, WK_READ);
+    add_condition(&conds, WK_READ, counter->value, "A>=#$07");
+    r = run(&c, (RunBudget){0});
+    ASSERT(r == SR_WATCHPOINT && !c.watched_write && c.a == 7 &&
+               c.pc == counter->value - 5,
+           "a read watchpoint checks its condition after the load");
+    r = run(&c, (RunBudget){0});
+    ASSERT(r == SR_WATCHPOINT && c.a == 8, "and goes on to the next one");
+    r = run(&c, (RunBudget){0});
+    ASSERT(r == SR_BRK && c.instructions == 1 + 8 * 5, "then to the end");
+    clear_watchpoint(&c, counter->value, WK_READ);
+    ASSERT(c.num_watchpoints == 0, "cleared the watchpoints");
+  }
+
+  c.conditions = NULL;
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING CONDITION, SUCCESS!\n\n\n");
+}
+
+// lda $0300,X, sta $0200,X, inx, bne, then jmp back to the start. the same
+// loop run with nothing set, with a watchpoint it never hits and with a
+// conditional breakpoint in the loop that never holds.
+static const u8 condition_program[] = {0xbd, 0x00, 0x03, 0x9d, 0x00,
+                                       0x02, 0xe8, 0xd0, 0xf7, 0x4c,
+                                       0x00, 0x06};
+
+#define BENCH_CONDITION_INSTRUCTIONS 100000000
+
+static double bench_mips(Core *c) {
+  struct timespec start, end;
+  core_reset(c, 0x0600);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  core_run(c, (RunBudget){.instructions = BENCH_CONDITION_INSTRUCTIONS});
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return c->instructions / seconds / 1e6;
+}
+
+void bench_condition() {
+  init_decode_table();
+
+  static Core c;
+  static Conditions conds;
+  core_init(&c);
+  core_load(&c, condition_program, 0x0600, sizeof(condition_program));
+
+  double none = bench_mips(&c);
+  set_watchpoint(&c, 0x1234, WK_WRITE);
+  double watched = bench_mips(&c);
+  clear_watchpoint(&c, 0x1234, WK_WRITE);
+
+  // on the jmp, so once every 256 times around.
+  c.conditions = &conds;
+  set_breakpoint(&c, 0x0609);
+  add_condition(&conds, WK_EXECUTE, 0x0609, "X==#$01 && A==#$ff");
+  double conditional = bench_mips(&c);
+
+  printf("condition: %.1f MIPS with nothing set, %.1f MIPS watching "
+         "(%.0f%%), %.1f MIPS with a conditional breakpoint (%.0f%%)\n",
+         none, watched, watched / none * 100, conditional,
+         conditional / none * 100);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "core.h"
+#include "defines.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// conditions on breakpoints and watchpoints, like "A==#$10 && X>3". they're
+// compiled once to a little stack bytecode, so checking one when the run
+// gets to its address doesn't go near the parser. the operands are written
+// the way the assembler's are: #$10 or #16 is a value, $0200 or a label is
+// the byte at that address, a bare decimal is a value too. A, X, Y, SP, P and
+// PC are the registers. there's == != < <= > >=, && || and !, and parens.
+
+#define CONDITION_CODE_LEN 64
+// how deep the evaluation stack can get, the compiler won't go past it.
+#define CONDITION_STACK_LEN 16
+
+typedef enum ConditionOp {
+  CO_CONST,    // the u16 after it.
+  CO_REGISTER, // the register in the byte after it, a ConditionRegister.
+  CO_LOAD,     // the byte at the u16 after it.
+  CO_EQ,
+  CO_NE,
+  CO_LT,
+  CO_LE,
+  CO_GT,
+  CO_GE,
+  CO_AND,
+  CO_OR,
+  CO_NOT,
+} ConditionOp;
+
+typedef enum ConditionRegister {
+  CR_A,
+  CR_X,
+  CR_Y,
+  CR_SP,
+  CR_P,
+  CR_PC,
+} ConditionRegister;
+
+typedef struct Condition {
+  u8 code[CONDITION_CODE_LEN];
+  uint len;
+} Condition;
+
+// errors out on anything that doesn't parse, or on a label that isn't in the
+// symbol table.
+void condition_compile(Condition *cond, const char *text);
+bool condition_holds(const Condition *cond, Registers r, const u8 *memory);
+
+// every condition a core has, hang it off Core.conditions.
+#define CONDITIONS_LEN 64
+
+typedef struct ConditionalStop {
+  WatchKind kind;
+  u16 address;
+  Condition cond;
+} ConditionalStop;
+
+typedef struct Conditions {
+  ConditionalStop stops[CONDITIONS_LEN];
+  uint len;
+} Conditions;
+
+// only the condition, the breakpoint or watchpoint still has to be set.
+void add_condition(Conditions *conds, WatchKind kind, u16 address,
+                   const char *text);
+
+// whether a breakpoint or a watchpoint the run just hit stops it, the run
+// loops call this with the core's registers stored. one without a condition
+// always does, one with a few does if any of them hold.
+bool condition_stops(const Core *c, WatchKind kind, u16 address);
+
+void test_condition();
+void bench_condition();
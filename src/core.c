@@ -0,0 +1,1092 @@
+#include "core.h"
+
+#include "assembler.h"
+#include "condition.h"
+#include "coverage.h"
+#include "defines.h"
+#include "history.h"
+#include "jit.h"
+#include "lexer.h"
+#include "map.h"
+#include "ops.h"
+#include "pragma.h"
+#include "profile.h"
+#include "trace.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// every official opcode but BRK, which stops the run instead. lib6502 calls
+// the accumulator forms Implicit, they get their own mode here so the shift
+// macros know to work on a.
+#define OPCODES(X)                                                             \
+  X(0x69, ADC, IMM) X(0x65, ADC, ZP) X(0x75, ADC, ZPX) X(0x6d, ADC, ABS)       \
+  X(0x7d, ADC, ABX) X(0x79, ADC, ABY) X(0x61, ADC, IZX) X(0x71, ADC, IZY)      \
+  X(0x29, AND, IMM) X(0x25, AND, ZP) X(0x35, AND, ZPX) X(0x2d, AND, ABS)       \
+  X(0x3d, AND, ABX) X(0x39, AND, ABY) X(0x21, AND, IZX) X(0x31, AND, IZY)      \
+  X(0x0a, ASL, ACC) X(0x06, ASL, ZP) X(0x16, ASL, ZPX) X(0x0e, ASL, ABS)       \
+  X(0x1e, ASL, ABX)                                                            \
+  X(0x90, BCC, REL) X(0xb0, BCS, REL) X(0xf0, BEQ, REL) X(0x30, BMI, REL)      \
+  X(0xd0, BNE, REL) X(0x10, BPL, REL) X(0x50, BVC, REL) X(0x70, BVS, REL)      \
+  X(0x24, BIT, ZP) X(0x2c, BIT, ABS)                                           \
+  X(0x18, CLC, IMP) X(0xd8, CLD, IMP) X(0x58, CLI, IMP) X(0xb8, CLV, IMP)      \
+  X(0xc9, CMP, IMM) X(0xc5, CMP, ZP) X(0xd5, CMP, ZPX) X(0xcd, CMP, ABS)       \
+  X(0xdd, CMP, ABX) X(0xd9, CMP, ABY) X(0xc1, CMP, IZX) X(0xd1, CMP, IZY)      \
+  X(0xe0, CPX, IMM) X(0xe4, CPX, ZP) X(0xec, CPX, ABS)                         \
+  X(0xc0, CPY, IMM) X(0xc4, CPY, ZP) X(0xcc, CPY, ABS)                         \
+  X(0xc6, DEC, ZP) X(0xd6, DEC, ZPX) X(0xce, DEC, ABS) X(0xde, DEC, ABX)       \
+  X(0xca, DEX, IMP) X(0x88, DEY, IMP)                                          \
+  X(0x49, EOR, IMM) X(0x45, EOR, ZP) X(0x55, EOR, ZPX) X(0x4d, EOR, ABS)       \
+  X(0x5d, EOR, ABX) X(0x59, EOR, ABY) X(0x41, EOR, IZX) X(0x51, EOR, IZY)      \
+  X(0xe6, INC, ZP) X(0xf6, INC, ZPX) X(0xee, INC, ABS) X(0xfe, INC, ABX)       \
+  X(0xe8, INX, IMP) X(0xc8, INY, IMP)                                          \
+  X(0x4c, JMP, ABS) X(0x6c, JMP, IND) X(0x20, JSR, ABS)                        \
+  X(0xa9, LDA, IMM) X(0xa5, LDA, ZP) X(0xb5, LDA, ZPX) X(0xad, LDA, ABS)       \
+  X(0xbd, LDA, ABX) X(0xb9, LDA, ABY) X(0xa1, LDA, IZX) X(0xb1, LDA, IZY)      \
+  X(0xa2, LDX, IMM) X(0xa6, LDX, ZP) X(0xb6, LDX, ZPY) X(0xae, LDX, ABS)       \
+  X(0xbe, LDX, ABY)                                                            \
+  X(0xa0, LDY, IMM) X(0xa4, LDY, ZP) X(0xb4, LDY, ZPX) X(0xac, LDY, ABS)       \
+  X(0xbc, LDY, ABX)                                                            \
+  X(0x4a, LSR, ACC) X(0x46, LSR, ZP) X(0x56, LSR, ZPX) X(0x4e, LSR, ABS)       \
+  X(0x5e, LSR, ABX)                                                            \
+  X(0xea, NOP, IMP)                                                            \
+  X(0x09, ORA, IMM) X(0x05, ORA, ZP) X(0x15, ORA, ZPX) X(0x0d, ORA, ABS)       \
+  X(0x1d, ORA, ABX) X(0x19, ORA, ABY) X(0x01, ORA, IZX) X(0x11, ORA, IZY)      \
+  X(0x48, PHA, IMP) X(0x08, PHP, IMP) X(0x68, PLA, IMP) X(0x28, PLP, IMP)      \
+  X(0x2a, ROL, ACC) X(0x26, ROL, ZP) X(0x36, ROL, ZPX) X(0x2e, ROL, ABS)       \
+  X(0x3e, ROL, ABX)                                                            \
+  X(0x6a, ROR, ACC) X(0x66, ROR, ZP) X(0x76, ROR, ZPX) X(0x6e, ROR, ABS)       \
+  X(0x7e, ROR, ABX)                                                            \
+  X(0x40, RTI, IMP) X(0x60, RTS, IMP)                                          \
+  X(0xe9, SBC, IMM) X(0xe5, SBC, ZP) X(0xf5, SBC, ZPX) X(0xed, SBC, ABS)       \
+  X(0xfd, SBC, ABX) X(0xf9, SBC, ABY) X(0xe1, SBC, IZX) X(0xf1, SBC, IZY)      \
+  X(0x38, SEC, IMP) X(0xf8, SED, IMP) X(0x78, SEI, IMP)                        \
+  X(0x85, STA, ZP) X(0x95, STA, ZPX) X(0x8d, STA, ABS) X(0x9d, STA, ABX)       \
+  X(0x99, STA, ABY) X(0x81, STA, IZX) X(0x91, STA, IZY)                        \
+  X(0x86, STX, ZP) X(0x96, STX, ZPY) X(0x8e, STX, ABS)                         \
+  X(0x84, STY, ZP) X(0x94, STY, ZPX) X(0x8c, STY, ABS)                         \
+  X(0xaa, TAX, IMP) X(0xa8, TAY, IMP) X(0xba, TSX, IMP) X(0x8a, TXA, IMP)      \
+  X(0x9a, TXS, IMP) X(0x98, TYA, IMP)
+
+// handlers[] in core_run has one slot per opcode byte, then this one.
+#define HANDLER_BREAKPOINT 256
+
+void core_init(Core *c) {
+  memset(c, 0, sizeof(Core));
+  core_reset(c, 0);
+}
+
+Core *core_new() {
+  Core *c = mmap(NULL, sizeof(Core), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (c == MAP_FAILED) {
+    error("Couldn't map a new core.");
+  }
+  core_reset(c, 0);
+  return c;
+}
+
+void core_free(Core *c) { munmap(c, sizeof(Core)); }
+
+void core_clear(Core *c) {
+  memset(c->memory, 0, sizeof(c->memory));
+  core_forget(c);
+}
+
+void core_forget(Core *c) {
+  if (c->history != NULL) {
+    history_clear(c->history);
+  }
+  for (uint page = 0; page < 0x100; page++) {
+    if (c->code_pages[page]) {
+      memset(&c->decoded[page << 8], 0, 0x100 * sizeof(DecodedOp));
+    }
+  }
+  memset(c->code_pages, 0, sizeof(c->code_pages));
+  memset(c->dirty_pages, 1, sizeof(c->dirty_pages));
+}
+
+void core_reset(Core *c, u16 start) {
+  c->a = c->x = c->y = 0;
+  c->sp = 0xfd;
+  c->p = FLAG_U | FLAG_I;
+  c->pc = start;
+  c->cycles = 0;
+  c->instructions = 0;
+  c->invalidations = 0;
+  if (c->history != NULL) {
+    history_clear(c->history);
+  }
+}
+
+void set_breakpoint(Core *c, u16 address) {
+  if (!has_breakpoint(c, address)) {
+    c->breakpoints[address >> 3] |= 1 << (address & 7);
+    c->num_breakpoints++;
+  }
+  // breakpoints are baked into the decoded entries, and native blocks never
+  // have one inside.
+  c->decoded[address].handler = NULL;
+  if (c->jit != NULL) {
+    jit_invalidate(c->jit, address);
+  }
+}
+
+void clear_breakpoint(Core *c, u16 address) {
+  if (has_breakpoint(c, address)) {
+    c->breakpoints[address >> 3] &= ~(1 << (address & 7));
+    c->num_breakpoints--;
+  }
+  c->decoded[address].handler = NULL;
+  if (c->jit != NULL) {
+    jit_invalidate(c->jit, address);
+  }
+}
+
+static u8 *watchpoints_for(Core *c, WatchKind kind) {
+  return (kind == WK_WRITE) ? c->write_watchpoints : c->read_watchpoints;
+}
+
+void set_watchpoint(Core *c, u16 address, WatchKind kind) {
+  u8 *bits = watchpoints_for(c, kind);
+  if (!(bits[address >> 3] & (1 << (address & 7)))) {
+    bits[address >> 3] |= 1 << (address & 7);
+    c->num_watchpoints++;
+  }
+}
+
+void clear_watchpoint(Core *c, u16 address, WatchKind kind) {
+  u8 *bits = watchpoints_for(c, kind);
+  if (bits[address >> 3] & (1 << (address & 7))) {
+    bits[address >> 3] &= ~(1 << (address & 7));
+    c->num_watchpoints--;
+  }
+}
+
+// throw out everything decoded with a byte at address. entries that stop the
+// run are only the one byte long.
+static void invalidate(Core *c, u16 address) {
+  for (uint k = 0; k < MAX_OPCODE_LEN; k++) {
+    DecodedOp *d = &c->decoded[(u16)(address - k)];
+    if (d->handler != NULL && (k == 0 || d->len > k)) {
+      d->handler = NULL;
+      c->invalidations++;
+    }
+  }
+  if (c->jit != NULL) {
+    jit_invalidate(c->jit, address);
+  }
+}
+
+static void store(Core *c, u16 address, u8 value) {
+  c->memory[address] = value;
+  c->dirty_pages[address >> 8] = 1;
+  if (c->code_pages[address >> 8]) {
+    invalidate(c, address);
+  }
+}
+
+// the byte a write to address lands on, NULL if a device gets it.
+static u8 *written_byte(Core *c, u16 address) {
+  if (c->map == NULL) {
+    return &c->memory[address];
+  }
+  u8 *page = c->map->write[address >> 8];
+  return (page != NULL) ? &page[address & 0xff] : NULL;
+}
+
+// a write the way the guest would do it, through the map if there is one.
+static void guest_write(Core *c, u16 address, u8 value) {
+  if (c->map != NULL) {
+    map_write(c->map, address, value);
+  } else {
+    store(c, address, value);
+  }
+}
+
+u8 core_peek(const Core *c, u16 address) {
+  const u8 *page = (c->map != NULL) ? c->map->read[address >> 8] : NULL;
+  return (page != NULL) ? page[address & 0xff] : c->memory[address];
+}
+
+void core_restore_byte(Core *c, u16 address, u8 value) {
+  if (c->map == NULL) {
+    store(c, address, value);
+    return;
+  }
+  // a device's page has nothing to put back.
+  u8 *at = written_byte(c, address);
+  if (at != NULL) {
+    *at = value;
+  }
+}
+
+void core_write(Core *c, u16 address, u8 value) {
+  u8 *at = written_byte(c, address);
+  if (c->history != NULL && at != NULL) {
+    history_begin(c->history, core_registers(c));
+    history_write(c->history, address, *at);
+    history_end(c->history, 0, HK_OUTSIDE);
+  }
+  guest_write(c, address, value);
+}
+
+void core_snapshot(Core *c, Snapshot *s) {
+  s->registers = core_registers(c);
+  s->cycles = c->cycles;
+  s->instructions = c->instructions;
+  memcpy(s->memory, c->memory, sizeof(s->memory));
+  memset(c->dirty_pages, 0, sizeof(c->dirty_pages));
+  c->snapshot = s;
+}
+
+uint core_restore(Core *c, const Snapshot *s) {
+  if (c->history != NULL) {
+    history_clear(c->history);
+  }
+  // the mapped loop doesn't keep the dirty pages.
+  if (c->snapshot != s || c->map != NULL) {
+    memset(c->dirty_pages, 1, sizeof(c->dirty_pages));
+  }
+
+  uint pages = 0;
+  for (uint page = 0; page < 0x100; page++) {
+    if (!c->dirty_pages[page]) {
+      continue;
+    }
+    u8 *to = &c->memory[page << 8];
+    const u8 *from = &s->memory[page << 8];
+    if (c->code_pages[page]) {
+      // only the bytes that changed throw out what's decoded from them.
+      for (uint i = 0; i < 0x100; i++) {
+        if (to[i] != from[i]) {
+          to[i] = from[i];
+          invalidate(c, (page << 8) | i);
+        }
+      }
+    } else {
+      memcpy(to, from, 0x100);
+    }
+    c->dirty_pages[page] = 0;
+    pages++;
+  }
+
+  core_set_registers(c, s->registers);
+  c->cycles = s->cycles;
+  c->instructions = s->instructions;
+  c->snapshot = s;
+  return pages;
+}
+
+// what the 6502 does between two instructions when an interrupt comes in.
+// the pushes, pushed the way the loops do so the history gets the whole
+// interrupt as one record.
+static void interrupt_push(Core *c, u8 value) {
+  u16 address = 0x100 | c->sp--;
+  u8 *at = written_byte(c, address);
+  if (c->history != NULL && at != NULL) {
+    history_write(c->history, address, *at);
+  }
+  guest_write(c, address, value);
+}
+
+static void interrupt(Core *c, u16 vector) {
+  if (c->history != NULL) {
+    history_begin(c->history, core_registers(c));
+  }
+  interrupt_push(c, c->pc >> 8);
+  interrupt_push(c, c->pc & 0xff);
+  interrupt_push(c, (c->p & ~FLAG_B) | FLAG_U);
+  c->p |= FLAG_I;
+  c->pc = (c->map != NULL) ? map_read(c->map, vector) |
+                                  (map_read(c->map, vector + 1) << 8)
+                            : c->memory[vector] | (c->memory[vector + 1] << 8);
+  c->cycles += 7;
+  if (c->history != NULL) {
+    history_end(c->history, 7, HK_OUTSIDE);
+  }
+}
+
+bool core_irq(Core *c) {
+  if (c->p & FLAG_I) {
+    return false;
+  }
+  interrupt(c, 0xfffe);
+  return true;
+}
+
+void core_nmi(Core *c) { interrupt(c, 0xfffa); }
+
+void core_load(Core *c, const u8 *bytes, u16 start, u32 len) {
+  if (c->history != NULL) {
+    history_clear(c->history);
+  }
+  for (u32 i = 0; i < len; i++) {
+    store(c, start + i, bytes[i]);
+  }
+}
+
+// a byte from memory, or through the map when there is one. the loops that
+// don't take a map have it as a NULL constant, so this folds away in them.
+#define FETCH(memory, map, address)                                            \
+  ((map) != NULL ? map_read((map), (address)) : (memory)[(address)])
+
+// the operand bytes, resolved as far as they can be without the registers. a
+// branch's offset turns into the address it goes to.
+static inline u16 fetch_operand(const u8 *memory, const MemoryMap *map, u16 pc,
+                                DecodeEntry d) {
+  if (d.mode == Relative) {
+    return pc + 2 + (i8)FETCH(memory, map, (u16)(pc + 1));
+  }
+  if (d.len == 2) {
+    return FETCH(memory, map, (u16)(pc + 1));
+  }
+  if (d.len == 3) {
+    return FETCH(memory, map, (u16)(pc + 1)) |
+           (FETCH(memory, map, (u16)(pc + 2)) << 8);
+  }
+  return 0;
+}
+
+static void decode(Core *c, u16 pc, DecodedOp *op, const void *const *handlers,
+                   bool breakpoints) {
+  u8 opcode = c->memory[pc];
+  DecodeEntry d = decode_table[opcode];
+  c->code_pages[pc >> 8] = 1;
+
+  if (breakpoints && has_breakpoint(c, pc)) {
+    *op = (DecodedOp){handlers[HANDLER_BREAKPOINT], 0, 0, 0};
+  } else if (opcode == 0x00 || d.instruction == LEXEME_NULL) {
+    *op = (DecodedOp){handlers[opcode], 0, 0, 0};
+    // getting to the brk counts as running it, an illegal opcode doesn't.
+    if (opcode == 0x00 && c->coverage != NULL) {
+      cover(c->coverage->executed, pc);
+    }
+  } else {
+    c->code_pages[(u16)(pc + d.len - 1) >> 8] = 1;
+    *op = (DecodedOp){handlers[opcode], fetch_operand(c->memory, NULL, pc, d),
+                      d.len, d.cycles};
+    // it only gets decoded when it's about to run.
+    if (c->coverage != NULL) {
+      cover(c->coverage->executed, pc);
+    }
+  }
+}
+
+// the flag helpers and the operations both loops share. everything works on
+// the loop's locals, which are only written back to the Core when it stops.
+
+#define SET_NZ(v)                                                              \
+  do {                                                                         \
+    u8 nz_ = (v);                                                              \
+    p = (p & ~(FLAG_N | FLAG_Z)) | (nz_ & FLAG_N) | (nz_ ? 0 : FLAG_Z);        \
+  } while (0)
+
+// a read or a write of a watched address. the instruction has to finish
+// first, so this pulls the instruction limit in to stop before the next one
+// and resume() takes it from there.
+#define WATCH(address, write)                                                  \
+  (((write) ? c->write_watchpoints                                             \
+            : c->read_watchpoints)[(u16)(address) >> 3] &                      \
+           (1 << ((address) & 7)) &&                                           \
+           !c->watch_pending                                                   \
+       ? (void)(c->watch_pending = true, c->watched = (address),               \
+                c->watched_write = (write),                                    \
+                instruction_limit = instructions + 1)                          \
+       : (void)0)
+
+// the reads and writes coverage or a watchpoint want to hear about. when
+// neither's on, that's one predictable test for every access.
+#define HOOK(address, write)                                                   \
+  (UNLIKELY(hooked) ? (cover(coverage == NULL ? NULL                           \
+                             : (write)        ? coverage->written              \
+                                              : coverage->read,                \
+                             (address)),                                       \
+                       WATCH(address, write))                                  \
+                    : (void)0)
+
+#define LOAD(address) FETCH(mem, map, (address))
+
+// the mapped loop doesn't keep the dirty pages, core_restore copies all of
+// them when there's a map.
+#define WR(address, v)                                                         \
+  do {                                                                         \
+    u16 wr_ = (address);                                                       \
+    if (map != NULL) {                                                         \
+      u8 *page_ = map->write[wr_ >> 8];                                        \
+      if (page_ == NULL) {                                                     \
+        map_write(map, wr_, (v));                                              \
+      } else {                                                                 \
+        if (history != NULL) {                                                 \
+          history_write(history, wr_, page_[wr_ & 0xff]);                      \
+        }                                                                      \
+        page_[wr_ & 0xff] = (v);                                               \
+      }                                                                        \
+    } else {                                                                   \
+      if (history != NULL) {                                                   \
+        history_write(history, wr_, mem[wr_]);                                 \
+      }                                                                        \
+      mem[wr_] = (v);                                                          \
+      dirty_pages[wr_ >> 8] = 1;                                               \
+    }                                                                          \
+    HOOK(wr_, true);                                                           \
+    if (code_pages[wr_ >> 8]) {                                                \
+      invalidate(c, wr_);                                                      \
+    }                                                                          \
+  } while (0)
+
+#define PUSH(v)                                                                \
+  do {                                                                         \
+    WR(0x100 | sp, (v));                                                       \
+    sp--;                                                                      \
+  } while (0)
+
+#define PULL()                                                                 \
+  (sp++, HOOK(0x100 | sp, false), LOAD(0x100 | sp))
+
+// the effective address from the operand, and whether indexing it crossed a
+// page.
+#define EA_IMP
+#define EA_ACC
+#define EA_IMM
+#define EA_REL ea = opnd;
+#define EA_ZP ea = opnd;
+#define EA_ZPX ea = (u8)(opnd + x);
+#define EA_ZPY ea = (u8)(opnd + y);
+#define EA_ABS ea = opnd;
+#define EA_ABX                                                                 \
+  ea = opnd + x;                                                               \
+  cross = (ea ^ opnd) > 0xff;
+#define EA_ABY                                                                 \
+  ea = opnd + y;                                                               \
+  cross = (ea ^ opnd) > 0xff;
+// the pointer's high byte never carries into the next page.
+#define EA_IND                                                                 \
+  ea = LOAD(opnd) | (LOAD((opnd & 0xff00) | (u8)(opnd + 1)) << 8);
+#define EA_IZX                                                                 \
+  ea = LOAD((u8)(opnd + x)) | (LOAD((u8)(opnd + x + 1)) << 8);
+#define EA_IZY                                                                 \
+  {                                                                            \
+    u16 base_ = LOAD(opnd) | (LOAD((u8)(opnd + 1)) << 8);                      \
+    ea = base_ + y;                                                            \
+    cross = (ea ^ base_) > 0xff;                                               \
+  }
+
+// reads pay for crossing a page, writes and read-modify-writes already have it
+// in their base cycles.
+#define READ_IMM ((u8)opnd)
+#define READ_MEM (HOOK(ea, false), LOAD(ea))
+#define READ_ZP READ_MEM
+#define READ_ZPX READ_MEM
+#define READ_ZPY READ_MEM
+#define READ_ABS READ_MEM
+#define READ_ABX (extra += cross, READ_MEM)
+#define READ_ABY (extra += cross, READ_MEM)
+#define READ_IZX READ_MEM
+#define READ_IZY (extra += cross, READ_MEM)
+
+#define RMW_ACC(f) a = f(a, &p);
+#define RMW_MEM(f)                                                             \
+  {                                                                            \
+    u8 v_ = f(READ_MEM, &p);                                                   \
+    WR(ea, v_);                                                                \
+  }
+#define RMW_ZP RMW_MEM
+#define RMW_ZPX RMW_MEM
+#define RMW_ABS RMW_MEM
+#define RMW_ABX RMW_MEM
+
+// a taken branch is one more cycle, two if it lands on another page.
+#define BRANCH(cond)                                                           \
+  if (cond) {                                                                  \
+    extra += 1 + ((pc ^ ea) > 0xff);                                           \
+    pc = ea;                                                                   \
+  }
+
+#define OP_ADC(m) a = adc(a, READ_##m, &p);
+#define OP_SBC(m) a = sbc(a, READ_##m, &p);
+#define OP_AND(m) SET_NZ(a &= READ_##m);
+#define OP_ORA(m) SET_NZ(a |= READ_##m);
+#define OP_EOR(m) SET_NZ(a ^= READ_##m);
+#define OP_CMP(m) compare(a, READ_##m, &p);
+#define OP_CPX(m) compare(x, READ_##m, &p);
+#define OP_CPY(m) compare(y, READ_##m, &p);
+#define OP_BIT(m)                                                              \
+  {                                                                            \
+    u8 v_ = READ_##m;                                                          \
+    p = (p & ~(FLAG_N | FLAG_V | FLAG_Z)) | (v_ & (FLAG_N | FLAG_V)) |         \
+        ((a & v_) ? 0 : FLAG_Z);                                               \
+  }
+#define OP_LDA(m) SET_NZ(a = READ_##m);
+#define OP_LDX(m) SET_NZ(x = READ_##m);
+#define OP_LDY(m) SET_NZ(y = READ_##m);
+#define OP_STA(m) WR(ea, a);
+#define OP_STX(m) WR(ea, x);
+#define OP_STY(m) WR(ea, y);
+#define OP_ASL(m) RMW_##m(asl)
+#define OP_LSR(m) RMW_##m(lsr)
+#define OP_ROL(m) RMW_##m(rol)
+#define OP_ROR(m) RMW_##m(ror)
+#define OP_INC(m) RMW_##m(inc)
+#define OP_DEC(m) RMW_##m(dec)
+#define OP_INX(m) SET_NZ(++x);
+#define OP_INY(m) SET_NZ(++y);
+#define OP_DEX(m) SET_NZ(--x);
+#define OP_DEY(m) SET_NZ(--y);
+#define OP_TAX(m) SET_NZ(x = a);
+#define OP_TAY(m) SET_NZ(y = a);
+#define OP_TSX(m) SET_NZ(x = sp);
+#define OP_TXA(m) SET_NZ(a = x);
+#define OP_TYA(m) SET_NZ(a = y);
+#define OP_TXS(m) sp = x;
+#define OP_BCC(m) BRANCH(!(p & FLAG_C))
+#define OP_BCS(m) BRANCH(p & FLAG_C)
+#define OP_BNE(m) BRANCH(!(p & FLAG_Z))
+#define OP_BEQ(m) BRANCH(p & FLAG_Z)
+#define OP_BPL(m) BRANCH(!(p & FLAG_N))
+#define OP_BMI(m) BRANCH(p & FLAG_N)
+#define OP_BVC(m) BRANCH(!(p & FLAG_V))
+#define OP_BVS(m) BRANCH(p & FLAG_V)
+#define OP_CLC(m) p &= ~FLAG_C;
+#define OP_CLD(m) p &= ~FLAG_D;
+#define OP_CLI(m) p &= ~FLAG_I;
+#define OP_CLV(m) p &= ~FLAG_V;
+#define OP_SEC(m) p |= FLAG_C;
+#define OP_SED(m) p |= FLAG_D;
+#define OP_SEI(m) p |= FLAG_I;
+#define OP_NOP(m)
+#define OP_JMP(m) pc = ea;
+// the return address pushed is the last byte of the JSR.
+#define OP_JSR(m)                                                              \
+  PUSH((u16)(pc - 1) >> 8);                                                    \
+  PUSH((u8)(pc - 1));                                                          \
+  pc = ea;
+#define OP_RTS(m)                                                              \
+  {                                                                            \
+    u8 lo_ = PULL();                                                           \
+    pc = (lo_ | (PULL() << 8)) + 1;                                            \
+  }
+#define OP_RTI(m)                                                              \
+  {                                                                            \
+    p = (PULL() & ~FLAG_B) | FLAG_U;                                           \
+    u8 lo_ = PULL();                                                           \
+    pc = lo_ | (PULL() << 8);                                                  \
+  }
+#define OP_PHA(m) PUSH(a);
+#define OP_PHP(m) PUSH(p | FLAG_B | FLAG_U);
+#define OP_PLA(m) SET_NZ(a = PULL());
+#define OP_PLP(m) p = (PULL() & ~FLAG_B) | FLAG_U;
+
+#define EXECUTE(name, mode)                                                    \
+  {                                                                            \
+    EA_##mode OP_##name(mode)                                                  \
+  }
+
+// both loops keep the registers and the totals in locals and fold the budgets
+// into two limits up front, so the only thing between instructions is two
+// compares.
+#define LOAD_LOCALS                                                            \
+  u8 *mem = c->memory;                                                         \
+  const u8 *code_pages = c->code_pages;                                        \
+  u8 *dirty_pages = c->dirty_pages;                                            \
+  Coverage *coverage = c->coverage;                                            \
+  bool hooked = coverage != NULL || c->num_watchpoints > 0;                    \
+  u8 a = c->a, x = c->x, y = c->y, sp = c->sp, p = c->p;                       \
+  u16 pc = c->pc;                                                              \
+  u16 ea = 0;                                                                  \
+  uint cross = 0, extra = 0;                                                   \
+  u64 cycles = c->cycles;                                                      \
+  u64 instructions = c->instructions;                                          \
+  u64 cycle_limit = budget.cycles ? cycles + budget.cycles : UINT64_MAX;       \
+  u64 instruction_limit =                                                      \
+      budget.instructions ? instructions + budget.instructions : UINT64_MAX;   \
+  u64 first = instructions;                                                    \
+  StopReason reason = SR_NONE;
+
+#define STORE_LOCALS                                                           \
+  c->a = a;                                                                    \
+  c->x = x;                                                                    \
+  c->y = y;                                                                    \
+  c->sp = sp;                                                                  \
+  c->p = p;                                                                    \
+  c->pc = pc;                                                                  \
+  c->cycles = cycles;                                                          \
+  c->instructions = instructions;
+
+// the loops stop on every breakpoint and watchpoint they get to, and the
+// conditions get checked out here so there's nothing in them to call out to.
+// false if the stop holds, otherwise the budget's cut down to what's left of
+// it for picking up again. the ends are 0 for no limit.
+static bool resume(Core *c, StopReason *r, RunBudget *budget, u64 cycle_end,
+                   u64 instruction_end) {
+  if (c->watch_pending) {
+    c->watch_pending = false;
+    if (condition_stops(c, c->watched_write ? WK_WRITE : WK_READ,
+                        c->watched)) {
+      *r = SR_WATCHPOINT;
+      return false;
+    }
+    // it was on the instruction the cycles ran out on.
+    if (*r == SR_MAX_CYCLES) {
+      return false;
+    }
+    // picking up again would step over a breakpoint on the next one.
+    if (has_breakpoint(c, c->pc) && condition_stops(c, WK_EXECUTE, c->pc)) {
+      *r = SR_BREAKPOINT;
+      return false;
+    }
+  } else if (*r != SR_BREAKPOINT || condition_stops(c, WK_EXECUTE, c->pc)) {
+    return false;
+  }
+
+  if (cycle_end != 0 && c->cycles >= cycle_end) {
+    *r = SR_MAX_CYCLES;
+    return false;
+  }
+  if (instruction_end != 0 && c->instructions >= instruction_end) {
+    *r = SR_MAX_INSTRUCTIONS;
+    return false;
+  }
+  budget->cycles = cycle_end ? cycle_end - c->cycles : 0;
+  budget->instructions =
+      instruction_end ? instruction_end - c->instructions : 0;
+  return true;
+}
+
+#define RUN_CHECKED(run)                                                       \
+  u64 cycle_end = budget.cycles ? c->cycles + budget.cycles : 0;               \
+  u64 instruction_end =                                                        \
+      budget.instructions ? c->instructions + budget.instructions : 0;         \
+  StopReason r;                                                                \
+  do {                                                                         \
+    r = (run);                                                                 \
+  } while (resume(c, &r, &budget, cycle_end, instruction_end));                \
+  return r;
+
+static StopReason run_cached(Core *c, RunBudget budget) {
+  LOAD_LOCALS
+  History *const history = NULL; // only the observed loop keeps it.
+  MemoryMap *const map = NULL;    // and a map goes through the plain one.
+  DecodedOp *decoded = c->decoded;
+  DecodedOp *op;
+  DecodedOp step;
+  u16 opnd;
+
+#define HANDLER(opcode, name, mode) [opcode] = &&op_##opcode,
+  static const void *const handlers[HANDLER_BREAKPOINT + 1] = {
+      [0 ... 0xff] = &&illegal,
+      OPCODES(HANDLER)[0x00] = &&brk,
+      [HANDLER_BREAKPOINT] = &&breakpoint,
+  };
+#undef HANDLER
+
+#define NEXT                                                                   \
+  cycles += op->cycles + extra;                                                \
+  instructions++;                                                              \
+  goto dispatch;
+
+dispatch:
+  if (cycles >= cycle_limit) {
+    reason = SR_MAX_CYCLES;
+    goto done;
+  }
+  if (instructions >= instruction_limit) {
+    reason = c->watch_pending ? SR_WATCHPOINT : SR_MAX_INSTRUCTIONS;
+    goto done;
+  }
+  op = &decoded[pc];
+  if (op->handler == NULL) {
+    decode(c, pc, op, handlers, c->num_breakpoints > 0);
+  }
+execute:
+  opnd = op->operand;
+  pc += op->len;
+  extra = 0;
+  goto *op->handler;
+
+#define LABEL(opcode, name, mode)                                              \
+  op_##opcode : EXECUTE(name, mode) NEXT
+  OPCODES(LABEL)
+#undef LABEL
+
+breakpoint:
+  if (instructions != first) {
+    reason = SR_BREAKPOINT;
+    goto done;
+  }
+  // the run started here, so step over it with a decode that leaves the
+  // breakpoint out. it doesn't go in the cache.
+  op = &step;
+  decode(c, pc, op, handlers, false);
+  goto execute;
+
+brk:
+  reason = SR_BRK;
+  goto done;
+
+illegal:
+  reason = SR_ILLEGAL;
+  goto done;
+
+#undef NEXT
+
+done:
+  (void)cross;
+  STORE_LOCALS
+  return reason;
+}
+
+// the plain loop, and the observed ones when t, prof or history isn't NULL.
+// it's inlined into each, so the plain one doesn't pay for the checks.
+static inline ALWAYS_INLINE StopReason run_plain(Core *c, RunBudget budget,
+                                                 Trace *t, Profile *prof,
+                                                 History *history,
+                                                 MemoryMap *map) {
+  LOAD_LOCALS
+  bool check_breakpoints = c->num_breakpoints > 0;
+
+  while (1) {
+    if (cycles >= cycle_limit) {
+      reason = SR_MAX_CYCLES;
+      break;
+    }
+    if (instructions >= instruction_limit) {
+      reason = c->watch_pending ? SR_WATCHPOINT : SR_MAX_INSTRUCTIONS;
+      break;
+    }
+    if (check_breakpoints && instructions != first && has_breakpoint(c, pc)) {
+      reason = SR_BREAKPOINT;
+      break;
+    }
+
+    u8 opcode = LOAD(pc);
+    DecodeEntry d = decode_table[opcode];
+    if (opcode == 0x00) {
+      cover(coverage ? coverage->executed : NULL, pc);
+      reason = SR_BRK;
+      break;
+    }
+    if (d.instruction == LEXEME_NULL) {
+      reason = SR_ILLEGAL;
+      break;
+    }
+    u16 opnd = fetch_operand(mem, map, pc, d);
+    u16 at = pc;
+    cover(coverage ? coverage->executed : NULL, at);
+    if (history != NULL) {
+      history_begin(history, (Registers){a, x, y, sp, p, at});
+    }
+    pc += d.len;
+    extra = 0;
+
+    switch (opcode) {
+#define CASE(opcode, name, mode)                                               \
+  case opcode:                                                                 \
+    EXECUTE(name, mode) break;
+      OPCODES(CASE)
+#undef CASE
+    }
+
+    cycles += d.cycles + extra;
+    instructions++;
+    if (history != NULL) {
+      history_end(history, d.cycles + extra, HK_INSTRUCTION);
+    }
+    if (t != NULL) {
+      u8 regs[5] = {a, x, y, sp, p};
+      trace_add(t, mem, at, opcode, regs, d.cycles + extra, ea);
+    }
+    if (prof != NULL) {
+      profile_add(prof, at, opcode, d.cycles + extra, pc);
+    }
+  }
+
+  (void)cross;
+  STORE_LOCALS
+  return reason;
+}
+
+// every access through the page table, see map.h.
+static StopReason run_mapped(Core *c, RunBudget budget) {
+  RUN_CHECKED(run_plain(c, budget, NULL, NULL, NULL, c->map))
+}
+
+StopReason core_run(Core *c, RunBudget budget) {
+  // the decoded cache is only for the flat memory.
+  if (c->map != NULL) {
+    return run_mapped(c, budget);
+  }
+  RUN_CHECKED(run_cached(c, budget))
+}
+
+StopReason core_run_plain(Core *c, RunBudget budget) {
+  if (c->map != NULL) {
+    return run_mapped(c, budget);
+  }
+  RUN_CHECKED(run_plain(c, budget, NULL, NULL, NULL, NULL))
+}
+
+// a loop of its own for keeping just the history, so it doesn't pay for the
+// trace and profile checks.
+static StopReason run_history(Core *c, RunBudget budget) {
+  RUN_CHECKED(run_plain(c, budget, NULL, NULL, c->history, c->map))
+}
+
+StopReason core_run_observed(Core *c, RunBudget budget, Trace *t,
+                             Profile *prof) {
+  if (t == NULL && prof == NULL && c->history != NULL) {
+    return run_history(c, budget);
+  }
+  RUN_CHECKED(run_plain(c, budget, t, prof, c->history, c->map))
+}
+
+// run the same program through both loops and check they end up in the same
+// place.
+static void check_both(Core *c, const u8 *program, uint len, u16 origin,
+                       RunBudget budget) {
+  static Core plain;
+  core_init(&plain);
+  core_load(&plain, program, origin, len);
+  core_reset(&plain, origin);
+  core_run_plain(&plain, budget);
+
+  core_init(c);
+  core_load(c, program, origin, len);
+  core_reset(c, origin);
+  core_run(c, budget);
+
+  ASSERT(c->a == plain.a && c->x == plain.x && c->y == plain.y &&
+             c->sp == plain.sp && c->p == plain.p && c->pc == plain.pc,
+         "the cached and plain loops agree on the registers");
+  ASSERT(c->cycles == plain.cycles && c->instructions == plain.instructions,
+         "the cached and plain loops agree on the counts");
+  ASSERT(memcmp(c->memory, plain.memory, sizeof(c->memory)) == 0,
+         "the cached and plain loops agree on memory");
+}
+
+void test_core() {
+  printf("\n\nTESTING CORE\n\n\n");
+
+  static Core c;
+
+  {
+    // every opcode the core has is the one the assembler decodes, in the same
+    // mode.
+    struct {
+      u8 opcode;
+      Lexeme instruction;
+      AddrMode mode;
+    } list[] = {
+#define MODE_IMP Implicit
+#define MODE_ACC Implicit
+#define MODE_IMM Immediate
+#define MODE_ZP ZP
+#define MODE_ZPX ZPX
+#define MODE_ZPY ZPY
+#define MODE_ABS Abs
+#define MODE_ABX AbsX
+#define MODE_ABY AbsY
+#define MODE_IND Indirect
+#define MODE_IZX IndexedIndirect
+#define MODE_IZY IndirectIndexed
+#define MODE_REL Relative
+#define ENTRY(opcode, name, mode) {opcode, name, MODE_##mode},
+        OPCODES(ENTRY)
+#undef ENTRY
+    };
+    uint n = sizeof(list) / sizeof(list[0]);
+    uint legal = 0;
+    for (uint i = 1; i < 256; i++) {
+      legal += decode_table[i].instruction != LEXEME_NULL;
+    }
+    ASSERT(n == legal, "one handler for every legal opcode");
+    uint mismatched = 0;
+    for (uint i = 0; i < n; i++) {
+      DecodeEntry d = decode_table[list[i].opcode];
+      if (d.instruction != list[i].instruction || d.mode != list[i].mode) {
+        printf("opcode $%02x doesn't match the decode table.\n",
+               list[i].opcode);
+        mismatched++;
+      }
+    }
+    ASSERT(mismatched == 0, "the opcode list matches the decode table");
+  }
+
+  {
+    // lda #$50, adc #$50, brk: signed overflow.
+    u8 program[] = {0xa9, 0x50, 0x69, 0x50, 0x00};
+    check_both(&c, program, sizeof(program), 0x0600, (RunBudget){0});
+    ASSERT(c.a == 0xa0 && (c.p & FLAG_V) && (c.p & FLAG_N) && !(c.p & FLAG_C),
+           "adc sets v on signed overflow");
+    ASSERT(c.pc == 0x0604 && c.cycles == 4 && c.instructions == 2,
+           "stopped on the brk");
+  }
+
+  {
+    // sed, clc, lda #$19, adc #$28, sta $10, sec, lda #$40, sbc #$01, brk
+    u8 program[] = {0xf8, 0x18, 0xa9, 0x19, 0x69, 0x28, 0x85, 0x10, 0x38,
+                    0xa9, 0x40, 0xe9, 0x01, 0x00};
+    check_both(&c, program, sizeof(program), 0x0600, (RunBudget){0});
+    ASSERT(c.memory[0x10] == 0x47 && c.a == 0x39, "decimal adc and sbc");
+  }
+
+  {
+    // ldx #$05, loop: dex, bne loop, brk. the taken branches cost 3.
+    u8 program[] = {0xa2, 0x05, 0xca, 0xd0, 0xfd, 0x00};
+    check_both(&c, program, sizeof(program), 0x0600, (RunBudget){0});
+    ASSERT(c.x == 0 && c.instructions == 11 &&
+               c.cycles == 2 + 5 * 2 + 4 * 3 + 2,
+           "count down a loop");
+  }
+
+  {
+    // jsr sub, brk, sub: lda #$07, rts
+    u8 program[] = {0x20, 0x04, 0x06, 0x00, 0xa9, 0x07, 0x60};
+    check_both(&c, program, sizeof(program), 0x0600, (RunBudget){0});
+    ASSERT(c.a == 0x07 && c.pc == 0x0603 && c.sp == 0xfd,
+           "jsr and rts come back after the call");
+  }
+
+  {
+    // ldx #$02, loop: lda #$01, stx loop+1, dex, bne loop, brk. the store
+    // rewrites the lda's operand, so the second time around loads the 2.
+    u8 program[] = {0xa2, 0x02, 0xa9, 0x01, 0x8e, 0x03, 0x06,
+                    0xca, 0xd0, 0xf8, 0x00};
+    check_both(&c, program, sizeof(program), 0x0600, (RunBudget){0});
+    ASSERT(c.a == 0x02 && c.memory[0x0603] == 0x01,
+           "self modifying code sees its own stores");
+    ASSERT(c.invalidations == 2, "each store threw out the decoded lda");
+  }
+
+  {
+    // a breakpoint set after the code's been decoded still stops it.
+    u8 program[] = {0xea, 0xea, 0xea, 0x00};
+    core_init(&c);
+    core_load(&c, program, 0x0600, sizeof(program));
+    core_reset(&c, 0x0600);
+    core_run(&c, (RunBudget){0});
+    set_breakpoint(&c, 0x0601);
+    core_reset(&c, 0x0600);
+    StopReason r = core_run(&c, (RunBudget){0});
+    ASSERT(r == SR_BREAKPOINT && c.pc == 0x0601, "stops on the breakpoint");
+    r = core_run(&c, (RunBudget){0});
+    ASSERT(r == SR_BRK && c.instructions == 3, "then carries on past it");
+    clear_breakpoint(&c, 0x0601);
+  }
+
+  {
+    // ldx #$02, loop: lda #$01, stx loop+1, dex, bne loop, pha, brk. it
+    // writes over its own code and pushes, so two pages are dirty after.
+    u8 program[] = {0xa2, 0x02, 0xa9, 0x01, 0x8e, 0x03,
+                    0x06, 0xca, 0xd0, 0xf8, 0x48, 0x00};
+    static Snapshot s;
+    core_init(&c);
+    core_load(&c, program, 0x0600, sizeof(program));
+    core_reset(&c, 0x0600);
+    core_snapshot(&c, &s);
+    core_run(&c, (RunBudget){0});
+    u8 a = c.a;
+    u64 cycles = c.cycles;
+
+    uint pages = core_restore(&c, &s);
+    ASSERT(pages == 2 && c.memory[0x0603] == 0x01 && c.memory[0x01fd] == 0 &&
+               c.pc == 0x0600 && c.cycles == 0,
+           "restore copies back the pages that were written");
+    core_run(&c, (RunBudget){0});
+    ASSERT(c.a == a && c.cycles == cycles && c.memory[0x0603] == 0x01,
+           "runs the same after a restore, its own code decoded again");
+    ASSERT(core_restore(&c, &s) == 2, "a snapshot can be restored again");
+  }
+
+  printf("\n\nDONE TESTING CORE, SUCCESS!\n\n\n");
+}
+
+// lda $0200,X, adc #$01, sta $0200,X, inx, bne loop, jmp loop: five
+// instructions of straight line code and a branch, around and around.
+static const u8 bench_program[] = {0xbd, 0x00, 0x02, 0x69, 0x01, 0x9d, 0x00,
+                                   0x02, 0xe8, 0xd0, 0xf5, 0x4c, 0x00, 0x06};
+
+#define BENCH_INSTRUCTIONS 200000000ull
+
+static double bench_loop(StopReason (*run)(Core *, RunBudget), bool jit) {
+  static Core c;
+  static Jit j;
+  core_init(&c);
+  core_load(&c, bench_program, 0x0600, sizeof(bench_program));
+  core_reset(&c, 0x0600);
+  if (jit && !jit_attach(&j, &c)) {
+    return 0;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  run(&c, (RunBudget){.instructions = BENCH_INSTRUCTIONS});
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (jit) {
+    jit_detach(&j);
+  }
+
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return c.instructions / seconds / 1e6;
+}
+
+#define BENCH_CASES 20000
+
+// a test harness putting a core back to the same place between short cases,
+// by loading it from scratch and by restoring a snapshot. microseconds a case.
+static void bench_reset(double *reload, double *restore) {
+  static Core c;
+  static Snapshot s;
+  RunBudget budget = {.instructions = 100};
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < BENCH_CASES; i++) {
+    core_init(&c);
+    core_load(&c, bench_program, 0x0600, sizeof(bench_program));
+    core_reset(&c, 0x0600);
+    core_run(&c, budget);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *reload = ((end.tv_sec - start.tv_sec) * 1e6 +
+             (end.tv_nsec - start.tv_nsec) / 1e3) /
+            BENCH_CASES;
+
+  core_snapshot(&c, &s);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < BENCH_CASES; i++) {
+    core_restore(&c, &s);
+    core_run(&c, budget);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *restore = ((end.tv_sec - start.tv_sec) * 1e6 +
+              (end.tv_nsec - start.tv_nsec) / 1e3) /
+             BENCH_CASES;
+}
+
+// the jit's target is 10x the loop decoding every instruction. here it comes
+// out anywhere from 8x to 11.7x from one run to the next, about 10x in the
+// middle, so it's around the target and not reliably past it. the adc's carry
+// and overflow are a third of the native code for the loop.
+void bench_core() {
+  init_decode_table();
+
+  double plain = bench_loop(core_run_plain, false);
+  double cached = bench_loop(core_run, false);
+  double jit = bench_loop(core_run_jit, true);
+  printf("core: %.1f MIPS decoding every instruction, %.1f MIPS from the "
+         "decoded cache (%.2fx), %.1f MIPS jitted (%.2fx) (target: 10x)\n",
+         plain, cached, cached / plain, jit, jit / plain);
+
+  double reload, restore;
+  bench_reset(&reload, &restore);
+  printf("core: %.2fus a case reloading from scratch, %.2fus restoring a "
+         "snapshot (%.1fx)\n",
+         reload, restore, reload / restore);
+}
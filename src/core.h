@@ -0,0 +1,209 @@
+#pragma once
+
+#include "defines.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// our own 6502, for running whole programs out of memory. lib6502 only ever
+// sees the bytes it's handed, so it can't tell us when the guest writes over
+// its own code, and the decoded cache needs to know that.
+
+// the status register.
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_U 0x20 // always reads as set.
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+typedef enum StopReason {
+  SR_NONE = 0,
+  SR_BRK,              // hit a BRK, which doesn't get executed.
+  SR_BREAKPOINT,       // about to execute an instruction with a breakpoint.
+  SR_MAX_CYCLES,       // ran out of the cycle budget.
+  SR_MAX_INSTRUCTIONS, // ran out of the instruction budget.
+  SR_ILLEGAL,          // an opcode byte that isn't an instruction.
+  SR_WATCHPOINT,       // just executed an instruction that hit a watchpoint.
+  SR_NO_HISTORY,       // stepped back as far as the history goes.
+  SR_COUNT,
+} StopReason;
+
+// how far one run can go. 0 means no limit. the cycles can only go over by
+// what the last instruction took.
+typedef struct RunBudget {
+  u64 cycles;
+  u64 instructions;
+} RunBudget;
+
+// the host's page size, or at least what the memory's aligned to for mapping.
+#define CORE_PAGE_SIZE 0x1000
+
+// one instruction, decoded the first time the pc lands on it.
+typedef struct DecodedOp {
+  const void *handler; // where core_run jumps for it, NULL until decoded.
+  u16 operand; // the immediate, the base address or a branch's target.
+  u8 len;      // 0 for the ones that stop the run instead of executing.
+  u8 cycles;   // base cycles, the extras get worked out as it runs.
+} DecodedOp;
+
+typedef struct Core {
+  u8 a, x, y, sp, p;
+  u16 pc;
+
+  // page aligned, so a shared image can be mapped straight over it, see
+  // image.h.
+  u8 memory[0x10000] __attribute__((aligned(CORE_PAGE_SIZE)));
+
+  // indexed by the pc. a write anywhere in an instruction's bytes throws its
+  // entry out, but only pages that have had something decoded in them are
+  // ever checked.
+  DecodedOp decoded[0x10000];
+  u8 code_pages[0x100];
+
+  // pages written since the last snapshot, so a restore only has to copy
+  // those back. every write marks its page, from the guest or not.
+  u8 dirty_pages[0x100];
+  const struct Snapshot *snapshot; // the one the dirty pages are against.
+
+  u8 breakpoints[0x10000 / 8]; // one bit per address.
+  uint num_breakpoints;
+  // the same for the data an instruction reads or writes. the run stops
+  // after the instruction, with the address it hit in watched.
+  u8 read_watchpoints[0x10000 / 8];
+  u8 write_watchpoints[0x10000 / 8];
+  uint num_watchpoints;
+  u16 watched;
+  bool watched_write;
+  bool watch_pending; // the loops' own, hit but not stopped for yet.
+  // NULL unless some of those only stop when a condition holds, see
+  // condition.h.
+  struct Conditions *conditions;
+
+  // totals since the last core_reset.
+  u64 cycles;
+  u64 instructions;
+  u64 invalidations; // decoded entries thrown out by writes.
+
+  struct Jit *jit; // NULL unless a JIT's been attached, see jit.h.
+  struct Coverage *coverage; // NULL unless it's being kept, see coverage.h.
+  struct History *history;   // the same, see history.h.
+  // NULL for the flat 64k in memory. with one, every run goes through its
+  // page table on the plain loop, see map.h. core_forget after taking it off
+  // again, the decoded cache missed the writes that went through it.
+  struct MemoryMap *map;
+} Core;
+
+// just the registers, for handing a machine's state around without the
+// whole core.
+typedef struct Registers {
+  u8 a, x, y, sp, p;
+  u16 pc;
+} Registers;
+
+static inline Registers core_registers(const Core *c) {
+  return (Registers){c->a, c->x, c->y, c->sp, c->p, c->pc};
+}
+
+static inline void core_set_registers(Core *c, Registers r) {
+  c->a = r.a;
+  c->x = r.x;
+  c->y = r.y;
+  c->sp = r.sp;
+  c->p = r.p;
+  c->pc = r.pc;
+}
+
+// a core's registers, totals and memory at one point, to go back to. taking
+// one copies everything, going back only copies the pages that have been
+// written since.
+typedef struct Snapshot {
+  Registers registers;
+  u64 cycles;
+  u64 instructions;
+  u8 memory[0x10000];
+} Snapshot;
+
+// zero everything, memory included.
+void core_init(Core *c);
+// a core in a fresh mapping of its own, already zero, so none of it takes up
+// memory until it's touched. core_init would touch all of it.
+Core *core_new();
+void core_free(Core *c);
+// zero the memory and throw out everything decoded, for running a new program
+// on a core that's already been used. a lot cheaper than core_init, the
+// decoded cache is only cleared where there was code. the jit (if any) isn't
+// told.
+void core_clear(Core *c);
+// throw out everything decoded and mark every page dirty, without touching
+// the memory. for after the memory's been replaced from under the core.
+void core_forget(Core *c);
+// registers to how they are after a reset, with the pc at start. the memory
+// and breakpoints stay.
+void core_reset(Core *c, u16 start);
+
+// writes from outside the guest, these keep the decoded cache right. core_load
+// goes straight into memory, core_write through the map like a store from the
+// guest would.
+void core_load(Core *c, const u8 *bytes, u16 start, u32 len);
+void core_write(Core *c, u16 address, u8 value);
+// core_write without it going in the history, for putting a byte back.
+void core_restore_byte(Core *c, u16 address, u8 value);
+// the byte the guest would read, without going near a device for it. a
+// device's page reads what's in memory under it.
+u8 core_peek(const Core *c, u16 address);
+
+// interrupts from outside, taken between runs: push the pc and the status,
+// set I and jump through $fffe or $fffa. an irq is ignored while I is set,
+// false if it was.
+bool core_irq(Core *c);
+void core_nmi(Core *c);
+
+static inline bool has_breakpoint(const Core *c, u16 address) {
+  return c->breakpoints[address >> 3] & (1 << (address & 7));
+}
+
+void core_snapshot(Core *c, Snapshot *s);
+// put the core back how it was when s was taken, returns how many pages that
+// had to copy. restoring a snapshot that isn't the last one taken or restored
+// copies all of them. the snapshot can be restored any number of times.
+uint core_restore(Core *c, const Snapshot *s);
+
+void set_breakpoint(Core *c, u16 address);
+void clear_breakpoint(Core *c, u16 address);
+
+// what a breakpoint or a watchpoint is on.
+typedef enum WatchKind {
+  WK_EXECUTE,
+  WK_READ,
+  WK_WRITE,
+} WatchKind;
+
+// reads or writes, breakpoints are the ones above. nothing is thrown out of
+// the decoded cache for these, but the JIT doesn't check them, so
+// core_run_jit interprets while there are any.
+void set_watchpoint(Core *c, u16 address, WatchKind kind);
+void clear_watchpoint(Core *c, u16 address, WatchKind kind);
+
+// run out of the decoded cache, dispatching with computed goto. a breakpoint
+// on the pc the run starts at doesn't count, so calling this again continues
+// past it.
+StopReason core_run(Core *c, RunBudget budget);
+
+// the same thing, but decoding every instruction from scratch every time. it's
+// the reference the cache gets checked and benchmarked against.
+StopReason core_run_plain(Core *c, RunBudget budget);
+
+struct Trace;
+struct Profile;
+
+// the plain loop again, handing every instruction to a trace (see trace.h),
+// a profile (profile.h) or both. either can be NULL. this is the loop that
+// keeps Core.history.
+StopReason core_run_observed(Core *c, RunBudget budget, struct Trace *t,
+                             struct Profile *prof);
+
+void test_core();
+void bench_core();
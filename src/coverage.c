@@ -0,0 +1,214 @@
+#include "coverage.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "symtab.h"
+#include "util.h"
+#include "writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+uint coverage_count(const u8 *bits) {
+  uint n = 0;
+  for (uint i = 0; i < 0x10000 / 8; i++) {
+    n += __builtin_popcount(bits[i]);
+  }
+  return n;
+}
+
+typedef struct LineHit {
+  u16 file;
+  u32 line;
+  bool hit;
+} LineHit;
+
+static int by_file_and_line(const void *a, const void *b) {
+  const LineHit *x = a, *y = b;
+  if (x->file != y->file) {
+    return (x->file > y->file) - (x->file < y->file);
+  }
+  return (x->line > y->line) - (x->line < y->line);
+}
+
+static bool entry_hit(const Coverage *cov, const LayoutEntry *e) {
+  if (e->kind == EK_INSTRUCTION) {
+    return covered(cov->executed, e->address);
+  }
+  for (u32 a = e->address; a < e->address + e->size && a < 0x10000; a++) {
+    if (covered(cov->read, a) || covered(cov->written, a)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+CoverageStats coverage_write_lcov(Writer *w, const Coverage *cov,
+                                  const char *test_name, const char *source) {
+  static LineHit hits[AST_LEN];
+  uint num_hits = 0;
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+    SourcePos pos = node_pos[e->node];
+    if ((e->kind != EK_INSTRUCTION && e->kind != EK_DATA) || e->size == 0 ||
+        pos.line == 0) {
+      continue;
+    }
+    hits[num_hits++] = (LineHit){pos.file, pos.line, entry_hit(cov, e)};
+  }
+  qsort(hits, num_hits, sizeof(LineHit), by_file_and_line);
+
+  // a macro's lines all land on the line it was used on, that line's hit if
+  // any of them were.
+  CoverageStats total = {0};
+  uint i = 0;
+  while (i < num_hits) {
+    u16 file = hits[i].file;
+    const char *path = source_files[file].path;
+    writer_put_str(w, "TN:");
+    writer_put_str(w, test_name);
+    writer_put_str(w, "\nSF:");
+    writer_put_str(w, (path != NULL) ? path : source);
+    writer_put_char(w, '\n');
+
+    CoverageStats stats = {0};
+    while (i < num_hits && hits[i].file == file) {
+      u32 line = hits[i].line;
+      bool hit = false;
+      for (; i < num_hits && hits[i].file == file && hits[i].line == line;
+           i++) {
+        hit |= hits[i].hit;
+      }
+      writer_put_str(w, "DA:");
+      writer_put_u64(w, line);
+      writer_put_str(w, hit ? ",1\n" : ",0\n");
+      stats.lines++;
+      stats.lines_hit += hit;
+    }
+
+    writer_put_str(w, "LF:");
+    writer_put_u64(w, stats.lines);
+    writer_put_str(w, "\nLH:");
+    writer_put_u64(w, stats.lines_hit);
+    writer_put_str(w, "\nend_of_record\n");
+    total.lines += stats.lines;
+    total.lines_hit += stats.lines_hit;
+  }
+  return total;
+}
+
+void test_coverage() {
+  printf("\n\nTESTING COVERAGE\n\n\n");
+
+  static Core c;
+  static Coverage cov;
+  static Writer w;
+  static char buf[4096];
+
+  u8 *image = assemble_source("  ldx #$00\n"
+                              "loop:\n"
+                              "  lda table,X\n"
+                              "  sta $0200,X\n"
+                              "  inx\n"
+                              "  cpx #$03\n"
+                              "  bne loop\n"
+                              "  beq done\n"
+                              "  lda #$ff\n"
+                              "done:\n"
+                              "  brk\n"
+                              "table:\n"
+                              "  .byte $01, $02, $03\n"
+                              "unused:\n"
+                              "  .byte $09\n");
+
+  // the same through both loops.
+  for (uint plain = 0; plain < 2; plain++) {
+    memset(&cov, 0, sizeof(cov));
+    core_init(&c);
+    c.coverage = &cov;
+    core_load(&c, image + layout_origin, layout_origin,
+              layout_end - layout_origin);
+    core_reset(&c, layout_origin);
+    if (plain) {
+      core_run_plain(&c, (RunBudget){0});
+    } else {
+      core_run(&c, (RunBudget){0});
+    }
+
+    ASSERT(covered(cov.written, 0x0202) && !covered(cov.written, 0x0203) &&
+               coverage_count(cov.written) == 3,
+           "the stores were written down");
+    Symbol *table = lookup_symbol("table");
+    ASSERT(coverage_count(cov.read) == 3 && covered(cov.read, table->value),
+           "and so was reading the table");
+
+    FILE *f = tmpfile();
+    writer_init(&w, fileno(f));
+    CoverageStats stats = coverage_write_lcov(&w, &cov, "coverage", "test.s");
+    writer_flush(&w);
+    lseek(fileno(f), 0, SEEK_SET);
+    ssize_t len = read(fileno(f), buf, sizeof(buf) - 1);
+    buf[len > 0 ? len : 0] = '\0';
+    fclose(f);
+    printf("%s", buf);
+
+    // the lda #$ff is skipped, and nothing reads the last byte.
+    ASSERT(strcmp(buf, "TN:coverage\nSF:test.s\n"
+                       "DA:1,1\nDA:3,1\nDA:4,1\nDA:5,1\nDA:6,1\nDA:7,1\n"
+                       "DA:8,1\nDA:9,0\nDA:11,1\nDA:13,1\nDA:15,0\n"
+                       "LF:11\nLH:9\nend_of_record\n") == 0 &&
+               stats.lines == 11 && stats.lines_hit == 9,
+           "lcov for every line with code or data on it");
+  }
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING COVERAGE, SUCCESS!\n\n\n");
+}
+
+// ldy #$00, outer: ldx #$00, loop: lda $0300,X, sta $0200,X, inx, bne loop,
+// dey, bne outer, brk. a quarter million loads and stores.
+static const u8 coverage_program[] = {0xa0, 0x00, 0xa2, 0x00, 0xbd, 0x00,
+                                      0x03, 0x9d, 0x00, 0x02, 0xe8, 0xd0,
+                                      0xf7, 0x88, 0xd0, 0xf2, 0x00};
+
+#define BENCH_COVERAGE_RUNS 200
+
+static double bench_runs(Coverage *cov) {
+  static Core c;
+  core_init(&c);
+  c.coverage = cov;
+  core_load(&c, coverage_program, 0x0600, sizeof(coverage_program));
+
+  struct timespec start, end;
+  u64 instructions = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < BENCH_COVERAGE_RUNS; i++) {
+    core_reset(&c, 0x0600);
+    core_run(&c, (RunBudget){0});
+    instructions += c.instructions;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return instructions / seconds / 1e6;
+}
+
+void bench_coverage() {
+  init_decode_table();
+
+  static Coverage cov;
+  double off = bench_runs(NULL);
+  double on = bench_runs(&cov);
+  printf("coverage: %.1f MIPS without, %.1f MIPS with (%.0f%%)\n", off, on,
+         on / off * 100);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "defines.h"
+#include "pragma.h"
+#include "writer.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// which addresses a run executed, read and wrote, a bit each. hang one off
+// Core.coverage and both of the core's loops fill it in. the cached loop
+// only marks an instruction when it decodes it, so executing is free, and a
+// read or a write is one more or into the bitmap.
+//
+// the JIT doesn't fill it in, a machine with coverage on runs out of the
+// decoded cache instead.
+
+typedef struct Coverage {
+  u8 executed[0x10000 / 8]; // the first byte of each instruction.
+  u8 read[0x10000 / 8];     // data reads, stack pulls included.
+  u8 written[0x10000 / 8];  // stack pushes included.
+} Coverage;
+
+static inline ALWAYS_INLINE void cover(u8 *bits, u16 address) {
+  if (bits != NULL) {
+    bits[address >> 3] |= 1 << (address & 7);
+  }
+}
+
+static inline bool covered(const u8 *bits, u16 address) {
+  return bits[address >> 3] & (1 << (address & 7));
+}
+
+// how many addresses are set.
+uint coverage_count(const u8 *bits);
+
+typedef struct CoverageStats {
+  uint lines;
+  uint lines_hit;
+} CoverageStats;
+
+// lcov tracefile records for the program that's laid out now, one per
+// source file. an instruction's line is hit if it was executed, a data
+// line's if any of its bytes were read or written. source is the name for
+// text that was handed straight to parse().
+CoverageStats coverage_write_lcov(Writer *w, const Coverage *cov,
+                                  const char *test_name, const char *source);
+
+void test_coverage();
+void bench_coverage();
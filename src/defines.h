@@ -21,7 +21,7 @@ typedef int64_t i64;
 #define MAX_STR_LITERAL_SIZE 256
 #define U16_MAX 65535
 #define AST_LEN ((U16_MAX)-1)
-#define SYMTAB_LEN 256
+#define SYMTAB_LEN 4096
 
 // how large can the keyword (and identifier) strings be? used for allocing the
 // buffer in the Lexer next() function. "register", "continue", "unsigned" and
@@ -0,0 +1,548 @@
+#include "disasm.h"
+
+#include "assembler.h"
+#include "defines.h"
+#include "lexer.h"
+#include "symtab.h"
+#include "util.h"
+#include "writer.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// what column the "; address: bytes" comment starts at.
+#define COMMENT_COLUMN 20
+
+// the most a single line can take up, with the longest possible label names in
+// it. we reserve this much in the writer before formatting each line.
+#define MAX_LINE_LEN (2 * MAX_KW_LEN + 64)
+
+// where everything goes in a line without labels. the code column always fits
+// in COMMENT_COLUMN then, so every line for an opcode is the same length.
+#define LINE_ADDRESS (COMMENT_COLUMN + 3)
+#define LINE_BYTES (LINE_ADDRESS + 6)
+// past the end of every line, where an opcode with no operand writes its
+// value. the next line goes over it.
+#define LINE_SCRATCH 44
+
+// the text around the operand value for each addressing mode, so that every
+// mode is just prefix + value + suffix.
+static const char *mode_prefix[ADDRMODE_COUNT] = {
+    [Implicit] = "",   [Immediate] = "#$",      [Abs] = "$",
+    [AbsX] = "$",      [AbsY] = "$",            [ZP] = "$",
+    [ZPX] = "$",       [ZPY] = "$",             [Relative] = "$",
+    [Indirect] = "($", [IndexedIndirect] = "($", [IndirectIndexed] = "($",
+};
+
+static const char *mode_suffix[ADDRMODE_COUNT] = {
+    [Implicit] = "",  [Immediate] = "",         [Abs] = "",
+    [AbsX] = ",X",    [AbsY] = ",Y",            [ZP] = "",
+    [ZPX] = ",X",     [ZPY] = ",Y",             [Relative] = "",
+    [Indirect] = ")", [IndexedIndirect] = ",X)", [IndirectIndexed] = "),Y",
+};
+
+typedef enum OperandKind {
+  OK_NONE = 0,
+  OK_BYTE,     // one operand byte.
+  OK_WORD,     // two operand bytes, little endian.
+  OK_RELATIVE, // one signed byte, printed as the target address.
+} OperandKind;
+
+// everything about how an opcode id prints that doesn't depend on the operand
+// value, built once from the decode_table. the text fields are padded out with
+// spaces so that the hot loop can always copy them at their full size and then
+// just bump the cursor by the real length.
+typedef struct OpText {
+  char head[16]; // "  lda #$"
+  char label_head[16]; // "  lda ", for when the operand prints as a label.
+  char tail[4];  // ",X)"
+  u8 head_len;
+  u8 label_head_len;
+  u8 tail_len;
+  u8 len;        // instruction length in bytes.
+  u8 hex_digits; // how many digits the operand value prints with.
+  u16 value_mask;
+  OperandKind kind;
+  // the whole line without labels, with the numbers left to write over it.
+  char line[48];
+  u8 line_len;
+  u8 value_high; // where the operand value's two pairs go.
+  u8 value_low;
+} OpText;
+
+static OpText op_text[256];
+// just the lengths again, small enough to stay in the cache while the output
+// goes through it. finding the next instruction only waits on this.
+static u8 op_len[256];
+static bool op_text_ready = false;
+
+// reverse label index, one slot per address in the 64k space. NULL if there's
+// no label there.
+static const char *label_at[0x10000] = {0};
+static bool have_labels = false;
+
+static void build_op_text() {
+  for (int i = 0; i < 256; i++) {
+    OpText *t = &op_text[i];
+    DecodeEntry d = decode_table[i];
+    char buf[32];
+
+    memset(t, ' ', sizeof(t->head) + sizeof(t->label_head) + sizeof(t->tail));
+
+    if (d.instruction == LEXEME_NULL) {
+      // illegal opcode, just dump it as data. the byte is always the same, so
+      // it can go right into the head.
+      snprintf(buf, sizeof(buf), "  .byte $%02x", i);
+      t->kind = OK_NONE;
+      t->len = 1;
+    } else {
+      snprintf(buf, sizeof(buf), "  %s%s%s", instruction_to_string(d.instruction),
+               (d.mode == Implicit) ? "" : " ", mode_prefix[d.mode]);
+      t->len = d.len;
+
+      if (d.mode == Implicit) {
+        t->kind = OK_NONE;
+      } else if (d.mode == Relative) {
+        t->kind = OK_RELATIVE;
+      } else if (d.len == 3) {
+        t->kind = OK_WORD;
+      } else {
+        t->kind = OK_BYTE;
+      }
+    }
+
+    t->head_len = strlen(buf);
+    memcpy(t->head, buf, t->head_len);
+
+    // same thing without the '$', a label isn't a hex literal. immediates
+    // never print as labels, so those don't matter here.
+    t->label_head_len = t->head_len;
+    memcpy(t->label_head, buf, t->head_len);
+    if (t->label_head_len > 0 && buf[t->label_head_len - 1] == '$') {
+      t->label_head[--t->label_head_len] = ' ';
+    }
+
+    switch (t->kind) {
+    case OK_NONE:
+      t->hex_digits = 0;
+      t->value_mask = 0;
+      break;
+    case OK_BYTE:
+      t->hex_digits = 2;
+      t->value_mask = 0xff;
+      break;
+    case OK_WORD:
+    case OK_RELATIVE:
+      t->hex_digits = 4;
+      t->value_mask = 0xffff;
+      break;
+    }
+
+    const char *suffix =
+        (d.instruction == LEXEME_NULL) ? "" : mode_suffix[d.mode];
+    t->tail_len = strlen(suffix);
+    memcpy(t->tail, suffix, t->tail_len);
+
+    memset(t->line, ' ', sizeof(t->line));
+    memcpy(t->line, t->head, t->head_len);
+    memcpy(t->line + t->head_len + t->hex_digits, t->tail, t->tail_len);
+    memcpy(t->line + COMMENT_COLUMN, "; $", 3);
+    memcpy(t->line + LINE_ADDRESS + 4, ": ", 2);
+    t->line_len = LINE_BYTES + 3 * t->len;
+    t->line[t->line_len - 1] = '\n';
+    if (t->kind == OK_NONE) {
+      t->value_high = t->value_low = LINE_SCRATCH;
+    } else {
+      t->value_high = t->head_len;
+      t->value_low = t->head_len + t->hex_digits - 2;
+    }
+    op_len[i] = t->len;
+  }
+
+  op_text_ready = true;
+}
+
+void disasm_load_labels() {
+  for (int i = 0; i < SYMTAB_LEN; i++) {
+    Symbol s = symtab[i];
+    if (s.name != NULL && s.type == DT_INT) {
+      label_at[s.value & 0xffff] = s.name;
+      have_labels = true;
+    }
+  }
+}
+
+void disasm_clear_labels() {
+  memset(label_at, 0, sizeof(label_at));
+  have_labels = false;
+}
+
+// copy a nullterm string into the cursor, return the new cursor.
+static inline char *put_cstr(char *c, const char *s) {
+  while (*s) {
+    *c++ = *s++;
+  }
+  return c;
+}
+
+static inline char *put_hex8(char *c, u8 value) {
+  memcpy(c, hex_pairs[value], 2);
+  return c + 2;
+}
+
+static inline char *put_hex16(char *c, u16 value) {
+  memcpy(c, hex_pairs[value >> 8], 2);
+  memcpy(c + 2, hex_pairs[value & 0xff], 2);
+  return c + 4;
+}
+
+// the trailing "; $0600: a9 10" comment. the caller has already padded
+// everything up to the comment column with spaces. all three byte slots are
+// always written and the cursor is bumped by the real length, which is a lot
+// cheaper than a loop that mispredicts on every other instruction.
+static inline char *put_comment(char *c, u16 address, u8 b0, u8 b1, u8 b2,
+                                int len) {
+  memcpy(c, "; $", 3);
+  c = put_hex16(c + 3, address);
+  c[0] = ':';
+  c[1] = ' ';
+  memcpy(c + 2, hex_pairs[b0], 2);
+  c[4] = ' ';
+  memcpy(c + 5, hex_pairs[b1], 2);
+  c[7] = ' ';
+  memcpy(c + 8, hex_pairs[b2], 2);
+  c += 1 + 3 * len;
+  *c++ = '\n';
+  return c;
+}
+
+// the bulk of a buffer with no labels loaded, while there's always a whole
+// instruction left. every line is its opcode's template with the numbers
+// written over it, all at fixed places, so there's nothing to measure. the
+// cursor and the table fields are kept in locals, since every store through a
+// char * could otherwise have changed them as far as the compiler knows.
+static size_t disasm_plain(Writer *w, const u8 *bytes, size_t len,
+                           u16 *address) {
+  size_t pos = 0;
+  u16 addr = *address;
+  char *c = w->buf + w->len;
+  char *last = w->buf + WRITER_BUF_SIZE - MAX_LINE_LEN;
+
+  while (pos + MAX_OPCODE_LEN <= len) {
+    u8 b0 = bytes[pos], b1 = bytes[pos + 1], b2 = bytes[pos + 2];
+    const OpText *t = &op_text[b0];
+    u8 ins_len = op_len[b0], line_len = t->line_len;
+    u8 value_high = t->value_high, value_low = t->value_low;
+
+    u16 value = (b1 | (b2 << 8)) & t->value_mask;
+    if (t->kind == OK_RELATIVE) {
+      value = addr + 2 + (i8)b1;
+    }
+
+    if (c > last) {
+      w->len = c - w->buf;
+      writer_flush(w);
+      c = w->buf;
+    }
+    memcpy(c, t->line, sizeof(t->line));
+    memcpy(c + value_high, hex_pairs[value >> 8], 2);
+    memcpy(c + value_low, hex_pairs[value & 0xff], 2);
+    put_hex16(c + LINE_ADDRESS, addr);
+    // all three pairs, then the newline over whatever shouldn't be there.
+    memcpy(c + LINE_BYTES, hex_pairs[b0], 2);
+    memcpy(c + LINE_BYTES + 3, hex_pairs[b1], 2);
+    memcpy(c + LINE_BYTES + 6, hex_pairs[b2], 2);
+    c[line_len - 1] = '\n';
+    c += line_len;
+
+    pos += ins_len;
+    addr += ins_len;
+  }
+
+  w->len = c - w->buf;
+  *address = addr;
+  return pos;
+}
+
+size_t disasm_bytes(Writer *w, const u8 *bytes, size_t len, u16 *address) {
+  if (!op_text_ready) {
+    build_op_text();
+  }
+
+  size_t pos = 0;
+  u16 addr = *address;
+  if (!have_labels) {
+    pos = disasm_plain(w, bytes, len, &addr);
+  }
+
+  while (pos < len) {
+    const OpText *t = &op_text[bytes[pos]];
+    int ins_len = t->len;
+
+    if (pos + ins_len > len) {
+      // the instruction is cut off by the end of the buffer, let the caller
+      // refill and hand it back to us.
+      break;
+    }
+
+    u8 b0 = bytes[pos];
+    u8 b1 = (pos + 1 < len) ? bytes[pos + 1] : 0;
+    u8 b2 = (pos + 2 < len) ? bytes[pos + 2] : 0;
+
+    char *line_start = writer_reserve(w, MAX_LINE_LEN);
+    char *c = line_start;
+
+    if (have_labels && label_at[addr]) {
+      c = put_cstr(c, label_at[addr]);
+      *c++ = ':';
+      *c++ = '\n';
+      line_start = c;
+    }
+
+    // blank out the code column, so that whatever we don't write over is
+    // already the padding before the comment.
+    memset(c, ' ', COMMENT_COLUMN + sizeof(t->tail));
+
+    u16 value = (b1 | (b2 << 8)) & t->value_mask;
+    if (t->kind == OK_RELATIVE) {
+      // branches are printed as the target address, which is what the source
+      // would have been written with.
+      value = addr + 2 + (i8)b1;
+    }
+
+    const char *name = NULL;
+    if (have_labels && t->kind != OK_NONE &&
+        decode_table[b0].mode != Immediate) {
+      name = label_at[value];
+    }
+
+    if (name) {
+      memcpy(c, t->label_head, sizeof(t->label_head));
+      c = put_cstr(c + t->label_head_len, name);
+    } else {
+      memcpy(c, t->head, sizeof(t->head));
+      c += t->head_len;
+      // the high pair always goes down first, and a one byte operand just
+      // writes its low pair right over it. with no operand at all, the tail
+      // below covers whatever was written here.
+      memcpy(c, hex_pairs[value >> 8], 2);
+      memcpy(c + (t->hex_digits == 4 ? 2 : 0), hex_pairs[value & 0xff], 2);
+      c += t->hex_digits;
+    }
+
+    memcpy(c, t->tail, sizeof(t->tail));
+    c += t->tail_len;
+
+    if (c < line_start + COMMENT_COLUMN) {
+      c = line_start + COMMENT_COLUMN;
+    } else {
+      *c++ = ' ';
+    }
+
+    c = put_comment(c, addr, b0, b1, b2, ins_len);
+    w->len = c - w->buf;
+
+    pos += ins_len;
+    addr += ins_len;
+  }
+
+  *address = addr;
+  return pos;
+}
+
+void disasm_fd(int in_fd, Writer *w, u16 origin) {
+  // keep a couple of extra bytes at the front of the buffer for the cut off
+  // instruction that gets carried over from the last read.
+  static u8 buf[DISASM_BUF_SIZE + MAX_OPCODE_LEN];
+  size_t carried = 0;
+  u16 address = origin;
+
+  while (1) {
+    ssize_t bytes_read = read(in_fd, buf + carried, DISASM_BUF_SIZE);
+    if (bytes_read < 0) {
+      perror("Disassembler read failed");
+      error("Could not read from fd %d.", in_fd);
+    }
+    if (bytes_read == 0) {
+      break;
+    }
+
+    size_t filled = carried + bytes_read;
+    size_t used = disasm_bytes(w, buf, filled, &address);
+
+    carried = filled - used;
+    memmove(buf, buf + used, carried);
+  }
+
+  // anything still carried over at EOF is a truncated instruction, so it's just
+  // data.
+  for (size_t i = 0; i < carried; i++) {
+    char *line_start = writer_reserve(w, MAX_LINE_LEN);
+    memset(line_start, ' ', COMMENT_COLUMN);
+    char *c = put_cstr(line_start, "  .byte $");
+    put_hex8(c, buf[i]);
+    c = put_comment(line_start + COMMENT_COLUMN, address, buf[i], 0, 0, 1);
+    w->len = c - w->buf;
+    address++;
+  }
+
+  writer_flush(w);
+}
+
+void disasm_file(const char *path, Writer *w, u16 origin) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    char error_buf[256];
+    sprintf(error_buf, "Error opening file [%s]", path);
+    perror(error_buf);
+    exit(1);
+  }
+
+  disasm_fd(fd, w, origin);
+  close(fd);
+}
+
+// disassemble into a tmpfile and read the text back out for comparison.
+static void disasm_to_string(const u8 *bytes, size_t len, u16 origin,
+                             char *dest, size_t dest_len) {
+  static Writer w;
+  FILE *f = tmpfile();
+  writer_init(&w, fileno(f));
+
+  u16 address = origin;
+  disasm_bytes(&w, bytes, len, &address);
+  writer_flush(&w);
+
+  rewind(f);
+  size_t n = fread(dest, 1, dest_len - 1, f);
+  dest[n] = '\0';
+  fclose(f);
+}
+
+void test_disasm() {
+  printf("\n\nTESTING DISASSEMBLER\n\n\n");
+
+  init_decode_table();
+
+  char text[1024];
+
+  {
+    ASSERT(decode_table[0xA9].instruction == LDA &&
+               decode_table[0xA9].mode == Immediate,
+           "decode table lda immediate");
+    ASSERT(decode_table[0x6C].instruction == JMP &&
+               decode_table[0x6C].len == 3,
+           "decode table jmp indirect");
+    ASSERT(decode_table[0x00].instruction == BRK, "decode table brk");
+    ASSERT(decode_table[0x02].instruction == LEXEME_NULL,
+           "decode table illegal opcode");
+  }
+
+  {
+    u8 bytes[] = {0xA9, 0x10, 0x9D, 0x00, 0x02, 0xB1, 0x20};
+    disasm_to_string(bytes, sizeof(bytes), 0x0600, text, sizeof(text));
+    ASSERT(strcmp(text, "  lda #$10          ; $0600: a9 10\n"
+                        "  sta $0200,X       ; $0602: 9d 00 02\n"
+                        "  lda ($20),Y       ; $0605: b1 20\n") == 0,
+           "disassemble addressing modes");
+  }
+
+  {
+    // a branch back to itself, with a label on the target.
+    symtab[0] = make_symbol(DT_INT, "loop", 0x0600);
+    disasm_load_labels();
+
+    u8 bytes[] = {0xD0, 0xFE};
+    disasm_to_string(bytes, sizeof(bytes), 0x0600, text, sizeof(text));
+    ASSERT(strcmp(text, "loop:\n"
+                        "  bne loop          ; $0600: d0 fe\n") == 0,
+           "disassemble branch to label");
+
+    disasm_clear_labels();
+    clean_symtab();
+  }
+
+  {
+    // every opcode through the template path, and again with a label loaded
+    // that nothing touches, which takes the long way round.
+    static u8 bytes[256 * MAX_OPCODE_LEN];
+    static char fast[256 * 64], slow[256 * 64];
+    for (int i = 0; i < 256; i++) {
+      bytes[i * MAX_OPCODE_LEN] = i;
+      bytes[i * MAX_OPCODE_LEN + 1] = i;
+      bytes[i * MAX_OPCODE_LEN + 2] = i;
+    }
+    disasm_to_string(bytes, sizeof(bytes), 0x0600, fast, sizeof(fast));
+    symtab[0] = make_symbol(DT_INT, "far", 0x8000);
+    disasm_load_labels();
+    disasm_to_string(bytes, sizeof(bytes), 0x0600, slow, sizeof(slow));
+    ASSERT(strcmp(fast, slow) == 0,
+           "the template path prints the same as the careful one");
+
+    disasm_clear_labels();
+    clean_symtab();
+  }
+
+  {
+    // the last instruction is cut off, so it shouldn't be consumed.
+    u8 bytes[] = {0xEA, 0x4C, 0x00};
+    u16 address = 0;
+    static Writer w;
+    writer_init(&w, -1);
+    ASSERT(disasm_bytes(&w, bytes, sizeof(bytes), &address) == 1,
+           "disassemble stops before a cut off instruction");
+    ASSERT(address == 1, "disassemble bumps the address");
+  }
+
+  printf("\n\nDONE TESTING DISASSEMBLER, SUCCESS!\n\n\n");
+}
+
+// how much random input to push through the disassembler.
+#define BENCH_INPUT_SIZE (1024 * 1024 * 64)
+
+void bench_disasm() {
+  init_decode_table();
+
+  // random bytes are roughly a worst case for us, lots of illegal opcodes and
+  // short instructions mean more lines of output per input byte.
+  u8 *input = (u8 *)malloc(BENCH_INPUT_SIZE);
+  srand(6502);
+  for (size_t i = 0; i < BENCH_INPUT_SIZE; i++) {
+    input[i] = rand() & 0xff;
+  }
+
+  FILE *in = tmpfile();
+  fwrite(input, 1, BENCH_INPUT_SIZE, in);
+  fflush(in);
+  free(input);
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  static Writer w;
+  writer_init(&w, null_fd);
+
+  // run it through once to warm up the page cache.
+  lseek(fileno(in), 0, SEEK_SET);
+  disasm_fd(fileno(in), &w, 0);
+
+  struct timespec start, end;
+  lseek(fileno(in), 0, SEEK_SET);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  disasm_fd(fileno(in), &w, 0);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  double mb = (double)BENCH_INPUT_SIZE / (1024 * 1024);
+
+  printf("disasm: %.0f MB in %.3fs, %.1f MB/s (target: 100 MB/s)\n", mb,
+         seconds, mb / seconds);
+
+  close(null_fd);
+  fclose(in);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "defines.h"
+#include "writer.h"
+
+#include <stddef.h>
+
+// how much of the input binary we pull in per read() call. the input is
+// streamed through this, so the size of the binary doesn't matter.
+#define DISASM_BUF_SIZE (1024 * 64)
+
+// pull the label names out of the symtab, so that addresses with a label on
+// them print as the label instead of as a raw hex address. safe to skip, the
+// disassembler just prints raw addresses then.
+void disasm_load_labels();
+void disasm_clear_labels();
+
+// disassemble as many whole instructions as fit in bytes[0..len], starting at
+// *address. *address is bumped past everything that was printed. returns how
+// many bytes were consumed, which can be up to two short of len if the last
+// instruction is cut off by the end of the buffer.
+size_t disasm_bytes(Writer *w, const u8 *bytes, size_t len, u16 *address);
+
+// stream a whole binary from the fd through a fixed buffer.
+void disasm_fd(int in_fd, Writer *w, u16 origin);
+void disasm_file(const char *path, Writer *w, u16 origin);
+
+void test_disasm();
+void bench_disasm();
@@ -0,0 +1,58 @@
+#include "fixture.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "core.h"
+#include "defines.h"
+#include "layout.h"
+#include "parse.h"
+#include "symtab.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+u8 *assemble_source(char *source) {
+  static u8 image[0x10000 + MAX_OPCODE_LEN];
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+  NodeIndex root = parse(source);
+  layout_program(root, DEFAULT_ORIGIN);
+  memset(image, 0, sizeof(image));
+  emit_layout(image);
+  return image;
+}
+
+void assemble_into(Core *c, char *source) {
+  u8 *image = assemble_source(source);
+  core_load(c, image + layout_origin, layout_origin,
+            layout_end - layout_origin);
+  core_reset(c, layout_origin);
+}
+
+bool assembly_fails(char *source) {
+  // or whatever's buffered gets printed by both.
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    // the error message is expected, keep it out of the test output.
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    assemble_source(source);
+    exit(0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
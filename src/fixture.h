@@ -0,0 +1,23 @@
+#pragma once
+
+#include "core.h"
+#include "defines.h"
+
+#include <stdbool.h>
+
+// shared setup for the test_xxx() functions, so each one doesn't carry its own
+// copy of the assembler boilerplate.
+
+// parse, lay out and encode source from a clean ast, symtab and layout, at
+// DEFAULT_ORIGIN. the image is the whole zeroed 64k with the program in it,
+// and it's only good until the next call. the symtab keeps the program's
+// labels afterwards for the test to look up.
+u8 *assemble_source(char *source);
+
+// assemble_source, then load the program into c and reset it to the origin.
+// c has to have been through core_init already.
+void assemble_into(Core *c, char *source);
+
+// whether assembling source stops on an error(). it's tried in a child
+// process, since error() exits.
+bool assembly_fails(char *source);
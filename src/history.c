@@ -0,0 +1,329 @@
+#include "history.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "condition.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void history_init(History *h, size_t size) {
+  memset(h, 0, sizeof(History));
+  if (size < 4 * HISTORY_RECORD_MAX) {
+    error("A history of %zu bytes is too small to keep anything in.", size);
+  }
+  h->bytes = malloc(size);
+  if (h->bytes == NULL) {
+    error("Couldn't allocate %zu bytes of history.", size);
+  }
+  h->size = size;
+  history_clear(h);
+}
+
+void history_free(History *h) {
+  free(h->bytes);
+  memset(h, 0, sizeof(History));
+}
+
+void history_clear(History *h) {
+  h->head = h->tail = h->wrap = 0;
+  h->limit = h->size - HISTORY_RECORD_MAX;
+  h->records = 0;
+  h->steps = 0;
+}
+
+// whether the records go around the end of the buffer.
+static bool wrapped(const History *h) { return h->records > 0 && h->wrap != 0; }
+
+static void drop_oldest(History *h) {
+  u8 n = h->bytes[h->tail];
+  h->tail += HISTORY_HEADER_LEN + 3 * n + HISTORY_TRAILER_LEN;
+  h->records--;
+  h->steps -= h->bytes[h->tail - 2];
+  if (h->wrap != 0 && h->tail == h->wrap) {
+    h->tail = 0;
+    h->wrap = 0;
+  }
+}
+
+void history_make_room(History *h) {
+  while (1) {
+    if (h->records == 0) {
+      h->head = h->tail = h->wrap = 0;
+    }
+    if (!wrapped(h)) {
+      if (h->head + HISTORY_RECORD_MAX <= h->size) {
+        h->limit = h->size - HISTORY_RECORD_MAX;
+        return;
+      }
+      // back around to the start, over the oldest records.
+      h->wrap = h->head;
+      h->head = 0;
+    } else {
+      if (h->head + HISTORY_RECORD_MAX <= h->tail) {
+        h->limit = h->tail - HISTORY_RECORD_MAX;
+        return;
+      }
+      drop_oldest(h);
+    }
+  }
+}
+
+// take the newest record back off and put everything it changed back. the
+// last write it undoes to a watched address goes in watched, or -1.
+static bool undo(History *h, Core *c, HistoryKind *kind, int *watched) {
+  if (h->records == 0) {
+    return false;
+  }
+  if (wrapped(h) && h->head == 0) {
+    h->head = h->wrap;
+    h->wrap = 0;
+  }
+
+  u8 *end = h->bytes + h->head;
+  u8 n = end[-1];
+  *kind = end[-2];
+  u8 *start = end - HISTORY_TRAILER_LEN - 3 * n - HISTORY_HEADER_LEN;
+
+  *watched = -1;
+  for (int i = n - 1; i >= 0; i--) {
+    u8 *w = start + HISTORY_HEADER_LEN + 3 * i;
+    u16 address = w[0] | (w[1] << 8);
+    core_restore_byte(c, address, w[2]);
+    if (c->write_watchpoints[address >> 3] & (1 << (address & 7))) {
+      *watched = address;
+    }
+  }
+  core_set_registers(c, (Registers){.pc = start[1] | (start[2] << 8),
+                                    .a = start[3],
+                                    .x = start[4],
+                                    .y = start[5],
+                                    .sp = start[6],
+                                    .p = start[7]});
+  c->cycles -= end[-3];
+  c->instructions -= *kind;
+
+  h->head = start - h->bytes;
+  h->records--;
+  h->steps -= *kind;
+  h->limit = wrapped(h) ? h->tail - HISTORY_RECORD_MAX
+                        : h->size - HISTORY_RECORD_MAX;
+  return true;
+}
+
+u64 core_step_back(Core *c, u64 n) {
+  History *h = c->history;
+  u64 stepped = 0;
+  HistoryKind kind;
+  int watched;
+  while (h != NULL && stepped < n && h->steps > 0 &&
+         undo(h, c, &kind, &watched)) {
+    stepped += kind;
+  }
+  return stepped;
+}
+
+StopReason core_reverse_continue(Core *c) {
+  History *h = c->history;
+  HistoryKind kind;
+  int watched;
+  while (h != NULL && h->steps > 0 && undo(h, c, &kind, &watched)) {
+    if (kind != HK_INSTRUCTION) {
+      continue;
+    }
+    if (watched >= 0 && condition_stops(c, WK_WRITE, watched)) {
+      c->watched = watched;
+      c->watched_write = true;
+      return SR_WATCHPOINT;
+    }
+    if (has_breakpoint(c, c->pc) && condition_stops(c, WK_EXECUTE, c->pc)) {
+      return SR_BREAKPOINT;
+    }
+  }
+  return SR_NO_HISTORY;
+}
+
+static bool same_as(const Core *c, const Snapshot *s) {
+  // a field at a time, the padding in Registers isn't anything.
+  const Registers *r = &s->registers;
+  return c->a == r->a && c->x == r->x && c->y == r->y && c->sp == r->sp &&
+         c->p == r->p && c->pc == r->pc && c->cycles == s->cycles &&
+         c->instructions == s->instructions &&
+         memcmp(c->memory, s->memory, sizeof(c->memory)) == 0;
+}
+
+#define TEST_HISTORY_STEPS 40
+
+void test_history() {
+  printf("\n\nTESTING HISTORY\n\n\n");
+
+  static Core c;
+  static History h;
+  static Snapshot states[TEST_HISTORY_STEPS + 1];
+
+  // stores, a call, and a subroutine that writes its own rts back over itself.
+  char *source = "  ldx #$05\n"
+                 "loop:\n"
+                 "  txa\n"
+                 "  sta $0200,X\n"
+                 "  jsr bump\n"
+                 "  dex\n"
+                 "  bne loop\n"
+                 "  brk\n"
+                 "bump:\n"
+                 "  inc $0210\n"
+                 "  lda #$60\n"
+                 "  sta patch\n"
+                 "patch:\n"
+                 "  rts\n";
+
+  core_init(&c);
+  history_init(&h, 1 << 16);
+  c.history = &h;
+  assemble_into(&c, source);
+
+  // a step at a time, with where it was after each one to go back to.
+  uint steps = 0;
+  core_snapshot(&c, &states[0]);
+  while (steps < TEST_HISTORY_STEPS &&
+         core_run_observed(&c, (RunBudget){.instructions = 1}, NULL, NULL) ==
+             SR_MAX_INSTRUCTIONS) {
+    core_snapshot(&c, &states[++steps]);
+  }
+  ASSERT(h.steps == steps && steps == TEST_HISTORY_STEPS,
+         "a record for every instruction");
+
+  bool all_same = true;
+  for (uint i = steps; i > 0; i--) {
+    all_same &= core_step_back(&c, 1) == 1 && same_as(&c, &states[i - 1]);
+  }
+  ASSERT(all_same, "every step back lands where it was before that step");
+  ASSERT(core_step_back(&c, 1) == 0 && h.records == 0,
+         "and there's nothing before the start");
+
+  // forwards again through the cached loop's cache, which the stepping back
+  // has to have kept right.
+  StopReason r = core_run(&c, (RunBudget){0});
+  ASSERT(r == SR_BRK && c.memory[0x0201] == 1 && c.memory[0x0210] == 5,
+         "runs forwards again after going back");
+
+  // writes and interrupts from outside get undone on the way.
+  core_reset(&c, layout_origin);
+  c.p &= ~FLAG_I;
+  core_run_observed(&c, (RunBudget){.instructions = 3}, NULL, NULL);
+  core_snapshot(&c, &states[0]);
+  core_write(&c, 0x0300, 0x42);
+  core_irq(&c);
+  ASSERT(h.steps == 3 && h.records == 5, "outside changes are records too");
+  ASSERT(core_step_back(&c, 1) == 1 && c.memory[0x0300] == 0 &&
+             c.instructions == 2,
+         "stepping back goes through them to the instruction before");
+  core_run_observed(&c, (RunBudget){.instructions = 1}, NULL, NULL);
+  ASSERT(same_as(&c, &states[0]) && c.memory[0x0300] == 0,
+         "and runs the same way after");
+
+  // back to a breakpoint and to a write.
+  core_reset(&c, layout_origin);
+  Symbol *bump = lookup_symbol("bump");
+  r = core_run_observed(&c, (RunBudget){0}, NULL, NULL);
+  set_breakpoint(&c, bump->value);
+  r = core_reverse_continue(&c);
+  ASSERT(r == SR_BREAKPOINT && c.pc == bump->value && c.x == 1,
+         "reverse-continue stops on the last time through the breakpoint");
+  clear_breakpoint(&c, bump->value);
+  set_watchpoint(&c, 0x0203, WK_WRITE);
+  r = core_reverse_continue(&c);
+  // the earlier runs left the same 3 there, so it's the pc that says.
+  Symbol *loop = lookup_symbol("loop");
+  ASSERT(r == SR_WATCHPOINT && c.watched == 0x0203 && c.x == 3 &&
+             c.pc == loop->value + 1,
+         "and on the store to a watched address, from before it");
+  clear_watchpoint(&c, 0x0203, WK_WRITE);
+  r = core_reverse_continue(&c);
+  ASSERT(r == SR_NO_HISTORY && c.instructions == 0 && c.pc == layout_origin,
+         "then all the way back to the start");
+
+  // a ring that's too small for the whole run keeps the end of it.
+  history_free(&h);
+  history_init(&h, 4 * HISTORY_RECORD_MAX + 7);
+  c.history = &h;
+  core_reset(&c, layout_origin);
+  r = core_run_observed(&c, (RunBudget){0}, NULL, NULL);
+  u64 kept = h.steps, end = c.instructions;
+  ASSERT(r == SR_BRK && kept > 0 && kept < end,
+         "a small ring only keeps the newest records");
+  core_snapshot(&c, &states[0]);
+  ASSERT(core_step_back(&c, 1000) == kept &&
+             c.instructions == end - kept && h.records == 0,
+         "which can all be stepped back through");
+  core_run_observed(&c, (RunBudget){0}, NULL, NULL);
+  ASSERT(same_as(&c, &states[0]), "and run forwards again to the same end");
+
+  c.history = NULL;
+  history_free(&h);
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING HISTORY, SUCCESS!\n\n\n");
+}
+
+// lda $0200,X, adc #$01, sta $0200,X, inx, bne, jmp back to the start. a
+// store every five instructions.
+static const u8 history_program[] = {0xbd, 0x00, 0x02, 0x69, 0x01,
+                                     0x9d, 0x00, 0x02, 0xe8, 0xd0,
+                                     0xf5, 0x4c, 0x00, 0x06};
+
+#define BENCH_HISTORY_INSTRUCTIONS 50000000
+
+static double bench_observed(Core *c) {
+  struct timespec start, end;
+  core_reset(c, 0x0600);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  core_run_observed(c, (RunBudget){.instructions = BENCH_HISTORY_INSTRUCTIONS},
+                    NULL, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return c->instructions / seconds / 1e6;
+}
+
+void bench_history() {
+  init_decode_table();
+
+  static Core c;
+  static History h;
+  core_init(&c);
+  core_load(&c, history_program, 0x0600, sizeof(history_program));
+
+  double without = bench_observed(&c);
+  history_init(&h, 64 << 20);
+  c.history = &h;
+  double with = bench_observed(&c);
+  u64 kept = h.steps;
+  size_t used = (h.wrap != 0) ? h.size : h.head;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  u64 back = core_step_back(&c, kept);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("history: %.1f MIPS observed, %.1f MIPS keeping history (%.0f%%), "
+         "%.2f bytes an instruction, %lu steps in 64MB, %.1fM steps back a "
+         "second\n",
+         without, with, with / without * 100, (double)used / kept,
+         (unsigned long)kept, back / seconds / 1e6);
+
+  c.history = NULL;
+  history_free(&h);
+}
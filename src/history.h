@@ -0,0 +1,110 @@
+#pragma once
+
+#include "core.h"
+#include "defines.h"
+#include "pragma.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+// what each instruction changed, so a run can be stepped backwards without
+// going back to a snapshot and running forwards again. hang one off
+// Core.history and core_run_observed keeps it (machine_run switches to that
+// loop when there is one), along with core_write and interrupts from outside.
+// loading, resetting or restoring the core empties it.
+//
+// it's a ring of bytes, the oldest records get dropped to make room. a record
+// is:
+//
+//   n, pc lo, pc hi, a, x, y, sp, p    the registers from before it
+//   n times: address lo, address hi, the byte that was there before
+//   cycles, kind, n
+//
+// with n at both ends so it can be walked from either one. an instruction
+// costs the 8 byte header, 3 bytes a write and the 3 byte trailer.
+
+// a jsr pushes two, an interrupt three.
+#define HISTORY_MAX_WRITES 3
+#define HISTORY_HEADER_LEN 8
+#define HISTORY_TRAILER_LEN 3
+// the room a record needs, with the byte history_end's store goes over by.
+#define HISTORY_RECORD_MAX                                                     \
+  (HISTORY_HEADER_LEN + 3 * HISTORY_MAX_WRITES + HISTORY_TRAILER_LEN + 1)
+
+typedef enum HistoryKind {
+  HK_OUTSIDE,     // core_write or an interrupt, undone along the way.
+  HK_INSTRUCTION, // the only kind that counts as a step.
+} HistoryKind;
+
+typedef struct History {
+  u8 *bytes;
+  size_t size;
+  // the records are [tail, head), or [tail, wrap) then [0, head) once head's
+  // gone back around to the start. wrap's 0 when it hasn't.
+  size_t head;
+  size_t tail;
+  size_t wrap;
+  size_t limit; // a record started past this might not fit.
+  u64 records;
+  u64 steps; // how many of the records are instructions.
+  u8 *at;    // where the open record's next write goes.
+} History;
+
+// size is in bytes, it has to fit a few records.
+void history_init(History *h, size_t size);
+void history_free(History *h);
+void history_clear(History *h);
+
+// make sure there's room for a whole record after head.
+void history_make_room(History *h);
+
+static inline ALWAYS_INLINE void history_begin(History *h, Registers r) {
+  if (UNLIKELY(h->head > h->limit)) {
+    history_make_room(h);
+  }
+  // the whole header in one store, n goes in at the end.
+  u64 header = ((u64)r.pc << 8) | ((u64)r.a << 24) | ((u64)r.x << 32) |
+               ((u64)r.y << 40) | ((u64)r.sp << 48) | ((u64)r.p << 56);
+  u8 *at = h->bytes + h->head;
+  memcpy(at, &header, sizeof(header));
+  h->at = at + HISTORY_HEADER_LEN;
+}
+
+// before the byte's written over.
+static inline ALWAYS_INLINE void history_write(History *h, u16 address,
+                                               u8 old) {
+  u8 *at = h->at;
+  at[0] = address & 0xff;
+  at[1] = address >> 8;
+  at[2] = old;
+  h->at = at + 3;
+}
+
+static inline ALWAYS_INLINE void history_end(History *h, u8 cycles,
+                                             HistoryKind kind) {
+  u8 *start = h->bytes + h->head;
+  u8 *at = h->at;
+  u8 n = (at - start - HISTORY_HEADER_LEN) / 3;
+  start[0] = n;
+  // four bytes for the three, the next record's header goes over the last.
+  u32 trailer = cycles | (kind << 8) | (n << 16);
+  memcpy(at, &trailer, sizeof(trailer));
+  h->head = at + HISTORY_TRAILER_LEN - h->bytes;
+  h->records++;
+  h->steps += kind;
+}
+
+// undo the last n instructions, and anything from outside the loop in
+// between. how many it got through, less than n if the history ran out.
+u64 core_step_back(Core *c, u64 n);
+
+// step back until the pc's on a breakpoint, or an instruction that wrote to
+// a watched address is undone (the core's left from before it, with the
+// address in watched). conditions count like they do going forwards.
+// SR_NO_HISTORY if it got back to the start of the history first.
+StopReason core_reverse_continue(Core *c);
+
+void test_history();
+void bench_history();
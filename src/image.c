@@ -0,0 +1,231 @@
+// for memfd_create.
+#define _GNU_SOURCE
+
+#include "image.h"
+
+#include "assembler.h"
+#include "core.h"
+#include "defines.h"
+#include "pool.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IMAGE_LEN 0x10000
+
+void image_create(ProgramImage *img, const u8 *bytes, u16 start, u32 len) {
+  if (start + len > IMAGE_LEN) {
+    len = IMAGE_LEN - start;
+  }
+
+  int fd = -1;
+#ifdef __linux__
+  fd = memfd_create("6502 image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+  if (fd < 0) {
+    // anything that's a file will do, it's just slower to get at.
+    FILE *f = tmpfile();
+    if (f == NULL) {
+      error("Couldn't make a file for the program image.");
+    }
+    fd = dup(fileno(f));
+    fclose(f);
+  }
+
+  if (fd < 0 || ftruncate(fd, IMAGE_LEN) != 0 ||
+      pwrite(fd, bytes, len, start) != (ssize_t)len) {
+    error("Couldn't write the program image.");
+  }
+#ifdef F_SEAL_WRITE
+  // nobody writes through the file after this, the cores only ever get copies
+  // of its pages. not every file can be sealed, that's fine.
+  fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW);
+#endif
+  img->fd = fd;
+}
+
+void image_destroy(ProgramImage *img) {
+  close(img->fd);
+  img->fd = -1;
+}
+
+bool image_map(Core *c, const ProgramImage *img) {
+  // replacing the old mapping throws out whatever pages the core had copied.
+  void *at = mmap(c->memory, IMAGE_LEN, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_FIXED, img->fd, 0);
+  bool mapped = at != MAP_FAILED;
+  if (!mapped && pread(img->fd, c->memory, IMAGE_LEN, 0) != IMAGE_LEN) {
+    error("Couldn't read the program image.");
+  }
+  core_forget(c);
+  return mapped;
+}
+
+void image_release(Core *c) {
+  void *at = mmap(c->memory, IMAGE_LEN, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (at == MAP_FAILED) {
+    memset(c->memory, 0, IMAGE_LEN);
+  }
+  core_forget(c);
+}
+
+// at $0600. ldx #$00, loop: txa, sta $0200,X, inx, cpx #$10, bne loop, then
+// lda #$e8, sta $0610 writes an inx over the brk right after it, so it runs
+// one more inx before the brk at $0611.
+static const u8 image_program[] = {0xa2, 0x00, 0x8a, 0x9d, 0x00, 0x02,
+                                   0xe8, 0xe0, 0x10, 0xd0, 0xf7, 0xa9,
+                                   0xe8, 0x8d, 0x10, 0x06, 0x00, 0x00};
+
+static bool same_core(const Core *a, const Core *b) {
+  return a->a == b->a && a->x == b->x && a->y == b->y && a->sp == b->sp &&
+         a->p == b->p && a->pc == b->pc && a->cycles == b->cycles &&
+         a->instructions == b->instructions &&
+         memcmp(a->memory, b->memory, IMAGE_LEN) == 0;
+}
+
+void test_image() {
+  printf("\n\nTESTING IMAGE\n\n\n");
+
+  init_decode_table();
+
+  // what it should come out as, loaded the usual way.
+  static Core expected;
+  core_init(&expected);
+  core_load(&expected, image_program, 0x0600, sizeof(image_program));
+  core_reset(&expected, 0x0600);
+  ASSERT(core_run(&expected, (RunBudget){0}) == SR_BRK &&
+             expected.x == 0x11 && expected.memory[0x0610] == 0xe8,
+         "the program writes over its own brk");
+
+  ProgramImage img;
+  image_create(&img, image_program, 0x0600, sizeof(image_program));
+
+  Core *a = core_new();
+  Core *b = core_new();
+  ASSERT(image_map(a, &img) && image_map(b, &img),
+         "the image maps over both cores");
+  ASSERT(a->memory[0x0600] == 0xa2 && a->memory[0x0610] == 0x00 &&
+             a->memory[0x0200] == 0x00,
+         "a mapped core sees the image");
+
+  core_reset(a, 0x0600);
+  core_run(a, (RunBudget){0});
+  ASSERT(same_core(a, &expected), "it runs the same as a loaded core");
+  ASSERT(b->memory[0x0610] == 0x00 && b->memory[0x0203] == 0x00,
+         "one core's writes don't show up in the other");
+
+  core_reset(b, 0x0600);
+  core_run(b, (RunBudget){0});
+  ASSERT(same_core(b, &expected), "and the other runs the same too");
+
+  // mapping it again starts over from the image, not what the core wrote.
+  image_map(a, &img);
+  ASSERT(a->memory[0x0610] == 0x00 && a->memory[0x0203] == 0x00,
+         "the image itself is never written");
+  core_reset(a, 0x0600);
+  core_run(a, (RunBudget){0});
+  ASSERT(same_core(a, &expected), "and the cache was thrown out with it");
+
+  image_release(b);
+  uint nonzero = 0;
+  for (uint i = 0; i < IMAGE_LEN; i++) {
+    nonzero += b->memory[i] != 0;
+  }
+  ASSERT(nonzero == 0, "releasing the image leaves zeroed memory");
+  core_free(a);
+  core_free(b);
+
+  // and through the pool, every job on the same image.
+  static Pool p;
+  pool_init(&p, 3);
+  for (uint i = 0; i < 200; i++) {
+    Job job = {
+        .id = i,
+        .shared = &img,
+        .registers = {.sp = 0xfd, .p = FLAG_U | FLAG_I, .pc = 0x0600},
+        .output_start = 0x0200,
+        .output_len = 0x11,
+    };
+    pool_submit(&p, &job);
+  }
+  uint collected = 0, mismatched = 0;
+  JobResult result;
+  while (pool_next_result(&p, &result)) {
+    collected++;
+    mismatched += result.reason != SR_BRK || result.registers.x != 0x11 ||
+                  result.cycles != expected.cycles ||
+                  memcmp(result.output, &expected.memory[0x0200], 0x11) != 0;
+  }
+  ASSERT(collected == 200 && mismatched == 0,
+         "pool jobs on a shared image all come out the same");
+  pool_clean(&p);
+  image_destroy(&img);
+
+  printf("\n\nDONE TESTING IMAGE, SUCCESS!\n\n\n");
+}
+
+#define BENCH_IMAGE_CORES 256
+
+static long resident_kb() {
+  long size = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// start a few hundred cores on the same program, copied into each one and
+// then shared, for how long it takes and how much memory each one ends up
+// with.
+static void bench_start(bool shared, const ProgramImage *img) {
+  static Core *cores[BENCH_IMAGE_CORES];
+  long before = resident_kb();
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < BENCH_IMAGE_CORES; i++) {
+    Core *c = cores[i] = core_new();
+    if (shared) {
+      image_map(c, img);
+    } else {
+      core_clear(c);
+      core_load(c, image_program, 0x0600, sizeof(image_program));
+    }
+    core_reset(c, 0x0600);
+    core_run(c, (RunBudget){0});
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  long after = resident_kb();
+  double us = ((end.tv_sec - start.tv_sec) * 1e9 +
+               (end.tv_nsec - start.tv_nsec)) /
+              1e3 / BENCH_IMAGE_CORES;
+  printf("image: %s, %.2fus and %ldk resident per core\n",
+         shared ? "shared" : "copied", us,
+         (after - before) / BENCH_IMAGE_CORES);
+
+  for (uint i = 0; i < BENCH_IMAGE_CORES; i++) {
+    core_free(cores[i]);
+  }
+}
+
+void bench_image() {
+  init_decode_table();
+
+  ProgramImage img;
+  image_create(&img, image_program, 0x0600, sizeof(image_program));
+  bench_start(false, &img);
+  bench_start(true, &img);
+  image_destroy(&img);
+}
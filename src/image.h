@@ -0,0 +1,36 @@
+#pragma once
+
+#include "core.h"
+#include "defines.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// a program image that's loaded once and shared by any number of cores. the
+// whole 64k address space sits in a sealed in-memory file, and each core maps
+// it privately over its memory. every core reads the same physical pages
+// until it writes one, then the kernel gives it a copy of just that page. so a
+// hundred cores running the same rom only cost the pages each one actually
+// writes, and starting one is a single mmap instead of clearing and copying
+// 64k.
+
+typedef struct ProgramImage {
+  int fd;
+} ProgramImage;
+
+// bytes[0..len) goes at start, everything else is zero, like core_load on a
+// cleared core. the bytes can go away once this returns.
+void image_create(ProgramImage *img, const u8 *bytes, u16 start, u32 len);
+void image_destroy(ProgramImage *img);
+
+// put the image in the core's memory and throw out everything decoded. true
+// if it was mapped, false if the memory couldn't be (a host with bigger pages
+// than CORE_PAGE_SIZE) and it got copied in instead, which still works, it
+// just isn't shared.
+bool image_map(Core *c, const ProgramImage *img);
+// zero the core's memory and give back the pages it had copied, like
+// core_clear but without touching every page.
+void image_release(Core *c);
+
+void test_image();
+void bench_image();
@@ -0,0 +1,1227 @@
+#include "jit.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "condition.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "lexer.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// the heat of a pc whose first instruction can't be compiled.
+#define JIT_NEVER 0xff
+// room for the biggest block, with a stub for every instruction.
+#define JIT_BLOCK_CODE (JIT_BLOCK_INSTRUCTIONS * 192 + 256)
+
+#if defined(__x86_64__)
+
+// host registers.
+enum {
+  RAX = 0,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+};
+
+// where the guest lives while a block runs. they're all callee-saved, so the
+// calls out to C on a write to code leave them alone. rbx is the Core, eax is
+// the effective address and ecx, edx and esi are scratch.
+#define REG_A R12
+#define REG_X R13
+#define REG_Y R14
+#define REG_P R15  // the status register, but n and z are out of date.
+#define REG_NZ RBP // the last result. n is its bit 7 and z is it being 0.
+// the counts and the budget, out of memory so a loop chained to itself isn't
+// waiting on its own stores. they get saved around calls.
+#define REG_CYCLES R8
+#define REG_INSTRUCTIONS R9
+#define REG_CYCLE_LIMIT R10
+#define REG_INSTRUCTION_LIMIT R11
+
+#define OFF_A offsetof(Core, a)
+#define OFF_X offsetof(Core, x)
+#define OFF_Y offsetof(Core, y)
+#define OFF_SP offsetof(Core, sp)
+#define OFF_P offsetof(Core, p)
+#define OFF_PC offsetof(Core, pc)
+#define OFF_MEMORY offsetof(Core, memory)
+#define OFF_CODE_PAGES offsetof(Core, code_pages)
+#define OFF_DIRTY_PAGES offsetof(Core, dirty_pages)
+#define OFF_CYCLES offsetof(Core, cycles)
+#define OFF_INSTRUCTIONS offsetof(Core, instructions)
+
+// the /digit in the group 1 (0x81) and shift (0xc1) opcodes.
+#define EXT_ADD 0
+#define EXT_OR 1
+#define EXT_AND 4
+#define EXT_SUB 5
+#define EXT_XOR 6
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+// register to register alu ops, op r/m32, r32.
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_TEST 0x85
+
+#define CC_O 0x0
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+
+static void emit8(Jit *j, u8 b) { j->code[j->code_len++] = b; }
+
+static void emit16(Jit *j, u16 v) {
+  memcpy(j->code + j->code_len, &v, 2);
+  j->code_len += 2;
+}
+
+static void emit32(Jit *j, u32 v) {
+  memcpy(j->code + j->code_len, &v, 4);
+  j->code_len += 4;
+}
+
+static void emit64(Jit *j, u64 v) {
+  memcpy(j->code + j->code_len, &v, 8);
+  j->code_len += 8;
+}
+
+// force is for byte registers, without a rex spl..dil mean ah..bh.
+static void emit_rex(Jit *j, bool w, int reg, int index, int base,
+                     bool force) {
+  u8 rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) |
+           (base >> 3);
+  if (rex != 0x40 || force) {
+    emit8(j, rex);
+  }
+}
+
+static void emit_opcode(Jit *j, u32 opcode) {
+  if (opcode > 0xff) {
+    emit8(j, opcode >> 8);
+  }
+  emit8(j, opcode & 0xff);
+}
+
+// op reg, [rbx + index + disp32], index < 0 for none.
+static void op_mem(Jit *j, bool w, bool byte, u32 opcode, int reg, int index,
+                   u32 disp) {
+  emit_rex(j, w, reg, (index < 0) ? 0 : index, RBX, byte);
+  emit_opcode(j, opcode);
+  if (index < 0) {
+    emit8(j, 0x80 | ((reg & 7) << 3) | RBX);
+  } else {
+    emit8(j, 0x84 | ((reg & 7) << 3));
+    emit8(j, ((index & 7) << 3) | RBX);
+  }
+  emit32(j, disp);
+}
+
+// op rm, reg.
+static void op_reg(Jit *j, bool w, bool byte, u32 opcode, int reg, int rm) {
+  emit_rex(j, w, reg, 0, rm, byte);
+  emit_opcode(j, opcode);
+  emit8(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// a 64 bit op reg, [base + disp32]. only for bases without a sib, so not rsp
+// or r12.
+static void op_mem_base(Jit *j, u32 opcode, int reg, int base, u32 disp) {
+  emit_rex(j, true, reg, 0, base, false);
+  emit_opcode(j, opcode);
+  emit8(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+  emit32(j, disp);
+}
+
+// movzx dst, byte [rbx + index + disp]
+static void load8(Jit *j, int dst, int index, u32 disp) {
+  op_mem(j, false, false, 0x0fb6, dst, index, disp);
+}
+
+// mov byte [rbx + index + disp], src
+static void store8(Jit *j, int src, int index, u32 disp) {
+  op_mem(j, false, true, 0x88, src, index, disp);
+}
+
+static void zext8(Jit *j, int r) { op_reg(j, false, true, 0x0fb6, r, r); }
+static void zext16(Jit *j, int r) { op_reg(j, false, false, 0x0fb7, r, r); }
+static void mov(Jit *j, int dst, int src) {
+  op_reg(j, false, false, 0x89, src, dst);
+}
+static void alu(Jit *j, u8 opcode, int dst, int src) {
+  op_reg(j, false, false, opcode, src, dst);
+}
+
+static void alu_imm(Jit *j, int ext, int dst, u32 imm) {
+  op_reg(j, false, false, 0x81, ext, dst);
+  emit32(j, imm);
+}
+
+static void shift(Jit *j, int ext, int dst, u8 n) {
+  op_reg(j, false, false, 0xc1, ext, dst);
+  emit8(j, n);
+}
+
+static void mov_imm(Jit *j, int dst, u32 imm) {
+  emit_rex(j, false, 0, 0, dst, false);
+  emit8(j, 0xb8 | (dst & 7));
+  emit32(j, imm);
+}
+
+static void test_imm(Jit *j, int r, u32 imm) {
+  op_reg(j, false, false, 0xf7, 0, r);
+  emit32(j, imm);
+}
+
+static void setcc(Jit *j, u8 cc, int r) {
+  op_reg(j, false, true, 0x0f90 | cc, 0, r);
+}
+
+static void add_counter(Jit *j, int counter, u32 n) {
+  if (n > 0) {
+    op_reg(j, true, false, 0x81, EXT_ADD, counter);
+    emit32(j, n);
+  }
+}
+
+static void add_counter_reg(Jit *j, int counter, int r) {
+  op_reg(j, true, false, 0x01, r, counter);
+}
+
+static void set_pc(Jit *j, u16 pc) {
+  emit8(j, 0x66);
+  op_mem(j, false, false, 0xc7, 0, -1, OFF_PC);
+  emit16(j, pc);
+}
+
+static void set_pc_reg(Jit *j, int r) {
+  emit8(j, 0x66);
+  op_mem(j, false, false, 0x89, r, -1, OFF_PC);
+}
+
+// the jumps return where their rel32 is, for patch.
+static u32 emit_jmp(Jit *j) {
+  emit8(j, 0xe9);
+  emit32(j, 0);
+  return j->code_len - 4;
+}
+
+static u32 emit_jcc(Jit *j, u8 cc) {
+  emit8(j, 0x0f);
+  emit8(j, 0x80 | cc);
+  emit32(j, 0);
+  return j->code_len - 4;
+}
+
+static void patch(Jit *j, u32 site, u32 target) {
+  i32 rel = (i32)(target - (site + 4));
+  memcpy(j->code + site, &rel, 4);
+}
+
+static void exit_to_dispatcher(Jit *j) {
+  patch(j, emit_jmp(j), j->exit - j->code);
+}
+
+// leave the block for target. the jump goes straight on to the stub that
+// hands target to the dispatcher, until target's compiled and it gets patched
+// to go there instead.
+static void exit_to(Jit *j, u16 target, u32 instructions, u32 cycles) {
+  add_counter(j, REG_INSTRUCTIONS, instructions);
+  add_counter(j, REG_CYCLES, cycles);
+  u32 site = emit_jmp(j);
+  j->links[j->num_links++] = (JitLink){target, site};
+  set_pc(j, target);
+  exit_to_dispatcher(j);
+}
+
+// code after the end of the block, off the straight line path.
+typedef struct Stub {
+  u32 site;   // the jcc into it.
+  u32 resume; // where a store goes back to.
+  bool store; // a write to code, otherwise a taken branch.
+  bool leave; // a store that ends the block if it threw any code out.
+  u16 pc;     // where the guest carries on if it leaves from here.
+  u32 instructions;
+  u32 cycles;
+} Stub;
+
+static Stub stubs[JIT_BLOCK_INSTRUCTIONS * 2];
+static uint num_stubs;
+
+// what a store from native code does when it lands on a page with code. the
+// core throws out whatever decoded and compiled code has that byte in it.
+static u32 write_hook(Core *c, u32 address) {
+  u64 before = c->jit->invalidated;
+  core_write(c, address, c->memory[address]);
+  return c->jit->invalidated != before;
+}
+
+// mov [eax], src, mark the page dirty, then check for it having code on it.
+static void emit_store(Jit *j, int src, bool leave, u16 pc, u32 instructions,
+                       u32 cycles) {
+  store8(j, src, RAX, OFF_MEMORY);
+  mov(j, RCX, RAX);
+  shift(j, EXT_SHR, RCX, 8);
+  op_mem(j, false, false, 0xc6, 0, RCX, OFF_DIRTY_PAGES); // mov byte, imm8
+  emit8(j, 1);
+  op_mem(j, false, false, 0x80, 7, RCX, OFF_CODE_PAGES); // cmp byte, imm8
+  emit8(j, 0);
+  u32 site = emit_jcc(j, CC_NE);
+  stubs[num_stubs++] =
+      (Stub){site, j->code_len, true, leave, pc, instructions, cycles};
+}
+
+static void emit_stub(Jit *j, Stub *s) {
+  patch(j, s->site, j->code_len);
+  if (!s->store) {
+    exit_to(j, s->pc, s->instructions, s->cycles);
+    return;
+  }
+
+  for (int r = R8; r <= R11; r++) { // push, four keeps the stack aligned
+    emit8(j, 0x41);
+    emit8(j, 0x50 | (r & 7));
+  }
+  op_reg(j, true, false, 0x89, RBX, RDI); // mov rdi, rbx
+  mov(j, RSI, RAX);
+  emit8(j, 0x48); // mov rax, imm64
+  emit8(j, 0xb8);
+  emit64(j, (u64)(uintptr_t)write_hook);
+  emit8(j, 0xff); // call rax
+  emit8(j, 0xd0);
+  for (int r = R11; r >= R8; r--) {
+    emit8(j, 0x41);
+    emit8(j, 0x58 | (r & 7));
+  }
+  if (!s->leave) {
+    patch(j, emit_jmp(j), s->resume);
+    return;
+  }
+  alu(j, ALU_TEST, RAX, RAX);
+  patch(j, emit_jcc(j, CC_E), s->resume);
+  add_counter(j, REG_INSTRUCTIONS, s->instructions);
+  add_counter(j, REG_CYCLES, s->cycles);
+  set_pc(j, s->pc);
+  exit_to_dispatcher(j);
+}
+
+// the operand's effective address into eax. reads pay for crossing a page.
+static void emit_address(Jit *j, AddrMode mode, u16 operand, bool read) {
+  switch (mode) {
+  case ZP:
+  case Abs:
+    mov_imm(j, RAX, operand);
+    break;
+  case ZPX:
+  case ZPY:
+    mov(j, RAX, (mode == ZPX) ? REG_X : REG_Y);
+    alu_imm(j, EXT_ADD, RAX, operand);
+    zext8(j, RAX);
+    break;
+  case AbsX:
+  case AbsY: {
+    int index = (mode == AbsX) ? REG_X : REG_Y;
+    // a base on the start of a page can't cross one, and one low enough
+    // can't wrap, so neither needs checking.
+    if (read && (operand & 0xff) != 0) {
+      mov(j, RCX, index);
+      alu_imm(j, EXT_ADD, RCX, operand & 0xff);
+      shift(j, EXT_SHR, RCX, 8);
+      add_counter_reg(j, REG_CYCLES, RCX);
+    }
+    mov(j, RAX, index);
+    alu_imm(j, EXT_ADD, RAX, operand);
+    if (operand > 0xff00) {
+      zext16(j, RAX);
+    }
+    break;
+  }
+  case IndexedIndirect:
+    mov(j, RCX, REG_X);
+    alu_imm(j, EXT_ADD, RCX, operand);
+    zext8(j, RCX);
+    load8(j, RAX, RCX, OFF_MEMORY);
+    alu_imm(j, EXT_ADD, RCX, 1);
+    zext8(j, RCX);
+    load8(j, RCX, RCX, OFF_MEMORY);
+    shift(j, EXT_SHL, RCX, 8);
+    alu(j, ALU_OR, RAX, RCX);
+    break;
+  case IndirectIndexed:
+    load8(j, RAX, -1, OFF_MEMORY + (operand & 0xff));
+    load8(j, RCX, -1, OFF_MEMORY + ((operand + 1) & 0xff));
+    shift(j, EXT_SHL, RCX, 8);
+    alu(j, ALU_OR, RAX, RCX);
+    if (read) {
+      mov(j, RCX, RAX);
+      alu_imm(j, EXT_AND, RCX, 0xff);
+      alu(j, ALU_ADD, RCX, REG_Y);
+      shift(j, EXT_SHR, RCX, 8);
+      add_counter_reg(j, REG_CYCLES, RCX);
+    }
+    alu(j, ALU_ADD, RAX, REG_Y);
+    zext16(j, RAX);
+    break;
+  default:
+    error("The JIT can't address with mode %d.", mode);
+  }
+}
+
+static void emit_operand(Jit *j, int dst, AddrMode mode, u16 operand) {
+  if (mode == Immediate) {
+    mov_imm(j, dst, operand & 0xff);
+  } else {
+    emit_address(j, mode, operand, true);
+    load8(j, dst, RAX, OFF_MEMORY);
+  }
+}
+
+static void emit_push(Jit *j, int src, bool leave, u16 pc, u32 instructions,
+                      u32 cycles) {
+  load8(j, RAX, -1, OFF_SP);
+  alu_imm(j, EXT_ADD, RAX, 0x100);
+  op_mem(j, false, false, 0xfe, 1, -1, OFF_SP); // dec byte
+  emit_store(j, src, leave, pc, instructions, cycles);
+}
+
+static void emit_pull(Jit *j, int dst) {
+  op_mem(j, false, false, 0xfe, 0, -1, OFF_SP); // inc byte
+  load8(j, RAX, -1, OFF_SP);
+  load8(j, dst, RAX, OFF_MEMORY + 0x100);
+}
+
+// the flags the shifts and rotates leave, with the carry out in ecx.
+static void emit_shift(Jit *j, Lexeme instruction, int v) {
+  switch (instruction) {
+  case ASL:
+    mov(j, RCX, v);
+    shift(j, EXT_SHR, RCX, 7);
+    shift(j, EXT_SHL, v, 1);
+    zext8(j, v);
+    break;
+  case LSR:
+    mov(j, RCX, v);
+    alu_imm(j, EXT_AND, RCX, 1);
+    shift(j, EXT_SHR, v, 1);
+    break;
+  case ROL:
+    mov(j, RSI, REG_P);
+    alu_imm(j, EXT_AND, RSI, FLAG_C);
+    mov(j, RCX, v);
+    shift(j, EXT_SHR, RCX, 7);
+    shift(j, EXT_SHL, v, 1);
+    alu(j, ALU_OR, v, RSI);
+    zext8(j, v);
+    break;
+  default: // ROR
+    mov(j, RSI, REG_P);
+    alu_imm(j, EXT_AND, RSI, FLAG_C);
+    shift(j, EXT_SHL, RSI, 7);
+    mov(j, RCX, v);
+    alu_imm(j, EXT_AND, RCX, 1);
+    shift(j, EXT_SHR, v, 1);
+    alu(j, ALU_OR, v, RSI);
+    break;
+  }
+  alu_imm(j, EXT_AND, REG_P, ~FLAG_C);
+  alu(j, ALU_OR, REG_P, RCX);
+  mov(j, REG_NZ, v);
+}
+
+static bool can_compile(u8 opcode, DecodeEntry d) {
+  if (opcode == 0x00 || d.instruction == LEXEME_NULL) {
+    return false;
+  }
+  switch (d.instruction) {
+  // these either read n and z as bits or can set decimal mode, which the
+  // native adc and sbc don't do.
+  case BIT:
+  case PHP:
+  case PLP:
+  case RTI:
+  case SED:
+    return false;
+  case JMP:
+    return d.mode == Abs;
+  default:
+    return true;
+  }
+}
+
+static bool ends_block(Lexeme instruction) {
+  switch (instruction) {
+  case BCC:
+  case BCS:
+  case BEQ:
+  case BMI:
+  case BNE:
+  case BPL:
+  case BVC:
+  case BVS:
+  case JMP:
+  case JSR:
+  case RTS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool is_branch(Lexeme instruction) {
+  return ends_block(instruction) && instruction != JMP &&
+         instruction != JSR && instruction != RTS;
+}
+
+static void emit_branch(Jit *j, Lexeme instruction, u16 next, u16 target,
+                        u32 instructions, u32 cycles) {
+  u8 taken = CC_NE;
+  switch (instruction) {
+  case BEQ:
+  case BNE:
+    alu(j, ALU_TEST, REG_NZ, REG_NZ);
+    taken = (instruction == BEQ) ? CC_E : CC_NE;
+    break;
+  case BMI:
+  case BPL:
+    test_imm(j, REG_NZ, FLAG_N);
+    taken = (instruction == BMI) ? CC_NE : CC_E;
+    break;
+  case BCS:
+  case BCC:
+    test_imm(j, REG_P, FLAG_C);
+    taken = (instruction == BCS) ? CC_NE : CC_E;
+    break;
+  default: // BVS, BVC
+    test_imm(j, REG_P, FLAG_V);
+    taken = (instruction == BVS) ? CC_NE : CC_E;
+    break;
+  }
+  u32 extra = 1 + ((next ^ target) > 0xff);
+  stubs[num_stubs++] = (Stub){.site = emit_jcc(j, taken),
+                              .pc = target,
+                              .instructions = instructions,
+                              .cycles = cycles + extra};
+  exit_to(j, next, instructions, cycles);
+}
+
+// one instruction. n and cycles are the totals for the block up to and
+// including it.
+static void emit_instruction(Jit *j, u16 pc, DecodeEntry d, u32 n,
+                             u32 cycles) {
+  const u8 *memory = j->core->memory;
+  u16 next = pc + d.len;
+  u16 operand = 0;
+  if (d.mode == Relative) {
+    operand = pc + 2 + (i8)memory[(u16)(pc + 1)];
+  } else if (d.len == 2) {
+    operand = memory[(u16)(pc + 1)];
+  } else if (d.len == 3) {
+    operand = memory[(u16)(pc + 1)] | (memory[(u16)(pc + 2)] << 8);
+  }
+
+  switch (d.instruction) {
+  case LDA:
+  case LDX:
+  case LDY: {
+    int r = (d.instruction == LDA) ? REG_A
+            : (d.instruction == LDX) ? REG_X
+                                     : REG_Y;
+    emit_operand(j, r, d.mode, operand);
+    mov(j, REG_NZ, r);
+    break;
+  }
+  case STA:
+  case STX:
+  case STY: {
+    int r = (d.instruction == STA) ? REG_A
+            : (d.instruction == STX) ? REG_X
+                                     : REG_Y;
+    emit_address(j, d.mode, operand, false);
+    emit_store(j, r, true, next, n, cycles);
+    break;
+  }
+  case ADC:
+  case SBC:
+    // the carry goes in and out through the host's, and x86's overflow is the
+    // same as the 6502's v. sbc's carry is the inverse of x86's borrow.
+    emit_operand(j, RDX, d.mode, operand);
+    alu(j, ALU_XOR, RCX, RCX);
+    alu(j, ALU_XOR, RSI, RSI);
+    op_reg(j, false, false, 0x0fba, 4, REG_P); // bt r15d, 0
+    emit8(j, 0);
+    if (d.instruction == ADC) {
+      op_reg(j, false, true, 0x10, RDX, REG_A); // adc r12b, dl
+      setcc(j, CC_B, RCX);
+    } else {
+      emit8(j, 0xf5);                           // cmc
+      op_reg(j, false, true, 0x18, RDX, REG_A); // sbb r12b, dl
+      setcc(j, CC_AE, RCX);
+    }
+    setcc(j, CC_O, RSI);
+    alu_imm(j, EXT_AND, REG_P, ~(FLAG_C | FLAG_V));
+    alu(j, ALU_OR, REG_P, RCX);
+    shift(j, EXT_SHL, RSI, 6);
+    alu(j, ALU_OR, REG_P, RSI);
+    mov(j, REG_NZ, REG_A);
+    break;
+  case AND:
+  case ORA:
+  case EOR:
+    if (d.mode == Immediate) {
+      alu_imm(j,
+              (d.instruction == AND)   ? EXT_AND
+              : (d.instruction == ORA) ? EXT_OR
+                                       : EXT_XOR,
+              REG_A, operand & 0xff);
+    } else {
+      emit_operand(j, RDX, d.mode, operand);
+      alu(j,
+          (d.instruction == AND)   ? ALU_AND
+          : (d.instruction == ORA) ? ALU_OR
+                                   : ALU_XOR,
+          REG_A, RDX);
+    }
+    mov(j, REG_NZ, REG_A);
+    break;
+  case CMP:
+  case CPX:
+  case CPY: {
+    int r = (d.instruction == CMP) ? REG_A
+            : (d.instruction == CPX) ? REG_X
+                                     : REG_Y;
+    alu(j, ALU_XOR, RCX, RCX);
+    mov(j, REG_NZ, r);
+    if (d.mode == Immediate) {
+      alu_imm(j, EXT_SUB, REG_NZ, operand & 0xff);
+    } else {
+      emit_operand(j, RDX, d.mode, operand);
+      alu(j, ALU_SUB, REG_NZ, RDX);
+    }
+    setcc(j, CC_AE, RCX);
+    zext8(j, REG_NZ);
+    alu_imm(j, EXT_AND, REG_P, ~FLAG_C);
+    alu(j, ALU_OR, REG_P, RCX);
+    break;
+  }
+  case INX:
+  case INY:
+  case DEX:
+  case DEY: {
+    int r = (d.instruction == INX || d.instruction == DEX) ? REG_X : REG_Y;
+    alu_imm(j, (d.instruction == INX || d.instruction == INY) ? EXT_ADD
+                                                              : EXT_SUB,
+            r, 1);
+    zext8(j, r);
+    mov(j, REG_NZ, r);
+    break;
+  }
+  case INC:
+  case DEC:
+    emit_address(j, d.mode, operand, false);
+    load8(j, RDX, RAX, OFF_MEMORY);
+    alu_imm(j, (d.instruction == INC) ? EXT_ADD : EXT_SUB, RDX, 1);
+    zext8(j, RDX);
+    mov(j, REG_NZ, RDX);
+    emit_store(j, RDX, true, next, n, cycles);
+    break;
+  case ASL:
+  case LSR:
+  case ROL:
+  case ROR:
+    // lib6502 calls the accumulator forms Implicit.
+    if (d.mode == Implicit) {
+      emit_shift(j, d.instruction, REG_A);
+    } else {
+      emit_address(j, d.mode, operand, false);
+      load8(j, RDX, RAX, OFF_MEMORY);
+      emit_shift(j, d.instruction, RDX);
+      emit_store(j, RDX, true, next, n, cycles);
+    }
+    break;
+  case TAX:
+  case TAY:
+  case TXA:
+  case TYA: {
+    int from = (d.instruction == TXA) ? REG_X
+               : (d.instruction == TYA) ? REG_Y
+                                        : REG_A;
+    int to = (d.instruction == TAX) ? REG_X
+             : (d.instruction == TAY) ? REG_Y
+                                      : REG_A;
+    mov(j, to, from);
+    mov(j, REG_NZ, to);
+    break;
+  }
+  case TSX:
+    load8(j, REG_X, -1, OFF_SP);
+    mov(j, REG_NZ, REG_X);
+    break;
+  case TXS:
+    store8(j, REG_X, -1, OFF_SP);
+    break;
+  case CLC:
+    alu_imm(j, EXT_AND, REG_P, ~FLAG_C);
+    break;
+  case SEC:
+    alu_imm(j, EXT_OR, REG_P, FLAG_C);
+    break;
+  case CLV:
+    alu_imm(j, EXT_AND, REG_P, ~FLAG_V);
+    break;
+  case CLD:
+    alu_imm(j, EXT_AND, REG_P, ~FLAG_D);
+    break;
+  case CLI:
+    alu_imm(j, EXT_AND, REG_P, ~FLAG_I);
+    break;
+  case SEI:
+    alu_imm(j, EXT_OR, REG_P, FLAG_I);
+    break;
+  case PHA:
+    emit_push(j, REG_A, true, next, n, cycles);
+    break;
+  case PLA:
+    emit_pull(j, REG_A);
+    mov(j, REG_NZ, REG_A);
+    break;
+  case NOP:
+    break;
+  case JMP:
+    exit_to(j, operand, n, cycles);
+    break;
+  case JSR:
+    // the return address is the last byte of the JSR.
+    mov_imm(j, RDX, (u16)(next - 1) >> 8);
+    emit_push(j, RDX, false, operand, n, cycles);
+    mov_imm(j, RDX, (u8)(next - 1));
+    emit_push(j, RDX, true, operand, n, cycles);
+    exit_to(j, operand, n, cycles);
+    break;
+  case RTS:
+    emit_pull(j, RDX);
+    emit_pull(j, RAX);
+    shift(j, EXT_SHL, RAX, 8);
+    alu(j, ALU_OR, RAX, RDX);
+    alu_imm(j, EXT_ADD, RAX, 1);
+    zext16(j, RAX);
+    set_pc_reg(j, RAX);
+    add_counter(j, REG_INSTRUCTIONS, n);
+    add_counter(j, REG_CYCLES, cycles);
+    exit_to_dispatcher(j);
+    break;
+  default:
+    if (!is_branch(d.instruction)) {
+      error("The JIT doesn't know how to compile %s.",
+            lexeme_to_string(d.instruction));
+    }
+    emit_branch(j, d.instruction, next, operand, n, cycles);
+    break;
+  }
+}
+
+// throw out every block and all of the code. only ever done from the
+// dispatcher, never with native code running.
+static void flush(Jit *j) {
+  memset(j->blocks, 0, sizeof(j->blocks));
+  memset(j->heat, 0, sizeof(j->heat));
+  j->num_blocks = 0;
+  j->num_links = 0;
+  j->code_len = j->trampolines_len;
+  j->flushes++;
+}
+
+static JitBlock *compile(Jit *j, u16 start) {
+  Core *c = j->core;
+  if (j->code_len + JIT_BLOCK_CODE > JIT_BUFFER_SIZE ||
+      j->num_blocks == JIT_BLOCKS_LEN ||
+      j->num_links + JIT_BLOCK_INSTRUCTIONS * 2 > JIT_LINKS_LEN) {
+    flush(j);
+  }
+
+  // find where the block ends first, the check on the way in needs to know
+  // the most it could cost.
+  u16 pcs[JIT_BLOCK_INSTRUCTIONS];
+  u32 cycles[JIT_BLOCK_INSTRUCTIONS + 1] = {0};
+  uint n = 0;
+  u32 most = 0;
+  u16 pc = start;
+  while (n < JIT_BLOCK_INSTRUCTIONS) {
+    if (n > 0 && has_breakpoint(c, pc)) {
+      break;
+    }
+    u8 opcode = c->memory[pc];
+    DecodeEntry d = decode_table[opcode];
+    if (!can_compile(opcode, d)) {
+      break;
+    }
+    pcs[n] = pc;
+    cycles[n + 1] = cycles[n] + d.cycles;
+    most += d.cycles;
+    if (is_branch(d.instruction)) {
+      most += 2;
+    } else if (d.mode == AbsX || d.mode == AbsY || d.mode == IndirectIndexed) {
+      most += 1;
+    }
+    n++;
+    pc += d.len;
+    if (ends_block(d.instruction)) {
+      break;
+    }
+  }
+  if (n == 0) {
+    j->heat[start] = JIT_NEVER;
+    return NULL;
+  }
+
+  JitBlock *b = &j->pool[j->num_blocks++];
+  b->start = start;
+  b->end = start + (u16)(pc - start);
+  b->body = j->code + j->code_len;
+  num_stubs = 0;
+  uint first_link = j->num_links;
+
+  // leave it to the interpreter if the block could go past either budget.
+  op_mem_base(j, 0x8d, RAX, REG_INSTRUCTIONS, n); // lea rax, [r9 + n]
+  op_reg(j, true, false, 0x39, REG_INSTRUCTION_LIMIT, RAX);
+  u32 over_instructions = emit_jcc(j, CC_A);
+  op_mem_base(j, 0x8d, RAX, REG_CYCLES, most);
+  op_reg(j, true, false, 0x39, REG_CYCLE_LIMIT, RAX);
+  u32 over_cycles = emit_jcc(j, CC_A);
+
+  DecodeEntry last = {0};
+  for (uint i = 0; i < n; i++) {
+    last = decode_table[c->memory[pcs[i]]];
+    emit_instruction(j, pcs[i], last, i + 1, cycles[i + 1]);
+  }
+  if (!ends_block(last.instruction)) {
+    exit_to(j, pc, n, cycles[n]);
+  }
+
+  for (uint i = 0; i < num_stubs; i++) {
+    emit_stub(j, &stubs[i]);
+  }
+  b->bail = j->code + j->code_len;
+  patch(j, over_instructions, j->code_len);
+  patch(j, over_cycles, j->code_len);
+  set_pc(j, start);
+  exit_to_dispatcher(j);
+
+  j->blocks[start] = b;
+  j->compiled++;
+  for (u32 a = start; a < (u32)start + (b->end - start); a += 0x100) {
+    c->code_pages[(u16)a >> 8] = 1;
+  }
+  c->code_pages[(u16)(b->end - 1) >> 8] = 1;
+
+  // anything already waiting on this block jumps straight in now, and this
+  // block's exits go straight to blocks that are already there.
+  for (uint i = 0; i < j->num_links; i++) {
+    JitLink *l = &j->links[i];
+    JitBlock *target = j->blocks[l->target];
+    if ((l->target == start || i >= first_link) && target != NULL) {
+      patch(j, l->site, target->body - j->code);
+      j->chained++;
+    }
+  }
+  return b;
+}
+
+void jit_invalidate(Jit *j, u16 address) {
+  for (uint k = 0; k < JIT_BLOCK_INSTRUCTIONS * MAX_OPCODE_LEN; k++) {
+    u16 start = address - k;
+    if (k < MAX_OPCODE_LEN && j->heat[start] == JIT_NEVER) {
+      j->heat[start] = 0;
+    }
+    JitBlock *b = j->blocks[start];
+    if (b != NULL && (u16)(address - b->start) < (u16)(b->end - b->start)) {
+      // anything still jumping in gets sent back to the dispatcher.
+      b->body[0] = 0xe9;
+      i32 rel = (i32)(b->bail - (b->body + 5));
+      memcpy(b->body + 1, &rel, 4);
+      j->blocks[start] = NULL;
+      j->heat[start] = 0;
+      j->invalidated++;
+    }
+  }
+}
+
+// enter(Core *c, const u8 *body, u32 nz) loads the guest into registers and
+// jumps into a block. the blocks all leave through exit, which puts the guest
+// back and returns from enter.
+static void emit_trampolines(Jit *j) {
+  j->enter = (void (*)(Core *, const u8 *, u32))(void *)j->code;
+  emit8(j, 0x53); // push rbx, rbp, r12-r15
+  emit8(j, 0x55);
+  for (int r = R12; r <= R15; r++) {
+    emit8(j, 0x41);
+    emit8(j, 0x50 | (r & 7));
+  }
+  emit8(j, 0x48); // sub rsp, 8, so calls out of a block are aligned
+  emit8(j, 0x83);
+  emit8(j, 0xec);
+  emit8(j, 0x08);
+  op_reg(j, true, false, 0x89, RDI, RBX); // mov rbx, rdi
+  load8(j, REG_A, -1, OFF_A);
+  load8(j, REG_X, -1, OFF_X);
+  load8(j, REG_Y, -1, OFF_Y);
+  load8(j, REG_P, -1, OFF_P);
+  mov(j, REG_NZ, RDX);
+  op_mem(j, true, false, 0x8b, REG_CYCLES, -1, OFF_CYCLES);
+  op_mem(j, true, false, 0x8b, REG_INSTRUCTIONS, -1, OFF_INSTRUCTIONS);
+  emit8(j, 0x48); // mov rax, &j->instruction_limit
+  emit8(j, 0xb8);
+  emit64(j, (u64)(uintptr_t)&j->instruction_limit);
+  emit8(j, 0x4c); // mov r11, [rax]
+  emit8(j, 0x8b);
+  emit8(j, 0x18);
+  emit8(j, 0x4c); // mov r10, [rax + 8], the cycle_limit
+  emit8(j, 0x8b);
+  emit8(j, 0x50);
+  emit8(j, 0x08);
+  emit8(j, 0xff); // jmp rsi
+  emit8(j, 0xe6);
+
+  j->exit = j->code + j->code_len;
+  store8(j, REG_A, -1, OFF_A);
+  store8(j, REG_X, -1, OFF_X);
+  store8(j, REG_Y, -1, OFF_Y);
+  op_mem(j, true, false, 0x89, REG_CYCLES, -1, OFF_CYCLES);
+  op_mem(j, true, false, 0x89, REG_INSTRUCTIONS, -1, OFF_INSTRUCTIONS);
+  // p = (p & ~(n | z)) | (nz & n) | (nz == 0 ? z : 0)
+  mov(j, RAX, REG_P);
+  alu_imm(j, EXT_AND, RAX, ~(FLAG_N | FLAG_Z) & 0xff);
+  mov(j, RCX, REG_NZ);
+  alu_imm(j, EXT_AND, RCX, FLAG_N);
+  alu(j, ALU_OR, RAX, RCX);
+  alu(j, ALU_XOR, RCX, RCX);
+  alu(j, ALU_TEST, REG_NZ, REG_NZ);
+  setcc(j, CC_E, RCX);
+  shift(j, EXT_SHL, RCX, 1);
+  alu(j, ALU_OR, RAX, RCX);
+  store8(j, RAX, -1, OFF_P);
+  emit8(j, 0x48); // add rsp, 8
+  emit8(j, 0x83);
+  emit8(j, 0xc4);
+  emit8(j, 0x08);
+  for (int r = R15; r >= R12; r--) {
+    emit8(j, 0x41);
+    emit8(j, 0x58 | (r & 7));
+  }
+  emit8(j, 0x5d); // pop rbp, rbx
+  emit8(j, 0x5b);
+  emit8(j, 0xc3); // ret
+
+  j->trampolines_len = j->code_len;
+}
+
+bool jit_attach(Jit *j, Core *c) {
+  memset(j, 0, sizeof(Jit));
+  // the buffer's readable, writable and executable all at once, for as long
+  // as it's attached. keeping it W^X would mean an mprotect of the buffer
+  // either side of every compile and every link patched, and the patching is
+  // constant while a program warms up, so that's skipped. a host that won't
+  // hand out RWX memory fails the mmap, and the core just interprets.
+  void *code = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    return false;
+  }
+  j->code = code;
+  j->core = c;
+  emit_trampolines(j);
+  c->jit = j;
+  return true;
+}
+
+void jit_detach(Jit *j) {
+  if (j->code != NULL) {
+    munmap(j->code, JIT_BUFFER_SIZE);
+    j->code = NULL;
+  }
+  if (j->core != NULL) {
+    j->core->jit = NULL;
+    j->core = NULL;
+  }
+}
+
+StopReason core_run_jit(Core *c, RunBudget budget) {
+  Jit *j = c->jit;
+  // native code doesn't check the watchpoints, or go through a map.
+  if (j == NULL || c->num_watchpoints > 0 || c->map != NULL) {
+    return core_run(c, budget);
+  }
+
+  j->cycle_limit = budget.cycles ? c->cycles + budget.cycles : UINT64_MAX;
+  j->instruction_limit =
+      budget.instructions ? c->instructions + budget.instructions : UINT64_MAX;
+  u64 first = c->instructions;
+
+  while (1) {
+    if (c->cycles >= j->cycle_limit) {
+      return SR_MAX_CYCLES;
+    }
+    if (c->instructions >= j->instruction_limit) {
+      return SR_MAX_INSTRUCTIONS;
+    }
+
+    u16 pc = c->pc;
+    if (has_breakpoint(c, pc)) {
+      if (c->instructions != first &&
+          condition_stops(c, WK_EXECUTE, pc)) {
+        return SR_BREAKPOINT;
+      }
+    } else if (!(c->p & FLAG_D) &&
+               (c->p & (FLAG_N | FLAG_Z)) != (FLAG_N | FLAG_Z)) {
+      // native code can't do decimal mode, or n and z both being set.
+      JitBlock *b = j->blocks[pc];
+      if (b == NULL && j->heat[pc] != JIT_NEVER && ++j->heat[pc] >= JIT_HOT) {
+        b = compile(j, pc);
+      }
+      if (b != NULL) {
+        u64 before = c->instructions;
+        u32 nz = (c->p & FLAG_Z) ? 0 : (c->p & FLAG_N) ? 0x80 : 1;
+        j->enter(c, b->body, nz);
+        if (c->instructions != before) {
+          continue;
+        }
+      }
+    }
+
+    // cold code, and whatever the blocks leave to us.
+    RunBudget one = {.cycles = j->cycle_limit - c->cycles, .instructions = 1};
+    StopReason r = core_run(c, one);
+    if (r == SR_BRK || r == SR_ILLEGAL) {
+      return r;
+    }
+  }
+}
+
+#else
+
+bool jit_attach(Jit *j, Core *c) {
+  memset(j, 0, sizeof(Jit));
+  return false;
+}
+
+void jit_detach(Jit *j) {}
+
+void jit_invalidate(Jit *j, u16 address) {}
+
+StopReason core_run_jit(Core *c, RunBudget budget) {
+  return core_run(c, budget);
+}
+
+#endif /* if defined(__x86_64__) */
+
+static bool same_state(Core *a, Core *b) {
+  return a->a == b->a && a->x == b->x && a->y == b->y && a->sp == b->sp &&
+         a->p == b->p && a->pc == b->pc && a->cycles == b->cycles &&
+         a->instructions == b->instructions &&
+         memcmp(a->memory, b->memory, sizeof(a->memory)) == 0 &&
+         memcmp(a->dirty_pages, b->dirty_pages, sizeof(a->dirty_pages)) == 0;
+}
+
+// run the program with the jit and with the interpreter side by side, in
+// uneven steps so the blocks get cut off by the budget all over the place,
+// and compare everything after every step.
+static void lockstep(Jit *j, char *source, u64 total) {
+  static Core jitted, interpreted;
+  core_init(&jitted);
+  core_init(&interpreted);
+  assemble_into(&jitted, source);
+  assemble_into(&interpreted, source);
+  ASSERT(jit_attach(j, &jitted), "attach the jit");
+
+  bool agree = true;
+  for (u64 step = 0; agree && jitted.instructions < total; step++) {
+    RunBudget budget = {.instructions = 1 + (step * 37) % 101};
+    if (step % 5 == 4) {
+      budget = (RunBudget){.cycles = 1 + (step * 53) % 211};
+    }
+    StopReason r = core_run_jit(&jitted, budget);
+    StopReason expected = core_run(&interpreted, budget);
+    if (r != expected || !same_state(&jitted, &interpreted)) {
+      printf("step %lu: jit pc $%04x a $%02x x $%02x y $%02x sp $%02x p $%02x "
+             "%lu/%lu, interpreter pc $%04x a $%02x x $%02x y $%02x sp $%02x "
+             "p $%02x %lu/%lu\n",
+             (unsigned long)step, jitted.pc, jitted.a, jitted.x, jitted.y,
+             jitted.sp, jitted.p, (unsigned long)jitted.instructions,
+             (unsigned long)jitted.cycles, interpreted.pc, interpreted.a,
+             interpreted.x, interpreted.y, interpreted.sp, interpreted.p,
+             (unsigned long)interpreted.instructions,
+             (unsigned long)interpreted.cycles);
+      agree = false;
+    }
+    if (r != SR_MAX_INSTRUCTIONS && r != SR_MAX_CYCLES) {
+      break;
+    }
+  }
+  ASSERT(agree, "the jit and the interpreter agree at every step");
+}
+
+void test_jit() {
+  printf("\n\nTESTING JIT\n\n\n");
+
+  static Jit j;
+  static Core c;
+  core_init(&c);
+  if (!jit_attach(&j, &c)) {
+    printf("no jit on this machine, skipping.\n");
+    printf("\n\nDONE TESTING JIT, SUCCESS!\n\n\n");
+    return;
+  }
+  jit_detach(&j);
+
+  {
+    // the benchmark loop, chained to itself.
+    lockstep(&j,
+             "loop:\n"
+             "  lda $0200,X\n"
+             "  adc #$01\n"
+             "  sta $0200,X\n"
+             "  inx\n"
+             "  bne loop\n"
+             "  jmp loop\n",
+             20000);
+    ASSERT(j.compiled > 0 && j.chained > 0, "compiled and chained the loop");
+    jit_detach(&j);
+  }
+
+  {
+    // most of the instruction set, the stack and a subroutine.
+    lockstep(&j,
+             "  ldx #$00\n"
+             "  lda #$00\n"
+             "  sta $20\n"
+             "  lda #$03\n"
+             "  sta $21\n"
+             "loop:\n"
+             "  txa\n"
+             "  asl\n"
+             "  sta $10\n"
+             "  txa\n"
+             "  tay\n"
+             "  lda $10\n"
+             "  sta ($20),Y\n"
+             "  lda ($20),Y\n"
+             "  lsr\n"
+             "  ror\n"
+             "  rol\n"
+             "  eor #$5a\n"
+             "  ora #$01\n"
+             "  and #$7f\n"
+             "  pha\n"
+             "  pla\n"
+             "  sec\n"
+             "  sbc #$03\n"
+             "  clc\n"
+             "  adc #$90\n"
+             "  cmp #$40\n"
+             "  bcc skip\n"
+             "  rol $10\n"
+             "  ror $0300,X\n"
+             "  lsr $10\n"
+             "  asl $10\n"
+             "skip:\n"
+             "  bvc novf\n"
+             "  clv\n"
+             "novf:\n"
+             "  bmi neg\n"
+             "  lda $20,X\n"
+             "  sta $0400,Y\n"
+             "neg:\n"
+             "  jsr sub\n"
+             "  sed\n"
+             "  clc\n"
+             "  lda #$15\n"
+             "  adc #$27\n"
+             "  cld\n"
+             "  inx\n"
+             "  cpx #$40\n"
+             "  bne loop\n"
+             "  brk\n"
+             "sub:\n"
+             "  inc $30\n"
+             "  dec $31\n"
+             "  ldy $30\n"
+             "  cpy #$80\n"
+             "  ldy $0300,X\n"
+             "  lda ($20,X)\n"
+             "  tsx\n"
+             "  txs\n"
+             "  ldx $0300\n"
+             "  ldx $32\n"
+             "  rts\n",
+             1000000);
+    jit_detach(&j);
+  }
+
+  {
+    // the store rewrites the lda's operand inside the compiled block.
+    lockstep(&j,
+             "  ldx #$ff\n"
+             "loop:\n"
+             "  lda #$01\n"
+             "  stx $0603\n"
+             "  dex\n"
+             "  bne loop\n"
+             "  brk\n",
+             100000);
+    ASSERT(j.invalidated > 0, "the store threw the block out");
+    jit_detach(&j);
+  }
+
+  {
+    // a breakpoint inside a block that's already compiled.
+    core_init(&c);
+    assemble_into(&c, "loop:\n"
+                      "  lda $0200,X\n"
+                      "  adc #$01\n"
+                      "  sta $0200,X\n"
+                      "  inx\n"
+                      "  bne loop\n"
+                      "  jmp loop\n");
+    jit_attach(&j, &c);
+    core_run_jit(&c, (RunBudget){.instructions = 1000});
+    ASSERT(j.compiled > 0, "compiled the loop");
+    set_breakpoint(&c, 0x0603);
+    StopReason r = core_run_jit(&c, (RunBudget){.instructions = 1000});
+    ASSERT(r == SR_BREAKPOINT && c.pc == 0x0603, "stopped on the breakpoint");
+    ASSERT(j.invalidated == 1, "threw out the block with the breakpoint");
+    clear_breakpoint(&c, 0x0603);
+    jit_detach(&j);
+  }
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING JIT, SUCCESS!\n\n\n");
+}
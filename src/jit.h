@@ -0,0 +1,75 @@
+#pragma once
+
+#include "core.h"
+#include "defines.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// how many times the dispatcher has to land on a pc before it gets compiled.
+#define JIT_HOT 8
+// a block stops after this many instructions even without a branch.
+#define JIT_BLOCK_INSTRUCTIONS 32
+#define JIT_BLOCKS_LEN 16384
+#define JIT_LINKS_LEN 32768
+// all of the native code. when it fills up everything is thrown out and
+// compiled again as it gets hot.
+#define JIT_BUFFER_SIZE (8 * 1024 * 1024)
+
+// a straight run of 6502 instructions compiled to x86-64. blocks end on a
+// branch, a jump, an instruction the compiler leaves to the interpreter or a
+// breakpoint.
+typedef struct JitBlock {
+  u16 start;
+  u32 end;  // one past the last byte.
+  u8 *body; // where the dispatcher and chained blocks jump in.
+  u8 *bail; // back to the dispatcher without running anything.
+} JitBlock;
+
+// a jump from the end of one block to the start of another. it goes back to
+// the dispatcher until the target's compiled, then straight there.
+typedef struct JitLink {
+  u16 target;
+  u32 site; // offset of the jump's rel32 in the buffer.
+} JitLink;
+
+typedef struct Jit {
+  Core *core;
+  u8 *code; // mmapped, readable, writable and executable.
+  u32 code_len;
+  u32 trampolines_len; // the enter/exit code at the start of the buffer.
+  void (*enter)(Core *c, const u8 *body, u32 nz);
+  u8 *exit;
+
+  // where the current run stops. each block checks it would stay inside these
+  // before running, and leaves the rest to the interpreter if it wouldn't.
+  u64 instruction_limit;
+  u64 cycle_limit;
+
+  JitBlock *blocks[0x10000]; // by start address, NULL if not compiled.
+  u8 heat[0x10000];          // dispatcher visits to pcs without a block.
+  JitBlock pool[JIT_BLOCKS_LEN];
+  uint num_blocks;
+  JitLink links[JIT_LINKS_LEN];
+  uint num_links;
+
+  u64 compiled;
+  u64 chained;     // links patched to jump straight into another block.
+  u64 invalidated; // blocks thrown out by writes and breakpoints.
+  u64 flushes;
+} Jit;
+
+// map the code buffer and hook the jit into the core. false if this isn't
+// x86-64 or the buffer couldn't be mapped, the core just keeps interpreting.
+bool jit_attach(Jit *j, Core *c);
+void jit_detach(Jit *j);
+
+// the core calls this for writes to pages with code on them.
+void jit_invalidate(Jit *j, u16 address);
+
+// core_run, but running compiled blocks wherever it can. it stops in exactly
+// the same place core_run would, a block that could go past a budget is left
+// to the interpreter. without a jit attached it's just core_run.
+StopReason core_run_jit(Core *c, RunBudget budget);
+
+void test_jit();
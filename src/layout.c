@@ -0,0 +1,644 @@
+#include "layout.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "bank.h"
+#include "defines.h"
+#include "fixture.h"
+#include "lexer.h"
+#include "listing.h"
+#include "parse.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+LayoutEntry layout[AST_LEN] = {0};
+uint layout_len = 0;
+LayoutStats layout_stats = {0};
+u16 layout_origin = 0;
+u32 layout_end = 0;
+uint layout_banks = 0;
+u8 *layout_bank_image = NULL;
+bool layout_relocatable = false;
+Writer *layout_listing = NULL;
+
+// the short and long versions of each resizable operand class.
+static const AddrMode short_mode[] = {
+    [OC_ADDRESS] = ZP, [OC_ADDRESS_X] = ZPX, [OC_ADDRESS_Y] = ZPY};
+static const AddrMode long_mode[] = {
+    [OC_ADDRESS] = Abs, [OC_ADDRESS_X] = AbsX, [OC_ADDRESS_Y] = AbsY};
+
+static Lexeme inverted_branch(Lexeme instruction) {
+  switch (instruction) {
+  case BCC:
+    return BCS;
+  case BCS:
+    return BCC;
+  case BEQ:
+    return BNE;
+  case BNE:
+    return BEQ;
+  case BMI:
+    return BPL;
+  case BPL:
+    return BMI;
+  case BVC:
+    return BVS;
+  case BVS:
+    return BVC;
+  default:
+    error("%s is not a branch, it can't be inverted.",
+          instruction_to_string(instruction));
+  }
+}
+
+static OperandClass classify(Lexeme instruction, AddrMode mode) {
+  if (has_addrmode(instruction, Relative)) {
+    if (mode != ZP && mode != Abs) {
+      error("%s only takes a branch target.",
+            instruction_to_string(instruction));
+    }
+    return OC_BRANCH;
+  }
+
+  switch (mode) {
+  case ZP:
+  case Abs:
+    return OC_ADDRESS;
+  case ZPX:
+  case AbsX:
+    return OC_ADDRESS_X;
+  case ZPY:
+  case AbsY:
+    return OC_ADDRESS_Y;
+  default:
+    return OC_FIXED;
+  }
+}
+
+// the operand value, either straight from the literal or from the label's
+// current address.
+u32 operand_value(LayoutEntry *e) {
+  if (e->name == NULL) {
+    return e->arg.value;
+  }
+
+  Symbol *s = lookup_symbol(e->name);
+  if (s == NULL || s->type != DT_INT) {
+    if (layout_relocatable) {
+      return 0; // the linker fills it in.
+    }
+    error("Undefined label %s used as an operand.", e->name);
+  }
+  return s->value;
+}
+
+// pick the smallest size the entry could possibly have, before anything's
+// been placed.
+static void initial_size(LayoutEntry *e) {
+  e->relaxed = false;
+
+  switch (e->operand_class) {
+  case OC_FIXED: {
+    if (!has_addrmode(e->instruction, e->arg.mode)) {
+      error("%s can't be used with addressing mode %d.",
+            instruction_to_string(e->instruction), e->arg.mode);
+    }
+    e->size = addrmode_len_table[e->arg.mode];
+  } break;
+
+  case OC_BRANCH: {
+    // start optimistic, everything's in range until proven otherwise.
+    e->arg.mode = Relative;
+    e->size = addrmode_len_table[Relative];
+  } break;
+
+  default: {
+    // same idea, start with the short mode wherever it could possibly work
+    // and only ever grow. since sizes only ever go up, the passes are
+    // guaranteed to stop.
+    AddrMode s = short_mode[e->operand_class];
+    AddrMode l = long_mode[e->operand_class];
+    // a label in a relocatable module could end up anywhere, so it can't
+    // start short.
+    bool fits = (e->name != NULL) ? !layout_relocatable : e->arg.value < 256;
+
+    if (has_addrmode(e->instruction, s) && fits) {
+      e->arg.mode = s;
+    } else if (has_addrmode(e->instruction, l)) {
+      e->arg.mode = l;
+    } else {
+      error("%s has no addressing mode that fits its operand.",
+            instruction_to_string(e->instruction));
+    }
+    e->size = addrmode_len_table[e->arg.mode];
+  } break;
+  }
+}
+
+static void add_instruction(NodeIndex n_idx) {
+  Node n = ast[n_idx];
+  Node arg_node = ast[n.left];
+
+  LayoutEntry *e = &layout[layout_len++];
+  memset(e, 0, sizeof(LayoutEntry));
+  e->kind = EK_INSTRUCTION;
+  e->node = n_idx;
+  e->instruction = (Lexeme)n.data.as_raw_data;
+  e->arg = arg_node.data.as_arg;
+  e->name = (arg_node.left != NULL_INDEX) ? (char *)ast[arg_node.left].data.as_ptr
+                                          : NULL;
+  e->operand_class = classify(e->instruction, e->arg.mode);
+  initial_size(e);
+}
+
+// a .bound waiting for the label it belongs to.
+static uint pending_bound = 0;
+
+static void add_label(NodeIndex n_idx) {
+  char *name = (char *)ast[ast[n_idx].left].data.as_ptr;
+
+  if (lookup_symbol(name) != NULL) {
+    error("The label %s is defined more than once.", name);
+  }
+  insert_symbol(make_symbol(DT_INT, name, 0));
+
+  LayoutEntry *e = &layout[layout_len++];
+  memset(e, 0, sizeof(LayoutEntry));
+  e->kind = EK_LABEL;
+  e->node = n_idx;
+  e->name = name;
+  e->bound = pending_bound;
+  pending_bound = 0;
+}
+
+static void add_pragma(NodeIndex n_idx) {
+  Node n = ast[n_idx];
+
+  switch (n.data.as_raw_data) {
+  case PR_BOUND: {
+    pending_bound = ast[n.left].data.as_raw_data;
+    if (pending_bound == 0) {
+      error(".bound has to be at least 1.");
+    }
+  } break;
+
+  case PR_ORG: {
+    u64 address = ast[n.left].data.as_raw_data;
+    if (address > 0xffff) {
+      error(".org $%lx is past the end of the address space.",
+            (unsigned long)address);
+    }
+
+    LayoutEntry *e = &layout[layout_len++];
+    memset(e, 0, sizeof(LayoutEntry));
+    e->kind = EK_ORG;
+    e->node = n_idx;
+    e->arg.value = address;
+  } break;
+
+  case PR_BANK: {
+    u64 bank = ast[n.left].data.as_raw_data;
+    if (bank >= BANKS_LEN) {
+      error(".bank %lu is past the last one, %d.", (unsigned long)bank,
+            BANKS_LEN - 1);
+    }
+
+    LayoutEntry *e = &layout[layout_len++];
+    memset(e, 0, sizeof(LayoutEntry));
+    e->kind = EK_BANK;
+    e->node = n_idx;
+    e->arg.value = bank;
+  } break;
+
+  default: {
+  } break;
+  }
+}
+
+static void add_data(NodeIndex n_idx) {
+  LayoutEntry *e = &layout[layout_len++];
+  memset(e, 0, sizeof(LayoutEntry));
+  e->kind = EK_DATA;
+  e->node = n_idx;
+  e->span = ast[n_idx].data.as_raw_data;
+  e->size = data_spans[e->span].len;
+}
+
+// walk the statement list iteratively, it can be as long as the program.
+static void flatten(NodeIndex root) {
+  NodeIndex list = root;
+  while (list != NULL_INDEX) {
+    Node statement = ast[ast[list].left];
+
+    // a .bound goes with the label straight after it, anything else in
+    // between would leave it bounding the wrong thing.
+    if (pending_bound != 0 && statement.type != NT_LABEL &&
+        statement.type != NT_EMPTY) {
+      error(".bound has to come right before the label of a loop.");
+    }
+
+    if (statement.type == NT_INSTRUCTION) {
+      add_instruction(ast[list].left);
+    } else if (statement.type == NT_LABEL) {
+      add_label(ast[list].left);
+    } else if (statement.type == NT_PRAGMA) {
+      add_pragma(ast[list].left);
+    } else if (statement.type == NT_DATA) {
+      add_data(ast[list].left);
+    }
+
+    list = ast[list].right;
+  }
+
+  if (pending_bound != 0) {
+    error(".bound at the end of the program has no label to go with.");
+  }
+}
+
+// give everything an address with the current sizes, and move the labels to
+// match.
+static void assign_addresses() {
+  u32 address = layout_origin;
+  layout_end = address;
+  layout_banks = 0;
+  int bank = -1;
+  static bool placed[BANKS_LEN];
+  memset(placed, 0, sizeof(placed));
+  // the first address outside the banks that's in the window. the banks
+  // could still come after it.
+  u32 in_window = 0;
+
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+    if (e->kind == EK_ORG) {
+      if (layout_relocatable) {
+        error("A module can't .org, the linker decides where it goes.");
+      }
+      // only forwards, so nothing can land on top of something else.
+      if (e->arg.value < address) {
+        error(".org $%04x would go backwards, the program is already at "
+              "$%04x.",
+              e->arg.value, address);
+      }
+      address = e->arg.value;
+    } else if (e->kind == EK_BANK) {
+      if (layout_relocatable) {
+        error("A module can't .bank, only a whole program can.");
+      }
+      // each one in one piece, so a bank can't land on top of itself.
+      if (placed[e->arg.value]) {
+        error(".bank %u is already placed, a bank has to be all in one "
+              "place.",
+              e->arg.value);
+      }
+      placed[e->arg.value] = true;
+      bank = e->arg.value;
+      if ((uint)bank + 1 > layout_banks) {
+        layout_banks = bank + 1;
+      }
+      address = BANK_WINDOW;
+    }
+
+    if (address > 0xffff && e->kind != EK_LABEL) {
+      error("The program doesn't fit in the address space, it runs past "
+            "$ffff.");
+    }
+    if (bank >= 0 && address + e->size > BANK_WINDOW + BANK_SIZE) {
+      error(".bank %d doesn't fit in the window at $%04x-$%04x.", bank,
+            BANK_WINDOW, BANK_WINDOW + BANK_SIZE - 1);
+    }
+    e->address = address;
+    e->bank = bank;
+
+    if (e->kind == EK_LABEL) {
+      lookup_symbol(e->name)->value = address;
+    }
+
+    if (bank < 0 && e->size > 0 && in_window == 0 &&
+        address < BANK_WINDOW + BANK_SIZE && address + e->size > BANK_WINDOW) {
+      in_window = (address > BANK_WINDOW) ? address : BANK_WINDOW;
+    }
+
+    address += e->size;
+    if (bank < 0 && address > layout_end) {
+      layout_end = address;
+    }
+  }
+
+  // the banks get mapped over it at run time, it would never be seen.
+  if (layout_banks > 0 && in_window != 0) {
+    error("The program's at $%04x, inside the bank window at $%04x-$%04x. "
+          "Only .bank code can go there.",
+          in_window, BANK_WINDOW, BANK_WINDOW + BANK_SIZE - 1);
+  }
+
+  if (layout_end > 0x10000) {
+    error("The program doesn't fit in the address space, it runs past "
+          "$ffff.");
+  }
+}
+
+// try to settle one entry with the current addresses. returns true if it had
+// to grow.
+static bool settle(LayoutEntry *e) {
+  u32 value = operand_value(e);
+
+  switch (e->operand_class) {
+  case OC_FIXED: {
+    if (layout_relocatable && e->name != NULL && e->arg.mode != Indirect) {
+      error("The label operand for %s has to fit in a byte, which can't be "
+            "known until the module is linked.",
+            instruction_to_string(e->instruction));
+    }
+    if ((e->arg.mode == IndexedIndirect || e->arg.mode == IndirectIndexed) &&
+        value > 0xff) {
+      error("The pointer for %s has to be in the zero page.",
+            instruction_to_string(e->instruction));
+    }
+    if (e->arg.mode == Immediate && value > 0xff) {
+      error("The immediate operand for %s doesn't fit in a byte.",
+            instruction_to_string(e->instruction));
+    }
+    return false;
+  } break;
+
+  case OC_BRANCH: {
+    if (e->relaxed) {
+      return false;
+    }
+    if (layout_relocatable && e->name != NULL &&
+        lookup_symbol(e->name) == NULL) {
+      // another module's label, it has to be in range after linking.
+      return false;
+    }
+    int offset = (int)value - (e->address + 2);
+    if (offset < -128 || offset > 127) {
+      e->relaxed = true;
+      e->size = RELAXED_BRANCH_LEN;
+      return true;
+    }
+    return false;
+  } break;
+
+  default: {
+    if (e->arg.mode == short_mode[e->operand_class] && value > 0xff) {
+      AddrMode l = long_mode[e->operand_class];
+      if (!has_addrmode(e->instruction, l)) {
+        // it only has the short form, like stx zp,Y.
+        error("%s has no addressing mode that reaches %s at $%04x.",
+              instruction_to_string(e->instruction),
+              (e->name != NULL) ? e->name : "its operand", value);
+      }
+      e->arg.mode = l;
+      e->size = addrmode_len_table[e->arg.mode];
+      return true;
+    }
+    return false;
+  } break;
+  }
+}
+
+static void collect_stats() {
+  LayoutStats *st = &layout_stats;
+
+  st->bytes = layout_end - layout_origin;
+
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+
+    if (e->relaxed) {
+      st->branches_relaxed++;
+    }
+
+    if (e->operand_class == OC_ADDRESS || e->operand_class == OC_ADDRESS_X ||
+        e->operand_class == OC_ADDRESS_Y) {
+      AddrMode s = short_mode[e->operand_class];
+      AddrMode l = long_mode[e->operand_class];
+      if (e->arg.mode == s && has_addrmode(e->instruction, l)) {
+        st->short_operands++;
+        st->bytes_saved += addrmode_len_table[l] - addrmode_len_table[s];
+        st->cycles_saved += instruction_cycles(e->instruction, l) -
+                            instruction_cycles(e->instruction, s);
+      }
+    }
+  }
+}
+
+static void fixed_point() {
+  bool changed;
+  do {
+    layout_stats.passes++;
+    assign_addresses();
+
+    changed = false;
+    for (uint i = 0; i < layout_len; i++) {
+      if (layout[i].kind == EK_INSTRUCTION) {
+        changed |= settle(&layout[i]);
+      }
+    }
+  } while (changed);
+
+  collect_stats();
+}
+
+void layout_program(NodeIndex root, u16 origin) {
+  clean_layout();
+  layout_origin = origin;
+
+  flatten(root);
+  fixed_point();
+}
+
+void relayout() {
+  memset(&layout_stats, 0, sizeof(LayoutStats));
+
+  for (uint i = 0; i < layout_len; i++) {
+    if (layout[i].kind == EK_INSTRUCTION) {
+      initial_size(&layout[i]);
+    }
+  }
+
+  fixed_point();
+}
+
+static uint emit_instruction(LayoutEntry *e, u8 *image) {
+  u8 *dest = image + e->address;
+  u32 value = operand_value(e);
+  Arg arg = e->arg;
+
+  if (e->relaxed) {
+    // bxx far -> b!xx +3, jmp far
+    make_opcode((Arg){.mode = Relative, .value = 3},
+                inverted_branch(e->instruction), dest);
+    make_opcode((Arg){.mode = Abs, .value = value}, JMP, dest + 2);
+    return RELAXED_BRANCH_LEN;
+  }
+
+  if (e->operand_class == OC_BRANCH) {
+    arg.value = (u8)(value - (e->address + 2));
+  } else {
+    arg.value = value;
+  }
+
+  // put the final operand back into the tree, so anything that walks the
+  // AST after us sees the same encoding we emitted.
+  ast[ast[e->node].left].data.as_arg = arg;
+
+  return make_opcode(arg, e->instruction, dest);
+}
+
+// a bank's entries are encoded into the window of a 64k of their own, then
+// copied out to its place in layout_bank_image.
+static void bank_done(int bank, u8 *window) {
+  if (bank >= 0) {
+    memcpy(layout_bank_image + (size_t)bank * BANK_SIZE, window + BANK_WINDOW,
+           BANK_SIZE);
+    memset(window + BANK_WINDOW, 0, BANK_SIZE + MAX_OPCODE_LEN);
+  }
+}
+
+uint emit_layout(u8 *image) {
+  static u8 window[0x10000 + MAX_OPCODE_LEN];
+  uint written = 0;
+
+  free(layout_bank_image);
+  layout_bank_image = NULL;
+  if (layout_banks > 0) {
+    layout_bank_image = calloc(layout_banks, BANK_SIZE);
+    if (layout_bank_image == NULL) {
+      error("Couldn't allocate %u banks.", layout_banks);
+    }
+  }
+
+  int bank = -1;
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+    if (e->bank != bank) {
+      bank_done(bank, window);
+      bank = e->bank;
+    }
+    u8 *to = (bank >= 0) ? window : image;
+    if (e->kind == EK_DATA) {
+      written += emit_span(e->span, to, e->address);
+    } else if (e->kind == EK_INSTRUCTION) {
+      written += emit_instruction(e, to);
+    }
+
+    // straight out of the encoder, so the listing never needs its own pass.
+    if (layout_listing != NULL) {
+      list_entry(layout_listing, e, to);
+    }
+  }
+  bank_done(bank, window);
+
+  return written;
+}
+
+void print_layout_stats() {
+  LayoutStats st = layout_stats;
+  printf("layout: $%04x-$%04x, %u bytes in %u passes\n", layout_origin,
+         (uint)(layout_end - 1) & 0xffff, st.bytes, st.passes);
+  printf("layout: %u zero page operands, %u bytes and %u cycles saved vs "
+         "absolute\n",
+         st.short_operands, st.bytes_saved, st.cycles_saved);
+  printf("layout: %u branches relaxed (+%u bytes)\n", st.branches_relaxed,
+         st.branches_relaxed * (RELAXED_BRANCH_LEN - 2));
+  if (layout_banks > 0) {
+    printf("layout: %u banks of %uk at $%04x\n", layout_banks, BANK_SIZE >> 10,
+           BANK_WINDOW);
+  }
+}
+
+void clean_layout() {
+  layout_len = 0;
+  layout_end = 0;
+  layout_banks = 0;
+  free(layout_bank_image);
+  layout_bank_image = NULL;
+  memset(&layout_stats, 0, sizeof(LayoutStats));
+}
+
+void test_layout() {
+  printf("\n\nTESTING LAYOUT\n\n\n");
+
+  static u8 image[0x10000 + MAX_OPCODE_LEN];
+
+  {
+    // with the program in the zero page, the label operands can all be
+    // short, except where the instruction has no short form.
+    clean_ast();
+    clean_symtab();
+    NodeIndex root = parse("data:\n"
+                           "  nop\n"
+                           "  lda data\n"
+                           "  lda data,X\n"
+                           "  jmp data\n");
+    layout_program(root, 0x0010);
+
+    ASSERT(layout[2].arg.mode == ZP, "label operand in the zero page");
+    ASSERT(layout[3].arg.mode == ZPX, "indexed label operand in the zero page");
+    ASSERT(layout[4].arg.mode == Abs, "jmp has no zero page mode");
+    ASSERT(layout_stats.bytes_saved == 2, "layout bytes saved");
+    // lda zp is a cycle faster than lda abs, but lda zp,X and lda abs,X are
+    // both 4 cycles.
+    ASSERT(layout_stats.cycles_saved == 1, "layout cycles saved");
+
+    emit_layout(image);
+    ASSERT(image[0x11] == 0xA5 && image[0x12] == 0x10, "emit zero page lda");
+    ASSERT(image[0x15] == 0x4C && image[0x16] == 0x10 && image[0x17] == 0x00,
+           "emit jmp to label");
+  }
+
+  {
+    // a forward branch over 150 bytes of code is out of range.
+    static char program[INPUT_LEN];
+    strcpy(program, "  bne far\n  beq near\nnear:\n");
+    for (int i = 0; i < 50; i++) {
+      strcat(program, "  lda $1234\n");
+    }
+    strcat(program, "far:\n  rts\n");
+
+    clean_ast();
+    clean_symtab();
+    NodeIndex root = parse(program);
+    layout_program(root, DEFAULT_ORIGIN);
+
+    ASSERT(layout[0].relaxed && layout[0].size == RELAXED_BRANCH_LEN,
+           "out of range branch is relaxed");
+    ASSERT(!layout[1].relaxed, "in range branch is left alone");
+    ASSERT(layout_stats.branches_relaxed == 1, "one branch relaxed");
+
+    emit_layout(image);
+    u16 far = lookup_symbol("far")->value;
+    ASSERT(image[0x0600] == 0xF0 && image[0x0601] == 0x03,
+           "relaxed branch is inverted");
+    ASSERT(image[0x0602] == 0x4C && image[0x0603] == (far & 0xff) &&
+               image[0x0604] == (far >> 8),
+           "relaxed branch jumps to the target");
+    ASSERT(image[0x0605] == 0xF0 && image[0x0606] == 0x00,
+           "short branch offset");
+  }
+
+  // stx has a zp,Y but no abs,Y, so a label past the zero page can't be
+  // reached that way. ldx has both.
+  ASSERT(assembly_fails("  stx far,Y\n"
+                        "  .org $0900\n"
+                        "far:\n"
+                        "  rts\n"),
+         "a label that outgrows the only mode there is");
+  ASSERT(!assembly_fails("  ldx far,Y\n"
+                         "  .org $0900\n"
+                         "far:\n"
+                         "  rts\n"),
+         "and one that has a wider mode to go to");
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING LAYOUT, SUCCESS!\n\n\n");
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "arguments.h"
+#include "ast.h"
+#include "defines.h"
+#include "lexer.h"
+#include "span.h"
+#include "writer.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// where programs get placed when nothing says otherwise.
+#define DEFAULT_ORIGIN 0x0600
+
+// a branch that can't reach its target turns into the inverted branch
+// hopping over a JMP to the real target, 2 + 3 bytes.
+#define RELAXED_BRANCH_LEN 5
+
+// how the layout pass is allowed to resize an operand.
+typedef enum OperandClass {
+  OC_FIXED = 0, // the syntax already pinned the mode down. (implicit,
+                // immediate and the indirect modes)
+  OC_ADDRESS,   // ZP or Abs.
+  OC_ADDRESS_X, // ZPX or AbsX.
+  OC_ADDRESS_Y, // ZPY or AbsY.
+  OC_BRANCH,    // Relative, or relaxed into a branch over a JMP.
+} OperandClass;
+
+typedef enum EntryKind {
+  EK_INSTRUCTION = 0,
+  EK_LABEL,
+  EK_DATA, // a span of bytes, placed and copied out as one piece.
+  EK_ORG,  // moves the address of everything after it to arg.value.
+  EK_BANK, // everything after it goes in bank arg.value, at the window.
+} EntryKind;
+
+// one flattened statement from the AST, with everything the layout pass needs
+// to place and size it.
+typedef struct LayoutEntry {
+  EntryKind kind;
+  NodeIndex node;     // the AST node this came from.
+  Lexeme instruction; // LEXEME_NULL for everything but instructions.
+  Arg arg;    // for branches, the value is the target address, not the offset.
+  char *name; // the label defined here, or the label used as the operand.
+  OperandClass operand_class;
+  u16 address;
+  u32 size; // a data span can be a lot bigger than an instruction.
+  bool relaxed;
+  uint bound; // labels only, from a .bound right before the label. 0 if there
+              // wasn't one.
+  SpanIndex span; // data only.
+  int bank;       // the .bank it's in, -1 for the 64k itself.
+} LayoutEntry;
+
+typedef struct LayoutStats {
+  uint passes; // how many passes it took to hit the fixed point.
+  uint bytes;
+  uint short_operands; // address operands that fit in the zero page.
+  // these two are against encoding every address operand as absolute.
+  uint bytes_saved;
+  uint cycles_saved;
+  uint branches_relaxed;
+} LayoutStats;
+
+// the flattened program, in source order.
+extern LayoutEntry layout[AST_LEN];
+extern uint layout_len;
+extern LayoutStats layout_stats;
+extern u16 layout_origin;
+extern u32 layout_end; // one past the last byte, so it can be 0x10000.
+// one more than the highest .bank, 0 if there weren't any. emit_layout puts
+// their bytes here, BANK_SIZE each in bank order, since they all share the
+// window in the 64k.
+extern uint layout_banks;
+extern u8 *layout_bank_image;
+
+// set before layout_program to lay out a module for the linker. labels are
+// sized as if they could end up anywhere, and labels that aren't defined are
+// left for the linker to find in another module.
+extern bool layout_relocatable;
+
+// if set, emit_layout writes the listing for every entry here as it encodes it.
+extern Writer *layout_listing;
+
+// flatten the statement list at root, place it at origin and size every
+// operand, iterating until nothing changes. labels go into the symtab with
+// their final addresses.
+void layout_program(NodeIndex root, u16 origin);
+
+// start over from the smallest sizes and find the fixed point again, for after
+// something has added or taken entries out of the layout array.
+void relayout();
+
+// the current value of the entry's operand, with labels resolved.
+u32 operand_value(LayoutEntry *e);
+
+// encode the laid out program into image, which is indexed by address and has
+// to cover the whole 64k space, and the banks into layout_bank_image. returns
+// how many bytes were written.
+uint emit_layout(u8 *image);
+
+void print_layout_stats();
+void clean_layout();
+
+void test_layout();
@@ -54,9 +54,9 @@ static Token token_at_cursor(Lexer *l) {
   // we can logically group lexemes into one-character and multi-character ones.
   char ch = l->curr_char;
 
-  printf("Trying to convert one-character lexeme from '%c'.\n", ch);
+  DEBUG_PRINTF("Trying to convert one-character lexeme from '%c'.\n", ch);
   if (ch == 0) {
-    printf("Found the EOF! Returning EMPTY token...\n");
+    DEBUG_PRINTF("Found the EOF! Returning EMPTY token...\n");
     l_type = EMPTY;
   } else if ((l->curr_char == '\'') && (isalnum(PEEK))) { // PARSE CHAR LITERAL
     // parse out the literals first, since the ' rule would take precedence over
@@ -96,8 +96,8 @@ static Token token_at_cursor(Lexer *l) {
       literal_ch = l->curr_char;
     }
 
-    // then bump the cursor back to the " in the string literal decl.
-    RET_TOKEN_NEXT(-1);
+    // the cursor is already on the closing " in the string literal decl,
+    // which is the last character in the lexeme.
 
     char *temp_value = (char *)malloc(
         sz + 1);           // malloc the size, then copy the buffer right in.
@@ -266,6 +266,8 @@ static Token token_at_cursor(Lexer *l) {
       break;
     case '\n':
       l_type = NEWLINE;
+      l->line++;
+      l->line_start = l->pos + 1;
       break;
     case ',':
       l_type = COMMA;
@@ -303,120 +305,121 @@ static Token token_at_cursor(Lexer *l) {
 
       BRK_NEXT(-1);
 
-      printf("Finished parsing keyword from the lexer [%s]\n", keyword_buf);
+      DEBUG_PRINTF("Finished parsing keyword from the lexer [%s]\n",
+                   keyword_buf);
 
       // parse all the opcode keywords
-      if (strncmp(keyword_buf, "adc", 3) == 0) {
+      if (strcmp(keyword_buf, "adc") == 0) {
         l_type = ADC;
-      } else if (strncmp(keyword_buf, "and", 3) == 0) {
+      } else if (strcmp(keyword_buf, "and") == 0) {
         l_type = AND;
-      } else if (strncmp(keyword_buf, "asl", 3) == 0) {
+      } else if (strcmp(keyword_buf, "asl") == 0) {
         l_type = ASL;
-      } else if (strncmp(keyword_buf, "bcc", 3) == 0) {
+      } else if (strcmp(keyword_buf, "bcc") == 0) {
         l_type = BCC;
-      } else if (strncmp(keyword_buf, "bcs", 3) == 0) {
+      } else if (strcmp(keyword_buf, "bcs") == 0) {
         l_type = BCS;
-      } else if (strncmp(keyword_buf, "beq", 3) == 0) {
+      } else if (strcmp(keyword_buf, "beq") == 0) {
         l_type = BEQ;
-      } else if (strncmp(keyword_buf, "bit", 3) == 0) {
+      } else if (strcmp(keyword_buf, "bit") == 0) {
         l_type = BIT;
-      } else if (strncmp(keyword_buf, "bmi", 3) == 0) {
+      } else if (strcmp(keyword_buf, "bmi") == 0) {
         l_type = BMI;
-      } else if (strncmp(keyword_buf, "bne", 3) == 0) {
+      } else if (strcmp(keyword_buf, "bne") == 0) {
         l_type = BNE;
-      } else if (strncmp(keyword_buf, "bpl", 3) == 0) {
+      } else if (strcmp(keyword_buf, "bpl") == 0) {
         l_type = BPL;
-      } else if (strncmp(keyword_buf, "brk", 3) == 0) {
+      } else if (strcmp(keyword_buf, "brk") == 0) {
         l_type = BRK;
-      } else if (strncmp(keyword_buf, "bvc", 3) == 0) {
+      } else if (strcmp(keyword_buf, "bvc") == 0) {
         l_type = BVC;
-      } else if (strncmp(keyword_buf, "bvs", 3) == 0) {
+      } else if (strcmp(keyword_buf, "bvs") == 0) {
         l_type = BVS;
-      } else if (strncmp(keyword_buf, "clc", 3) == 0) {
+      } else if (strcmp(keyword_buf, "clc") == 0) {
         l_type = CLC;
-      } else if (strncmp(keyword_buf, "cld", 3) == 0) {
+      } else if (strcmp(keyword_buf, "cld") == 0) {
         l_type = CLD;
-      } else if (strncmp(keyword_buf, "cli", 3) == 0) {
+      } else if (strcmp(keyword_buf, "cli") == 0) {
         l_type = CLI;
-      } else if (strncmp(keyword_buf, "clv", 3) == 0) {
+      } else if (strcmp(keyword_buf, "clv") == 0) {
         l_type = CLV;
-      } else if (strncmp(keyword_buf, "cmp", 3) == 0) {
+      } else if (strcmp(keyword_buf, "cmp") == 0) {
         l_type = CMP;
-      } else if (strncmp(keyword_buf, "cpx", 3) == 0) {
+      } else if (strcmp(keyword_buf, "cpx") == 0) {
         l_type = CPX;
-      } else if (strncmp(keyword_buf, "cpy", 3) == 0) {
+      } else if (strcmp(keyword_buf, "cpy") == 0) {
         l_type = CPY;
-      } else if (strncmp(keyword_buf, "dec", 3) == 0) {
+      } else if (strcmp(keyword_buf, "dec") == 0) {
         l_type = DEC;
-      } else if (strncmp(keyword_buf, "dex", 3) == 0) {
+      } else if (strcmp(keyword_buf, "dex") == 0) {
         l_type = DEX;
-      } else if (strncmp(keyword_buf, "dey", 3) == 0) {
+      } else if (strcmp(keyword_buf, "dey") == 0) {
         l_type = DEY;
-      } else if (strncmp(keyword_buf, "eor", 3) == 0) {
+      } else if (strcmp(keyword_buf, "eor") == 0) {
         l_type = EOR;
-      } else if (strncmp(keyword_buf, "inc", 3) == 0) {
+      } else if (strcmp(keyword_buf, "inc") == 0) {
         l_type = INC;
-      } else if (strncmp(keyword_buf, "inx", 3) == 0) {
+      } else if (strcmp(keyword_buf, "inx") == 0) {
         l_type = INX;
-      } else if (strncmp(keyword_buf, "iny", 3) == 0) {
+      } else if (strcmp(keyword_buf, "iny") == 0) {
         l_type = INY;
-      } else if (strncmp(keyword_buf, "jmp", 3) == 0) {
+      } else if (strcmp(keyword_buf, "jmp") == 0) {
         l_type = JMP;
-      } else if (strncmp(keyword_buf, "jsr", 3) == 0) {
+      } else if (strcmp(keyword_buf, "jsr") == 0) {
         l_type = JSR;
-      } else if (strncmp(keyword_buf, "lda", 3) == 0) {
+      } else if (strcmp(keyword_buf, "lda") == 0) {
         l_type = LDA;
-      } else if (strncmp(keyword_buf, "ldx", 3) == 0) {
+      } else if (strcmp(keyword_buf, "ldx") == 0) {
         l_type = LDX;
-      } else if (strncmp(keyword_buf, "ldy", 3) == 0) {
+      } else if (strcmp(keyword_buf, "ldy") == 0) {
         l_type = LDY;
-      } else if (strncmp(keyword_buf, "lsr", 3) == 0) {
+      } else if (strcmp(keyword_buf, "lsr") == 0) {
         l_type = LSR;
-      } else if (strncmp(keyword_buf, "nop", 3) == 0) {
+      } else if (strcmp(keyword_buf, "nop") == 0) {
         l_type = NOP;
-      } else if (strncmp(keyword_buf, "ora", 3) == 0) {
+      } else if (strcmp(keyword_buf, "ora") == 0) {
         l_type = ORA;
-      } else if (strncmp(keyword_buf, "pha", 3) == 0) {
+      } else if (strcmp(keyword_buf, "pha") == 0) {
         l_type = PHA;
-      } else if (strncmp(keyword_buf, "php", 3) == 0) {
+      } else if (strcmp(keyword_buf, "php") == 0) {
         l_type = PHP;
-      } else if (strncmp(keyword_buf, "pla", 3) == 0) {
+      } else if (strcmp(keyword_buf, "pla") == 0) {
         l_type = PLA;
-      } else if (strncmp(keyword_buf, "plp", 3) == 0) {
+      } else if (strcmp(keyword_buf, "plp") == 0) {
         l_type = PLP;
-      } else if (strncmp(keyword_buf, "rol", 3) == 0) {
+      } else if (strcmp(keyword_buf, "rol") == 0) {
         l_type = ROL;
-      } else if (strncmp(keyword_buf, "ror", 3) == 0) {
+      } else if (strcmp(keyword_buf, "ror") == 0) {
         l_type = ROR;
-      } else if (strncmp(keyword_buf, "rti", 3) == 0) {
+      } else if (strcmp(keyword_buf, "rti") == 0) {
         l_type = RTI;
-      } else if (strncmp(keyword_buf, "rts", 3) == 0) {
+      } else if (strcmp(keyword_buf, "rts") == 0) {
         l_type = RTS;
-      } else if (strncmp(keyword_buf, "sbc", 3) == 0) {
+      } else if (strcmp(keyword_buf, "sbc") == 0) {
         l_type = SBC;
-      } else if (strncmp(keyword_buf, "sec", 3) == 0) {
+      } else if (strcmp(keyword_buf, "sec") == 0) {
         l_type = SEC;
-      } else if (strncmp(keyword_buf, "sed", 3) == 0) {
+      } else if (strcmp(keyword_buf, "sed") == 0) {
         l_type = SED;
-      } else if (strncmp(keyword_buf, "sei", 3) == 0) {
+      } else if (strcmp(keyword_buf, "sei") == 0) {
         l_type = SEI;
-      } else if (strncmp(keyword_buf, "sta", 3) == 0) {
+      } else if (strcmp(keyword_buf, "sta") == 0) {
         l_type = STA;
-      } else if (strncmp(keyword_buf, "stx", 3) == 0) {
+      } else if (strcmp(keyword_buf, "stx") == 0) {
         l_type = STX;
-      } else if (strncmp(keyword_buf, "sty", 3) == 0) {
+      } else if (strcmp(keyword_buf, "sty") == 0) {
         l_type = STY;
-      } else if (strncmp(keyword_buf, "tax", 3) == 0) {
+      } else if (strcmp(keyword_buf, "tax") == 0) {
         l_type = TAX;
-      } else if (strncmp(keyword_buf, "tay", 3) == 0) {
+      } else if (strcmp(keyword_buf, "tay") == 0) {
         l_type = TAY;
-      } else if (strncmp(keyword_buf, "tsx", 3) == 0) {
+      } else if (strcmp(keyword_buf, "tsx") == 0) {
         l_type = TSX;
-      } else if (strncmp(keyword_buf, "txa", 3) == 0) {
+      } else if (strcmp(keyword_buf, "txa") == 0) {
         l_type = TXA;
-      } else if (strncmp(keyword_buf, "txs", 3) == 0) {
+      } else if (strcmp(keyword_buf, "txs") == 0) {
         l_type = TXS;
-      } else if (strncmp(keyword_buf, "tya", 3) == 0) {
+      } else if (strcmp(keyword_buf, "tya") == 0) {
         l_type = TYA;
 
       } else { // else, parse the ID out of the keyword_buf, since it's clearly
@@ -648,6 +651,26 @@ const char *lexeme_to_string(Lexeme lexeme) {
   }
 }
 
+// the lowercase source spelling of each instruction, in the same order as the
+// instruction lexemes. this is the spelling the lexer accepts, so anything
+// printed with it can be fed right back into the assembler.
+static const char *instruction_names[] = {
+    "adc", "and", "asl", "bcc", "bcs", "beq", "bit", "bmi", "bne", "bpl",
+    "brk", "bvc", "bvs", "clc", "cld", "cli", "clv", "cmp", "cpx", "cpy",
+    "dec", "dex", "dey", "eor", "inc", "inx", "iny", "jmp", "jsr", "lda",
+    "ldx", "ldy", "lsr", "nop", "ora", "pha", "php", "pla", "plp", "rol",
+    "ror", "rti", "rts", "sbc", "sec", "sed", "sei", "sta", "stx", "sty",
+    "tax", "tay", "tsx", "txa", "txs", "tya"};
+
+const char *instruction_to_string(Lexeme instruction) {
+  int offset = instruction - INSTRUCTION_MASK;
+  if (offset < 0 ||
+      offset >= (int)(sizeof(instruction_names) / sizeof(instruction_names[0]))) {
+    return "???";
+  }
+  return instruction_names[offset];
+}
+
 // don't expose the static methods, just expose one testing method for the main
 // testing function to call.
 void test_lexer() {
@@ -720,6 +743,9 @@ void test_lexer() {
     // the token should contain a pointer to the proper string.
     ASSERT(strncmp((char *)l->curr_token.value, "my_string", 9) == 0,
            "string literal lexing value");
+
+    next(l);
+    ASSERT(l->curr_token.type == EMPTY, "nothing after the string literal");
   }
 
   { // test identifiers
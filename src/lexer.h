@@ -170,6 +170,9 @@ typedef struct Lexer {
   int pos;          // index into the text input of the lexer.
   char curr_char;   // the raw character at the current position.
   Token curr_token; // the current token the parser is on.
+  u16 file;         // which of the source_files the text is.
+  int line;         // the line the cursor is on, 1-based.
+  int line_start;   // index of the first character of that line.
 } Lexer;
 
 int get_int(Lexer *l);
@@ -179,6 +182,8 @@ void eat(Lexer *lx, Lexeme l);
 BinopType binop_from_lexeme(Lexeme l);
 DataType datatype_from_lexeme(Lexeme l);
 const char *lexeme_to_string(Lexeme lexeme);
+// the lowercase mnemonic for an instruction lexeme, like "lda".
+const char *instruction_to_string(Lexeme instruction);
 
 bool is_instruction(Lexeme l);
 bool is_keyword(Lexeme l);
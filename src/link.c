@@ -0,0 +1,319 @@
+#include "link.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "cache.h"
+#include "defines.h"
+#include "layout.h"
+#include "macro.h"
+#include "object.h"
+#include "parse.h"
+#include "span.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+LinkStats link_stats = {0};
+
+static char source_buffer[INPUT_LEN] = {0};
+
+void assemble_object(const char *source_path, const char *object_path) {
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+  clean_spans();
+  clean_macros();
+  clean_exports();
+  clean_dependencies();
+
+  size_t len = read_into_buf(source_path, source_buffer, INPUT_LEN - 1);
+  source_buffer[len] = '\0';
+  u64 key = cache_key(source_path, source_buffer, len);
+
+  layout_relocatable = true;
+  parse_path = source_path;
+  NodeIndex root = parse(source_buffer);
+  parse_path = NULL;
+  layout_program(root, 0);
+
+  Object o;
+  object_from_layout(&o);
+  layout_relocatable = false;
+
+  // write it somewhere else first, so a module that dies halfway never
+  // leaves an object that looks newer than its source.
+  char tmp_path[MODULE_PATH_LEN + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", object_path);
+  write_object(tmp_path, &o);
+  if (rename(tmp_path, object_path) != 0) {
+    error("Could not move the object into place at %s.", object_path);
+  }
+  cache_store(key, object_path);
+
+  free_object(&o);
+}
+
+void object_path_for(const char *source_path, char *out, size_t out_len) {
+  size_t len = strlen(source_path);
+  if (len >= 2 && strcmp(source_path + len - 2, ".s") == 0) {
+    len -= 2;
+  }
+  if (len + 3 > out_len) {
+    error("The path %s is too long.", source_path);
+  }
+  memcpy(out, source_path, len);
+  strcpy(out + len, ".o");
+}
+
+static bool wait_module() {
+  int status;
+  if (wait(&status) < 0) {
+    return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void build_objects(char **sources, uint num_sources) {
+  // the assembler's all global state, so each module gets its own process
+  // instead of its own thread.
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  uint running = 0;
+  bool failed = false;
+
+  for (uint i = 0; i < num_sources; i++) {
+    char object_path[MODULE_PATH_LEN];
+    object_path_for(sources[i], object_path, MODULE_PATH_LEN);
+    link_stats.modules++;
+
+    // on a hit the object's just copied out, nothing gets lexed or parsed.
+    if (cache_fetch(sources[i], object_path)) {
+      link_stats.cached++;
+      continue;
+    }
+    link_stats.assembled++;
+
+    if (running >= jobs) {
+      failed |= !wait_module();
+      running--;
+    }
+
+    // don't let the child print everything the parent hasn't flushed yet.
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      error("Could not start a process to assemble %s.", sources[i]);
+    }
+    if (pid == 0) {
+      assemble_object(sources[i], object_path);
+      fflush(stdout);
+      _exit(0);
+    }
+    running++;
+  }
+
+  while (running > 0) {
+    failed |= !wait_module();
+    running--;
+  }
+
+  if (failed) {
+    error("Not every module assembled, nothing was linked.");
+  }
+}
+
+u32 link_objects(char **objects, uint num_objects, u16 origin, u8 *image) {
+  static Object loaded[MODULES_LEN];
+  static SpanIndex spans[MODULES_LEN];
+  static u16 bases[MODULES_LEN];
+
+  if (num_objects > MODULES_LEN) {
+    error("Too many modules, the limit is %d.", MODULES_LEN);
+  }
+
+  clean_symtab();
+  clean_spans();
+
+  // place everything first, so every export has an address before anything
+  // gets patched.
+  u32 address = origin;
+  for (uint i = 0; i < num_objects; i++) {
+    Object *o = &loaded[i];
+    read_object(objects[i], o);
+
+    if (address + o->code.len > 0x10000) {
+      error("The linked program doesn't fit in the address space, %s runs "
+            "past $ffff.",
+            objects[i]);
+    }
+    bases[i] = address;
+
+    for (uint x = 0; x < o->num_exports; x++) {
+      ObjectExport e = o->exports[x];
+      if (lookup_symbol(e.name) != NULL) {
+        error("%s is exported by more than one module, the second is %s.",
+              e.name, objects[i]);
+      }
+      insert_symbol(make_symbol(DT_INT, e.name, address + e.offset));
+    }
+
+    // the code's already a span with its relocations as fixups, so it gets
+    // emitted like any other data.
+    spans[i] = new_span();
+    data_spans[spans[i]] = o->code;
+    memset(&o->code, 0, sizeof(DataSpan));
+
+    address += data_spans[spans[i]].len;
+  }
+
+  for (uint i = 0; i < num_objects; i++) {
+    emit_span(spans[i], image, bases[i]);
+  }
+
+  link_stats.bytes = address - origin;
+
+  for (uint i = 0; i < num_objects; i++) {
+    free_object(&loaded[i]);
+  }
+  clean_symtab();
+  clean_spans();
+
+  return address;
+}
+
+static void write_file(const char *path, const char *text) {
+  FILE *f = fopen(path, "w");
+  ASSERT(f != NULL, "write a module source");
+  fputs(text, f);
+  fclose(f);
+}
+
+void test_link() {
+  printf("\n\nTESTING LINKER\n\n\n");
+
+  static u8 image[0x10000 + MAX_OPCODE_LEN];
+  char *sources[] = {"/tmp/6502_link_a.s", "/tmp/6502_link_b.s"};
+  char *objects[] = {"/tmp/6502_link_a.o", "/tmp/6502_link_b.o"};
+
+  // a cache of its own, so nothing from an earlier run can hit.
+  char *old_dir = cache_dir;
+  char cache[] = "/tmp/6502_link_cache_XXXXXX";
+  ASSERT(mkdtemp(cache) != NULL, "make a cache directory");
+  cache_dir = cache;
+
+  remove(objects[0]);
+  remove(objects[1]);
+  write_file(sources[0], ".export main\n"
+                         "main:\n"
+                         "  jsr helper\n"
+                         "  jmp main\n");
+  write_file(sources[1], ".export helper\n"
+                         "helper:\n"
+                         "  lda table\n"
+                         "  bne helper\n"
+                         "  rts\n"
+                         "table:\n"
+                         "  .word helper, main\n");
+
+  {
+    memset(&link_stats, 0, sizeof(LinkStats));
+    build_objects(sources, 2);
+    ASSERT(link_stats.assembled == 2, "both modules assembled");
+
+    memset(image, 0, sizeof(image));
+    u32 end = link_objects(objects, 2, DEFAULT_ORIGIN, image);
+    ASSERT(end == 0x0610, "linked length");
+
+    ASSERT(memcmp(image + 0x0600, "\x20\x06\x06\x4c\x00\x06", 6) == 0,
+           "calls into the other module");
+    ASSERT(memcmp(image + 0x0606, "\xad\x0c\x06\xd0\xfb\x60", 6) == 0,
+           "module relocated after the first");
+    ASSERT(memcmp(image + 0x060c, "\x06\x06\x00\x06", 4) == 0,
+           "data relocated and resolved across modules");
+  }
+
+  {
+    // nothing changed, so nothing gets assembled again, even with the objects
+    // gone.
+    remove(objects[0]);
+    remove(objects[1]);
+    memset(&link_stats, 0, sizeof(LinkStats));
+    build_objects(sources, 2);
+    ASSERT(link_stats.assembled == 0 && link_stats.cached == 2,
+           "unchanged sources come out of the cache");
+
+    // changing one module only assembles that one again.
+    write_file(sources[1], ".export helper\n"
+                           "helper:\n"
+                           "  rts\n");
+    memset(&link_stats, 0, sizeof(LinkStats));
+    build_objects(sources, 2);
+    ASSERT(link_stats.assembled == 1 && link_stats.cached == 1,
+           "only the changed module is assembled");
+
+    u32 end = link_objects(objects, 2, DEFAULT_ORIGIN, image);
+    ASSERT(end == 0x0607 && image[0x0606] == 0x60, "linked the new module");
+  }
+
+  {
+    // an included file is part of the module that includes it.
+    write_file("/tmp/6502_link_inc.s", "  nop\n");
+    // next to the module, not the working directory.
+    write_file(sources[1], ".export helper\n"
+                           "helper:\n"
+                           ".include \"6502_link_inc.s\"\n"
+                           "  rts\n");
+    memset(&link_stats, 0, sizeof(LinkStats));
+    build_objects(sources, 2);
+    u32 end = link_objects(objects, 2, DEFAULT_ORIGIN, image);
+    ASSERT(end == 0x0608 && image[0x0606] == 0xea && image[0x0607] == 0x60,
+           "the include is spliced in");
+
+    write_file("/tmp/6502_link_inc.s", "  nop\n  nop\n");
+    memset(&link_stats, 0, sizeof(LinkStats));
+    build_objects(sources, 2);
+    ASSERT(link_stats.assembled == 1, "a changed include is a miss");
+    end = link_objects(objects, 2, DEFAULT_ORIGIN, image);
+    ASSERT(end == 0x0609, "linked with the new include");
+    remove("/tmp/6502_link_inc.s");
+  }
+
+  for (int i = 0; i < 2; i++) {
+    remove(sources[i]);
+    remove(objects[i]);
+  }
+
+  // every entry in the cache is a key and an extension.
+  DIR *d = opendir(cache);
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      char path[MODULE_PATH_LEN];
+      snprintf(path, sizeof(path), "%s/%s", cache, entry->d_name);
+      remove(path);
+    }
+  }
+  closedir(d);
+  rmdir(cache);
+  cache_dir = old_dir;
+
+  clean_ast();
+  clean_symtab();
+  clean_spans();
+  clean_macros();
+  clean_layout();
+
+  printf("\n\nDONE TESTING LINKER, SUCCESS!\n\n\n");
+}
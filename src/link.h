@@ -0,0 +1,35 @@
+#pragma once
+
+#include "defines.h"
+
+#include <sys/types.h>
+
+#define MODULES_LEN 256
+#define MODULE_PATH_LEN 512
+
+typedef struct LinkStats {
+  uint modules;
+  uint assembled; // sources that weren't in the cache.
+  uint cached;    // sources whose object came out of the cache.
+  uint bytes;
+} LinkStats;
+
+extern LinkStats link_stats;
+
+// assemble one source file on its own into a relocatable object.
+void assemble_object(const char *source_path, const char *object_path);
+
+// where the object for a source goes, foo.s -> foo.o.
+void object_path_for(const char *source_path, char *out, size_t out_len);
+
+// make sure every source has an up to date object. anything with the same
+// bytes (and includes) as something already assembled comes out of the cache,
+// the rest get assembled at the same time, one process each.
+void build_objects(char **sources, uint num_sources);
+
+// place the objects one after the other from origin, resolve everything
+// between them and write the result into image. returns one past the last
+// byte.
+u32 link_objects(char **objects, uint num_objects, u16 origin, u8 *image);
+
+void test_link();
@@ -0,0 +1,173 @@
+#include "listing.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "defines.h"
+#include "layout.h"
+#include "parse.h"
+#include "span.h"
+#include "symtab.h"
+#include "timing.h"
+#include "util.h"
+#include "writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// "0600  a9 01 __ __ ", the address and the padded out bytes column.
+#define ROW_START_LEN (4 + 2 + LISTING_ROW_BYTES * 3)
+// "4+  "
+#define CYCLES_LEN 4
+
+static void put_row_start(Writer *w, u16 address, const u8 *bytes,
+                          uint len) {
+  char *c = writer_reserve(w, ROW_START_LEN);
+  memcpy(c, hex_pairs[address >> 8], 2);
+  memcpy(c + 2, hex_pairs[address & 0xff], 2);
+  memset(c + 4, ' ', ROW_START_LEN - 4);
+  for (uint i = 0; i < len; i++) {
+    memcpy(c + 6 + i * 3, hex_pairs[bytes[i]], 2);
+  }
+  w->len += ROW_START_LEN;
+}
+
+static void put_cycles(Writer *w, LayoutEntry *e) {
+  char *c = writer_reserve(w, CYCLES_LEN);
+  memset(c, ' ', CYCLES_LEN);
+  w->len += CYCLES_LEN;
+
+  uint cycles = 0;
+  bool more = false;
+  if (e->kind == EK_INSTRUCTION) {
+    AddrMode mode = e->relaxed ? Relative : e->arg.mode;
+    cycles = instruction_cycles(e->instruction, mode);
+    more = e->operand_class == OC_BRANCH ||
+           can_cross_page(e->instruction, mode);
+  } else if (e->kind == EK_DATA && data_spans[e->span].straight) {
+    // code from a macro or a .rept, it already knows what it costs.
+    cycles = data_spans[e->span].cycles;
+  }
+  if (cycles == 0) {
+    return;
+  }
+
+  // only macros ever get past two digits.
+  char digits[8];
+  int len = snprintf(digits, sizeof(digits), "%u", cycles);
+  if (len > CYCLES_LEN - 1) {
+    len = CYCLES_LEN - 1;
+  }
+  memcpy(c, digits, len);
+  if (more) {
+    c[len] = '+';
+  }
+}
+
+static void put_source_line(Writer *w, SourcePos pos) {
+  if (pos.line == 0) {
+    return; // something the assembler made up, there's no line for it.
+  }
+  SourceFile *f = &source_files[pos.file];
+  const char *start = f->text + pos.line_start;
+  const char *end = memchr(start, '\n', f->len - pos.line_start);
+  if (end == NULL) {
+    end = f->text + f->len;
+  }
+  writer_put(w, start, end - start);
+}
+
+void list_entry(Writer *w, LayoutEntry *e, const u8 *image) {
+  u16 address = (e->kind == EK_ORG) ? e->arg.value : e->address;
+  uint len = (e->kind == EK_INSTRUCTION || e->kind == EK_DATA) ? e->size : 0;
+  const u8 *bytes = image + e->address;
+
+  uint first = (len < LISTING_ROW_BYTES) ? len : LISTING_ROW_BYTES;
+  put_row_start(w, address, bytes, first);
+  put_cycles(w, e);
+  put_source_line(w, node_pos[e->node]);
+  writer_put_char(w, '\n');
+
+  // the rest of a long entry, without the trailing padding.
+  for (uint i = first; i < len; i += LISTING_ROW_BYTES) {
+    uint row = (len - i < LISTING_ROW_BYTES) ? len - i : LISTING_ROW_BYTES;
+    put_row_start(w, address + i, bytes + i, row);
+    w->len -= ROW_START_LEN - (6 + row * 3 - 1);
+    writer_put_char(w, '\n');
+  }
+}
+
+void test_listing() {
+  printf("\n\nTESTING LISTING\n\n\n");
+
+  static u8 image[0x10000 + MAX_OPCODE_LEN];
+  static Writer w;
+
+  {
+    clean_ast();
+    clean_symtab();
+    clean_layout();
+    NodeIndex root = parse("start:\n"
+                           "  lda #$01\n"
+                           "  lda $1000,X\n"
+                           "  bne start\n"
+                           "  .byte $01, $02, $03, $04, $05\n"
+                           "  rts");
+    layout_program(root, DEFAULT_ORIGIN);
+
+    FILE *f = tmpfile();
+    ASSERT(f != NULL, "open a file for the listing");
+    writer_init(&w, fileno(f));
+    layout_listing = &w;
+    emit_layout(image);
+    layout_listing = NULL;
+    writer_flush(&w);
+
+    const char *expected = "0600                  start:\n"
+                           "0600  a9 01       2     lda #$01\n"
+                           "0602  bd 00 10    4+    lda $1000,X\n"
+                           "0605  d0 f9       2+    bne start\n"
+                           "0607  01 02 03 04       .byte $01, $02, $03, "
+                           "$04, $05\n"
+                           "060b  05\n"
+                           "060c  60          6     rts\n";
+    char buf[512] = {0};
+    lseek(fileno(f), 0, SEEK_SET);
+    ssize_t len = read(fileno(f), buf, sizeof(buf) - 1);
+    fclose(f);
+    printf("%s", buf);
+    ASSERT(len == (ssize_t)strlen(expected) && strcmp(buf, expected) == 0,
+           "listing rows for code, labels and data");
+  }
+
+  {
+    // lines from an include point back into the included file.
+    FILE *inc = fopen("/tmp/6502_listing_inc.s", "w");
+    ASSERT(inc != NULL, "write an include");
+    fputs("  nop\n", inc);
+    fclose(inc);
+
+    clean_ast();
+    clean_symtab();
+    clean_layout();
+    NodeIndex root = parse("  rts\n"
+                           ".include \"/tmp/6502_listing_inc.s\"\n"
+                           "  rts\n");
+    layout_program(root, DEFAULT_ORIGIN);
+    remove("/tmp/6502_listing_inc.s");
+
+    LayoutEntry *e = &layout[1];
+    SourcePos pos = node_pos[e->node];
+    ASSERT(e->instruction == NOP && pos.file == 1 && pos.line == 1,
+           "the nop is on line 1 of the include");
+    pos = node_pos[layout[2].node];
+    ASSERT(pos.file == 0 && pos.line == 3, "back in the main file on line 3");
+  }
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING LISTING, SUCCESS!\n\n\n");
+}
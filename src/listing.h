@@ -0,0 +1,21 @@
+#pragma once
+
+#include "defines.h"
+#include "layout.h"
+#include "writer.h"
+
+// how many encoded bytes fit on one row. anything longer carries on in rows
+// with just the address and the bytes.
+#define LISTING_ROW_BYTES 4
+
+// write the rows for one entry, right after emit_layout has encoded it into
+// image:
+//
+// 0600  a9 01       2     lda #$01
+// 0602  bd 00 10    4+    lda $1000,X
+//
+// the cycles get a + when the instruction can take longer, a taken branch or
+// an indexed read crossing a page.
+void list_entry(Writer *w, LayoutEntry *e, const u8 *image);
+
+void test_listing();
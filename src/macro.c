@@ -0,0 +1,522 @@
+#include "macro.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "defines.h"
+#include "layout.h"
+#include "lexer.h"
+#include "parse.h"
+#include "span.h"
+#include "symtab.h"
+#include "timing.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Macro macros[MACROS_LEN] = {0};
+uint num_macros = 0;
+MacroStats macro_stats = {0};
+
+// (macro, arguments) -> template.
+typedef struct CacheEntry {
+  bool used;
+  uint macro;
+  uint num_args;
+  MacroArg args[MACRO_PARAMS_LEN];
+  SpanIndex span;
+} CacheEntry;
+
+static CacheEntry cache[MACRO_CACHE_LEN] = {0};
+static uint cache_len = 0;
+
+// set while a macro's body is being encoded, so one that ends up expanding
+// itself gets caught instead of recursing forever.
+static bool expanding[MACROS_LEN] = {0};
+
+uint define_macro(char *name, char **params, uint num_params,
+                  NodeIndex body) {
+  if (num_macros >= MACROS_LEN) {
+    error("Too many macros, the limit is %d.", MACROS_LEN);
+  }
+  if (lookup_symbol(name) != NULL) {
+    error("The macro %s is defined more than once.", name);
+  }
+
+  Macro *m = &macros[num_macros];
+  m->name = name;
+  m->num_params = num_params;
+  memcpy(m->params, params, sizeof(char *) * num_params);
+  m->body = body;
+
+  insert_symbol(make_symbol(DT_MACRO, name, num_macros));
+  return num_macros++;
+}
+
+Macro *lookup_macro(char *name) {
+  Symbol *s = lookup_symbol(name);
+  if (s == NULL || s->type != DT_MACRO) {
+    return NULL;
+  }
+  return &macros[s->value];
+}
+
+// what the names in the body currently mean. macro is NULL for a .rept
+// outside of any macro, where nothing's bound.
+typedef struct Bindings {
+  Macro *macro;
+  MacroArg *args;
+} Bindings;
+
+static MacroArg *bound(Bindings *b, char *name) {
+  if (b->macro == NULL) {
+    return NULL;
+  }
+  for (uint i = 0; i < b->macro->num_params; i++) {
+    if (strcmp(b->macro->params[i], name) == 0) {
+      return &b->args[i];
+    }
+  }
+  return NULL;
+}
+
+// labels defined in one body, and the operands that use a label we might not
+// have seen yet. once the body's done, anything that isn't local is a label
+// from outside.
+typedef struct LocalLabel {
+  char *name;
+  u32 offset;
+} LocalLabel;
+
+typedef struct LabelRef {
+  char *name;
+  u32 slot;
+  u8 kind;
+} LabelRef;
+
+typedef struct BodyScope {
+  LocalLabel labels[MACRO_LABELS_LEN];
+  uint num_labels;
+  LabelRef refs[MACRO_LABELS_LEN];
+  uint num_refs;
+} BodyScope;
+
+static bool is_control(Lexeme instruction) {
+  switch (instruction) {
+  case JMP:
+  case JSR:
+  case RTS:
+  case RTI:
+  case BRK:
+    return true;
+  default:
+    return has_addrmode(instruction, Relative);
+  }
+}
+
+// the same sizing the layout pass does, except that a label is always wide
+// since nothing's been placed yet.
+static AddrMode template_mode(Lexeme instruction, AddrMode mode, bool label,
+                              u32 value) {
+  if (has_addrmode(instruction, Relative)) {
+    return Relative;
+  }
+
+  AddrMode s, l;
+  switch (mode) {
+  case ZP:
+  case Abs:
+    s = ZP;
+    l = Abs;
+    break;
+  case ZPX:
+  case AbsX:
+    s = ZPX;
+    l = AbsX;
+    break;
+  case ZPY:
+  case AbsY:
+    s = ZPY;
+    l = AbsY;
+    break;
+  default: {
+    if (!has_addrmode(instruction, mode)) {
+      error("%s can't be used with addressing mode %d.",
+            instruction_to_string(instruction), mode);
+    }
+    if (label && mode != Indirect && mode != Implicit) {
+      error("%s in a macro needs a number here, not a label.",
+            instruction_to_string(instruction));
+    }
+    if (!label && mode == Immediate && value > 0xff) {
+      error("The immediate operand for %s doesn't fit in a byte.",
+            instruction_to_string(instruction));
+    }
+    return mode;
+  }
+  }
+
+  if (!label && value < 256 && has_addrmode(instruction, s)) {
+    return s;
+  }
+  if (has_addrmode(instruction, l)) {
+    return l;
+  }
+  error("%s has no addressing mode that fits its operand.",
+        instruction_to_string(instruction));
+}
+
+static void encode_instruction(DataSpan *out, BodyScope *scope, Bindings *b,
+                               NodeIndex n_idx) {
+  Node n = ast[n_idx];
+  Lexeme instruction = (Lexeme)n.data.as_raw_data;
+  Arg arg = ast[n.left].data.as_arg;
+  NodeIndex id = ast[n.left].left;
+  char *name = (id != NULL_INDEX) ? (char *)ast[id].data.as_ptr : NULL;
+
+  if (name != NULL) {
+    MacroArg *a = bound(b, name);
+    if (a != NULL) {
+      name = a->name;
+      arg.value = a->value;
+    }
+  }
+
+  arg.mode = template_mode(instruction, arg.mode, name != NULL, arg.value);
+  u32 target = arg.value;
+  if (name != NULL || arg.mode == Relative) {
+    arg.value = 0; // filled in by a fixup.
+  }
+
+  u8 encoded[MAX_OPCODE_LEN] = {0};
+  make_opcode(arg, instruction, encoded);
+
+  u32 at = out->len;
+  u8 len = addrmode_len_table[arg.mode];
+  memcpy(span_reserve(out, len), encoded, len);
+
+  u8 kind = (arg.mode == Relative) ? FX_BRANCH : FX_WORD;
+  if (name != NULL) {
+    if (scope->num_refs >= MACRO_LABELS_LEN) {
+      error("Too many label operands in one macro body.");
+    }
+    scope->refs[scope->num_refs++] =
+        (LabelRef){.name = name, .slot = at + 1, .kind = kind};
+  } else if (arg.mode == Relative) {
+    span_add_fixup(out, (DataFixup){.offset = at + 1,
+                                    .addend = target,
+                                    .kind = FX_BRANCH});
+  }
+
+  out->cycles += instruction_cycles(instruction, arg.mode) +
+                 can_cross_page(instruction, arg.mode);
+  if (is_control(instruction)) {
+    out->straight = false;
+  }
+}
+
+// now that every label in the body is known, sort out what the operands were
+// pointing at.
+static void resolve_refs(DataSpan *out, BodyScope *scope) {
+  for (uint i = 0; i < scope->num_refs; i++) {
+    LabelRef r = scope->refs[i];
+
+    LocalLabel *local = NULL;
+    for (uint j = 0; j < scope->num_labels; j++) {
+      if (strcmp(scope->labels[j].name, r.name) == 0) {
+        local = &scope->labels[j];
+        break;
+      }
+    }
+
+    if (local == NULL) {
+      span_add_fixup(out, (DataFixup){.offset = r.slot,
+                                      .name = r.name,
+                                      .kind = r.kind});
+    } else if (r.kind == FX_BRANCH) {
+      // branches inside the body don't care where it's placed.
+      int offset = (int)local->offset - (int)(r.slot + 1);
+      if (offset < -128 || offset > 127) {
+        error("The branch to %s in a macro body is out of range.", r.name);
+      }
+      out->bytes[r.slot] = (u8)offset;
+    } else {
+      span_add_fixup(out, (DataFixup){.offset = r.slot,
+                                      .addend = local->offset,
+                                      .kind = FX_WORD,
+                                      .based = true});
+    }
+  }
+}
+
+static void encode_body(DataSpan *out, NodeIndex list, Bindings *b);
+
+static void encode_call(DataSpan *out, Bindings *b, MacroCall *call) {
+  // the arguments might be the outer macro's parameters.
+  MacroArg args[MACRO_PARAMS_LEN];
+  for (uint i = 0; i < call->num_args; i++) {
+    args[i] = call->args[i];
+    if (args[i].name != NULL) {
+      MacroArg *a = bound(b, args[i].name);
+      if (a != NULL) {
+        args[i] = *a;
+      }
+    }
+  }
+
+  SpanIndex s = expand_macro(call->macro, args, call->num_args);
+  span_append(out, &data_spans[s]);
+}
+
+static void encode_rept(DataSpan *out, Bindings *b, NodeIndex body,
+                        uint count) {
+  DataSpan once = {.straight = true};
+  encode_body(&once, body, b);
+  for (uint i = 0; i < count; i++) {
+    span_append(out, &once);
+  }
+  span_free(&once);
+}
+
+static void encode_body(DataSpan *out, NodeIndex list, Bindings *b) {
+  BodyScope *scope = calloc(1, sizeof(BodyScope));
+
+  while (list != NULL_INDEX) {
+    NodeIndex s_idx = ast[list].left;
+    Node statement = ast[s_idx];
+
+    switch (statement.type) {
+    case NT_INSTRUCTION: {
+      encode_instruction(out, scope, b, s_idx);
+    } break;
+
+    case NT_LABEL: {
+      if (scope->num_labels >= MACRO_LABELS_LEN) {
+        error("Too many labels in one macro body.");
+      }
+      scope->labels[scope->num_labels++] = (LocalLabel){
+          .name = (char *)ast[statement.left].data.as_ptr, .offset = out->len};
+    } break;
+
+    case NT_DATA: {
+      span_append(out, &data_spans[statement.data.as_raw_data]);
+      out->straight = false;
+    } break;
+
+    case NT_MACRO_CALL: {
+      encode_call(out, b, (MacroCall *)statement.data.as_ptr);
+    } break;
+
+    case NT_REPT: {
+      encode_rept(out, b, statement.left, statement.data.as_raw_data);
+    } break;
+
+    case NT_PRAGMA: {
+      error("Only data, .rept and other macros can go in a macro body.");
+    } break;
+
+    default: {
+    } break;
+    }
+
+    list = ast[list].right;
+  }
+
+  resolve_refs(out, scope);
+  free(scope);
+}
+
+static u32 hash_args(uint macro, MacroArg *args, uint num_args) {
+  // fnv-1a over the macro and every argument.
+  u32 h = 2166136261u;
+  h = (h ^ macro) * 16777619u;
+  for (uint i = 0; i < num_args; i++) {
+    if (args[i].name != NULL) {
+      for (char *c = args[i].name; *c; c++) {
+        h = (h ^ (u8)*c) * 16777619u;
+      }
+    } else {
+      h = (h ^ args[i].value) * 16777619u;
+    }
+  }
+  return h;
+}
+
+static bool same_args(CacheEntry *c, uint macro, MacroArg *args,
+                      uint num_args) {
+  if (c->macro != macro || c->num_args != num_args) {
+    return false;
+  }
+  for (uint i = 0; i < num_args; i++) {
+    MacroArg x = c->args[i];
+    MacroArg y = args[i];
+    if ((x.name == NULL) != (y.name == NULL)) {
+      return false;
+    }
+    if (x.name != NULL ? strcmp(x.name, y.name) != 0 : x.value != y.value) {
+      return false;
+    }
+  }
+  return true;
+}
+
+SpanIndex expand_macro(uint macro, MacroArg *args, uint num_args) {
+  Macro *m = &macros[macro];
+  if (num_args != m->num_params) {
+    error("The macro %s takes %u arguments, not %u.", m->name, m->num_params,
+          num_args);
+  }
+  macro_stats.expansions++;
+
+  u32 slot = hash_args(macro, args, num_args) & (MACRO_CACHE_LEN - 1);
+  while (cache[slot].used) {
+    if (same_args(&cache[slot], macro, args, num_args)) {
+      macro_stats.cache_hits++;
+      return cache[slot].span;
+    }
+    slot = (slot + 1) & (MACRO_CACHE_LEN - 1);
+  }
+
+  if (expanding[macro]) {
+    error("The macro %s ends up expanding itself.", m->name);
+  }
+  expanding[macro] = true;
+
+  // encode into a span on the stack, the nested expansions can add more spans
+  // to the table while we're going.
+  Bindings b = {.macro = m, .args = args};
+  DataSpan encoded = {.straight = true};
+  encode_body(&encoded, m->body, &b);
+
+  SpanIndex s = new_span();
+  data_spans[s] = encoded;
+  expanding[macro] = false;
+  macro_stats.templates++;
+
+  // past 3/4 full the probes get long, just stop caching new ones.
+  if (cache_len < MACRO_CACHE_LEN / 4 * 3) {
+    CacheEntry *c = &cache[slot];
+    c->used = true;
+    c->macro = macro;
+    c->num_args = num_args;
+    memcpy(c->args, args, sizeof(MacroArg) * num_args);
+    c->span = s;
+    cache_len++;
+  }
+
+  return s;
+}
+
+SpanIndex expand_rept(NodeIndex body, uint count) {
+  Bindings b = {0};
+  DataSpan encoded = {.straight = true};
+  encode_rept(&encoded, &b, body, count);
+
+  SpanIndex s = new_span();
+  data_spans[s] = encoded;
+  return s;
+}
+
+void print_macro_stats() {
+  MacroStats st = macro_stats;
+  printf("macros: %u expansions, %u from the cache, %u templates encoded\n",
+         st.expansions, st.cache_hits, st.templates);
+}
+
+void clean_macros() {
+  num_macros = 0;
+  cache_len = 0;
+  memset(&macro_stats, 0, sizeof(MacroStats));
+  memset(cache, 0, sizeof(cache));
+  memset(expanding, 0, sizeof(expanding));
+}
+
+void test_macros() {
+  printf("\n\nTESTING MACROS\n\n\n");
+
+  static u8 image[0x10000 + MAX_OPCODE_LEN];
+
+  {
+    clean_ast();
+    clean_symtab();
+    clean_spans();
+    clean_macros();
+    NodeIndex root = parse(".macro store value, dest\n"
+                           "  lda #value\n"
+                           "  sta dest\n"
+                           ".endm\n"
+                           ".macro wait count\n"
+                           "  ldx #count\n"
+                           "spin:\n"
+                           "  dex\n"
+                           "  bne spin\n"
+                           ".endm\n"
+                           ".macro twice dest\n"
+                           "again:\n"
+                           "  store $01, dest\n"
+                           "  jmp again\n"
+                           ".endm\n"
+                           "start:\n"
+                           "  store $01, $10\n"
+                           "  store $01, $10\n"
+                           "  store $02, $1234\n"
+                           "  wait $05\n"
+                           ".rept 3\n"
+                           "  inx\n"
+                           ".endr\n"
+                           "  twice $10\n"
+                           "  twice $10\n"
+                           "  store $03, start\n");
+    NodeIndex nodes = ast_len;
+    layout_program(root, DEFAULT_ORIGIN);
+
+    // the second store $01, $10 and everything in the second twice come
+    // straight from the cache.
+    ASSERT(macro_stats.expansions == 8, "every expansion is counted");
+    ASSERT(macro_stats.cache_hits == 3, "repeated expansions hit the cache");
+    ASSERT(macro_stats.templates == 5, "one template per argument tuple");
+
+    memset(image, 0, sizeof(image));
+    emit_layout(image);
+
+    ASSERT(memcmp(image + 0x0600, "\xa9\x01\x85\x10\xa9\x01\x85\x10", 8) == 0,
+           "zero page store from the template");
+    ASSERT(memcmp(image + 0x0608, "\xa9\x02\x8d\x34\x12", 5) == 0,
+           "absolute store from another template");
+    ASSERT(memcmp(image + 0x060d, "\xa2\x05\xca\xd0\xfd", 5) == 0,
+           "local branch in a template");
+    ASSERT(memcmp(image + 0x0612, "\xe8\xe8\xe8", 3) == 0, ".rept");
+    // each twice jumps back to its own copy of the label.
+    ASSERT(memcmp(image + 0x0619, "\x4c\x15\x06", 3) == 0,
+           "local label relocated to the first expansion");
+    ASSERT(memcmp(image + 0x0620, "\x4c\x1c\x06", 3) == 0,
+           "local label relocated to the second expansion");
+    ASSERT(memcmp(image + 0x0623, "\xa9\x03\x8d\x00\x06", 5) == 0,
+           "outside label as a macro argument");
+
+    // unrolling a lot more doesn't cost any more nodes.
+    clean_ast();
+    clean_symtab();
+    clean_spans();
+    clean_macros();
+    parse(".macro store value, dest\n"
+          "  lda #value\n"
+          "  sta dest\n"
+          ".endm\n"
+          ".rept 1000\n"
+          "  store $01, $10\n"
+          ".endr\n");
+    ASSERT(ast_len < nodes, "unrolled macro stays small in the ast");
+    ASSERT(macro_stats.templates == 1, "unrolled macro encoded once");
+  }
+
+  clean_ast();
+  clean_symtab();
+  clean_spans();
+  clean_macros();
+  clean_layout();
+
+  printf("\n\nDONE TESTING MACROS, SUCCESS!\n\n\n");
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ast.h"
+#include "defines.h"
+#include "span.h"
+
+#include <sys/types.h>
+
+#define MACROS_LEN 256
+#define MACRO_PARAMS_LEN 8
+// how many labels and label operands one macro body can have.
+#define MACRO_LABELS_LEN 256
+// power of two, it's an open addressed hash table.
+#define MACRO_CACHE_LEN 1024
+
+// one argument to a macro, either a number or the name of a label.
+typedef struct MacroArg {
+  char *name; // NULL for numbers.
+  u32 value;
+} MacroArg;
+
+typedef struct Macro {
+  char *name;
+  char *params[MACRO_PARAMS_LEN];
+  uint num_params;
+  NodeIndex body; // statement list, parsed once when the macro's defined.
+} Macro;
+
+// a call inside another macro's body. those can't be expanded until the outer
+// macro is, since the arguments might be the outer macro's parameters.
+typedef struct MacroCall {
+  uint macro;
+  uint num_args;
+  MacroArg args[MACRO_PARAMS_LEN];
+} MacroCall;
+
+typedef struct MacroStats {
+  uint expansions;
+  uint cache_hits;
+  uint templates; // how many bodies actually had to be encoded.
+} MacroStats;
+
+extern Macro macros[MACROS_LEN];
+extern uint num_macros;
+extern MacroStats macro_stats;
+
+uint define_macro(char *name, char **params, uint num_params, NodeIndex body);
+// NULL if there's no macro called name.
+Macro *lookup_macro(char *name);
+
+// the pre-encoded template for the macro with these arguments. every
+// expansion with the same arguments shares the same span, the only thing that
+// changes per expansion is where it gets placed, and the fixups take care of
+// that.
+//
+// labels from outside the body are always encoded as absolute addresses, since
+// the template is built before anything is placed. labels inside the body are
+// local to each expansion.
+SpanIndex expand_macro(uint macro, MacroArg *args, uint num_args);
+
+// the body encoded once and copied count times.
+SpanIndex expand_rept(NodeIndex body, uint count);
+
+void print_macro_stats();
+void clean_macros();
+
+void test_macros();
@@ -1,16 +1,43 @@
+#include "assembler.h"
 #include "ast.h"
+#include "bank.h"
+#include "cache.h"
 #include "cglm/types.h"
+#include "condition.h"
+#include "core.h"
+#include "coverage.h"
 #include "defines.h"
+#include "disasm.h"
+#include "history.h"
+#include "image.h"
+#include "layout.h"
 #include "interpret.h"
+#include "jit.h"
 #include "lexer.h"
+#include "link.h"
+#include "listing.h"
+#include "macro.h"
+#include "map.h"
 #include "mempool.h"
+#include "object.h"
 #include "parse.h"
 #include "path.h"
+#include "peephole.h"
+#include "profile.h"
+#include "pool.h"
+#include "recompile.h"
+#include "record.h"
+#include "run.h"
+#include "span.h"
 #include "symtab.h"
+#include "timing.h"
+#include "trace.h"
 #include "util.h"
 #include "visit.h"
+#include "writer.h"
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <ncurses.h>
 #include <signal.h>
 #include <stdio.h>
@@ -18,24 +45,702 @@
 #include <string.h>
 
 #include <time.h>
+#include <unistd.h>
 
 // clean up the ast state for the next run through.
 void clean() {
   clean_ast();
   clean_symtab();
+  clean_layout();
+  clean_spans();
+  clean_macros();
+  clean_exports();
+  clean_dependencies();
+}
+
+// the source and the assembled 64k address space for the command line modes.
+// the image has a little slack at the end, since make_opcode always fills whole
+// opcodes.
+static char source_buffer[INPUT_LEN] = {0};
+static u8 image[0x10000 + MAX_OPCODE_LEN] = {0};
+
+// read, parse, lay out and encode a whole source file into the image. the
+// peephole pass only runs if it's asked for.
+static void assemble_file(const char *path, bool optimize) {
+  size_t len = read_into_buf(path, source_buffer, INPUT_LEN - 1);
+  source_buffer[len] = '\0';
+
+  parse_path = path;
+  NodeIndex root = parse(source_buffer);
+  parse_path = NULL;
+  layout_program(root, DEFAULT_ORIGIN);
+  if (optimize) {
+    peephole_optimize();
+  }
+  emit_layout(image);
+}
+
+// asm disasm <file.bin> [origin] [-s prog.s]
+// dump the disassembly of a raw binary to stdout. -s assembles the source the
+// binary came from first, so the addresses with labels print as the labels.
+static int disasm_main(int argc, char *argv[]) {
+  u16 origin = 0;
+  const char *source_path = NULL;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      source_path = argv[++i];
+    } else {
+      origin = (u16)strtoul(argv[i], NULL, 0);
+    }
+  }
+
+  if (source_path != NULL) {
+    debug_output = false;
+    assemble_file(source_path, false);
+    disasm_load_labels();
+  }
+
+  static Writer out;
+  writer_init(&out, STDOUT_FILENO);
+  disasm_file(argv[2], &out, origin);
+  return 0;
+}
+
+// asm build <prog.s> [-o out.bin] [-O] [-t routine] [-l out.lst]
+//                    [--emit-c out.c]
+// --emit-c also writes the program out as C, see recompile.h. a program with
+// .bank in it has the banks after the 64k part, BANK_SIZE each in bank order.
+static int build_main(int argc, char *argv[]) {
+  // stdout is just the stats, without the lexer and parser chatter.
+  debug_output = false;
+  const char *out_path = "out.bin";
+  const char *listing_path = NULL;
+  const char *c_path = NULL;
+  bool optimize = false;
+  char *timed_routine = NULL;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (strcmp(argv[i], "-O") == 0) {
+      optimize = true;
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      timed_routine = argv[++i];
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      listing_path = argv[++i];
+    } else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+      c_path = argv[++i];
+    }
+  }
+
+  // the listing comes out of the encoder as it goes.
+  static Writer listing;
+  int listing_fd = -1;
+  if (listing_path != NULL) {
+    listing_fd = open(listing_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (listing_fd < 0) {
+      perror(listing_path);
+      return 1;
+    }
+    writer_init(&listing, listing_fd);
+    layout_listing = &listing;
+  }
+
+  assemble_file(argv[2], optimize);
+
+  if (listing_fd >= 0) {
+    writer_flush(&listing);
+    close(listing_fd);
+    layout_listing = NULL;
+  }
+
+  FILE *out = fopen(out_path, "wb");
+  if (out == NULL) {
+    perror(out_path);
+    return 1;
+  }
+  fwrite(image + layout_origin, 1, layout_end - layout_origin, out);
+  if (layout_banks > 0) {
+    fwrite(layout_bank_image, BANK_SIZE, layout_banks, out);
+  }
+  fclose(out);
+
+  print_layout_stats();
+  if (macro_stats.expansions > 0) {
+    print_macro_stats();
+  }
+  if (optimize) {
+    print_peephole_stats();
+  }
+  if (timed_routine != NULL) {
+    build_blocks();
+    print_timing(timed_routine);
+  }
+  if (c_path != NULL) {
+    int fd = open(c_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror(c_path);
+      return 1;
+    }
+    static Writer c_out;
+    writer_init(&c_out, fd);
+    emit_c(&c_out, image, argv[2]);
+    writer_flush(&c_out);
+    close(fd);
+  }
+  return 0;
+}
+
+// a --break or a --watch: an address or a label, then maybe " if " and a
+// condition (see condition.h).
+static void set_stop(Core *c, Conditions *conds, WatchKind kind, char *spec) {
+  char *cond = strstr(spec, " if ");
+  if (cond != NULL) {
+    *cond = '\0';
+    cond += strlen(" if ");
+  }
+
+  // labels only exist once the program's been assembled.
+  u16 address;
+  Symbol *s = lookup_symbol(spec);
+  if (s != NULL && s->type == DT_INT) {
+    address = s->value;
+  } else if (isdigit(spec[0])) {
+    address = strtoul(spec, NULL, 0);
+  } else {
+    error("There's no label %s to put a %s on.", spec,
+          (kind == WK_EXECUTE) ? "breakpoint" : "watchpoint");
+  }
+
+  if (kind == WK_EXECUTE) {
+    set_breakpoint(c, address);
+  } else {
+    set_watchpoint(c, address, kind);
+  }
+  if (cond != NULL) {
+    add_condition(conds, kind, address, cond);
+    c->conditions = conds;
+  }
+}
+
+// the pages a --rom or a --mirror covers, it has to be whole ones.
+static void range_pages(MemoryRange r, u8 *page, uint *count) {
+  if ((r.start & 0xff) != 0 || (r.end & 0xff) != 0) {
+    error("The map works in whole pages, $%04x-$%04x doesn't start and end "
+          "on one.",
+          r.start, r.end);
+  }
+  *page = r.start >> 8;
+  *count = (r.end - r.start) >> 8;
+}
+
+static void console_write(void *ctx, u16 address, u8 value) {
+  fputc(value, stderr);
+}
+
+// --rom, --mirror and --console, in the order they were given.
+static void add_to_map(MemoryMap *map, Core *c, const char *option,
+                       char *spec) {
+  static Device console = {NULL, console_write, NULL};
+  u8 page;
+  uint count;
+  if (strcmp(option, "--rom") == 0) {
+    MemoryRange r = parse_memory_range(spec);
+    range_pages(r, &page, &count);
+    map_rom(map, page, count, &c->memory[r.start]);
+  } else if (strcmp(option, "--mirror") == 0) {
+    // start:end=from, the pages from from up to start over and over.
+    char *from = strchr(spec, '=');
+    if (from == NULL) {
+      error("Expected start:end=from for a mirror, found \"%s\".", spec);
+    }
+    *from++ = '\0';
+    MemoryRange r = parse_memory_range(spec);
+    range_pages(r, &page, &count);
+    u32 source = strtoul(from, NULL, 0);
+    if ((source & 0xff) != 0 || source >= r.start) {
+      error("A mirror's from has to be a page before its start, not %s.",
+            from);
+    }
+    map_mirror(map, page, count, source >> 8, page - (source >> 8));
+  } else {
+    map_device(map, strtoul(spec, NULL, 0) >> 8, 1, &console);
+  }
+}
+
+// asm run <prog.s> [--max-cycles N] [--max-instructions N] [--break addr]...
+//                  [--watch addr]... [--watch-read addr]...
+//                  [--dump-state json|text] [--dump-mem start:end]... [--stats]
+//                  [--no-cache | --jit] [--record log] [--trace out]
+//                  [--profile] [--folded out] [--coverage out]
+//                  [--history MB] [--step-back N] [--reverse-continue]
+//                  [--rom start:end]... [--mirror start:end=from]...
+//                  [--console addr]...
+// assemble, run from the origin up to a BRK, a breakpoint or a budget and
+// print the final state, without a terminal. --max-cycles 0 takes the cap off.
+// breakpoints can be addresses or labels, --watch stops right after a write
+// to one and --watch-read after a read. any of them can have a condition on
+// the end, like --break "loop if X==#$10". --no-cache decodes every instruction
+// as it goes instead of keeping them, --jit compiles the hot blocks to native
+// code. --record writes a log that asm replay can run again, --trace a row
+// for every instruction (see trace.h), which is as slow as --no-cache.
+// --profile prints where the cycles went to stderr, and --folded writes the
+// call stacks for a flame graph (see profile.h). --coverage writes which
+// lines ran as an lcov tracefile (see coverage.h) and doesn't use the JIT.
+// --history keeps the last MB megabytes of what every instruction changed,
+// on the --no-cache loop (see history.h). with it, --reverse-continue goes
+// back from where the run stopped to the breakpoint or watched write before
+// it, then --step-back undoes N more instructions, and the state's dumped
+// from there. either of them keeps 16MB if --history doesn't say.
+// --rom, --mirror and --console run it through a page table (see map.h) on
+// the --no-cache loop: --rom makes whole pages read only, --mirror repeats
+// the pages from from up to start through the range, like "0x0800:0x2000=0"
+// for 2k of RAM through $1fff, and --console prints every byte written to
+// addr's page to stderr. a program with .bank in it gets the map too, with
+// bank 0 in the window to start with (see bank.h).
+// exits with 0 if it got to the BRK and 2 if it stopped for anything else.
+static int run_main(int argc, char *argv[]) {
+  static MemoryRange ranges[DUMP_RANGES_LEN];
+  static char *breaks[64];
+  static WatchKind break_kinds[64];
+  static char *maps[64];
+  static const char *map_options[64];
+  uint num_maps = 0;
+  uint num_ranges = 0, num_breaks = 0;
+  RunBudget budget = {.cycles = DEFAULT_MAX_CYCLES};
+  bool json = false;
+  bool stats = false;
+  bool plain = false;
+  bool use_jit = false;
+  const char *record_path = NULL;
+  const char *trace_path = NULL;
+  const char *folded_path = NULL;
+  const char *coverage_path = NULL;
+  bool profile = false;
+  size_t history_mb = 0;
+  u64 step_back = 0;
+  bool reverse_continue = false;
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) {
+      budget.cycles = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc) {
+      budget.instructions = strtoull(argv[++i], NULL, 0);
+    } else if ((strcmp(argv[i], "--break") == 0 ||
+                strcmp(argv[i], "--watch") == 0 ||
+                strcmp(argv[i], "--watch-read") == 0) &&
+               i + 1 < argc) {
+      if (num_breaks >= 64) {
+        error("Too many breakpoints and watchpoints, the limit is 64.");
+      }
+      break_kinds[num_breaks] = (strcmp(argv[i], "--break") == 0) ? WK_EXECUTE
+                                : (strcmp(argv[i], "--watch") == 0)
+                                    ? WK_WRITE
+                                    : WK_READ;
+      breaks[num_breaks++] = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--no-cache") == 0) {
+      plain = true;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      use_jit = true;
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) {
+      folded_path = argv[++i];
+    } else if (strcmp(argv[i], "--coverage") == 0 && i + 1 < argc) {
+      coverage_path = argv[++i];
+    } else if ((strcmp(argv[i], "--rom") == 0 ||
+                strcmp(argv[i], "--mirror") == 0 ||
+                strcmp(argv[i], "--console") == 0) &&
+               i + 1 < argc) {
+      if (num_maps >= 64) {
+        error("Too many --rom, --mirror and --console, the limit is 64.");
+      }
+      map_options[num_maps] = argv[i];
+      maps[num_maps++] = argv[++i];
+    } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+      history_mb = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--step-back") == 0 && i + 1 < argc) {
+      step_back = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--reverse-continue") == 0) {
+      reverse_continue = true;
+    } else if (strcmp(argv[i], "--dump-state") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "json") == 0) {
+        json = true;
+      } else if (strcmp(argv[i], "text") != 0) {
+        error("--dump-state is either json or text, not %s.", argv[i]);
+      }
+    } else if (strcmp(argv[i], "--dump-mem") == 0 && i + 1 < argc) {
+      if (num_ranges >= DUMP_RANGES_LEN) {
+        error("Too many --dump-mem ranges, the limit is %d.", DUMP_RANGES_LEN);
+      }
+      ranges[num_ranges++] = parse_memory_range(argv[++i]);
+    }
+  }
+
+  // stdout is only the state dump from here on.
+  debug_output = false;
+  assemble_file(argv[2], false);
+
+  static Machine m;
+  machine_init(&m);
+  m.plain = plain;
+  static Jit jit;
+  if (use_jit && !plain && !jit_attach(&jit, &m.core)) {
+    fprintf(stderr, "No JIT on this machine, interpreting instead.\n");
+  }
+  static Conditions conds;
+  for (uint i = 0; i < num_breaks; i++) {
+    set_stop(&m.core, &conds, break_kinds[i], breaks[i]);
+  }
+
+  load_image(&m, image, layout_origin, layout_end);
+  machine_reset(&m, layout_origin);
+  static MemoryMap map;
+  static Banks banks;
+  if (num_maps > 0 || layout_banks > 0) {
+    map_init(&map, m.core.memory);
+    if (layout_banks > 0) {
+      banks_init(&banks, &map, layout_bank_image, layout_banks);
+    }
+    for (uint i = 0; i < num_maps; i++) {
+      add_to_map(&map, &m.core, map_options[i], maps[i]);
+    }
+    m.core.map = &map;
+  }
+
+  static Recorder recorder;
+  int record_fd = -1;
+  if (record_path != NULL) {
+    record_fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (record_fd < 0) {
+      error("Could not open %s to record to.", record_path);
+    }
+    record_start(&recorder, &m.core, (layout_banks > 0) ? &banks : NULL,
+                 record_fd);
+  }
+  static Trace trace;
+  int trace_fd = -1;
+  if (trace_path != NULL) {
+    trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0) {
+      error("Could not open %s to trace to.", trace_path);
+    }
+    trace_open(&trace, trace_fd);
+    m.trace = &trace;
+  }
+  static Profile prof;
+  if (profile || folded_path != NULL) {
+    profile_init(&prof, m.core.pc);
+    m.profile = &prof;
+  }
+  static Coverage cov;
+  if (coverage_path != NULL) {
+    m.core.coverage = &cov;
+  }
+  if (history_mb == 0 && (step_back > 0 || reverse_continue)) {
+    history_mb = 16;
+  }
+  static History history;
+  if (history_mb > 0) {
+    history_init(&history, history_mb << 20);
+    m.core.history = &history;
+  }
+  StopReason reason = machine_run(&m, budget);
+  if (record_fd >= 0) {
+    record_finish(&recorder, reason);
+    close(record_fd);
+  }
+  if (trace_fd >= 0) {
+    trace_close(&trace);
+    close(trace_fd);
+  }
+  if (reverse_continue) {
+    m.reason = core_reverse_continue(&m.core);
+  }
+  if (step_back > 0) {
+    u64 stepped = core_step_back(&m.core, step_back);
+    fprintf(stderr, "stepped back %lu instructions\n", (unsigned long)stepped);
+  }
+
+  static Writer out;
+  writer_init(&out, STDOUT_FILENO);
+  if (json) {
+    dump_state_json(&out, &m, ranges, num_ranges);
+  } else {
+    dump_state_text(&out, &m, ranges, num_ranges);
+  }
+  writer_flush(&out);
+
+  if (stats || profile) {
+    static Writer err;
+    writer_init(&err, STDERR_FILENO);
+    if (stats) {
+      print_run_stats(&err, &m);
+    }
+    if (profile) {
+      profile_report(&err, &prof, 20);
+    }
+    writer_flush(&err);
+  }
+  if (folded_path != NULL) {
+    int fd = open(folded_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      error("Could not open %s for the folded stacks.", folded_path);
+    }
+    static Writer folded;
+    writer_init(&folded, fd);
+    profile_write_folded(&folded, &prof);
+    writer_flush(&folded);
+    close(fd);
+  }
+  if (coverage_path != NULL) {
+    int fd = open(coverage_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      error("Could not open %s for the coverage.", coverage_path);
+    }
+    static Writer lcov;
+    writer_init(&lcov, fd);
+    CoverageStats stats = coverage_write_lcov(&lcov, &cov, "asm", argv[2]);
+    writer_flush(&lcov);
+    close(fd);
+    fprintf(stderr, "coverage: %u/%u lines, %u bytes read, %u written\n",
+            stats.lines_hit, stats.lines, coverage_count(cov.read),
+            coverage_count(cov.written));
+  }
+
+  return (m.reason == SR_BRK) ? 0 : 2;
+}
+
+// asm replay <log> [--dump-state json|text] [--dump-mem start:end]...
+// run a log from asm run --record again and print the state it ends in, like
+// asm run does. the log brings its own --rom, --mirror, --console and banks,
+// with what the devices read back then. exits with 0 if that's the state the
+// recording ended in and 1 if it isn't.
+static int replay_main(int argc, char *argv[]) {
+  static MemoryRange ranges[DUMP_RANGES_LEN];
+  uint num_ranges = 0;
+  bool json = false;
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--dump-state") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "json") == 0) {
+        json = true;
+      } else if (strcmp(argv[i], "text") != 0) {
+        error("--dump-state is either json or text, not %s.", argv[i]);
+      }
+    } else if (strcmp(argv[i], "--dump-mem") == 0 && i + 1 < argc) {
+      if (num_ranges >= DUMP_RANGES_LEN) {
+        error("Too many --dump-mem ranges, the limit is %d.", DUMP_RANGES_LEN);
+      }
+      ranges[num_ranges++] = parse_memory_range(argv[++i]);
+    }
+  }
+
+  static Machine m;
+  machine_init(&m);
+  bool matched = replay_file(&m.core, argv[2], &m.reason);
+
+  static Writer out;
+  writer_init(&out, STDOUT_FILENO);
+  if (json) {
+    dump_state_json(&out, &m, ranges, num_ranges);
+  } else {
+    dump_state_text(&out, &m, ranges, num_ranges);
+  }
+  writer_flush(&out);
+
+  if (!matched) {
+    fprintf(stderr, "The replay didn't end where the recording did.\n");
+  }
+  return matched ? 0 : 1;
+}
+
+// asm trace <file>
+// print a trace from asm run --trace, a line per row. for looking at, the
+// reader in trace.h is for anything that has a lot of rows to get through.
+static int trace_main(int argc, char *argv[]) {
+  static TraceReader r;
+  static Writer out;
+  writer_init(&out, STDOUT_FILENO);
+  trace_reader_open(&r, argv[2], TRACE_ALL_COLUMNS);
+  while (trace_next_chunk(&r)) {
+    for (uint i = 0; i < r.rows; i++) {
+      u16 *row[TC_COUNT];
+      for (uint c = 0; c < TC_COUNT; c++) {
+        row[c] = &r.columns[c][i];
+      }
+      writer_put_char(&out, '$');
+      writer_put_hex16(&out, *row[TC_PC]);
+      writer_put_str(&out, "  ");
+      writer_put_hex8(&out, *row[TC_OPCODE]);
+      writer_put_str(&out, "  a: $");
+      writer_put_hex8(&out, *row[TC_A]);
+      writer_put_str(&out, "  x: $");
+      writer_put_hex8(&out, *row[TC_X]);
+      writer_put_str(&out, "  y: $");
+      writer_put_hex8(&out, *row[TC_Y]);
+      writer_put_str(&out, "  sp: $");
+      writer_put_hex8(&out, *row[TC_SP]);
+      writer_put_str(&out, "  p: $");
+      writer_put_hex8(&out, *row[TC_P]);
+      writer_put_str(&out, "  +");
+      writer_put_u64(&out, *row[TC_CYCLES]);
+      if (*row[TC_ACCESS] != TA_NONE) {
+        writer_put_str(&out, "  ");
+        writer_put_str(&out, trace_access_to_string(*row[TC_ACCESS]));
+        writer_put_str(&out, " $");
+        writer_put_hex16(&out, *row[TC_ADDRESS]);
+        writer_put_str(&out, " = $");
+        writer_put_hex8(&out, *row[TC_VALUE]);
+      }
+      writer_put_char(&out, '\n');
+    }
+  }
+  trace_reader_close(&r);
+  writer_flush(&out);
+  return 0;
+}
+
+static bool has_suffix(const char *s, const char *suffix) {
+  size_t len = strlen(s), suffix_len = strlen(suffix);
+  return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+// asm link <module.s|module.o>... [-o out.bin] [--origin N] [--cache dir]
+// sources are assembled into objects next to them unless the cache already
+// has them, all at once, then everything's linked in the order it was given.
+static int link_main(int argc, char *argv[]) {
+  // stdout is just the stats, the modules' chatter would bury them.
+  debug_output = false;
+  static char *sources[MODULES_LEN];
+  static char *objects[MODULES_LEN];
+  static char object_paths[MODULES_LEN][MODULE_PATH_LEN];
+  uint num_sources = 0, num_objects = 0;
+
+  const char *out_path = "out.bin";
+  u16 origin = DEFAULT_ORIGIN;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (strcmp(argv[i], "--origin") == 0 && i + 1 < argc) {
+      origin = (u16)strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (num_objects >= MODULES_LEN) {
+      error("Too many modules, the limit is %d.", MODULES_LEN);
+    } else if (has_suffix(argv[i], ".o")) {
+      objects[num_objects++] = argv[i];
+    } else {
+      object_path_for(argv[i], object_paths[num_objects], MODULE_PATH_LEN);
+      objects[num_objects] = object_paths[num_objects];
+      num_objects++;
+      sources[num_sources++] = argv[i];
+    }
+  }
+
+  // wall time, the modules are assembled in other processes.
+  struct timespec start, stop;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  build_objects(sources, num_sources);
+  u32 end = link_objects(objects, num_objects, origin, image);
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  double ms = (stop.tv_sec - start.tv_sec) * 1000.0 +
+              (stop.tv_nsec - start.tv_nsec) / 1e6;
+
+  FILE *out = fopen(out_path, "wb");
+  if (out == NULL) {
+    perror(out_path);
+    return 1;
+  }
+  fwrite(image + origin, 1, end - origin, out);
+  fclose(out);
+
+  printf("link: %u modules, %u assembled, %u cached, %u bytes in %.2fms\n",
+         link_stats.modules + (num_objects - num_sources),
+         link_stats.assembled, link_stats.cached, link_stats.bytes, ms);
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
   // common initialization, we'll always use the mempool.
   mempool_init();
+  init_decode_table();
 
 #ifdef TESTING
   test_lexer();
   test_parse();
   test_util();
+  test_disasm();
+  test_layout();
+  test_peephole();
+  test_timing();
+  test_spans();
+  test_macros();
+  test_listing();
+  test_cache();
+  test_link();
+  test_core();
+  test_jit();
+  test_recompile();
+  test_pool();
+  test_image();
+  test_record();
+  test_trace();
+  test_profile();
+  test_coverage();
+  test_condition();
+  test_history();
+  test_map();
+  test_bank();
+  test_run();
   return 0;
 #endif /* ifdef TESTING */
 
+#ifdef BENCH
+  bench_disasm();
+  bench_core();
+  bench_pool();
+  bench_image();
+  bench_trace();
+  bench_coverage();
+  bench_condition();
+  bench_history();
+  bench_map();
+  bench_bank();
+  return 0;
+#endif /* ifdef BENCH */
+
+  if (argc >= 3 && strcmp(argv[1], "disasm") == 0) {
+    return disasm_main(argc, argv);
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "build") == 0) {
+    return build_main(argc, argv);
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "link") == 0) {
+    return link_main(argc, argv);
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "run") == 0) {
+    return run_main(argc, argv);
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+    return replay_main(argc, argv);
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "trace") == 0) {
+    return trace_main(argc, argv);
+  }
+
   init_interpreter();
 
   // Initialize ncurses
@@ -0,0 +1,212 @@
+#include "map.h"
+
+#include "assembler.h"
+#include "core.h"
+#include "defines.h"
+#include "history.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void check_pages(u8 page, uint count) {
+  if (count == 0 || page + count > 0x100) {
+    error("Pages $%02x and the %u after it don't fit in the 64k.", page,
+          count - 1);
+  }
+}
+
+void map_init(MemoryMap *m, u8 *memory) {
+  memset(m, 0, sizeof(MemoryMap));
+  map_ram(m, 0, 0x100, memory);
+}
+
+void map_ram(MemoryMap *m, u8 page, uint count, u8 *bytes) {
+  check_pages(page, count);
+  for (uint i = 0; i < count; i++) {
+    m->read[page + i] = m->write[page + i] = bytes + (i << 8);
+    m->devices[page + i] = NULL;
+  }
+}
+
+void map_rom(MemoryMap *m, u8 page, uint count, const u8 *bytes) {
+  check_pages(page, count);
+  for (uint i = 0; i < count; i++) {
+    // never written through, the writes go in the sink.
+    m->read[page + i] = (u8 *)bytes + (i << 8);
+    m->write[page + i] = m->sink;
+    m->devices[page + i] = NULL;
+  }
+}
+
+void map_mirror(MemoryMap *m, u8 page, uint count, u8 from, uint span) {
+  check_pages(page, count);
+  check_pages(from, span);
+  for (uint i = 0; i < count; i++) {
+    u8 to = page + i, src = from + i % span;
+    m->read[to] = m->read[src];
+    m->write[to] = m->write[src];
+    m->devices[to] = m->devices[src];
+  }
+}
+
+void map_device(MemoryMap *m, u8 page, uint count, Device *d) {
+  check_pages(page, count);
+  for (uint i = 0; i < count; i++) {
+    if (d->read != NULL) {
+      m->read[page + i] = NULL;
+    }
+    if (d->write != NULL) {
+      m->write[page + i] = NULL;
+    }
+    m->devices[page + i] = d;
+  }
+}
+
+// a timer that counts reads and a port that keeps what was last written to
+// it, for the test.
+typedef struct TestDevice {
+  uint reads;
+  uint writes;
+  u8 last;
+} TestDevice;
+
+static u8 test_read(void *ctx, u16 address) {
+  TestDevice *t = ctx;
+  return ++t->reads;
+}
+
+static void test_write(void *ctx, u16 address, u8 value) {
+  TestDevice *t = ctx;
+  t->writes++;
+  t->last = value;
+}
+
+void test_map() {
+  printf("\n\nTESTING MAP\n\n\n");
+
+  static Core flat, c;
+  static MemoryMap m;
+  static History h;
+  static u8 rom[0x100];
+
+  // ldx #$00, loop: txa, sta $0000,X, sta $d000, inx, cpx #$10, bne loop,
+  // lda $0805, sta $f010, lda $f010, ldy $d000, ldy $d000, jsr sub, brk,
+  // sub: rts.
+  u8 program[] = {0xa2, 0x00, 0x8a, 0x9d, 0x00, 0x00, 0x8d, 0x00, 0xd0,
+                  0xe8, 0xe0, 0x10, 0xd0, 0xf4, 0xad, 0x05, 0x08, 0x8d,
+                  0x10, 0xf0, 0xad, 0x10, 0xf0, 0xac, 0x00, 0xd0, 0xac,
+                  0x00, 0xd0, 0x20, 0x21, 0x06, 0x00, 0x60};
+
+  // a map of every page onto the core's own memory runs the same as none.
+  core_init(&flat);
+  core_load(&flat, program, 0x0600, sizeof(program));
+  core_reset(&flat, 0x0600);
+  core_run(&flat, (RunBudget){0});
+  core_init(&c);
+  map_init(&m, c.memory);
+  c.map = &m;
+  core_load(&c, program, 0x0600, sizeof(program));
+  core_reset(&c, 0x0600);
+  StopReason r = core_run(&c, (RunBudget){0});
+  ASSERT(r == SR_BRK && c.a == flat.a && c.x == flat.x && c.y == flat.y &&
+             c.pc == flat.pc && c.cycles == flat.cycles &&
+             memcmp(c.memory, flat.memory, sizeof(c.memory)) == 0,
+         "a flat map runs the same as no map");
+
+  // 2k of RAM through $1fff, ROM at $f000 and a device on $d000.
+  static TestDevice dev;
+  Device d = {test_read, test_write, &dev};
+  memset(&dev, 0, sizeof(dev));
+  memset(rom, 0x5a, sizeof(rom));
+  core_init(&c);
+  map_init(&m, c.memory);
+  map_mirror(&m, 0x08, 0x18, 0x00, 0x08);
+  map_rom(&m, 0xf0, 1, rom);
+  map_device(&m, 0xd0, 1, &d);
+  c.map = &m;
+  core_load(&c, program, 0x0600, sizeof(program));
+  core_reset(&c, 0x0600);
+  r = core_run_plain(&c, (RunBudget){0});
+  ASSERT(r == SR_BRK, "runs to the brk through the map");
+  ASSERT(c.memory[0x0805] == 0 && core_peek(&c, 0x1805) == 5,
+         "a mirror reads the RAM under it");
+  ASSERT(rom[0x10] == 0x5a && m.sink[0x10] == 5 && c.a == 0x5a,
+         "a store to ROM goes nowhere");
+  ASSERT(dev.writes == 16 && dev.last == 15 && dev.reads == 2 && c.y == 2,
+         "and the device hears about every access to its page");
+  ASSERT(c.memory[0x01fd] == 0x06 && c.memory[0x01fc] == 0x1f,
+         "the stack's still RAM");
+
+  core_write(&c, 0x1003, 0x77);
+  ASSERT(c.memory[0x0003] == 0x77, "writes from outside go through it too");
+
+  // a history undoes the stores through the mirror, and leaves the device.
+  history_init(&h, 1 << 16);
+  c.history = &h;
+  core_reset(&c, 0x0600);
+  memset(c.memory, 0xee, 0x10);
+  uint writes = dev.writes;
+  core_run_observed(&c, (RunBudget){0}, NULL, NULL);
+  ASSERT(c.memory[0x0004] == 4 && dev.writes == writes + 16,
+         "ran again keeping a history");
+  core_step_back(&c, 1000);
+  ASSERT(c.memory[0x0004] == 0xee && c.memory[0x000f] == 0xee &&
+             c.pc == 0x0600,
+         "and stepped back over the stores");
+  c.history = NULL;
+  history_free(&h);
+
+  printf("\n\nDONE TESTING MAP, SUCCESS!\n\n\n");
+}
+
+// ldy #$00, outer: ldx #$00, loop: lda $0300,X, sta $0200,X, inx, bne loop,
+// dey, bne outer, brk.
+static const u8 map_program[] = {0xa0, 0x00, 0xa2, 0x00, 0xbd, 0x00,
+                                 0x03, 0x9d, 0x00, 0x02, 0xe8, 0xd0,
+                                 0xf7, 0x88, 0xd0, 0xf2, 0x00};
+
+#define BENCH_MAP_RUNS 200
+
+static double bench_runs(MemoryMap *m, bool plain) {
+  static Core c;
+  core_init(&c);
+  if (m != NULL) {
+    map_init(m, c.memory);
+    // the stores land on a mirror, which costs the same as anything else.
+    map_mirror(m, 0x02, 1, 0x04, 1);
+    c.map = m;
+  }
+  core_load(&c, map_program, 0x0600, sizeof(map_program));
+
+  struct timespec start, end;
+  u64 instructions = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < BENCH_MAP_RUNS; i++) {
+    core_reset(&c, 0x0600);
+    if (plain) {
+      core_run_plain(&c, (RunBudget){0});
+    } else {
+      core_run(&c, (RunBudget){0});
+    }
+    instructions += c.instructions;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return instructions / seconds / 1e6;
+}
+
+void bench_map() {
+  init_decode_table();
+
+  static MemoryMap m;
+  double cached = bench_runs(NULL, false);
+  double plain = bench_runs(NULL, true);
+  double mapped = bench_runs(&m, false);
+  printf("map: %.1f MIPS cached, %.1f MIPS plain, %.1f MIPS through a page "
+         "table (%.0f%% of plain)\n",
+         cached, plain, mapped, mapped / plain * 100);
+}
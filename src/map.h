@@ -0,0 +1,64 @@
+#pragma once
+
+#include "defines.h"
+#include "pragma.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// a page table over the 64k, one entry for each 256 byte page. an entry points
+// straight at the bytes behind the page, or hands the access to a device. the
+// read and the write side are separate, so a page can be ROM (the writes go in
+// a page nothing reads) or RAM with a register that only listens to writes.
+// hang one off Core.map and the runs go through it instead of Core.memory,
+// which is what map_init points every page at to start with.
+
+typedef struct Device {
+  // either can be NULL, and that side of the page is left how it was.
+  u8 (*read)(void *ctx, u16 address);
+  void (*write)(void *ctx, u16 address, u8 value);
+  void *ctx;
+} Device;
+
+typedef struct MemoryMap {
+  // NULL where a device has the page.
+  u8 *read[0x100];
+  u8 *write[0x100];
+  Device *devices[0x100];
+  u8 sink[0x100]; // where writes to ROM go.
+} MemoryMap;
+
+// every page RAM, at the same page of memory.
+void map_init(MemoryMap *m, u8 *memory);
+// count pages from page, onto the count * 256 bytes at bytes.
+void map_ram(MemoryMap *m, u8 page, uint count, u8 *bytes);
+void map_rom(MemoryMap *m, u8 page, uint count, const u8 *bytes);
+// count pages from page get the entries of the span pages from from, over and
+// over, like the 2k of RAM through $1fff on the NES.
+void map_mirror(MemoryMap *m, u8 page, uint count, u8 from, uint span);
+// d has to last as long as the map does.
+void map_device(MemoryMap *m, u8 page, uint count, Device *d);
+
+static inline ALWAYS_INLINE u8 map_read(const MemoryMap *m, u16 address) {
+  const u8 *page = m->read[address >> 8];
+  if (UNLIKELY(page == NULL)) {
+    Device *d = m->devices[address >> 8];
+    return d->read(d->ctx, address);
+  }
+  return page[address & 0xff];
+}
+
+static inline ALWAYS_INLINE void map_write(const MemoryMap *m, u16 address,
+                                           u8 value) {
+  u8 *page = m->write[address >> 8];
+  if (UNLIKELY(page == NULL)) {
+    Device *d = m->devices[address >> 8];
+    d->write(d->ctx, address, value);
+    return;
+  }
+  page[address & 0xff] = value;
+}
+
+void test_map();
+void bench_map();
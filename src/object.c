@@ -0,0 +1,270 @@
+#include "object.h"
+
+#include "assembler.h"
+#include "defines.h"
+#include "layout.h"
+#include "span.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// for relocations that don't name a label.
+#define NO_NAME 0xffffffff
+
+static char *exports[EXPORTS_LEN];
+static uint num_exports = 0;
+
+void export_symbol(char *name) {
+  for (uint i = 0; i < num_exports; i++) {
+    if (strcmp(exports[i], name) == 0) {
+      return;
+    }
+  }
+  if (num_exports >= EXPORTS_LEN) {
+    error("Too many exports, the limit is %d.", EXPORTS_LEN);
+  }
+  exports[num_exports++] = name;
+}
+
+void clean_exports() { num_exports = 0; }
+
+// labels from this module get turned into offsets from the start of the
+// module, anything else is left for the linker to look up.
+static void add_relocation(Object *o, DataFixup f) {
+  Symbol *s = (f.name != NULL) ? lookup_symbol(f.name) : NULL;
+  if (s != NULL && s->type == DT_INT) {
+    f.name = NULL;
+    f.addend += s->value;
+    f.based = true;
+  }
+  span_add_fixup(&o->code, f);
+}
+
+void object_from_layout(Object *o) {
+  static u8 image[0x10000 + MAX_OPCODE_LEN];
+
+  memset(o, 0, sizeof(Object));
+
+  // everything this module knows about is already right at origin 0, the
+  // relocations only have to say what moves.
+  memset(image, 0, layout_end);
+  emit_layout(image);
+  memcpy(span_reserve(&o->code, layout_end), image, layout_end);
+
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+
+    if (e->kind == EK_DATA) {
+      DataSpan *d = &data_spans[e->span];
+      for (uint f = 0; f < d->num_fixups; f++) {
+        DataFixup fx = d->fixups[f];
+        fx.offset += e->address;
+        if (fx.based) {
+          // relative to the span, and the span's relative to the module.
+          fx.addend += e->address;
+        }
+        add_relocation(o, fx);
+      }
+      continue;
+    }
+
+    if (e->kind != EK_INSTRUCTION || e->name == NULL) {
+      continue;
+    }
+
+    Symbol *s = lookup_symbol(e->name);
+    bool local = s != NULL && s->type == DT_INT;
+
+    DataFixup fx = {.offset = e->address + 1, .name = e->name};
+    if (e->relaxed) {
+      // the JMP after the inverted branch holds the real target.
+      fx.offset = e->address + 3;
+      add_relocation(o, fx);
+    } else if (e->operand_class == OC_BRANCH) {
+      // a branch inside the module moves along with its target.
+      if (!local) {
+        fx.kind = FX_BRANCH;
+        add_relocation(o, fx);
+      }
+    } else {
+      add_relocation(o, fx);
+    }
+  }
+
+  o->exports = malloc(sizeof(ObjectExport) * (num_exports + 1));
+  for (uint i = 0; i < num_exports; i++) {
+    Symbol *s = lookup_symbol(exports[i]);
+    if (s == NULL || s->type != DT_INT) {
+      error("The module exports %s, but never defines it.", exports[i]);
+    }
+    o->exports[o->num_exports++] =
+        (ObjectExport){.name = exports[i], .offset = s->value};
+  }
+}
+
+static void put_u32(FILE *f, u32 v) {
+  u8 b[4] = {v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24};
+  fwrite(b, 1, 4, f);
+}
+
+static void put_u16(FILE *f, u16 v) {
+  u8 b[2] = {v & 0xff, v >> 8};
+  fwrite(b, 1, 2, f);
+}
+
+static u32 get_u32(const u8 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static u16 get_u16(const u8 *p) { return p[0] | (p[1] << 8); }
+
+#define HEADER_LEN (8 + 4 * 5)
+#define EXPORT_LEN 8
+#define RELOCATION_LEN 12
+
+void write_object(const char *path, Object *o) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    error("Could not open %s to write the object.", path);
+  }
+
+  // names go into the string table in the order they're written, so the
+  // offsets can be worked out on the way.
+  u32 strings_len = 0;
+  for (uint i = 0; i < o->num_exports; i++) {
+    strings_len += strlen(o->exports[i].name) + 1;
+  }
+  for (uint i = 0; i < o->code.num_fixups; i++) {
+    if (o->code.fixups[i].name != NULL) {
+      strings_len += strlen(o->code.fixups[i].name) + 1;
+    }
+  }
+
+  char magic[8] = OBJECT_MAGIC;
+  fwrite(magic, 1, 8, f);
+  put_u32(f, OBJECT_VERSION);
+  put_u32(f, o->code.len);
+  put_u32(f, o->num_exports);
+  put_u32(f, o->code.num_fixups);
+  put_u32(f, strings_len);
+
+  fwrite(o->code.bytes, 1, o->code.len, f);
+
+  u32 name = 0;
+  for (uint i = 0; i < o->num_exports; i++) {
+    put_u32(f, name);
+    put_u32(f, o->exports[i].offset);
+    name += strlen(o->exports[i].name) + 1;
+  }
+
+  for (uint i = 0; i < o->code.num_fixups; i++) {
+    DataFixup fx = o->code.fixups[i];
+    put_u32(f, fx.offset);
+    put_u32(f, fx.name != NULL ? name : NO_NAME);
+    put_u16(f, fx.addend);
+    fputc(fx.kind, f);
+    fputc(fx.based, f);
+    if (fx.name != NULL) {
+      name += strlen(fx.name) + 1;
+    }
+  }
+
+  for (uint i = 0; i < o->num_exports; i++) {
+    fwrite(o->exports[i].name, 1, strlen(o->exports[i].name) + 1, f);
+  }
+  for (uint i = 0; i < o->code.num_fixups; i++) {
+    if (o->code.fixups[i].name != NULL) {
+      char *n = o->code.fixups[i].name;
+      fwrite(n, 1, strlen(n) + 1, f);
+    }
+  }
+
+  if (fclose(f) != 0) {
+    error("Could not finish writing the object %s.", path);
+  }
+}
+
+void read_object(const char *path, Object *o) {
+  memset(o, 0, sizeof(Object));
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    error("Could not open the object %s.", path);
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  u8 *buf = malloc(len > 0 ? len : 1);
+  if (fread(buf, 1, len, f) != (size_t)len) {
+    error("Could not read the object %s.", path);
+  }
+  fclose(f);
+
+  if (len < HEADER_LEN || memcmp(buf, OBJECT_MAGIC, 8) != 0 ||
+      get_u32(buf + 8) != OBJECT_VERSION) {
+    error("%s isn't an object file from this assembler.", path);
+  }
+
+  u32 code_len = get_u32(buf + 12);
+  u32 num_exports = get_u32(buf + 16);
+  u32 num_relocations = get_u32(buf + 20);
+  u32 strings_len = get_u32(buf + 24);
+
+  u64 expected = (u64)HEADER_LEN + code_len + (u64)num_exports * EXPORT_LEN +
+                 (u64)num_relocations * RELOCATION_LEN + strings_len;
+  if (code_len > 0x10000 || expected != (u64)len) {
+    error("The object %s is cut off or corrupt.", path);
+  }
+
+  const u8 *p = buf + HEADER_LEN;
+  memcpy(span_reserve(&o->code, code_len), p, code_len);
+  p += code_len;
+
+  const u8 *exports_at = p;
+  const u8 *relocations_at = exports_at + num_exports * EXPORT_LEN;
+  const u8 *strings_at = relocations_at + num_relocations * RELOCATION_LEN;
+
+  // keep the strings around, everything's going to point into them.
+  o->strings = malloc(strings_len + 1);
+  memcpy(o->strings, strings_at, strings_len);
+  o->strings[strings_len] = '\0';
+
+  o->exports = malloc(sizeof(ObjectExport) * (num_exports + 1));
+  for (uint i = 0; i < num_exports; i++) {
+    const u8 *x = exports_at + i * EXPORT_LEN;
+    u32 name = get_u32(x);
+    if (name >= strings_len) {
+      error("The object %s has a bad export name.", path);
+    }
+    o->exports[o->num_exports++] =
+        (ObjectExport){.name = o->strings + name, .offset = get_u32(x + 4)};
+  }
+
+  for (uint i = 0; i < num_relocations; i++) {
+    const u8 *r = relocations_at + i * RELOCATION_LEN;
+    u32 name = get_u32(r + 4);
+    DataFixup fx = {.offset = get_u32(r),
+                    .name = (name == NO_NAME) ? NULL : o->strings + name,
+                    .addend = get_u16(r + 8),
+                    .kind = r[10],
+                    .based = r[11]};
+    if ((name != NO_NAME && name >= strings_len) ||
+        fx.offset + (fx.kind == FX_WORD ? 2 : 1) > code_len) {
+      error("The object %s has a bad relocation.", path);
+    }
+    span_add_fixup(&o->code, fx);
+  }
+
+  free(buf);
+}
+
+void free_object(Object *o) {
+  span_free(&o->code);
+  free(o->exports);
+  free(o->strings);
+  memset(o, 0, sizeof(Object));
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "defines.h"
+#include "span.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define OBJECT_MAGIC "6502OBJ"
+#define OBJECT_VERSION 1
+#define EXPORTS_LEN 1024
+
+typedef struct ObjectExport {
+  char *name;
+  u16 offset; // from the start of the module's code.
+} ObjectExport;
+
+// one assembled module. the code is assembled as if it starts at 0, and its
+// fixups are the relocation records: based ones get the module's final
+// address added, named ones are labels from other modules.
+typedef struct Object {
+  DataSpan code;
+  ObjectExport *exports;
+  uint num_exports;
+  char *strings; // every name in a loaded object points in here.
+} Object;
+
+// .export adds a label to the list the module makes visible to the linker.
+// everything else stays private to the module.
+void export_symbol(char *name);
+void clean_exports();
+
+// turn the program laid out with layout_relocatable into an object.
+void object_from_layout(Object *o);
+
+// the file is a header, the code, the exports, the relocations and then the
+// strings, all little endian.
+void write_object(const char *path, Object *o);
+void read_object(const char *path, Object *o);
+void free_object(Object *o);
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "core.h"
+#include "defines.h"
+
+#include <sys/types.h>
+
+// what the instructions do to the registers and flags, shared by the core's
+// loops and the C that asm build --emit-c writes out. nothing in here touches
+// memory, so it only needs core.h for the flag bits.
+
+static inline u8 nz(u8 v, u8 *p) {
+  *p = (*p & ~(FLAG_N | FLAG_Z)) | (v & FLAG_N) | (v ? 0 : FLAG_Z);
+  return v;
+}
+
+static inline u8 asl(u8 v, u8 *p) {
+  *p = (*p & ~FLAG_C) | (v >> 7);
+  return nz(v << 1, p);
+}
+
+static inline u8 lsr(u8 v, u8 *p) {
+  *p = (*p & ~FLAG_C) | (v & 1);
+  return nz(v >> 1, p);
+}
+
+static inline u8 rol(u8 v, u8 *p) {
+  u8 carry = *p & FLAG_C;
+  *p = (*p & ~FLAG_C) | (v >> 7);
+  return nz((v << 1) | carry, p);
+}
+
+static inline u8 ror(u8 v, u8 *p) {
+  u8 carry = *p & FLAG_C;
+  *p = (*p & ~FLAG_C) | (v & 1);
+  return nz((v >> 1) | (carry << 7), p);
+}
+
+static inline u8 inc(u8 v, u8 *p) { return nz(v + 1, p); }
+static inline u8 dec(u8 v, u8 *p) { return nz(v - 1, p); }
+
+// decimal mode works like the NMOS part: z comes from the binary sum, n and v
+// from the sum before the high digit is adjusted.
+static inline u8 adc(u8 a, u8 v, u8 *p) {
+  uint carry = *p & FLAG_C;
+  *p &= ~(FLAG_C | FLAG_Z | FLAG_V | FLAG_N);
+
+  if (*p & FLAG_D) {
+    uint lo = (a & 0x0f) + (v & 0x0f) + carry;
+    if (lo > 9) {
+      lo += 6;
+    }
+    uint hi = (a >> 4) + (v >> 4) + (lo > 0x0f);
+    u8 half = (hi << 4) | (lo & 0x0f);
+    *p |= ((u8)(a + v + carry) ? 0 : FLAG_Z) | (half & FLAG_N) |
+          ((~(a ^ v) & (a ^ half) & 0x80) ? FLAG_V : 0);
+    if (hi > 9) {
+      hi += 6;
+    }
+    *p |= (hi > 0x0f) ? FLAG_C : 0;
+    return (hi << 4) | (lo & 0x0f);
+  }
+
+  uint sum = a + v + carry;
+  *p |= ((sum > 0xff) ? FLAG_C : 0) |
+        ((~(a ^ v) & (a ^ sum) & 0x80) ? FLAG_V : 0);
+  return nz(sum, p);
+}
+
+// the flags always come from the binary difference.
+static inline u8 sbc(u8 a, u8 v, u8 *p) {
+  uint borrow = !(*p & FLAG_C);
+  uint diff = a - v - borrow;
+  *p &= ~(FLAG_C | FLAG_V);
+  *p |= ((diff < 0x100) ? FLAG_C : 0) |
+        (((a ^ v) & (a ^ diff) & 0x80) ? FLAG_V : 0);
+  nz(diff, p);
+
+  if (*p & FLAG_D) {
+    int lo = (a & 0x0f) - (v & 0x0f) - (int)borrow;
+    int hi = (a >> 4) - (v >> 4);
+    if (lo < 0) {
+      lo -= 6;
+      hi--;
+    }
+    if (hi < 0) {
+      hi -= 6;
+    }
+    return (hi << 4) | (lo & 0x0f);
+  }
+  return diff;
+}
+
+static inline void compare(u8 r, u8 v, u8 *p) {
+  *p = (*p & ~FLAG_C) | ((r >= v) ? FLAG_C : 0);
+  nz(r - v, p);
+}
@@ -2,9 +2,13 @@
 
 #include "arguments.h"
 #include "ast.h"
+#include "cache.h"
 #include "cpu.h"
 #include "defines.h"
 #include "lexer.h"
+#include "macro.h"
+#include "object.h"
+#include "span.h"
 #include "util.h"
 
 #include <ctype.h>
@@ -45,7 +49,7 @@ static NodeIndex term(Lexer *l) {
   NodeIndex second_term = NULL_INDEX;
   Lexeme cl = l->curr_token.type;
   while (cl == MUL || cl == DIV) {
-    printf("New expr term: '%c'\n", l->curr_char);
+    DEBUG_PRINTF("New expr term: '%c'\n", l->curr_char);
     BinopType bt = binop_from_lexeme(cl);
 
     if (cl == MUL) {
@@ -73,7 +77,7 @@ static NodeIndex expr(Lexer *l) {
   NodeIndex second_term = NULL_INDEX;
   Lexeme cl = l->curr_token.type;
   while (cl == ADD || cl == SUB) {
-    printf("New expr term: '%c'\n", l->curr_char);
+    DEBUG_PRINTF("New expr term: '%c'\n", l->curr_char);
     BinopType bt = binop_from_lexeme(cl);
 
     if (cl == ADD) {
@@ -124,8 +128,12 @@ static NodeIndex empty(Lexer *l) {
 // interpreter.
 static NodeIndex argument(Lexer *l) {
   Lexeme cl = l->curr_token.type;
-  Arg a; // fill this arg from the stack, we're going to use all 64 bits of it
-         // and put it in the argument node for easy parsing.
+  Arg a = {0}; // fill this arg from the stack, we're going to use all 64 bits
+               // of it and put it in the argument node for easy parsing.
+
+  // if the operand is a label instead of a literal, the ID node goes here and
+  // the layout pass fills in the value and the final ZP/Abs mode.
+  NodeIndex label_id = NULL_INDEX;
 
   switch (cl) {
   // immediate handling
@@ -133,8 +141,13 @@ static NodeIndex argument(Lexer *l) {
     // literal 8 bit value
     a.mode = Immediate;
     eat(l, HASHTAG);
-    a.value = l->curr_token.value;
-    eat(l, HEX_LITERAL);
+    if (l->curr_token.type == ID) {
+      // mostly for macro parameters, a label has to be in the zero page.
+      label_id = id(l);
+    } else {
+      a.value = l->curr_token.value;
+      eat(l, HEX_LITERAL);
+    }
   } break;
 
   // determine the ZP and Abs submodes
@@ -207,12 +220,17 @@ static NodeIndex argument(Lexer *l) {
   case LPAREN: {
     eat(l, LPAREN);
 
-    a.value =
-        l->curr_token
-            .value; // operate generically over the value, it's just a hex
-                    // literal no matter which weird indirect mode we find here.
+    if (l->curr_token.type == ID) {
+      // the pointer is a label, let the layout pass figure out where it is.
+      label_id = id(l);
+    } else {
+      a.value =
+          l->curr_token.value; // operate generically over the value, it's just
+                               // a hex literal no matter which weird indirect
+                               // mode we find here.
 
-    eat(l, HEX_LITERAL);
+      eat(l, HEX_LITERAL);
+    }
     cl = l->curr_token.type;
 
     switch (cl) {
@@ -241,15 +259,31 @@ static NodeIndex argument(Lexer *l) {
   } break;
 
   case ID: {
-    // a label passed in as an argument.
-    eat(l, ID);
+    // a label passed in as an argument. we can't know if it's ZP or Abs until
+    // the layout pass knows where the label is, so just assume the widest mode
+    // for now.
+    label_id = id(l);
+    a.mode = Abs;
+
+    if (l->curr_token.type == COMMA) {
+      eat(l, COMMA);
+      char *id = (char *)l->curr_token.value;
+
+      if (strncmp(id, "X", 1) == 0) {
+        a.mode = AbsX;
+      } else if (strncmp(id, "Y", 1) == 0) {
+        a.mode = AbsY;
+      }
+
+      eat(l, ID);
+    }
   } break;
 
   case NEWLINE: {
     // implicit addressing, no explicit args were found at the cursor right
-    // after the instruction.
+    // after the instruction. leave the NEWLINE for the statement_list to eat,
+    // or it'll think the program ends here.
     a.mode = Implicit; // gah! why are these not all uppercase! i suck!
-    eat(l, NEWLINE);
   } break;
 
   // this is similar to the newline case, but when it's a blank instruction at
@@ -266,12 +300,349 @@ static NodeIndex argument(Lexer *l) {
 
   // parse out an ID, and just put that in the left slot.
   return add_node(
-      make_node(NT_ARGUMENT, NULL_INDEX, NULL_INDEX, (NodeData){.as_arg = a}));
+      make_node(NT_ARGUMENT, label_id, NULL_INDEX, (NodeData){.as_arg = a}));
 }
 
 static NodeIndex statement_list(Lexer *l);
+static NodeIndex statement(Lexer *l);
+
+// how deep into .macro and .rept bodies we are. a macro call in a body has to
+// wait until the body is encoded, everywhere else it's expanded right away.
+static uint body_depth = 0;
+
+const char *parse_path = NULL;
+
+// where the path in an .include or .incbin in l's file points, in out. a
+// relative one goes from the directory of the file it's written in, so it
+// doesn't matter where the assembler was run from.
+static void resolve_path(Lexer *l, const char *path, char *out) {
+  const char *from = source_files[l->file].path;
+  if (from == NULL) {
+    from = parse_path;
+  }
+  const char *slash = (from != NULL) ? strrchr(from, '/') : NULL;
+  size_t dir_len = (path[0] != '/' && slash != NULL) ? slash - from + 1 : 0;
+  if (dir_len + strlen(path) >= CACHE_PATH_LEN) {
+    error("The path %s is too long.", path);
+  }
+  memcpy(out, from, dir_len);
+  strcpy(out + dir_len, path);
+}
+
+// how deep the .includes go, so one including itself is an error and not a
+// stack overflow.
+#define INCLUDE_DEPTH 16
+static uint include_depth = 0;
+
+static Lexer *new_lexer(const char *text, u16 file) {
+  Lexer *l = (Lexer *)calloc(
+      1, sizeof(Lexer)); // pass through the lexer manually and calloc that, so
+                         // everything past the end of the text reads as a
+                         // NULL. TODO: is there a better way to place the lexer
+                         // in memory?
+
+  // use the actual string length and not the buffer length to do the EOF
+  // check.
+  l->text_len = strlen(text);
+  if (l->text_len >= INPUT_LEN) {
+    error("The program is too long, the limit is %d characters.", INPUT_LEN - 1);
+  }
+  l->pos = -1; // set to -1, the init next() call will put it at 0.
+  l->curr_token.type = EMPTY;
+
+  // only copy the real text, the caller's buffer might be a lot shorter than
+  // INPUT_LEN.
+  memcpy(l->text, text, l->text_len);
+  l->file = file;
+  l->line = 1;
+  next(l);
+  return l;
+}
+
+// parse another file with its own lexer. the statements get spliced into the
+// including list by statement_list.
+static NodeIndex include(Lexer *including, const char *name) {
+  if (include_depth >= INCLUDE_DEPTH) {
+    error("Includes nested more than %d deep, does %s include itself?",
+          INCLUDE_DEPTH, name);
+  }
+
+  // kept for the file's own includes and the listing, like the text.
+  char *path = malloc(CACHE_PATH_LEN);
+  resolve_path(including, name, path);
+
+  char *text = malloc(INPUT_LEN);
+  size_t len = read_into_buf(path, text, INPUT_LEN - 1);
+  text[len] = '\0';
+  note_dependency(path, text, len);
+
+  // the text stays around for listings, clean_ast frees it.
+  Lexer *l = new_lexer(text, add_source_file(path, text, true));
+  include_depth++;
+  NodeIndex list = statement_list(l);
+  include_depth--;
+
+  if (l->curr_token.type != EMPTY) {
+    error("Extra garbage at the end of %s, found %s.", path,
+          lexeme_to_string(l->curr_token.type));
+  }
+  free(l);
+  return list;
+}
+
+// a plain number literal, in any of the bases the lexer knows.
+static u64 literal(Lexer *l) {
+  Lexeme cl = l->curr_token.type;
+  if (cl != INT_LITERAL && cl != HEX_LITERAL && cl != BINARY_LITERAL) {
+    error("Expected a number, found %s.", lexeme_to_string(cl));
+  }
+
+  u64 value = l->curr_token.value;
+  eat(l, cl);
+  return value;
+}
+
+static NodeIndex number(Lexer *l) {
+  return add_node(make_node(NT_NUMBER, NULL_INDEX, NULL_INDEX,
+                            (NodeData){.as_raw_data = literal(l)}));
+}
+
+// .byte/.word a, b, c...
+// the whole list goes into one span, however long it is.
+static NodeIndex data_list(Lexer *l, bool words) {
+  SpanIndex s = new_span();
+
+  while (1) {
+    if (l->curr_token.type == ID) {
+      if (!words) {
+        error("Labels only fit in a .word, not a .byte.");
+      }
+      span_push_label(s, (char *)l->curr_token.value);
+      eat(l, ID);
+    } else {
+      u64 value = literal(l);
+      if (value > (words ? 0xffff : 0xff)) {
+        error("%lu doesn't fit in a .%s.", (unsigned long)value,
+              words ? "word" : "byte");
+      }
+      if (words) {
+        span_push_word(s, value);
+      } else {
+        span_push(s, value);
+      }
+    }
+
+    if (l->curr_token.type != COMMA) {
+      break;
+    }
+    eat(l, COMMA);
+  }
+
+  return add_node(
+      make_node(NT_DATA, NULL_INDEX, NULL_INDEX, (NodeData){.as_raw_data = s}));
+}
+
+// the statements up to the .endm or .endr, as a statement list.
+static NodeIndex body(Lexer *l, PragmaType end) {
+  const char *end_name = (end == PR_ENDM) ? ".endm" : ".endr";
+  NodeIndex head = NULL_INDEX;
+  NodeIndex tail = NULL_INDEX;
+
+  body_depth++;
+  while (1) {
+    if (l->curr_token.type == EMPTY) {
+      error("The program ends before the %s.", end_name);
+    }
+
+    NodeIndex s = statement(l);
+    if (ast[s].type == NT_PRAGMA) {
+      PragmaType p = ast[s].data.as_raw_data;
+      if (p == end) {
+        break;
+      } else if (p == PR_ENDM || p == PR_ENDR) {
+        error("Expected %s before the end of another body.", end_name);
+      }
+    }
+
+    // build the list front to back, it's the same shape statement_list makes.
+    NodeIndex item =
+        add_node(make_node(NT_STATEMENT_LIST, s, NULL_INDEX, NO_NODE_DATA));
+    if (tail == NULL_INDEX) {
+      head = item;
+    } else {
+      ast[tail].right = item;
+    }
+    tail = item;
 
-static NodeIndex pragma(Lexer *l) { return NULL_INDEX; }
+    if (l->curr_token.type == NEWLINE) {
+      eat(l, NEWLINE);
+    } else if (l->curr_token.type != EMPTY) {
+      error("Extra garbage after a statement in a body, found %s.",
+            lexeme_to_string(l->curr_token.type));
+    }
+  }
+  body_depth--;
+
+  return head;
+}
+
+// name [arg, arg...]
+static NodeIndex macro_call(Lexer *l) {
+  char *name = (char *)l->curr_token.value;
+  eat(l, ID);
+
+  MacroCall call = {.macro = lookup_macro(name) - macros};
+  while (l->curr_token.type != NEWLINE && l->curr_token.type != EMPTY) {
+    if (call.num_args >= MACRO_PARAMS_LEN) {
+      error("Too many arguments to %s.", name);
+    }
+
+    if (l->curr_token.type == ID) {
+      call.args[call.num_args++] =
+          (MacroArg){.name = (char *)l->curr_token.value};
+      eat(l, ID);
+    } else {
+      call.args[call.num_args++] = (MacroArg){.value = literal(l)};
+    }
+
+    if (l->curr_token.type != COMMA) {
+      break;
+    }
+    eat(l, COMMA);
+  }
+
+  if (body_depth > 0) {
+    MacroCall *c = malloc(sizeof(MacroCall));
+    *c = call;
+    return add_node(make_node(NT_MACRO_CALL, NULL_INDEX, NULL_INDEX,
+                              (NodeData){.as_ptr = c}));
+  }
+
+  SpanIndex s = expand_macro(call.macro, call.args, call.num_args);
+  return add_node(
+      make_node(NT_DATA, NULL_INDEX, NULL_INDEX, (NodeData){.as_raw_data = s}));
+}
+
+// .name [argument]
+static NodeIndex pragma(Lexer *l) {
+  eat(l, DOT);
+
+  if (l->curr_token.type != ID) {
+    error("Expected a pragma name after the '.', found %s.",
+          lexeme_to_string(l->curr_token.type));
+  }
+  char *name = (char *)l->curr_token.value;
+  eat(l, ID);
+
+  if (strcmp(name, "bound") == 0) {
+    NodeIndex value = number(l);
+    return add_node(make_node(NT_PRAGMA, value, NULL_INDEX,
+                              (NodeData){.as_raw_data = PR_BOUND}));
+  } else if (strcmp(name, "org") == 0) {
+    NodeIndex value = number(l);
+    return add_node(make_node(NT_PRAGMA, value, NULL_INDEX,
+                              (NodeData){.as_raw_data = PR_ORG}));
+  } else if (strcmp(name, "bank") == 0) {
+    NodeIndex value = number(l);
+    return add_node(make_node(NT_PRAGMA, value, NULL_INDEX,
+                              (NodeData){.as_raw_data = PR_BANK}));
+  } else if (strcmp(name, "byte") == 0) {
+    return data_list(l, false);
+  } else if (strcmp(name, "word") == 0) {
+    return data_list(l, true);
+  } else if (strcmp(name, "fill") == 0) {
+    // .fill count [, value]
+    u64 count = literal(l);
+    u64 value = 0;
+    if (l->curr_token.type == COMMA) {
+      eat(l, COMMA);
+      value = literal(l);
+    }
+    return add_node(make_node(
+        NT_DATA, NULL_INDEX, NULL_INDEX,
+        (NodeData){.as_raw_data = fill_span(count, (u8)value)}));
+  } else if (strcmp(name, "incbin") == 0) {
+    if (l->curr_token.type != STRING_LITERAL) {
+      error(".incbin needs a path in quotes.");
+    }
+    char path[CACHE_PATH_LEN];
+    resolve_path(l, (char *)l->curr_token.value, path);
+    eat(l, STRING_LITERAL);
+    return add_node(make_node(NT_DATA, NULL_INDEX, NULL_INDEX,
+                              (NodeData){.as_raw_data = incbin_span(path)}));
+  } else if (strcmp(name, "macro") == 0) {
+    // .macro name [param, param...]
+    if (body_depth > 0) {
+      error("Macros can't be defined inside another body.");
+    }
+    if (l->curr_token.type != ID) {
+      error("Expected a name for the macro.");
+    }
+    char *macro_name = (char *)l->curr_token.value;
+    eat(l, ID);
+
+    char *params[MACRO_PARAMS_LEN];
+    uint num_params = 0;
+    while (l->curr_token.type == ID) {
+      if (num_params >= MACRO_PARAMS_LEN) {
+        error("Too many parameters for the macro %s.", macro_name);
+      }
+      params[num_params++] = (char *)l->curr_token.value;
+      eat(l, ID);
+      if (l->curr_token.type != COMMA) {
+        break;
+      }
+      eat(l, COMMA);
+    }
+
+    define_macro(macro_name, params, num_params, body(l, PR_ENDM));
+    return empty(l);
+  } else if (strcmp(name, "rept") == 0) {
+    u64 count = literal(l);
+    NodeIndex b = body(l, PR_ENDR);
+
+    if (body_depth > 0) {
+      return add_node(make_node(NT_REPT, b, NULL_INDEX,
+                                (NodeData){.as_raw_data = count}));
+    }
+    SpanIndex s = expand_rept(b, count);
+    return add_node(make_node(NT_DATA, NULL_INDEX, NULL_INDEX,
+                              (NodeData){.as_raw_data = s}));
+  } else if (strcmp(name, "include") == 0) {
+    if (body_depth > 0) {
+      error(".include can't be used inside a macro or a .rept.");
+    }
+    if (l->curr_token.type != STRING_LITERAL) {
+      error(".include needs a path in quotes.");
+    }
+    char *path = (char *)l->curr_token.value;
+    eat(l, STRING_LITERAL);
+    return include(l, path);
+  } else if (strcmp(name, "export") == 0) {
+    // .export label [, label...]
+    while (true) {
+      if (l->curr_token.type != ID) {
+        error("Expected a label to export.");
+      }
+      export_symbol((char *)l->curr_token.value);
+      eat(l, ID);
+      if (l->curr_token.type != COMMA) {
+        break;
+      }
+      eat(l, COMMA);
+    }
+    return empty(l);
+  } else if (strcmp(name, "endm") == 0 || strcmp(name, "endr") == 0) {
+    if (body_depth == 0) {
+      error(".%s without anything to end.", name);
+    }
+    PragmaType p = (name[3] == 'm') ? PR_ENDM : PR_ENDR;
+    return add_node(make_node(NT_PRAGMA, NULL_INDEX, NULL_INDEX,
+                              (NodeData){.as_raw_data = p}));
+  }
+
+  error("Unknown pragma: .%s", name);
+}
 
 static NodeIndex label(Lexer *l) {
   // transparent wrapper around an ID, there might be more data here at some
@@ -306,11 +677,11 @@ static NodeIndex instruction(Lexer *l) {
 }
 
 // OR over a bunch of potential statement types.
-static NodeIndex statement(Lexer *l) {
+static NodeIndex statement_kind(Lexer *l) {
   Lexeme cl = l->curr_token.type;
 
-  printf("Parsing new statement. Starting with token %s.\n",
-         lexeme_to_string(cl));
+  DEBUG_PRINTF("Parsing new statement. Starting with token %s.\n",
+               lexeme_to_string(cl));
 
   // while (cl == NEWLINE) {
   //   eat(l, NEWLINE);
@@ -319,18 +690,23 @@ static NodeIndex statement(Lexer *l) {
   // cl = l->curr_token.type;
 
   if (cl == DOT) {
-    printf("Choosing pragma branch in statement parser\n");
+    DEBUG_PRINTF("Choosing pragma branch in statement parser\n");
     return pragma(l);
   } else if (cl == ID) { // an ID in the first slot, like a variable or
                          // function name.
-    printf("Choosing label branch in statement parser\n");
+    if (lookup_macro((char *)l->curr_token.value) != NULL) {
+      DEBUG_PRINTF("Choosing macro call branch in statement parser\n");
+      return macro_call(l);
+    }
+    DEBUG_PRINTF("Choosing label branch in statement parser\n");
     return label(l);
   } else if (is_instruction(cl)) {
-    printf("Choosing instruction branch in statement parser\n");
+    DEBUG_PRINTF("Choosing instruction branch in statement parser\n");
     return instruction(l);
   } else if (cl == NEWLINE || cl == EMPTY) {
-    printf("Choosing empty statement branch in statement parser: found %s\n",
-           lexeme_to_string(cl));
+    DEBUG_PRINTF(
+        "Choosing empty statement branch in statement parser: found %s\n",
+        lexeme_to_string(cl));
     return empty(l);
   } else {
     // print the lexeme_to_string ptr, not the cl value as a pointer x_x
@@ -338,6 +714,16 @@ static NodeIndex statement(Lexer *l) {
   }
 }
 
+// every statement remembers the line it started on, for the listing.
+static NodeIndex statement(Lexer *l) {
+  SourcePos pos = {l->file, l->line, l->line_start};
+  NodeIndex s = statement_kind(l);
+  if (ast[s].type != NT_STATEMENT_LIST) { // .includes have their own lines.
+    node_pos[s] = pos;
+  }
+  return s;
+}
+
 // either an assembler pragma, an instruction or a label.
 static NodeIndex statement_list(Lexer *l) {
   NodeIndex left = statement(l);
@@ -345,17 +731,28 @@ static NodeIndex statement_list(Lexer *l) {
 
   Lexeme cl = l->curr_token.type;
 
-  printf("after parsing statement, found lexeme: %s\n", lexeme_to_string(cl));
+  DEBUG_PRINTF("after parsing statement, found lexeme: %s\n",
+               lexeme_to_string(cl));
 
   if (cl == NEWLINE) { // if there's another statement found, parse it and
                        // add it onto the tree.
-    printf("Found another newline in the statement list, parsing another "
-           "statement...\n");
+    DEBUG_PRINTF("Found another newline in the statement list, parsing "
+                 "another statement...\n");
     eat(l, NEWLINE); // move past the NEWLINE, positioning at the start of
                      // the new next statement.
     second_term = statement_list(l);
   }
 
+  if (ast[left].type == NT_STATEMENT_LIST) {
+    // an .include, its statements go right where it was.
+    NodeIndex tail = left;
+    while (ast[tail].right != NULL_INDEX) {
+      tail = ast[tail].right;
+    }
+    ast[tail].right = second_term;
+    return left;
+  }
+
   return add_node(
       make_node(NT_STATEMENT_LIST, left, second_term, NO_NODE_DATA));
 }
@@ -365,22 +762,15 @@ static NodeIndex statement_list(Lexer *l) {
 //
 // will return the index of the root node into the
 // global ast Node array.
-NodeIndex parse(char text_input[INPUT_LEN]) {
-  Lexer *l = (Lexer *)malloc(
-      sizeof(Lexer)); // pass through the lexer manually and malloc that. TODO:
-                      // is there a better way to place the lexer in memory?
-
-  // use the actual string length and not the buffer length to do the EOF
-  // check.
-  l->text_len = strlen(text_input);
-  l->pos = -1; // set to -1, the init next() call will put it at 0.
-  l->curr_token.type = EMPTY;
-
-  memcpy(l->text, text_input, INPUT_LEN);
-  next(l);
+NodeIndex parse(char *text_input) {
+  Lexer *l = new_lexer(text_input, add_source_file(NULL, text_input, false));
 
   // everything in C is just a list of top-level declarations.
-  return statement_list(l);
+  NodeIndex root = statement_list(l);
+
+  // the ID strings are their own allocations, so the lexer can go.
+  free(l);
+  return root;
 }
 
 void test_parse() {}
@@ -3,5 +3,10 @@
 #include "ast.h"
 #include "defines.h"
 
-NodeIndex parse(char text_input[INPUT_LEN]);
+// the file the text handed to parse() came from, set by whoever read it in.
+// relative .include and .incbin paths go from its directory, or from the
+// working directory if this is NULL.
+extern const char *parse_path;
+
+NodeIndex parse(char *text_input);
 void test_parse();
@@ -0,0 +1,497 @@
+#include "peephole.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "defines.h"
+#include "layout.h"
+#include "lexer.h"
+#include "parse.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+PeepholeStats peephole_stats = {0};
+
+// the base effects of each instruction, before the addressing mode adds its
+// index register reads. control means the instruction can send execution
+// somewhere other than the next instruction, so no rule can see past it.
+typedef struct InstructionEffects {
+  u16 reads;
+  u16 writes;
+  bool control;
+} InstructionEffects;
+
+#define I(instruction) [(instruction)-INSTRUCTION_MASK]
+#define NZ (EF_N | EF_Z)
+
+static const InstructionEffects effects_table[NUM_6502_OPCODES] = {
+    I(ADC) = {EF_A | EF_C | EF_D, EF_A | NZ | EF_V | EF_C},
+    I(AND) = {EF_A, EF_A | NZ},
+    I(ASL) = {EF_A, EF_A | NZ | EF_C},
+    I(BCC) = {EF_C, 0, true},
+    I(BCS) = {EF_C, 0, true},
+    I(BEQ) = {EF_Z, 0, true},
+    I(BIT) = {EF_A, NZ | EF_V},
+    I(BMI) = {EF_N, 0, true},
+    I(BNE) = {EF_Z, 0, true},
+    I(BPL) = {EF_N, 0, true},
+    I(BRK) = {EF_ALL, EF_ALL, true},
+    I(BVC) = {EF_V, 0, true},
+    I(BVS) = {EF_V, 0, true},
+    I(CLC) = {0, EF_C},
+    I(CLD) = {0, EF_D},
+    I(CLI) = {0, EF_I},
+    I(CLV) = {0, EF_V},
+    I(CMP) = {EF_A, NZ | EF_C},
+    I(CPX) = {EF_X, NZ | EF_C},
+    I(CPY) = {EF_Y, NZ | EF_C},
+    I(DEC) = {0, NZ},
+    I(DEX) = {EF_X, EF_X | NZ},
+    I(DEY) = {EF_Y, EF_Y | NZ},
+    I(EOR) = {EF_A, EF_A | NZ},
+    I(INC) = {0, NZ},
+    I(INX) = {EF_X, EF_X | NZ},
+    I(INY) = {EF_Y, EF_Y | NZ},
+    I(JMP) = {EF_ALL, 0, true},
+    I(JSR) = {EF_ALL, EF_ALL, true},
+    I(LDA) = {0, EF_A | NZ},
+    I(LDX) = {0, EF_X | NZ},
+    I(LDY) = {0, EF_Y | NZ},
+    I(LSR) = {EF_A, EF_A | NZ | EF_C},
+    I(NOP) = {0, 0},
+    I(ORA) = {EF_A, EF_A | NZ},
+    I(PHA) = {EF_A | EF_SP, EF_SP},
+    I(PHP) = {EF_FLAGS | EF_SP, EF_SP},
+    I(PLA) = {EF_SP, EF_A | EF_SP | NZ},
+    I(PLP) = {EF_SP, EF_FLAGS | EF_SP},
+    I(ROL) = {EF_A | EF_C, EF_A | NZ | EF_C},
+    I(ROR) = {EF_A | EF_C, EF_A | NZ | EF_C},
+    I(RTI) = {EF_ALL, EF_ALL, true},
+    I(RTS) = {EF_ALL, EF_ALL, true},
+    I(SBC) = {EF_A | EF_C | EF_D, EF_A | NZ | EF_V | EF_C},
+    I(SEC) = {0, EF_C},
+    I(SED) = {0, EF_D},
+    I(SEI) = {0, EF_I},
+    I(STA) = {EF_A, 0},
+    I(STX) = {EF_X, 0},
+    I(STY) = {EF_Y, 0},
+    I(TAX) = {EF_A, EF_X | NZ},
+    I(TAY) = {EF_A, EF_Y | NZ},
+    I(TSX) = {EF_SP, EF_X | NZ},
+    I(TXA) = {EF_X, EF_A | NZ},
+    I(TXS) = {EF_X, EF_SP},
+    I(TYA) = {EF_Y, EF_A | NZ},
+};
+
+#undef I
+#undef NZ
+
+static bool is_control(Lexeme instruction) {
+  return effects_table[instruction - INSTRUCTION_MASK].control;
+}
+
+Effects instruction_effects(Lexeme instruction, AddrMode mode) {
+  InstructionEffects base = effects_table[instruction - INSTRUCTION_MASK];
+  Effects e = {base.reads, base.writes};
+
+  // the shifts only touch A when they're implicit, otherwise they work on
+  // memory.
+  if ((instruction == ASL || instruction == LSR || instruction == ROL ||
+       instruction == ROR) &&
+      mode != Implicit) {
+    e.reads &= ~EF_A;
+    e.writes &= ~EF_A;
+  }
+
+  switch (mode) {
+  case ZPX:
+  case AbsX:
+  case IndexedIndirect:
+    e.reads |= EF_X;
+    break;
+  case ZPY:
+  case AbsY:
+  case IndirectIndexed:
+    e.reads |= EF_Y;
+    break;
+  default:
+    break;
+  }
+
+  return e;
+}
+
+// the layout entries the rules have taken out so far. they're only really
+// removed from the layout array once the rules stop matching.
+static bool deleted[AST_LEN] = {0};
+
+// labels that something jumps or branches to. code can come in from
+// somewhere else at these, so they're a hard stop for every rule. labels that
+// nothing refers to are just names and get looked straight through.
+static bool is_target[AST_LEN] = {0};
+
+static void mark_targets() {
+  static bool referenced[SYMTAB_LEN];
+  memset(referenced, 0, sizeof(referenced));
+  memset(is_target, 0, sizeof(is_target));
+
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+    if (e->kind == EK_INSTRUCTION && e->name != NULL) {
+      referenced[lookup_symbol(e->name) - symtab] = true;
+    } else if (e->kind == EK_DATA) {
+      // a .word table of addresses can send execution to any of them.
+      DataSpan *d = &data_spans[e->span];
+      for (uint f = 0; f < d->num_fixups; f++) {
+        if (d->fixups[f].name == NULL) {
+          continue;
+        }
+        Symbol *s = lookup_symbol(d->fixups[f].name);
+        if (s == NULL) {
+          error("Undefined label %s used in a .word.", d->fixups[f].name);
+        }
+        referenced[s - symtab] = true;
+      }
+    }
+  }
+
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+    if (e->kind == EK_LABEL) {
+      is_target[i] = referenced[lookup_symbol(e->name) - symtab];
+    }
+  }
+}
+
+// the next entry a rule can look at after i. returns layout_len if there
+// isn't one, or the index of a target label or data, which no rule will match.
+static uint next_entry(uint i) {
+  for (uint j = i + 1; j < layout_len; j++) {
+    if (deleted[j]) {
+      continue;
+    }
+    if (layout[j].kind == EK_LABEL && !is_target[j]) {
+      continue;
+    }
+    return j;
+  }
+  return layout_len;
+}
+
+static bool is_instruction_entry(uint i) {
+  return i < layout_len && layout[i].kind == EK_INSTRUCTION;
+}
+
+// is everything in mask overwritten before anything reads it, starting right
+// after entry i? anything we can't see past (a target label, a jump, the end
+// of the program) counts as a read, so this only ever says yes when it's sure.
+static bool dead_after(uint i, u16 mask) {
+  for (uint j = next_entry(i); j < layout_len; j = next_entry(j)) {
+    LayoutEntry *e = &layout[j];
+    if (e->kind != EK_INSTRUCTION || is_control(e->instruction)) {
+      return false;
+    }
+
+    Effects eff = instruction_effects(e->instruction, e->arg.mode);
+    if (eff.reads & mask) {
+      return false;
+    }
+    mask &= ~eff.writes;
+    if (mask == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// we don't know the memory map of the guest, so the only memory we trust to
+// not be I/O is the zero page.
+static bool is_zero_page(AddrMode mode) {
+  return mode == ZP || mode == ZPX || mode == ZPY;
+}
+
+static bool same_operand(LayoutEntry *a, LayoutEntry *b) {
+  return a->arg.mode == b->arg.mode && operand_value(a) == operand_value(b);
+}
+
+static Lexeme load_for_store(Lexeme store) {
+  switch (store) {
+  case STA:
+    return LDA;
+  case STX:
+    return LDX;
+  case STY:
+    return LDY;
+  default:
+    return LEXEME_NULL;
+  }
+}
+
+//// THE RULES. each one looks at the instruction at i and returns the index of
+//// the entry it wants taken out, or -1 if it doesn't match.
+
+// sta $10 / lda $10 -> sta $10, when nothing reads the flags the load sets.
+static int store_then_load(uint i) {
+  LayoutEntry *store = &layout[i];
+  Lexeme load = load_for_store(store->instruction);
+  if (load == LEXEME_NULL || !is_zero_page(store->arg.mode)) {
+    return -1;
+  }
+
+  uint j = next_entry(i);
+  if (!is_instruction_entry(j) || layout[j].instruction != load ||
+      !same_operand(store, &layout[j])) {
+    return -1;
+  }
+
+  return dead_after(j, EF_N | EF_Z) ? (int)j : -1;
+}
+
+// lda $10 / sta $10 -> lda $10, the store can't change anything.
+static int load_then_store(uint i) {
+  LayoutEntry *load = &layout[i];
+  if (!is_zero_page(load->arg.mode)) {
+    return -1;
+  }
+
+  uint j = next_entry(i);
+  if (!is_instruction_entry(j) ||
+      load_for_store(layout[j].instruction) != load->instruction ||
+      !same_operand(load, &layout[j])) {
+    return -1;
+  }
+
+  return j;
+}
+
+// clc / clc, clc / sec, cld / sed and so on. any flag op that gets overwritten
+// before anything reads it. CLI and SEI are left alone, since moving the
+// interrupt window around changes behaviour even when nothing reads I.
+static int dead_flag_op(uint i) {
+  Lexeme ins = layout[i].instruction;
+  if (ins != CLC && ins != SEC && ins != CLD && ins != SED && ins != CLV) {
+    return -1;
+  }
+
+  Effects eff = instruction_effects(ins, Implicit);
+  return dead_after(i, eff.writes) ? (int)i : -1;
+}
+
+// lda #1 / lda #2 and friends. a load or transfer whose register and flags are
+// all overwritten before they're read. loads from outside the zero page might
+// be I/O reads with side effects, so those stay.
+static int dead_load(uint i) {
+  LayoutEntry *e = &layout[i];
+  switch (e->instruction) {
+  case LDA:
+  case LDX:
+  case LDY: {
+    if (e->arg.mode != Immediate && !is_zero_page(e->arg.mode)) {
+      return -1;
+    }
+  } break;
+  case TAX:
+  case TAY:
+  case TXA:
+  case TYA:
+  case TSX:
+    break;
+  default:
+    return -1;
+  }
+
+  Effects eff = instruction_effects(e->instruction, e->arg.mode);
+  return dead_after(i, eff.writes) ? (int)i : -1;
+}
+
+// tax / txa -> tax. the second transfer copies the same value back and sets
+// the flags from it exactly like the first one did.
+static int transfer_back(uint i) {
+  Lexeme ins = layout[i].instruction;
+  Lexeme back;
+  switch (ins) {
+  case TAX:
+    back = TXA;
+    break;
+  case TXA:
+    back = TAX;
+    break;
+  case TAY:
+    back = TYA;
+    break;
+  case TYA:
+    back = TAY;
+    break;
+  default:
+    return -1;
+  }
+
+  uint j = next_entry(i);
+  if (!is_instruction_entry(j) || layout[j].instruction != back) {
+    return -1;
+  }
+  return j;
+}
+
+// jmp next / next: -> next:
+static int jump_to_next(uint i) {
+  LayoutEntry *e = &layout[i];
+  if (e->instruction != JMP || e->arg.mode != Abs || e->name == NULL) {
+    return -1;
+  }
+
+  // this one has to look through target labels, it's looking for one.
+  for (uint j = i + 1; j < layout_len; j++) {
+    if (deleted[j]) {
+      continue;
+    }
+    if (layout[j].kind != EK_LABEL) {
+      return -1;
+    }
+    if (strcmp(layout[j].name, e->name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+typedef struct PeepholeRule {
+  const char *name;
+  int (*match)(uint i);
+  uint hits;
+} PeepholeRule;
+
+static PeepholeRule rules[] = {
+    {"store then load", store_then_load, 0},
+    {"load then store", load_then_store, 0},
+    {"dead flag op", dead_flag_op, 0},
+    {"dead load", dead_load, 0},
+    {"transfer back", transfer_back, 0},
+    {"jump to next", jump_to_next, 0},
+};
+
+#define NUM_RULES (sizeof(rules) / sizeof(rules[0]))
+
+// actually take the deleted entries out of the layout array.
+static void compact() {
+  uint kept = 0;
+  for (uint i = 0; i < layout_len; i++) {
+    if (!deleted[i]) {
+      layout[kept++] = layout[i];
+    }
+  }
+  layout_len = kept;
+  memset(deleted, 0, sizeof(deleted));
+}
+
+void peephole_optimize() {
+  memset(&peephole_stats, 0, sizeof(PeepholeStats));
+  memset(deleted, 0, sizeof(deleted));
+  for (uint r = 0; r < NUM_RULES; r++) {
+    rules[r].hits = 0;
+  }
+
+  uint bytes_before = layout_stats.bytes;
+  mark_targets();
+
+  // taking one instruction out can make another one match, so keep sweeping
+  // until a sweep doesn't change anything.
+  bool changed;
+  do {
+    changed = false;
+    for (uint i = 0; i < layout_len; i++) {
+      if (deleted[i] || layout[i].kind != EK_INSTRUCTION) {
+        continue;
+      }
+
+      for (uint r = 0; r < NUM_RULES; r++) {
+        int d = rules[r].match(i);
+        if (d < 0) {
+          continue;
+        }
+
+        LayoutEntry *e = &layout[d];
+        deleted[d] = true;
+        rules[r].hits++;
+        peephole_stats.removed++;
+        peephole_stats.cycles_saved +=
+            instruction_cycles(e->instruction, e->arg.mode);
+        changed = true;
+        break;
+      }
+    }
+  } while (changed);
+
+  compact();
+
+  // things moved, so the sizes and relaxed branches might have changed too.
+  relayout();
+  peephole_stats.bytes_saved = bytes_before - layout_stats.bytes;
+}
+
+void print_peephole_stats() {
+  for (uint r = 0; r < NUM_RULES; r++) {
+    if (rules[r].hits > 0) {
+      printf("peephole: %-16s %u\n", rules[r].name, rules[r].hits);
+    }
+  }
+  printf("peephole: %u instructions removed, %u bytes and %u cycles saved\n",
+         peephole_stats.removed, peephole_stats.bytes_saved,
+         peephole_stats.cycles_saved);
+}
+
+void test_peephole() {
+  printf("\n\nTESTING PEEPHOLE\n\n\n");
+
+  {
+    clean_ast();
+    clean_symtab();
+    NodeIndex root = parse("  sta $10\n"
+                           "  lda $10\n"
+                           "  sta $11\n"
+                           "  clc\n"
+                           "  clc\n"
+                           "  adc #$01\n"
+                           "  lda #$05\n"
+                           "  lda #$06\n"
+                           "  sta $12\n"
+                           "  tax\n"
+                           "  txa\n"
+                           "  rts\n");
+    layout_program(root, DEFAULT_ORIGIN);
+    peephole_optimize();
+
+    ASSERT(peephole_stats.removed == 4, "peephole removed count");
+    ASSERT(peephole_stats.bytes_saved == 6, "peephole bytes saved");
+    ASSERT(peephole_stats.cycles_saved == 9, "peephole cycles saved");
+    ASSERT(layout_len == 8, "peephole compacts the layout");
+    ASSERT(layout[1].instruction == STA && layout[2].instruction == CLC &&
+               layout[3].instruction == ADC,
+           "peephole keeps the clc that adc reads");
+  }
+
+  {
+    // the same store and load, but something branches in between them.
+    clean_ast();
+    clean_symtab();
+    NodeIndex root = parse("  sta $10\n"
+                           "loop:\n"
+                           "  lda $10\n"
+                           "  ldx #$00\n"
+                           "  jmp loop\n");
+    layout_program(root, DEFAULT_ORIGIN);
+    peephole_optimize();
+
+    ASSERT(peephole_stats.removed == 0, "peephole stops at branch targets");
+  }
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING PEEPHOLE, SUCCESS!\n\n\n");
+}
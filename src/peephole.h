@@ -0,0 +1,45 @@
+#pragma once
+
+#include "arguments.h"
+#include "defines.h"
+#include "lexer.h"
+
+#include <sys/types.h>
+
+// what an instruction reads and writes, as bitmasks over these. the flag bits
+// line up with the real status register.
+#define EF_C (1 << 0)
+#define EF_Z (1 << 1)
+#define EF_I (1 << 2)
+#define EF_D (1 << 3)
+#define EF_V (1 << 6)
+#define EF_N (1 << 7)
+#define EF_FLAGS (EF_C | EF_Z | EF_I | EF_D | EF_V | EF_N)
+#define EF_A (1 << 8)
+#define EF_X (1 << 9)
+#define EF_Y (1 << 10)
+#define EF_SP (1 << 11)
+#define EF_ALL 0xffff
+
+typedef struct Effects {
+  u16 reads;
+  u16 writes;
+} Effects;
+
+typedef struct PeepholeStats {
+  uint removed;
+  uint bytes_saved; // after the program was laid out again.
+  uint cycles_saved; // base cycles of everything that was removed.
+} PeepholeStats;
+
+extern PeepholeStats peephole_stats;
+
+// the register and flag effects of one instruction in one addressing mode.
+Effects instruction_effects(Lexeme instruction, AddrMode mode);
+
+// run the rule table over the laid out program until nothing else matches,
+// then lay it out again. opt-in, nothing calls this unless asked to.
+void peephole_optimize();
+void print_peephole_stats();
+
+void test_peephole();
@@ -0,0 +1,400 @@
+#include "pool.h"
+
+#include "assembler.h"
+#include "core.h"
+#include "defines.h"
+#include "image.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// the owner's end.
+static bool queue_take(JobQueue *q, Job *job) {
+  pthread_mutex_lock(&q->lock);
+  bool found = q->len > 0;
+  if (found) {
+    *job = q->jobs[q->head];
+    q->head = (q->head + 1) % POOL_OUTSTANDING_LEN;
+    q->len--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+// the thieves' end, the most recently queued job. the owner gets to the old
+// ones first, so the two ends only fight over the last job.
+static bool queue_steal(JobQueue *q, Job *job) {
+  pthread_mutex_lock(&q->lock);
+  bool found = q->len > 0;
+  if (found) {
+    q->len--;
+    *job = q->jobs[(q->head + q->len) % POOL_OUTSTANDING_LEN];
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+static void queue_put(JobQueue *q, const Job *job) {
+  pthread_mutex_lock(&q->lock);
+  q->jobs[(q->head + q->len) % POOL_OUTSTANDING_LEN] = *job;
+  q->len++;
+  pthread_mutex_unlock(&q->lock);
+}
+
+static bool find_job(Worker *w, Job *job) {
+  Pool *p = w->pool;
+  if (queue_take(&w->queue, job)) {
+    return true;
+  }
+  for (uint i = 1; i < p->num_workers; i++) {
+    Worker *victim = &p->workers[(w->index + i) % p->num_workers];
+    if (queue_steal(&victim->queue, job)) {
+      w->steals++;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void run_job(Core *c, const Job *job, JobResult *result) {
+  if (job->shared != NULL) {
+    image_map(c, job->shared);
+  } else {
+    core_clear(c);
+    core_load(c, job->image + job->start, job->start, job->end - job->start);
+  }
+  core_reset(c, job->registers.pc);
+  core_set_registers(c, job->registers);
+
+  result->id = job->id;
+  result->reason = core_run(c, job->budget);
+  result->registers = core_registers(c);
+  result->cycles = c->cycles;
+  result->instructions = c->instructions;
+  for (uint i = 0; i < job->output_len && i < JOB_OUTPUT_LEN; i++) {
+    result->output[i] = c->memory[(u16)(job->output_start + i)];
+  }
+}
+
+static void *worker_main(void *arg) {
+  Worker *w = arg;
+  Pool *p = w->pool;
+  Job job;
+  JobResult result;
+
+  while (1) {
+    if (find_job(w, &job)) {
+      __atomic_sub_fetch(&p->queued, 1, __ATOMIC_RELAXED);
+      memset(&result, 0, sizeof(result));
+      run_job(w->core, &job, &result);
+      w->jobs++;
+
+      // there's always room, pool_submit never lets more out than fit.
+      pthread_mutex_lock(&p->done_lock);
+      p->results[(p->results_head + p->results_len) % POOL_OUTSTANDING_LEN] =
+          result;
+      p->results_len++;
+      pthread_cond_signal(&p->done);
+      pthread_mutex_unlock(&p->done_lock);
+      continue;
+    }
+
+    // the count goes up before the submitter takes the lock to signal, so
+    // checking it under the lock can't miss a job.
+    pthread_mutex_lock(&p->lock);
+    while (__atomic_load_n(&p->queued, __ATOMIC_RELAXED) == 0 &&
+           !p->stopping) {
+      pthread_cond_wait(&p->work, &p->lock);
+    }
+    bool stop = p->stopping;
+    pthread_mutex_unlock(&p->lock);
+    if (stop) {
+      return NULL;
+    }
+  }
+}
+
+void pool_init(Pool *p, uint num_workers) {
+  if (num_workers == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = (cpus > 0) ? cpus : 1;
+  }
+  if (num_workers > POOL_WORKERS_LEN) {
+    num_workers = POOL_WORKERS_LEN;
+  }
+
+  memset(p, 0, sizeof(Pool));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_mutex_init(&p->done_lock, NULL);
+  pthread_cond_init(&p->done, NULL);
+
+  p->num_workers = num_workers;
+  p->workers = calloc(num_workers, sizeof(Worker));
+  if (p->workers == NULL) {
+    error("Couldn't allocate %u pool workers.", num_workers);
+  }
+  for (uint i = 0; i < num_workers; i++) {
+    Worker *w = &p->workers[i];
+    w->pool = p;
+    w->index = i;
+    pthread_mutex_init(&w->queue.lock, NULL);
+    w->core = core_new();
+  }
+  // only once every worker exists, since they steal from each other.
+  for (uint i = 0; i < num_workers; i++) {
+    pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]);
+  }
+}
+
+void pool_clean(Pool *p) {
+  pthread_mutex_lock(&p->lock);
+  p->stopping = true;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  for (uint i = 0; i < p->num_workers; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+  }
+  for (uint i = 0; i < p->num_workers; i++) {
+    pthread_mutex_destroy(&p->workers[i].queue.lock);
+    core_free(p->workers[i].core);
+  }
+  free(p->workers);
+  p->workers = NULL;
+  p->num_workers = 0;
+
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work);
+  pthread_mutex_destroy(&p->done_lock);
+  pthread_cond_destroy(&p->done);
+}
+
+bool pool_submit(Pool *p, const Job *job) {
+  // the worker's picked under the same lock as the slot, so any number of
+  // threads can submit at once.
+  pthread_mutex_lock(&p->done_lock);
+  bool full = p->outstanding >= POOL_OUTSTANDING_LEN;
+  uint worker = p->next;
+  if (!full) {
+    p->outstanding++;
+    p->next = (p->next + 1) % p->num_workers;
+  }
+  pthread_mutex_unlock(&p->done_lock);
+  if (full) {
+    return false;
+  }
+
+  queue_put(&p->workers[worker].queue, job);
+
+  __atomic_add_fetch(&p->queued, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_signal(&p->work);
+  pthread_mutex_unlock(&p->lock);
+  return true;
+}
+
+bool pool_next_result(Pool *p, JobResult *result) {
+  pthread_mutex_lock(&p->done_lock);
+  if (p->outstanding == 0) {
+    pthread_mutex_unlock(&p->done_lock);
+    return false;
+  }
+  while (p->results_len == 0) {
+    pthread_cond_wait(&p->done, &p->done_lock);
+  }
+  *result = p->results[p->results_head];
+  p->results_head = (p->results_head + 1) % POOL_OUTSTANDING_LEN;
+  p->results_len--;
+  p->outstanding--;
+  pthread_mutex_unlock(&p->done_lock);
+  return true;
+}
+
+// ldx #$00, loop: txa, adc $10, sta $0200,X, inx, cpx $11, bne loop, brk.
+// $10 and $11 are filled in per job, so every job ends somewhere different.
+static const u8 pool_program[] = {0xa2, 0x00, 0x8a, 0x65, 0x10, 0x9d,
+                                  0x00, 0x02, 0xe8, 0xe4, 0x11, 0xd0,
+                                  0xf5, 0x00};
+#define POOL_IMAGE_LEN 0x0700
+
+static void fill_image(u8 *image, u64 n) {
+  memset(image, 0, POOL_IMAGE_LEN);
+  memcpy(image + 0x0600, pool_program, sizeof(pool_program));
+  image[0x10] = n * 7;
+  image[0x11] = 1 + n % 200;
+}
+
+static Job make_job(const u8 *image, u64 n) {
+  return (Job){
+      .id = n,
+      .image = image,
+      .start = 0,
+      .end = POOL_IMAGE_LEN,
+      .registers = {.sp = 0xfd, .p = FLAG_U | FLAG_I | (n & FLAG_C),
+                    .pc = 0x0600},
+      .budget = {.cycles = 1 + n * 13 % 2000},
+      .output_start = 0x0200,
+      .output_len = JOB_OUTPUT_LEN,
+  };
+}
+
+#define POOL_TEST_JOBS 3000
+#define POOL_TEST_SUBMITTERS 4
+
+typedef struct Submitter {
+  Pool *pool;
+  u8 (*images)[POOL_IMAGE_LEN];
+  uint first;
+} Submitter;
+
+// every POOL_TEST_SUBMITTERS'th job from first. they all fit, so none of
+// these can come back full.
+static void *submit_jobs(void *arg) {
+  Submitter *s = arg;
+  for (uint i = s->first; i < POOL_TEST_JOBS; i += POOL_TEST_SUBMITTERS) {
+    Job job = make_job(s->images[i], i);
+    pool_submit(s->pool, &job);
+  }
+  return NULL;
+}
+
+static bool same_result(JobResult *a, JobResult *b) {
+  Registers *ra = &a->registers, *rb = &b->registers;
+  return a->id == b->id && a->reason == b->reason && ra->a == rb->a &&
+         ra->x == rb->x && ra->y == rb->y && ra->sp == rb->sp &&
+         ra->p == rb->p && ra->pc == rb->pc && a->cycles == b->cycles &&
+         a->instructions == b->instructions &&
+         memcmp(a->output, b->output, JOB_OUTPUT_LEN) == 0;
+}
+
+void test_pool() {
+  printf("\n\nTESTING POOL\n\n\n");
+
+  static u8 images[POOL_TEST_JOBS][POOL_IMAGE_LEN];
+  static bool seen[POOL_TEST_JOBS];
+  static Core c;
+  static Pool p;
+  core_init(&c);
+  pool_init(&p, 4);
+
+  uint submitted = 0, collected = 0, mismatched = 0, duplicates = 0;
+  JobResult result;
+  while (collected < POOL_TEST_JOBS) {
+    // keep it full, so the queues have something to steal.
+    while (submitted < POOL_TEST_JOBS) {
+      fill_image(images[submitted], submitted);
+      Job job = make_job(images[submitted], submitted);
+      if (!pool_submit(&p, &job)) {
+        break;
+      }
+      submitted++;
+    }
+    if (!pool_next_result(&p, &result)) {
+      break;
+    }
+    collected++;
+
+    // the same job on a core of our own.
+    Job job = make_job(images[result.id], result.id);
+    JobResult expected = {0};
+    run_job(&c, &job, &expected);
+    duplicates += seen[result.id];
+    seen[result.id] = true;
+    mismatched += !same_result(&result, &expected);
+  }
+
+  ASSERT(collected == POOL_TEST_JOBS && duplicates == 0,
+         "every job comes back once");
+  ASSERT(mismatched == 0, "results match running them one at a time");
+  ASSERT(!pool_next_result(&p, &result), "nothing left to wait for");
+
+  u64 jobs = 0;
+  for (uint i = 0; i < p.num_workers; i++) {
+    jobs += p.workers[i].jobs;
+  }
+  ASSERT(jobs == POOL_TEST_JOBS, "the workers ran all of them");
+
+  // the same jobs again, from a few threads submitting at once.
+  pthread_t threads[POOL_TEST_SUBMITTERS];
+  Submitter submitters[POOL_TEST_SUBMITTERS];
+  for (uint i = 0; i < POOL_TEST_SUBMITTERS; i++) {
+    submitters[i] = (Submitter){&p, images, i};
+    pthread_create(&threads[i], NULL, submit_jobs, &submitters[i]);
+  }
+  for (uint i = 0; i < POOL_TEST_SUBMITTERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  memset(seen, 0, sizeof(seen));
+  collected = mismatched = duplicates = 0;
+  while (pool_next_result(&p, &result)) {
+    collected++;
+    Job job = make_job(images[result.id], result.id);
+    JobResult expected = {0};
+    run_job(&c, &job, &expected);
+    duplicates += seen[result.id];
+    seen[result.id] = true;
+    mismatched += !same_result(&result, &expected);
+  }
+  ASSERT(collected == POOL_TEST_JOBS && duplicates == 0 && mismatched == 0,
+         "jobs from several submitters all come back right, once");
+  pool_clean(&p);
+
+  printf("\n\nDONE TESTING POOL, SUCCESS!\n\n\n");
+}
+
+#define BENCH_POOL_JOBS 200000
+
+// jobs per second through the pool, for one worker and one per cpu.
+static double bench_jobs(uint num_workers, const u8 *image, u64 *steals) {
+  static Pool p;
+  pool_init(&p, num_workers);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint submitted = 0;
+  JobResult result;
+  while (1) {
+    while (submitted < BENCH_POOL_JOBS) {
+      Job job = make_job(image, submitted);
+      job.budget.cycles = 0;
+      if (!pool_submit(&p, &job)) {
+        break;
+      }
+      submitted++;
+    }
+    if (!pool_next_result(&p, &result)) {
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  *steals = 0;
+  for (uint i = 0; i < p.num_workers; i++) {
+    *steals += p.workers[i].steals;
+  }
+  pool_clean(&p);
+
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return BENCH_POOL_JOBS / seconds;
+}
+
+void bench_pool() {
+  init_decode_table();
+
+  static u8 image[POOL_IMAGE_LEN];
+  fill_image(image, 100);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  u64 steals;
+  double one = bench_jobs(1, image, &steals);
+  double all = bench_jobs(0, image, &steals);
+  printf("pool: %.0f jobs/sec on one worker, %.0f jobs/sec on %ld (%.2fx, "
+         "%lu steals)\n",
+         one, all, cpus, all / one, (unsigned long)steals);
+}
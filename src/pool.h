@@ -0,0 +1,105 @@
+#pragma once
+
+#include "core.h"
+#include "defines.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// a pool of worker threads, each with its own core, for running lots of short
+// programs at once. jobs go out round robin to the workers' queues, and a
+// worker that runs out steals from the back of someone else's. results come
+// back through one completion queue, in whatever order they finish.
+
+#define POOL_WORKERS_LEN 64
+// how many jobs can be submitted and not collected yet. the completion queue
+// is this big too, so a worker never has to wait to hand a result back.
+#define POOL_OUTSTANDING_LEN 4096
+// how many bytes of memory a job can ask to get back with its result.
+#define JOB_OUTPUT_LEN 64
+
+typedef struct Job {
+  u64 id; // handed back with the result, the pool doesn't look at it.
+
+  // image[start..end) is copied to the same addresses, everything else is
+  // zero. the image has to stay around until the job's result comes back.
+  const u8 *image;
+  u16 start;
+  u32 end;
+  // or, if this is set, it's mapped instead and the three above are ignored.
+  // a lot cheaper when the jobs all run the same program, see image.h.
+  const struct ProgramImage *shared;
+
+  Registers registers;
+  RunBudget budget;
+
+  // the memory to copy into the result, up to JOB_OUTPUT_LEN bytes.
+  u16 output_start;
+  u8 output_len;
+} Job;
+
+typedef struct JobResult {
+  u64 id;
+  StopReason reason;
+  Registers registers;
+  u64 cycles;
+  u64 instructions;
+  u8 output[JOB_OUTPUT_LEN];
+} JobResult;
+
+// one worker's queue. the owner takes from the front, thieves from the back.
+typedef struct JobQueue {
+  pthread_mutex_t lock;
+  Job jobs[POOL_OUTSTANDING_LEN];
+  uint head;
+  uint len;
+} JobQueue;
+
+typedef struct Worker {
+  struct Pool *pool;
+  uint index;
+  pthread_t thread;
+  Core *core;
+  JobQueue queue;
+
+  u64 jobs;
+  u64 steals; // jobs it took from another worker's queue.
+} Worker;
+
+typedef struct Pool {
+  Worker *workers;
+  uint num_workers;
+  uint next; // the worker the next submitted job goes to, under done_lock.
+
+  // the workers sleep on this when every queue is empty.
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  uint queued; // jobs sitting in the queues, not picked up yet.
+  bool stopping;
+
+  pthread_mutex_t done_lock;
+  pthread_cond_t done;
+  JobResult results[POOL_OUTSTANDING_LEN];
+  uint results_head;
+  uint results_len;
+  uint outstanding; // submitted, but not collected with pool_next_result.
+} Pool;
+
+// start num_workers threads, each with a core of its own. 0 means one per
+// cpu.
+void pool_init(Pool *p, uint num_workers);
+// stop and join the workers. anything still queued is thrown away.
+void pool_clean(Pool *p);
+
+// queue a job, from any thread. false if POOL_OUTSTANDING_LEN jobs are already
+// waiting to be collected, take some results off with pool_next_result and try
+// again.
+bool pool_submit(Pool *p, const Job *job);
+
+// wait for the next job to finish. false if there's nothing outstanding to
+// wait for.
+bool pool_next_result(Pool *p, JobResult *result);
+
+void test_pool();
+void bench_pool();
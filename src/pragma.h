@@ -8,3 +8,11 @@
 #else
 #define ALWAYS_INLINE
 #endif
+
+// for branches that are almost never taken, so the compiler keeps them out of
+// the way of the hot path.
+#if defined(__GNUC__) || defined(__clang__)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define UNLIKELY(x) (x)
+#endif
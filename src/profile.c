@@ -0,0 +1,269 @@
+#include "profile.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "symtab.h"
+#include "util.h"
+#include "writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void profile_init(Profile *p, u16 start) {
+  memset(p, 0, sizeof(Profile));
+  p->nodes[0].address = start;
+  p->num_nodes = 1;
+  for (int i = 0; i < SYMTAB_LEN; i++) {
+    Symbol s = symtab[i];
+    if (s.name != NULL && s.type == DT_INT) {
+      p->label_at[s.value & 0xffff] = s.name;
+    }
+  }
+}
+
+static inline uint bucket_of(u32 parent, u16 address) {
+  return (parent * 31 + address) % PROFILE_BUCKETS_LEN;
+}
+
+void profile_call(Profile *p, u16 target) {
+  if (p->depth >= PROFILE_DEPTH_LEN) {
+    p->unmatched++;
+    return;
+  }
+
+  uint bucket = bucket_of(p->current, target);
+  u32 n = p->buckets[bucket];
+  while (n != 0 &&
+         (p->nodes[n].parent != p->current || p->nodes[n].address != target)) {
+    n = p->nodes[n].next;
+  }
+  if (n == 0) {
+    if (p->num_nodes >= PROFILE_NODES_LEN) {
+      p->unmatched++;
+      return;
+    }
+    n = p->num_nodes++;
+    p->nodes[n] = (ProfileNode){.address = target,
+                                .parent = p->current,
+                                .next = p->buckets[bucket]};
+    p->buckets[bucket] = n;
+  }
+  p->nodes[n].calls++;
+  p->current = n;
+  p->depth++;
+}
+
+// the label, or the label it's past and how far, or just the address.
+static void put_where(Writer *w, Profile *p, u16 address) {
+  for (u32 a = address;; a--) {
+    if (p->label_at[a] != NULL) {
+      writer_put_str(w, p->label_at[a]);
+      if (a != address) {
+        writer_put_char(w, '+');
+        writer_put_u64(w, address - a);
+      }
+      writer_put_str(w, " ($");
+      writer_put_hex16(w, address);
+      writer_put_char(w, ')');
+      return;
+    }
+    if (a == 0) {
+      break;
+    }
+  }
+  writer_put_char(w, '$');
+  writer_put_hex16(w, address);
+}
+
+static const u64 *sort_by;
+
+static int most_first(const void *a, const void *b) {
+  u64 x = sort_by[*(const u16 *)a], y = sort_by[*(const u16 *)b];
+  return (x < y) - (x > y);
+}
+
+static void put_row(Writer *w, u64 cycles, u64 total, u64 count) {
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%12lu %6.2f%% %12lu  ",
+                     (unsigned long)cycles,
+                     total ? 100.0 * cycles / total : 0.0,
+                     (unsigned long)count);
+  writer_put(w, line, len);
+}
+
+void profile_report(Writer *w, Profile *p, uint top) {
+  static u16 order[0x10000];
+  static u64 routine_cycles[0x10000];
+  static u64 routine_calls[0x10000];
+
+  u64 total = 0, instructions = 0;
+  uint used = 0;
+  for (u32 a = 0; a < 0x10000; a++) {
+    total += p->cycles[a];
+    instructions += p->counts[a];
+    if (p->counts[a] != 0) {
+      order[used++] = a;
+    }
+  }
+
+  writer_put_str(w, "profile: ");
+  writer_put_u64(w, total);
+  writer_put_str(w, " cycles over ");
+  writer_put_u64(w, instructions);
+  writer_put_str(w, " instructions\n\n");
+  writer_put_str(w, "      cycles        %        count  pc\n");
+  sort_by = p->cycles;
+  qsort(order, used, sizeof(u16), most_first);
+  for (uint i = 0; i < used && i < top; i++) {
+    put_row(w, p->cycles[order[i]], total, p->counts[order[i]]);
+    put_where(w, p, order[i]);
+    writer_put_char(w, '\n');
+  }
+
+  // a routine is somewhere that got called, or where the run started, and
+  // everything from there up to the next one counts as that routine. labels
+  // inside one (loops and the like) don't split it up.
+  memset(routine_cycles, 0, sizeof(routine_cycles));
+  memset(routine_calls, 0, sizeof(routine_calls));
+  for (uint n = 1; n < p->num_nodes; n++) {
+    routine_calls[p->nodes[n].address] += p->nodes[n].calls;
+  }
+  u16 routine = p->nodes[0].address;
+  for (u32 a = 0; a < 0x10000; a++) {
+    if (routine_calls[a] != 0 || a == p->nodes[0].address) {
+      routine = a;
+    }
+    routine_cycles[routine] += p->cycles[a];
+  }
+
+  used = 0;
+  for (u32 a = 0; a < 0x10000; a++) {
+    if (routine_cycles[a] != 0) {
+      order[used++] = a;
+    }
+  }
+  writer_put_str(w, "\n      cycles        %        calls  routine\n");
+  sort_by = routine_cycles;
+  qsort(order, used, sizeof(u16), most_first);
+  for (uint i = 0; i < used && i < top; i++) {
+    put_row(w, routine_cycles[order[i]], total, routine_calls[order[i]]);
+    put_where(w, p, order[i]);
+    writer_put_char(w, '\n');
+  }
+  if (p->unmatched > 0) {
+    writer_put_str(w, "\n(some calls went too deep to get their own stack, "
+                      "they're counted against the caller)\n");
+  }
+}
+
+static void put_name(Writer *w, Profile *p, u16 address) {
+  if (p->label_at[address] != NULL) {
+    writer_put_str(w, p->label_at[address]);
+  } else {
+    writer_put_char(w, '$');
+    writer_put_hex16(w, address);
+  }
+}
+
+void profile_write_folded(Writer *w, Profile *p) {
+  u32 stack[PROFILE_DEPTH_LEN + 1];
+  for (uint n = 0; n < p->num_nodes; n++) {
+    if (p->nodes[n].cycles == 0) {
+      continue;
+    }
+    uint depth = 0;
+    for (u32 at = n; at != 0; at = p->nodes[at].parent) {
+      stack[depth++] = at;
+    }
+    put_name(w, p, p->nodes[0].address);
+    while (depth > 0) {
+      writer_put_char(w, ';');
+      put_name(w, p, p->nodes[stack[--depth]].address);
+    }
+    writer_put_char(w, ' ');
+    writer_put_u64(w, p->nodes[n].cycles);
+    writer_put_char(w, '\n');
+  }
+}
+
+// everything the writer got, out of the file it went to.
+static size_t read_back(FILE *f, char *buf, size_t size) {
+  lseek(fileno(f), 0, SEEK_SET);
+  ssize_t len = read(fileno(f), buf, size - 1);
+  len = (len > 0) ? len : 0;
+  buf[len] = '\0';
+  return len;
+}
+
+void test_profile() {
+  printf("\n\nTESTING PROFILE\n\n\n");
+
+  static Core c;
+  static Profile p;
+  static Writer w;
+  static char buf[4096];
+
+  core_init(&c);
+  assemble_into(&c, "start:\n"
+                    "  ldx #$03\n"
+                    "again:\n"
+                    "  jsr draw\n"
+                    "  jsr plot\n"
+                    "  dex\n"
+                    "  bne again\n"
+                    "  brk\n"
+                    "draw:\n"
+                    "  jsr plot\n"
+                    "  rts\n"
+                    "plot:\n"
+                    "  nop\n"
+                    "  rts\n");
+  profile_init(&p, c.pc);
+  core_run_observed(&c, (RunBudget){0}, NULL, &p);
+
+  u64 cycles = 0;
+  for (u32 a = 0; a < 0x10000; a++) {
+    cycles += p.cycles[a];
+  }
+  ASSERT(cycles == c.cycles && p.counts[0x0602] == 3,
+         "every cycle counted against a pc");
+  ASSERT(p.num_nodes == 4 && p.depth == 0, "a node per call stack");
+
+  FILE *f = tmpfile();
+  writer_init(&w, fileno(f));
+  profile_write_folded(&w, &p);
+  writer_flush(&w);
+  read_back(f, buf, sizeof(buf));
+  fclose(f);
+  printf("%s", buf);
+  // ldx, then 3 times around with the last bne not taken. the jsrs count
+  // against the caller and the rts against the routine.
+  ASSERT(strcmp(buf, "start 52\n"
+                     "start;draw 36\n"
+                     "start;draw;plot 24\n"
+                     "start;plot 24\n") == 0,
+         "folded stacks");
+
+  f = tmpfile();
+  writer_init(&w, fileno(f));
+  profile_report(&w, &p, 10);
+  writer_flush(&w);
+  read_back(f, buf, sizeof(buf));
+  fclose(f);
+  printf("%s", buf);
+  ASSERT(strstr(buf, "48  35.29%            6  plot ($") != NULL &&
+             strstr(buf, "52  38.24%            0  start ($") != NULL,
+         "the report adds up the routines");
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING PROFILE, SUCCESS!\n\n\n");
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "defines.h"
+#include "pragma.h"
+#include "writer.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// where a run's cycles go. every instruction counts against its pc, and jsr
+// and rts walk a call tree so the cycles can be split up by call stack too.
+// the reports are a hot-spot list with the pcs resolved to labels, and
+// folded stacks ("main;draw;plot 1234" lines) for flamegraph.pl and friends.
+
+// distinct call stacks the tree can hold. past this, calls count against
+// the caller.
+#define PROFILE_NODES_LEN 0x10000
+#define PROFILE_BUCKETS_LEN 0x4000
+// calls deeper than this count against the deepest one.
+#define PROFILE_DEPTH_LEN 256
+
+// one call stack, the call at address from the stack its parent is.
+typedef struct ProfileNode {
+  u16 address;
+  u32 parent;
+  u32 next; // the next node in the same bucket, 0 at the end.
+  u64 cycles; // spent with exactly this stack.
+  u64 calls;
+} ProfileNode;
+
+typedef struct Profile {
+  u64 counts[0x10000]; // executions per pc.
+  u64 cycles[0x10000];
+
+  // node 0 is the root, where the run started.
+  ProfileNode nodes[PROFILE_NODES_LEN];
+  uint num_nodes;
+  u32 buckets[PROFILE_BUCKETS_LEN];
+  u32 current;
+  uint depth;
+  uint unmatched; // calls that didn't get a node of their own.
+
+  // the label for each address, from the symbol table.
+  const char *label_at[0x10000];
+} Profile;
+
+// start empty, with the root at the core's pc. the labels come from whatever
+// the symbol table has in it now.
+void profile_init(Profile *p, u16 start);
+
+void profile_call(Profile *p, u16 target);
+
+// one instruction, from core_run_observed after it runs. pc is where it
+// went next.
+static inline ALWAYS_INLINE void profile_add(Profile *p, u16 at, u8 opcode,
+                                             u8 cycles, u16 pc) {
+  p->counts[at]++;
+  p->cycles[at] += cycles;
+  p->nodes[p->current].cycles += cycles;
+
+  if (opcode == 0x20) { // jsr
+    profile_call(p, pc);
+  } else if (opcode == 0x60) { // rts
+    if (p->unmatched > 0) {
+      p->unmatched--;
+    } else if (p->current != 0) {
+      p->current = p->nodes[p->current].parent;
+      p->depth--;
+    }
+  }
+}
+
+// the top pcs and the top routines by cycles, most first.
+void profile_report(Writer *w, Profile *p, uint top);
+// a line per call stack that spent any cycles.
+void profile_write_folded(Writer *w, Profile *p);
+
+void test_profile();
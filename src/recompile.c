@@ -0,0 +1,831 @@
+#include "recompile.h"
+
+#include "assembler.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "lexer.h"
+#include "run.h"
+#include "symtab.h"
+#include "timing.h"
+#include "util.h"
+#include "writer.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the addresses the dispatcher can jump straight into compiled code at. the
+// start of every block, and the return address of every JSR inside one.
+static bool is_label[0x10000];
+
+// per instruction of the block being written, the worst case cycles from it
+// to the bottom of the block. a label needs that much budget left to run
+// without checking.
+static u32 worst_after[0x10000 + 1];
+
+static void put(Writer *w, const char *fmt, ...) {
+  char line[512];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (len >= (int)sizeof(line)) {
+    error("A line of the C output is too long.");
+  }
+  writer_put(w, line, len);
+}
+
+// an instruction's length, with the ones that stop the run only taking up
+// their opcode.
+static u8 instruction_len(u8 opcode) {
+  DecodeEntry d = decode_table[opcode];
+  return (opcode == 0x00 || d.instruction == LEXEME_NULL) ? 1 : d.len;
+}
+
+static bool is_branch(Lexeme instruction) {
+  return has_addrmode(instruction, Relative);
+}
+
+// one instruction being written out. a block knows the operand and where the
+// instruction ends when it's built, the interpreter only once it's running,
+// so the operand goes in as text and the rest is worked out from step.
+typedef struct Emit {
+  Writer *w;
+  const char *in; // the indent.
+  DecodeEntry d;
+  bool step; // in the interpreter, where pc has already been moved past it.
+  u16 operand;
+  u16 next;
+  char o[16]; // the operand as C.
+} Emit;
+
+// leave the block for target, straight into its code if it has some.
+static void emit_goto(Emit *e, u16 target) {
+  if (is_label[target]) {
+    put(e->w, "%sgoto b_%04x;\n", e->in, target);
+  } else {
+    put(e->w, "%spc = 0x%04x;\n%sgoto dispatch;\n", e->in, target, e->in);
+  }
+}
+
+// the effective address into ea. reads pay for crossing a page.
+static void emit_ea(Emit *e, bool read) {
+  const char *o = e->o;
+  bool cross = read && can_cross_page(e->d.instruction, e->d.mode);
+  switch (e->d.mode) {
+  case ZP:
+  case Abs:
+    put(e->w, "%sea = %s;\n", e->in, o);
+    break;
+  case ZPX:
+  case ZPY:
+    put(e->w, "%sea = (u8)(%s + %c);\n", e->in, o,
+        (e->d.mode == ZPX) ? 'x' : 'y');
+    break;
+  case AbsX:
+  case AbsY:
+    put(e->w, "%sea = %s + %c;\n", e->in, o, (e->d.mode == AbsX) ? 'x' : 'y');
+    // an index can't carry a base on the start of a page into the next one.
+    if (cross && (e->step || (e->operand & 0xff) != 0)) {
+      put(e->w, "%scycles += (ea ^ %s) > 0xff;\n", e->in, o);
+    }
+    break;
+  case Indirect:
+    // the pointer's high byte never carries into the next page.
+    put(e->w, "%sea = mem[%s] | (mem[(%s & 0xff00) | (u8)(%s + 1)] << 8);\n",
+        e->in, o, o, o);
+    break;
+  case IndexedIndirect:
+    put(e->w, "%sea = mem[(u8)(%s + x)] | (mem[(u8)(%s + x + 1)] << 8);\n",
+        e->in, o, o);
+    break;
+  case IndirectIndexed:
+    put(e->w, "%sbase = mem[%s] | (mem[(u8)(%s + 1)] << 8);\n", e->in, o, o);
+    put(e->w, "%sea = base + y;\n", e->in);
+    if (cross) {
+      put(e->w, "%scycles += (ea ^ base) > 0xff;\n", e->in);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// the byte the instruction reads, after emit_ea.
+static void read_expr(Emit *e, char *out) {
+  if (e->d.mode != Immediate) {
+    strcpy(out, "mem[ea]");
+  } else if (e->step) {
+    strcpy(out, "(u8)opnd");
+  } else {
+    sprintf(out, "0x%02x", e->operand & 0xff);
+  }
+}
+
+static void emit_count(Emit *e) {
+  put(e->w, "%scycles += %d;\n%sinstructions++;\n", e->in, e->d.cycles, e->in);
+}
+
+// the blocks were built from the bytes as they were assembled. once the
+// program writes over any of them, everything goes through the interpreter.
+static void emit_stale_check(Emit *e, u16 resume) {
+  if (!e->step) {
+    put(e->w, "%sif (stale) {\n%s  pc = 0x%04x;\n%s  goto dispatch;\n%s}\n",
+        e->in, e->in, resume, e->in, e->in);
+  }
+}
+
+static const char *branch_condition(Lexeme instruction) {
+  switch (instruction) {
+  case BCC:
+    return "!(p & FLAG_C)";
+  case BCS:
+    return "p & FLAG_C";
+  case BNE:
+    return "!(p & FLAG_Z)";
+  case BEQ:
+    return "p & FLAG_Z";
+  case BPL:
+    return "!(p & FLAG_N)";
+  case BMI:
+    return "p & FLAG_N";
+  case BVC:
+    return "!(p & FLAG_V)";
+  default:
+    return "p & FLAG_V";
+  }
+}
+
+// the registers the loads, stores, compares and transfers work on.
+static char reg_of(Lexeme instruction) {
+  switch (instruction) {
+  case LDX:
+  case STX:
+  case CPX:
+  case INX:
+  case DEX:
+    return 'x';
+  case LDY:
+  case STY:
+  case CPY:
+  case INY:
+  case DEY:
+    return 'y';
+  default:
+    return 'a';
+  }
+}
+
+// the control flow instructions. returns whether anything after it in the
+// block can run.
+static bool emit_flow(Emit *e) {
+  Writer *w = e->w;
+  const char *in = e->in;
+  Lexeme i = e->d.instruction;
+
+  if (is_branch(i)) {
+    emit_count(e);
+    put(w, "%sif (%s) {\n", in, branch_condition(i));
+    if (e->step) {
+      put(w, "%s  cycles += 1 + ((pc ^ opnd) > 0xff);\n%s  pc = opnd;\n", in,
+          in);
+    } else {
+      Emit taken = *e;
+      char indent[32];
+      snprintf(indent, sizeof(indent), "%s  ", in);
+      taken.in = indent;
+      put(w, "%s  cycles += %d;\n", in,
+          1 + ((e->next ^ e->operand) > 0xff));
+      emit_goto(&taken, e->operand);
+    }
+    put(w, "%s}\n", in);
+    return true;
+  }
+
+  switch (i) {
+  case JMP:
+    if (e->d.mode == Indirect) {
+      emit_ea(e, false);
+      put(w, "%spc = ea;\n", in);
+    } else if (e->step) {
+      put(w, "%spc = opnd;\n", in);
+    }
+    emit_count(e);
+    if (e->step) {
+      return true;
+    }
+    if (e->d.mode == Indirect) {
+      put(w, "%sgoto dispatch;\n", in);
+    } else {
+      emit_goto(e, e->operand);
+    }
+    return false;
+  case JSR:
+    // the return address pushed is the last byte of the JSR.
+    if (e->step) {
+      put(w, "%sPUSH((u16)(pc - 1) >> 8);\n%sPUSH((u8)(pc - 1));\n", in, in);
+      put(w, "%spc = opnd;\n", in);
+      emit_count(e);
+      return true;
+    }
+    put(w, "%sPUSH(0x%02x);\n%sPUSH(0x%02x);\n", in, (u16)(e->next - 1) >> 8,
+        in, (u8)(e->next - 1));
+    emit_count(e);
+    emit_stale_check(e, e->operand);
+    emit_goto(e, e->operand);
+    return false;
+  case RTS:
+    put(w,
+        "%s{\n%s  u8 lo_ = PULL();\n%s  pc = (lo_ | (PULL() << 8)) + 1;\n"
+        "%s}\n",
+        in, in, in, in);
+    break;
+  case RTI:
+    put(w, "%sp = (PULL() & ~FLAG_B) | FLAG_U;\n", in);
+    put(w, "%s{\n%s  u8 lo_ = PULL();\n%s  pc = lo_ | (PULL() << 8);\n%s}\n",
+        in, in, in, in);
+    break;
+  default:
+    error("%s isn't a jump.", instruction_to_string(i));
+  }
+
+  emit_count(e);
+  if (e->step) {
+    return true;
+  }
+  put(w, "%sgoto dispatch;\n", in);
+  return false;
+}
+
+// everything but BRK. returns whether anything after it in the block can run.
+static bool emit_instruction(Emit *e) {
+  Writer *w = e->w;
+  const char *in = e->in;
+  Lexeme i = e->d.instruction;
+  char r = reg_of(i);
+  char v[24];
+  bool writes = false;
+
+  switch (i) {
+  case ADC:
+  case SBC:
+    emit_ea(e, true);
+    read_expr(e, v);
+    put(w, "%sa = %s(a, %s, &p);\n", in, instruction_to_string(i), v);
+    break;
+  case AND:
+  case ORA:
+  case EOR:
+    emit_ea(e, true);
+    read_expr(e, v);
+    put(w, "%snz(a %c= %s, &p);\n", in,
+        (i == AND)   ? '&'
+        : (i == ORA) ? '|'
+                     : '^',
+        v);
+    break;
+  case CMP:
+  case CPX:
+  case CPY:
+    emit_ea(e, true);
+    read_expr(e, v);
+    put(w, "%scompare(%c, %s, &p);\n", in, r, v);
+    break;
+  case BIT:
+    emit_ea(e, true);
+    put(w,
+        "%sp = (p & ~(FLAG_N | FLAG_V | FLAG_Z)) | (mem[ea] & (FLAG_N | "
+        "FLAG_V)) |\n%s    ((a & mem[ea]) ? 0 : FLAG_Z);\n",
+        in, in);
+    break;
+  case LDA:
+  case LDX:
+  case LDY:
+    emit_ea(e, true);
+    read_expr(e, v);
+    put(w, "%snz(%c = %s, &p);\n", in, r, v);
+    break;
+  case STA:
+  case STX:
+  case STY:
+    emit_ea(e, false);
+    put(w, "%sWR(ea, %c);\n", in, r);
+    writes = true;
+    break;
+  case ASL:
+  case LSR:
+  case ROL:
+  case ROR:
+  case INC:
+  case DEC:
+    // lib6502 calls the accumulator forms implicit.
+    if (e->d.mode == Implicit) {
+      put(w, "%sa = %s(a, &p);\n", in, instruction_to_string(i));
+      break;
+    }
+    emit_ea(e, false);
+    put(w, "%sWR(ea, %s(mem[ea], &p));\n", in, instruction_to_string(i));
+    writes = true;
+    break;
+  case INX:
+  case INY:
+    put(w, "%snz(++%c, &p);\n", in, r);
+    break;
+  case DEX:
+  case DEY:
+    put(w, "%snz(--%c, &p);\n", in, r);
+    break;
+  case TAX:
+    put(w, "%snz(x = a, &p);\n", in);
+    break;
+  case TAY:
+    put(w, "%snz(y = a, &p);\n", in);
+    break;
+  case TSX:
+    put(w, "%snz(x = sp, &p);\n", in);
+    break;
+  case TXA:
+    put(w, "%snz(a = x, &p);\n", in);
+    break;
+  case TYA:
+    put(w, "%snz(a = y, &p);\n", in);
+    break;
+  case TXS:
+    put(w, "%ssp = x;\n", in);
+    break;
+  case CLC:
+  case CLD:
+  case CLI:
+  case CLV:
+    put(w, "%sp &= ~FLAG_%c;\n", in, (i == CLC)   ? 'C'
+                                     : (i == CLD) ? 'D'
+                                     : (i == CLI) ? 'I'
+                                                  : 'V');
+    break;
+  case SEC:
+  case SED:
+  case SEI:
+    put(w, "%sp |= FLAG_%c;\n", in, (i == SEC)   ? 'C'
+                                    : (i == SED) ? 'D'
+                                                 : 'I');
+    break;
+  case NOP:
+    break;
+  case PHA:
+    put(w, "%sPUSH(a);\n", in);
+    writes = true;
+    break;
+  case PHP:
+    put(w, "%sPUSH(p | FLAG_B | FLAG_U);\n", in);
+    writes = true;
+    break;
+  case PLA:
+    put(w, "%snz(a = PULL(), &p);\n", in);
+    break;
+  case PLP:
+    put(w, "%sp = (PULL() & ~FLAG_B) | FLAG_U;\n", in);
+    break;
+  default:
+    return emit_flow(e);
+  }
+
+  emit_count(e);
+  if (writes) {
+    emit_stale_check(e, e->next);
+  }
+  return true;
+}
+
+static void emit_budget_check(Writer *w, u16 label, u32 instructions,
+                              u32 cycles) {
+  put(w,
+      "  if (cycles + %u > cycle_limit ||\n"
+      "      instructions + %u > instruction_limit) {\n"
+      "    pc = 0x%04x;\n"
+      "    goto step;\n"
+      "  }\n",
+      cycles, instructions, label);
+}
+
+static void emit_block(Writer *w, const u8 *image, BasicBlock *b) {
+  // the worst case from every instruction down, counting every read as
+  // crossing a page and every branch as taken onto another one.
+  u32 n = 0;
+  static u16 at[0x10000];
+  for (u32 pc = b->start; pc < b->end; pc += instruction_len(image[pc])) {
+    at[n++] = pc;
+  }
+  worst_after[n] = 0;
+  for (int k = n - 1; k >= 0; k--) {
+    DecodeEntry d = decode_table[image[at[k]]];
+    worst_after[k] = worst_after[k + 1] + d.cycles +
+                     can_cross_page(d.instruction, d.mode) +
+                     (is_branch(d.instruction) ? 2 : 0);
+  }
+
+  Emit e = {.w = w, .in = "  "};
+  bool open = true;
+  for (u32 k = 0; k < n; k++) {
+    u16 pc = at[k];
+    u8 opcode = image[pc];
+    e.d = decode_table[opcode];
+
+    if (is_label[pc]) {
+      if (pc == b->start && b->label != NULL) {
+        put(w, "\nb_%04x: // %s\n", pc, b->label);
+      } else {
+        put(w, "\nb_%04x:\n", pc);
+      }
+      emit_budget_check(w, pc, n - k, worst_after[k]);
+      open = true;
+    }
+    if (!open) {
+      continue;
+    }
+
+    if (opcode == 0x00 || e.d.instruction == LEXEME_NULL) {
+      put(w, "  pc = 0x%04x;\n  reason = %s;\n  goto done;\n", pc,
+          (opcode == 0x00) ? "SR_BRK" : "SR_ILLEGAL");
+      open = false;
+      continue;
+    }
+
+    e.next = pc + e.d.len;
+    if (e.d.mode == Relative) {
+      e.operand = e.next + (i8)image[(u16)(pc + 1)];
+    } else if (e.d.len == 3) {
+      e.operand = image[(u16)(pc + 1)] | (image[(u16)(pc + 2)] << 8);
+    } else {
+      e.operand = image[(u16)(pc + 1)];
+    }
+    snprintf(e.o, sizeof(e.o), (e.d.len == 3 || e.d.mode == Relative)
+                                   ? "0x%04x"
+                                   : "0x%02x",
+             e.operand);
+
+    put(w, "  // $%04x %s\n", pc, instruction_to_string(e.d.instruction));
+    open = emit_instruction(&e);
+  }
+
+  if (open) {
+    e.in = "  ";
+    emit_goto(&e, b->end);
+  }
+}
+
+// the interpreter, one case per opcode. it runs anything that isn't the start
+// of a block, and everything once the code's been written over.
+static void emit_step(Writer *w) {
+  put(w, "  switch (mem[pc]) {\n");
+  for (uint opcode = 0; opcode < 0x100; opcode++) {
+    DecodeEntry d = decode_table[opcode];
+    if (opcode == 0x00) {
+      put(w, "  case 0x00:\n    reason = SR_BRK;\n    goto done;\n");
+      continue;
+    }
+    if (d.instruction == LEXEME_NULL) {
+      continue;
+    }
+
+    put(w, "  case 0x%02x: // %s\n", opcode,
+        instruction_to_string(d.instruction));
+    if (d.mode == Relative) {
+      put(w, "    opnd = pc + 2 + (i8)mem[(u16)(pc + 1)];\n");
+    } else if (d.len == 2) {
+      put(w, "    opnd = mem[(u16)(pc + 1)];\n");
+    } else if (d.len == 3) {
+      put(w, "    opnd = mem[(u16)(pc + 1)] | (mem[(u16)(pc + 2)] << 8);\n");
+    }
+    put(w, "    pc += %d;\n", d.len);
+
+    Emit e = {.w = w, .in = "    ", .d = d, .step = true, .o = "opnd"};
+    emit_instruction(&e);
+    put(w, "    goto dispatch;\n");
+  }
+  put(w, "  default:\n    reason = SR_ILLEGAL;\n    goto done;\n  }\n");
+}
+
+static void emit_bytes(Writer *w, const u8 *bytes, u32 len) {
+  for (u32 i = 0; i < len; i += 16) {
+    put(w, " ");
+    for (u32 b = i; b < i + 16 && b < len; b++) {
+      put(w, " 0x%02x,", bytes[b]);
+    }
+    put(w, "\n");
+  }
+}
+
+static const char *prelude =
+    "#include \"core.h\"\n"
+    "#include \"ops.h\"\n"
+    "\n"
+    "#include <stdbool.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "// stores to the bytes the blocks were built from leave everything after\n"
+    "// them to the interpreter.\n"
+    "#define WR(address, v) \\\n"
+    "  do { \\\n"
+    "    u16 wr_ = (address); \\\n"
+    "    mem[wr_] = (v); \\\n"
+    "    c->dirty_pages[wr_ >> 8] = 1; \\\n"
+    "    if ((u16)(wr_ - CODE_START) < CODE_LEN && \\\n"
+    "        code[wr_ - CODE_START]) { \\\n"
+    "      stale = true; \\\n"
+    "    } \\\n"
+    "  } while (0)\n"
+    "\n"
+    "#define PUSH(v) \\\n"
+    "  do { \\\n"
+    "    WR(0x100 | sp, (v)); \\\n"
+    "    sp--; \\\n"
+    "  } while (0)\n"
+    "\n"
+    "#define PULL() (sp++, mem[0x100 | sp])\n"
+    "\n";
+
+void emit_c(Writer *w, const u8 *image, const char *source) {
+  // the banks all sit at the same addresses, the blocks would land on each
+  // other.
+  if (layout_banks > 0) {
+    error("A program with banks can't be written out as C.");
+  }
+  build_blocks();
+
+  memset(is_label, 0, sizeof(is_label));
+  u32 code_start = 0x10000, code_end = 0;
+  for (uint i = 0; i < num_blocks; i++) {
+    BasicBlock *b = &blocks[i];
+    is_label[b->start] = true;
+    code_start = (b->start < code_start) ? b->start : code_start;
+    code_end = (b->end > code_end) ? b->end : code_end;
+    for (u32 pc = b->start; pc < b->end; pc += instruction_len(image[pc])) {
+      u32 next = pc + instruction_len(image[pc]);
+      if (decode_table[image[pc]].instruction == JSR && next < b->end) {
+        is_label[next] = true;
+      }
+    }
+  }
+  if (code_start > code_end) {
+    code_start = code_end = 0;
+  }
+
+  put(w, "// built by asm build --emit-c from %s, rebuild it instead of "
+         "editing it.\n",
+      source);
+  put(w, "// cc -O2 -I<asm's src dir> -DAOT_MAIN this.c runs it standalone.\n");
+  writer_put_str(w, prelude);
+  put(w, "#define ORIGIN 0x%04x\n#define CODE_START 0x%04x\n#define CODE_LEN "
+         "%u\n\n",
+      layout_origin, code_start, code_end - code_start);
+
+  put(w, "// the assembled program, from ORIGIN.\n");
+  put(w, "static const u8 image[] = {\n");
+  emit_bytes(w, image + layout_origin, layout_end - layout_origin);
+  put(w, "};\n\n");
+
+  // which of the bytes from CODE_START the blocks were compiled from.
+  static u8 code[0x10000];
+  memset(code, 0, sizeof(code));
+  for (uint i = 0; i < num_blocks; i++) {
+    memset(code + blocks[i].start - code_start, 1,
+           blocks[i].end - blocks[i].start);
+  }
+  put(w, "// the bytes from CODE_START that got compiled into the blocks.\n");
+  put(w, "static const u8 code[CODE_LEN + 1] = {\n");
+  emit_bytes(w, code, code_end - code_start);
+  put(w, "};\n\n");
+
+  writer_put_str(w, "void aot_load(Core *c) {\n"
+                    "  memcpy(c->memory + ORIGIN, image, sizeof(image));\n"
+                    "}\n\n");
+
+  writer_put_str(
+      w,
+      "StopReason aot_run(Core *c, RunBudget budget) {\n"
+      "  u8 *mem = c->memory;\n"
+      "  u8 a = c->a, x = c->x, y = c->y, sp = c->sp, p = c->p;\n"
+      "  u16 pc = c->pc, ea = 0, base = 0, opnd = 0;\n"
+      "  u64 cycles = c->cycles, instructions = c->instructions;\n"
+      "  u64 cycle_limit = budget.cycles ? cycles + budget.cycles : "
+      "UINT64_MAX;\n"
+      "  u64 instruction_limit =\n"
+      "      budget.instructions ? instructions + budget.instructions : "
+      "UINT64_MAX;\n"
+      "  bool stale = false;\n"
+      "  StopReason reason = SR_NONE;\n"
+      "\n"
+      "dispatch:\n"
+      "  if (!stale) {\n"
+      "    switch (pc) {\n");
+  for (u32 pc = 0; pc < 0x10000; pc++) {
+    if (is_label[pc]) {
+      put(w, "    case 0x%04x:\n      goto b_%04x;\n", pc, pc);
+    }
+  }
+  writer_put_str(w, "    }\n"
+                    "  }\n"
+                    "\n"
+                    "step:\n"
+                    "  if (cycles >= cycle_limit) {\n"
+                    "    reason = SR_MAX_CYCLES;\n"
+                    "    goto done;\n"
+                    "  }\n"
+                    "  if (instructions >= instruction_limit) {\n"
+                    "    reason = SR_MAX_INSTRUCTIONS;\n"
+                    "    goto done;\n"
+                    "  }\n");
+  emit_step(w);
+
+  for (uint i = 0; i < num_blocks; i++) {
+    emit_block(w, image, &blocks[i]);
+  }
+
+  writer_put_str(w, "\ndone:\n"
+                    "  (void)ea;\n"
+                    "  (void)base;\n"
+                    "  (void)opnd;\n"
+                    "  c->a = a;\n"
+                    "  c->x = x;\n"
+                    "  c->y = y;\n"
+                    "  c->sp = sp;\n"
+                    "  c->p = p;\n"
+                    "  c->pc = pc;\n"
+                    "  c->cycles = cycles;\n"
+                    "  c->instructions = instructions;\n"
+                    "  return reason;\n"
+                    "}\n\n");
+
+  // the same state asm run --dump-state text prints, without the memory.
+  writer_put_str(w, "#ifdef AOT_MAIN\n"
+                    "static const char *reasons[SR_COUNT] = {");
+  for (int r = 0; r < SR_COUNT; r++) {
+    put(w, "%s\"%s\"", (r == 0) ? "" : ", ", stop_reason_to_string(r));
+  }
+  writer_put_str(
+      w,
+      "};\n\n"
+      "// the only argument is the cycle cap, 0 takes it off.\n"
+      "int main(int argc, char *argv[]) {\n"
+      "  static Core c;\n"
+      "  aot_load(&c);\n"
+      "  c.sp = 0xfd;\n"
+      "  c.p = FLAG_U | FLAG_I;\n"
+      "  c.pc = ORIGIN;\n");
+  put(w, "  RunBudget budget = {.cycles = %d};\n", DEFAULT_MAX_CYCLES);
+  writer_put_str(
+      w,
+      "  if (argc > 1) {\n"
+      "    budget.cycles = strtoull(argv[1], NULL, 0);\n"
+      "  }\n"
+      "  StopReason r = aot_run(&c, budget);\n"
+      "\n"
+      "  printf(\"stop: %s\\npc: $%04x  a: $%02x  x: $%02x  y: $%02x  \"\n"
+      "         \"sp: $%02x  status: \",\n"
+      "         reasons[r], c.pc, c.a, c.x, c.y, c.sp);\n"
+      "  for (int bit = 7; bit >= 0; bit--) {\n"
+      "    putchar('0' + ((c.p >> bit) & 1));\n"
+      "  }\n"
+      "  printf(\"\\ncycles: %llu  instructions: %llu\\n\",\n"
+      "         (unsigned long long)c.cycles,\n"
+      "         (unsigned long long)c.instructions);\n"
+      "  return (r == SR_BRK) ? 0 : 2;\n"
+      "}\n"
+      "#endif\n");
+}
+
+#define AOT_TEST_SOURCE "/tmp/6502_aot_test.c"
+#define AOT_TEST_BINARY "/tmp/6502_aot_test"
+
+static void read_all(int fd, char *buf, size_t cap) {
+  size_t len = 0;
+  ssize_t n;
+  while (len < cap - 1 && (n = read(fd, buf + len, cap - 1 - len)) > 0) {
+    len += n;
+  }
+  buf[len] = '\0';
+}
+
+// build the C for source, compile it and check it stops in the same state as
+// the core with the same cycle cap.
+static bool same_as_core(char *source, u64 max_cycles) {
+  static Machine m;
+  u8 *image = assemble_source(source);
+
+  static Writer w;
+  int fd = open(AOT_TEST_SOURCE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  writer_init(&w, fd);
+  emit_c(&w, image, "test");
+  writer_flush(&w);
+  close(fd);
+
+  if (system("cc -O1 -Wall -Werror -Isrc -DAOT_MAIN -o " AOT_TEST_BINARY
+             " " AOT_TEST_SOURCE) != 0) {
+    return false;
+  }
+  char cmd[128], aot[512], core[512];
+  snprintf(cmd, sizeof(cmd), AOT_TEST_BINARY " %lu", (unsigned long)max_cycles);
+  FILE *p = popen(cmd, "r");
+  read_all(fileno(p), aot, sizeof(aot));
+  pclose(p);
+
+  machine_init(&m);
+  load_image(&m, image, layout_origin, layout_end);
+  machine_reset(&m, layout_origin);
+  machine_run(&m, (RunBudget){.cycles = max_cycles});
+  FILE *f = tmpfile();
+  writer_init(&w, fileno(f));
+  dump_state_text(&w, &m, NULL, 0);
+  writer_flush(&w);
+  lseek(fileno(f), 0, SEEK_SET);
+  read_all(fileno(f), core, sizeof(core));
+  fclose(f);
+
+  printf("%s", aot);
+  return strcmp(aot, core) == 0;
+}
+
+void test_recompile() {
+  printf("\n\nTESTING RECOMPILE\n\n\n");
+
+  if (system("cc --version > /dev/null 2>&1") != 0 ||
+      access("src/ops.h", R_OK) != 0) {
+    printf("no cc, or not running from the top of the repo. skipping.\n");
+    printf("\n\nDONE TESTING RECOMPILE, SUCCESS!\n\n\n");
+    return;
+  }
+
+  // decimal mode, page crossing reads, a computed jump, and a JSR whose
+  // return address is in the middle of a block.
+  char *mix = "  jmp start\n"
+              "ptr:\n"
+              "  .word done\n"
+              "start:\n"
+              "  jsr fill\n"
+              "  ldx #$00\n"
+              "  sed\n"
+              "sum:\n"
+              "  lda $02f0,X\n"
+              "  adc #$19\n"
+              "  sta $02f0,X\n"
+              "  eor $10\n"
+              "  sta $10\n"
+              "  inx\n"
+              "  bne sum\n"
+              "  cld\n"
+              "  jmp (ptr)\n"
+              "fill:\n"
+              "  ldy #$1f\n"
+              "fill_loop:\n"
+              "  tya\n"
+              "  sta ($30),Y\n"
+              "  dey\n"
+              "  bne fill_loop\n"
+              "  rts\n"
+              "done:\n"
+              "  pha\n"
+              "  php\n"
+              "  pla\n"
+              "  asl\n"
+              "  rol $10\n"
+              "  ror $10,X\n"
+              "  lsr $0200\n"
+              "  inc $0200,X\n"
+              "  dec $11\n"
+              "  bit $10\n"
+              "  sbc ($10),Y\n"
+              "  cmp #$40\n"
+              "  tsx\n"
+              "  txs\n"
+              "  brk\n";
+  ASSERT(same_as_core(mix, 0), "instruction mix runs to the brk");
+  ASSERT(same_as_core(mix, 1000), "stops on the same instruction on a budget");
+  ASSERT(same_as_core(mix, 1337), "and on another one");
+
+  // the sta writes over the lda's operand inside its own block.
+  char *smc = "  ldx #$05\n"
+              "loop:\n"
+              "  lda #$00\n"
+              "  clc\n"
+              "  adc #$01\n"
+              "  sta $0603\n"
+              "  dex\n"
+              "  bne loop\n"
+              "  brk\n";
+  ASSERT(same_as_core(smc, 0), "self-modifying code");
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING RECOMPILE, SUCCESS!\n\n\n");
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "defines.h"
+#include "writer.h"
+
+// static recompilation of an assembled program to C. every basic block the
+// timing pass finds turns into straight line C over a Core's registers and
+// memory, with the constant operands and the jumps between blocks resolved at
+// build time. anything the blocks can't cover (computed jumps, returns into
+// the middle of a block, code written at runtime) goes through an interpreter
+// written out alongside them.
+//
+// the output includes core.h and ops.h, so it builds with
+//   cc -O2 -I<this src dir> -DAOT_MAIN prog.c -o prog
+// into a standalone program that runs from the origin and prints the state
+// like asm run does. without AOT_MAIN it's just aot_load() and aot_run() for
+// linking into something else.
+
+// write out the C for the program that's currently laid out in image, which
+// is indexed by address. source is only for the comment at the top.
+void emit_c(Writer *w, const u8 *image, const char *source);
+
+void test_recompile();
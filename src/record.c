@@ -0,0 +1,695 @@
+#include "record.h"
+
+#include "assembler.h"
+#include "ast.h"
+#include "bank.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "map.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void write_all(int fd, const u8 *s, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, s, n);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("Couldn't write the replay log.");
+    }
+    s += written;
+    n -= written;
+  }
+}
+
+static void *record_main(void *arg) {
+  Recorder *r = arg;
+  pthread_mutex_lock(&r->lock);
+  while (1) {
+    while (!r->pending && !r->stopping) {
+      pthread_cond_wait(&r->changed, &r->lock);
+    }
+    if (!r->pending) {
+      break;
+    }
+    // the chunk that isn't filling is ours until pending goes back down.
+    const u8 *chunk = r->chunks[r->filling ^ 1];
+    uint len = r->pending_len;
+    pthread_mutex_unlock(&r->lock);
+    write_all(r->fd, chunk, len);
+    pthread_mutex_lock(&r->lock);
+    r->pending = false;
+    pthread_cond_broadcast(&r->changed);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+// hand the filled chunk to the thread and start on the other one, once the
+// thread's done with it.
+static void hand_off(Recorder *r) {
+  pthread_mutex_lock(&r->lock);
+  while (r->pending) {
+    pthread_cond_wait(&r->changed, &r->lock);
+  }
+  r->pending = true;
+  r->pending_len = r->len;
+  r->filling ^= 1;
+  pthread_cond_broadcast(&r->changed);
+  pthread_mutex_unlock(&r->lock);
+  r->len = 0;
+}
+
+static inline u8 *reserve(Recorder *r, uint n) {
+  if (r->len + n > RECORD_CHUNK_LEN) {
+    hand_off(r);
+  }
+  return &r->chunks[r->filling][r->len];
+}
+
+// 7 bits at a time, low first, with the top bit set on all but the last.
+static inline uint put_varint(u8 *out, u64 v) {
+  uint len = 0;
+  while (v >= 0x80) {
+    out[len++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  out[len++] = v;
+  return len;
+}
+
+static void put(Recorder *r, u64 v) {
+  u8 *out = reserve(r, 10);
+  uint len = put_varint(out, v);
+  r->len += len;
+  r->bytes += len;
+}
+
+static void put_bytes(Recorder *r, const u8 *bytes, uint n) {
+  memcpy(reserve(r, n), bytes, n);
+  r->len += n;
+  r->bytes += n;
+}
+
+// fnv-1a over everything a replay has to get the same.
+static u64 state_hash(const Core *c, const Banks *banks) {
+  u64 h = 14695981039346656037ull;
+  u8 regs[] = {c->a, c->x, c->y, c->sp, c->p, c->pc & 0xff, c->pc >> 8};
+  for (uint i = 0; i < sizeof(regs); i++) {
+    h = (h ^ regs[i]) * 1099511628211ull;
+  }
+  h = (h ^ c->cycles) * 1099511628211ull;
+  h = (h ^ c->instructions) * 1099511628211ull;
+  for (uint i = 0; i < 0x10000; i++) {
+    h = (h ^ c->memory[i]) * 1099511628211ull;
+  }
+  if (banks != NULL) {
+    h = (h ^ banks->current) * 1099511628211ull;
+  }
+  return h;
+}
+
+static void put_event(Recorder *r, RecordEvent kind) {
+  Core *c = r->core;
+  put(r, ((c->instructions - r->last_instructions) << RECORD_KIND_BITS) |
+             kind);
+  r->last_instructions = c->instructions;
+  r->events++;
+}
+
+// a bit for each page with anything in it, then just those pages.
+static void put_pages(Recorder *r, const u8 *bytes, uint pages) {
+  static u8 used[BANKS_LEN * BANK_PAGES / 8];
+  memset(used, 0, (pages + 7) / 8);
+  for (uint page = 0; page < pages; page++) {
+    for (uint i = 0; i < 0x100; i++) {
+      if (bytes[(page << 8) | i] != 0) {
+        used[page >> 3] |= 1 << (page & 7);
+        break;
+      }
+    }
+  }
+  put_bytes(r, used, (pages + 7) / 8);
+  for (uint page = 0; page < pages; page++) {
+    if (used[page >> 3] & (1 << (page & 7))) {
+      put_bytes(r, &bytes[page << 8], 0x100);
+    }
+  }
+}
+
+// what a page table entry points at in the log: below MK_SINK it's that page
+// of the core's memory, from MK_BANK on it's a page of the banks.
+enum { MK_SINK = 0x100, MK_DEVICE, MK_REGISTER, MK_BANK };
+
+static u64 map_kind(const Recorder *r, const u8 *entry, u8 page) {
+  const Core *c = r->core;
+  const Banks *b = r->banks;
+  if (entry == NULL) {
+    return (b != NULL && c->map->devices[page] == &b->select) ? MK_REGISTER
+                                                               : MK_DEVICE;
+  }
+  if (entry == c->map->sink) {
+    return MK_SINK;
+  }
+  if (entry >= c->memory && entry < c->memory + sizeof(c->memory)) {
+    return (entry - c->memory) >> 8;
+  }
+  if (b != NULL && entry >= b->bytes &&
+      entry < b->bytes + (size_t)b->count * BANK_SIZE) {
+    return MK_BANK + ((entry - b->bytes) >> 8);
+  }
+  error("Page $%02x is mapped somewhere outside the core and its banks, "
+        "which can't be recorded.",
+        page);
+}
+
+static u8 tap_read(void *ctx, u16 address) {
+  Recorder *r = ctx;
+  Device *d = r->tapped[address >> 8];
+  u8 value = d->read(d->ctx, address);
+  // the core only keeps its instruction count up between runs, so a read
+  // doesn't have one. the replay hands them back in order instead.
+  put(r, RE_READ);
+  put_bytes(r, &value, 1);
+  r->events++;
+  return value;
+}
+
+static void tap_write(void *ctx, u16 address, u8 value) {
+  Recorder *r = ctx;
+  Device *d = r->tapped[address >> 8];
+  if (d->write != NULL) {
+    d->write(d->ctx, address, value);
+  }
+}
+
+// the map's pages, and the banks to start with, with the device reads tapped
+// from here on.
+static void put_map(Recorder *r) {
+  MemoryMap *m = r->core->map;
+  const Banks *b = r->banks;
+  put(r, (b != NULL) ? b->count : 0);
+  if (b != NULL) {
+    put(r, b->current);
+    put_pages(r, b->bytes, b->count * BANK_PAGES);
+  }
+  for (uint page = 0; page < 0x100; page++) {
+    put(r, map_kind(r, m->read[page], page));
+    put(r, map_kind(r, m->write[page], page));
+  }
+
+  r->tap = (Device){tap_read, tap_write, r};
+  for (uint page = 0; page < 0x100; page++) {
+    if (m->read[page] == NULL) {
+      r->tapped[page] = m->devices[page];
+      m->devices[page] = &r->tap;
+    }
+  }
+}
+
+void record_start(Recorder *r, Core *c, const Banks *banks, int fd) {
+  memset(r, 0, sizeof(Recorder));
+  r->core = c;
+  r->banks = banks;
+  r->fd = fd;
+  r->last_instructions = c->instructions;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->changed, NULL);
+  pthread_create(&r->thread, NULL, record_main, r);
+
+  put_bytes(r, (const u8 *)RECORD_MAGIC, 8);
+  put(r, RECORD_VERSION);
+  put(r, c->a);
+  put(r, c->x);
+  put(r, c->y);
+  put(r, c->sp);
+  put(r, c->p);
+  put(r, c->pc);
+  put(r, c->cycles);
+  put(r, c->instructions);
+  put_pages(r, c->memory, 0x100);
+
+  put(r, c->map != NULL);
+  if (c->map != NULL) {
+    put_map(r);
+  }
+}
+
+void record_write(Recorder *r, u16 address, u8 value) {
+  put_event(r, RE_WRITE);
+  put(r, address);
+  put_bytes(r, &value, 1);
+  core_write(r->core, address, value);
+}
+
+bool record_irq(Recorder *r) {
+  if (!core_irq(r->core)) {
+    return false;
+  }
+  put_event(r, RE_IRQ);
+  return true;
+}
+
+void record_nmi(Recorder *r) {
+  put_event(r, RE_NMI);
+  core_nmi(r->core);
+}
+
+void record_finish(Recorder *r, StopReason reason) {
+  put_event(r, RE_END);
+  put(r, reason);
+  u64 h = state_hash(r->core, r->banks);
+  u8 bytes[8];
+  for (uint i = 0; i < 8; i++) {
+    bytes[i] = h >> (i * 8);
+  }
+  put_bytes(r, bytes, 8);
+
+  hand_off(r);
+  pthread_mutex_lock(&r->lock);
+  r->stopping = true;
+  pthread_cond_broadcast(&r->changed);
+  pthread_mutex_unlock(&r->lock);
+  pthread_join(r->thread, NULL);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->changed);
+
+  // the map's devices back how they were.
+  for (uint page = 0; page < 0x100; page++) {
+    if (r->tapped[page] != NULL) {
+      r->core->map->devices[page] = r->tapped[page];
+    }
+  }
+}
+
+typedef struct LogReader {
+  const u8 *at;
+  const u8 *end;
+} LogReader;
+
+static u64 get(LogReader *l) {
+  u64 v = 0;
+  for (uint shift = 0; shift < 64; shift += 7) {
+    if (l->at >= l->end) {
+      error("The replay log is cut short.");
+    }
+    u8 b = *l->at++;
+    v |= (u64)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return v;
+    }
+  }
+  error("The replay log has a bad number in it.");
+}
+
+static const u8 *get_bytes(LogReader *l, size_t n) {
+  if ((size_t)(l->end - l->at) < n) {
+    error("The replay log is cut short.");
+  }
+  const u8 *bytes = l->at;
+  l->at += n;
+  return bytes;
+}
+
+static void get_pages(LogReader *l, u8 *bytes, uint pages) {
+  const u8 *used = get_bytes(l, (pages + 7) / 8);
+  memset(bytes, 0, (size_t)pages << 8);
+  for (uint page = 0; page < pages; page++) {
+    if (used[page >> 3] & (1 << (page & 7))) {
+      memcpy(&bytes[page << 8], get_bytes(l, 0x100), 0x100);
+    }
+  }
+}
+
+// past whatever comes after an event's tag.
+static void skip_event(LogReader *l, RecordEvent kind) {
+  switch (kind) {
+  case RE_WRITE:
+    get(l);
+    get_bytes(l, 1);
+    break;
+  case RE_READ:
+    get_bytes(l, 1);
+    break;
+  case RE_IRQ:
+  case RE_NMI:
+    break;
+  default:
+    error("The replay log has a bad event in it.");
+  }
+}
+
+// the map a replay runs through, which stays on the core after for whatever
+// looks at where it ended.
+static MemoryMap replay_map;
+static Banks replay_banks;
+static u8 *replay_bank_bytes;
+
+// the device reads come out of the same log, a cursor of their own going
+// through it ahead of the events.
+static LogReader replay_reads;
+
+static u8 replayed_read(void *ctx, u16 address) {
+  LogReader *l = ctx;
+  while (1) {
+    RecordEvent kind = get(l) & ((1 << RECORD_KIND_BITS) - 1);
+    if (kind == RE_READ) {
+      return *get_bytes(l, 1);
+    }
+    if (kind == RE_END) {
+      error("The replay reads more from the devices than the recording did.");
+    }
+    skip_event(l, kind);
+  }
+}
+
+// the device was told about the write when it was recorded, and nothing it
+// did with it gets back to the core but through its reads.
+static void replayed_write(void *ctx, u16 address, u8 value) {}
+
+static Device replayed = {replayed_read, replayed_write, &replay_reads};
+
+static u8 *replayed_entry(Core *c, u64 kind) {
+  if (kind < MK_SINK) {
+    return &c->memory[kind << 8];
+  }
+  if (kind == MK_SINK) {
+    return replay_map.sink;
+  }
+  if (kind == MK_DEVICE || kind == MK_REGISTER) {
+    return NULL;
+  }
+  if (replay_bank_bytes == NULL ||
+      kind - MK_BANK >= (u64)replay_banks.count * BANK_PAGES) {
+    error("The replay log's map has a page that isn't in its banks.");
+  }
+  return replay_bank_bytes + ((kind - MK_BANK) << 8);
+}
+
+static void get_map(LogReader *l, Core *c) {
+  map_init(&replay_map, c->memory);
+  free(replay_bank_bytes);
+  replay_bank_bytes = NULL;
+  memset(&replay_banks, 0, sizeof(Banks));
+
+  uint count = get(l);
+  if (count > BANKS_LEN) {
+    error("The replay log has %u banks, the limit is %d.", count, BANKS_LEN);
+  }
+  if (count > 0) {
+    uint current = get(l);
+    replay_bank_bytes = malloc((size_t)count * BANK_SIZE);
+    if (replay_bank_bytes == NULL) {
+      error("Couldn't allocate the replay's %u banks.", count);
+    }
+    get_pages(l, replay_bank_bytes, count * BANK_PAGES);
+    banks_init(&replay_banks, &replay_map, replay_bank_bytes, count);
+    bank_switch(&replay_banks, current);
+  }
+
+  for (uint page = 0; page < 0x100; page++) {
+    u64 read = get(l), write = get(l);
+    if (read == MK_REGISTER || (write == MK_REGISTER && count == 0)) {
+      error("The replay log's map has the bank register where it can't be.");
+    }
+    replay_map.read[page] = replayed_entry(c, read);
+    replay_map.write[page] = replayed_entry(c, write);
+    replay_map.devices[page] = (write == MK_REGISTER) ? &replay_banks.select
+                               : (read == MK_DEVICE || write == MK_DEVICE)
+                                   ? &replayed
+                                   : NULL;
+  }
+  c->map = &replay_map;
+}
+
+// run up to the given instruction count, or as far as the program goes.
+static void run_to(Core *c, u64 target) {
+  while (c->instructions < target) {
+    RunBudget budget = {.instructions = target - c->instructions};
+    StopReason reason = core_run(c, budget);
+    if (reason == SR_BRK || reason == SR_ILLEGAL) {
+      break;
+    }
+  }
+}
+
+bool replay(Core *c, const u8 *log, size_t len, StopReason *reason) {
+  LogReader l = {log, log + len};
+  if (memcmp(get_bytes(&l, 8), RECORD_MAGIC, 8) != 0 ||
+      get(&l) != RECORD_VERSION) {
+    error("That isn't a replay log from this version.");
+  }
+
+  c->map = NULL;
+  core_clear(c);
+  Registers regs;
+  regs.a = get(&l);
+  regs.x = get(&l);
+  regs.y = get(&l);
+  regs.sp = get(&l);
+  regs.p = get(&l);
+  regs.pc = get(&l);
+  core_reset(c, regs.pc);
+  core_set_registers(c, regs);
+  c->cycles = get(&l);
+  c->instructions = get(&l);
+
+  static u8 memory[0x10000];
+  get_pages(&l, memory, 0x100);
+  core_load(c, memory, 0, sizeof(memory));
+  if (get(&l)) {
+    get_map(&l, c);
+  }
+
+  replay_reads = l;
+  u64 at = c->instructions;
+  while (1) {
+    u64 tag = get(&l);
+    at += tag >> RECORD_KIND_BITS;
+    run_to(c, at);
+
+    switch (tag & ((1 << RECORD_KIND_BITS) - 1)) {
+    case RE_WRITE: {
+      u16 address = get(&l);
+      core_write(c, address, *get_bytes(&l, 1));
+      break;
+    }
+    case RE_IRQ:
+      core_irq(c);
+      break;
+    case RE_NMI:
+      core_nmi(c);
+      break;
+    case RE_READ:
+      // the map's device has had it, or will on the way to the next event.
+      get_bytes(&l, 1);
+      break;
+    case RE_END: {
+      *reason = get(&l);
+      const u8 *bytes = get_bytes(&l, 8);
+      u64 h = 0;
+      for (uint i = 0; i < 8; i++) {
+        h |= (u64)bytes[i] << (i * 8);
+      }
+      return h == state_hash(c, (c->map != NULL && replay_banks.count > 0)
+                                    ? &replay_banks
+                                    : NULL);
+    }
+    default:
+      error("The replay log has a bad event in it.");
+    }
+  }
+}
+
+bool replay_file(Core *c, const char *path, StopReason *reason) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    error("Could not open the replay log %s.", path);
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  u8 *buf = malloc(len > 0 ? len : 1);
+  if (fread(buf, 1, len, f) != (size_t)len) {
+    error("Could not read the replay log %s.", path);
+  }
+  fclose(f);
+
+  bool matched = replay(c, buf, len, reason);
+  free(buf);
+  return matched;
+}
+
+// at $0600. cli, loop: lda $f0, clc, adc $10, sta $10, inc $11, jmp loop.
+// the interrupt handler at $060d is inc $12, rti. $f0 is the input port.
+static const u8 record_program[] = {0x58, 0xa5, 0xf0, 0x18, 0x65, 0x10,
+                                    0x85, 0x10, 0xe6, 0x11, 0x4c, 0x01,
+                                    0x06, 0xe6, 0x12, 0x40};
+
+// enough for the log to go through both chunks a few times.
+#define RECORD_TEST_ROUNDS 30000
+
+// a port that reads something different every time, so a replay can only get
+// it back out of the log.
+static u8 counter_read(void *ctx, u16 address) {
+  uint *reads = ctx;
+  return ++*reads * 17;
+}
+
+// the whole log, read back out of the file it was written to.
+static size_t read_back(FILE *f, u8 *buf, size_t size) {
+  fflush(f);
+  lseek(fileno(f), 0, SEEK_SET);
+  size_t len = 0;
+  ssize_t n;
+  while (len < size && (n = read(fileno(f), buf + len, size - len)) > 0) {
+    len += n;
+  }
+  return len;
+}
+
+void test_record() {
+  printf("\n\nTESTING RECORD\n\n\n");
+
+  init_decode_table();
+
+  static Core c, again;
+  static Recorder r;
+  static u8 log[1024 * 256];
+
+  core_init(&c);
+  core_load(&c, record_program, 0x0600, sizeof(record_program));
+  static const u8 vectors[] = {0x0d, 0x06, 0x00, 0x00, 0x0d, 0x06};
+  core_load(&c, vectors, 0xfffa, sizeof(vectors));
+  core_reset(&c, 0x0600);
+
+  FILE *f = tmpfile();
+  record_start(&r, &c, NULL, fileno(f));
+  u64 header = r.bytes;
+  uint irqs = 0;
+  for (uint i = 0; i < RECORD_TEST_ROUNDS; i++) {
+    // runs of any length, and inputs landing wherever they land.
+    core_run(&c, (RunBudget){.cycles = 1 + i * 37 % 300});
+    record_write(&r, 0xf0, i * 13);
+    if (i % 7 == 0) {
+      irqs += record_irq(&r);
+    }
+    if (i % 500 == 499) {
+      record_nmi(&r);
+    }
+  }
+  record_finish(&r, SR_MAX_CYCLES);
+  size_t len = read_back(f, log, sizeof(log));
+  fclose(f);
+
+  ASSERT(irqs > 0 && c.memory[0x12] != 0, "the handler got run");
+  uint nmis = RECORD_TEST_ROUNDS / 500;
+  ASSERT(len == r.bytes && len > 2 * RECORD_CHUNK_LEN &&
+             r.events == RECORD_TEST_ROUNDS + irqs + nmis + 1,
+         "the thread wrote the whole log out");
+  printf("%lu events in %lu bytes over %lu instructions\n",
+         (unsigned long)r.events, (unsigned long)len,
+         (unsigned long)c.instructions);
+  ASSERT(len < 8 * r.events + 0x400, "the log is compact");
+
+  StopReason reason;
+  core_init(&again);
+  ASSERT(replay(&again, log, len, &reason) && reason == SR_MAX_CYCLES,
+         "replaying ends in the same state");
+  ASSERT(again.cycles == c.cycles && again.instructions == c.instructions &&
+             again.pc == c.pc &&
+             memcmp(again.memory, c.memory, sizeof(c.memory)) == 0,
+         "down to the memory");
+
+  // change the first input, and it doesn't come out the same. it's the
+  // byte after a one byte tag and a two byte address.
+  size_t i = header + 3;
+  log[i] ^= 0x01;
+  bool matched = replay(&again, log, len, &reason);
+  log[i] ^= 0x01;
+  ASSERT(!matched, "a different input ends up somewhere else");
+  ASSERT(replay(&again, log, len, &reason), "and the log still replays");
+
+  // a call into the bank that's in to start with, then into each bank in
+  // turn, storing what the port reads through a mirror and into ROM.
+  u8 *image = assemble_source("  jsr $8000\n"
+                              "  ldx #$00\n"
+                              "loop:\n"
+                              "  stx $8000\n"
+                              "  jsr $8000\n"
+                              "  inx\n"
+                              "  cpx #$03\n"
+                              "  bne loop\n"
+                              "  lda $d000\n"
+                              "  sta $1001\n"
+                              "  sta $f000\n"
+                              "  brk\n"
+                              ".bank 0\n"
+                              "  lda $d000\n"
+                              "  sta $0a00,X\n"
+                              "  rts\n"
+                              ".bank 1\n"
+                              "  lda $d000\n"
+                              "  eor #$ff\n"
+                              "  sta $0a00,X\n"
+                              "  rts\n"
+                              ".bank 2\n"
+                              "  lda $d000\n"
+                              "  asl\n"
+                              "  sta $0a04\n"
+                              "  rts\n");
+  static MemoryMap m;
+  static Banks b;
+  uint reads = 0;
+  Device port = {counter_read, NULL, &reads};
+  core_init(&c);
+  map_init(&m, c.memory);
+  banks_init(&b, &m, layout_bank_image, layout_banks);
+  bank_switch(&b, 2);
+  map_mirror(&m, 0x08, 0x18, 0x00, 0x08);
+  map_rom(&m, 0xf0, 1, &c.memory[0xf000]);
+  map_device(&m, 0xd0, 1, &port);
+  c.map = &m;
+  core_load(&c, image + layout_origin, layout_origin,
+            layout_end - layout_origin);
+  core_reset(&c, layout_origin);
+
+  f = tmpfile();
+  record_start(&r, &c, &b, fileno(f));
+  StopReason ended = core_run(&c, (RunBudget){0});
+  record_finish(&r, ended);
+  len = read_back(f, log, sizeof(log));
+  fclose(f);
+  ASSERT(ended == SR_BRK && reads == 5 && r.events == reads + 1 &&
+             m.devices[0xd0] == &port,
+         "the port's reads are in the log, and the map's put back after");
+  ASSERT(c.memory[0x0200] == 34 && c.memory[0x0201] == 0xcc &&
+             c.memory[0x0204] == 136 && c.memory[0x0001] == 85 &&
+             c.memory[0xf000] == 0 && b.current == 2,
+         "the recording went through the mirror, the ROM and the banks");
+
+  core_init(&again);
+  ASSERT(replay(&again, log, len, &reason) && reason == SR_BRK,
+         "a mapped and banked run replays");
+  ASSERT(again.map == &replay_map && replay_banks.current == b.current &&
+             memcmp(again.memory, c.memory, sizeof(c.memory)) == 0 &&
+             core_peek(&again, 0x8000) == core_peek(&c, 0x8000) &&
+             reads == 5,
+         "through the same map, with the reads from the log and not the port");
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING RECORD, SUCCESS!\n\n\n");
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "bank.h"
+#include "core.h"
+#include "defines.h"
+#include "map.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// recording a run compactly enough to leave on, and replaying it exactly.
+// the core itself is deterministic, so the log only has what comes from
+// outside it: the state it started in, then every interrupt and every byte
+// put into memory from outside (an input port, a key), each at the
+// instruction count it happened at. replaying runs the core to each of those
+// counts and does the same thing there.
+//
+// a run through a map (see map.h) has the map's pages in the starting state
+// too, and the banks with the one that's in, and every byte read from a
+// device is an event. the replay gets the same map, with the reads handed
+// back out of the log in order, and the writes to a device going nowhere
+// unless it's the bank register.
+//
+// the log is a header, the starting state, then the events, all varints.
+// each event starts with (instructions since the last one << 3) | the kind.
+// the core fills one chunk while a thread of its own writes out the other,
+// so recording never waits on the disk unless the disk can't keep up.
+
+#define RECORD_MAGIC "6502REC"
+#define RECORD_VERSION 2
+#define RECORD_KIND_BITS 3
+#define RECORD_CHUNK_LEN (1024 * 64)
+
+typedef enum RecordEvent {
+  RE_END = 0, // then the stop reason and a hash of the final state.
+  RE_WRITE,   // then the address and the byte.
+  RE_IRQ,
+  RE_NMI,
+  RE_READ, // then the byte, always at 0 instructions since the last one.
+} RecordEvent;
+
+typedef struct Recorder {
+  Core *core;
+  const Banks *banks;
+  int fd;
+  u64 last_instructions; // where the last event was.
+
+  u8 chunks[2][RECORD_CHUNK_LEN];
+  uint filling; // the chunk the core is adding to.
+  uint len;
+
+  // the other chunk, while the thread's writing it out.
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  bool pending;
+  uint pending_len;
+  bool stopping;
+
+  // the devices that get read from, the map's pages point at tap while the
+  // recording's on.
+  Device tap;
+  Device *tapped[0x100];
+
+  u64 events;
+  u64 bytes; // the whole log so far, header included.
+} Recorder;
+
+// start logging to fd with the core's state as it is now, and its map if it
+// has one. banks is what's switching the map's window, or NULL. the fd isn't
+// closed at the end.
+void record_start(Recorder *r, Core *c, const Banks *banks, int fd);
+
+// the inputs. run the core however you like in between, they're logged at
+// whatever instruction count it's at. record_irq is false (and nothing's
+// logged) if the irq was ignored.
+void record_write(Recorder *r, u16 address, u8 value);
+bool record_irq(Recorder *r);
+void record_nmi(Recorder *r);
+
+// log the end of the run, with why the last run stopped, and wait for all of
+// it to be written.
+void record_finish(Recorder *r, StopReason reason);
+
+// reset c (which has been through core_init) to the log's starting state and
+// replay it, with core_run. a log with a map leaves c on a copy of it, which
+// is good until the next replay. true if it ends in exactly the state the
+// recording did. errors out on a log that's cut short or isn't one.
+bool replay(Core *c, const u8 *log, size_t len, StopReason *reason);
+bool replay_file(Core *c, const char *path, StopReason *reason);
+
+void test_record();
@@ -0,0 +1,304 @@
+#include "run.h"
+
+#include "assembler.h"
+#include "core.h"
+#include "defines.h"
+#include "fixture.h"
+#include "jit.h"
+#include "layout.h"
+#include "symtab.h"
+#include "trace.h"
+#include "util.h"
+#include "writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+const char *stop_reason_to_string(StopReason r) {
+  switch (r) {
+  case SR_NONE:
+    return "none";
+  case SR_BRK:
+    return "brk";
+  case SR_BREAKPOINT:
+    return "breakpoint";
+  case SR_MAX_CYCLES:
+    return "max-cycles";
+  case SR_MAX_INSTRUCTIONS:
+    return "max-instructions";
+  case SR_ILLEGAL:
+    return "illegal-opcode";
+  case SR_WATCHPOINT:
+    return "watchpoint";
+  case SR_NO_HISTORY:
+    return "no-history";
+  default:
+    return "unknown";
+  }
+}
+
+void machine_init(Machine *m) {
+  memset(m, 0, sizeof(Machine));
+  core_init(&m->core);
+}
+
+void machine_reset(Machine *m, u16 start) {
+  core_reset(&m->core, start);
+  m->seconds = 0;
+  m->reason = SR_NONE;
+}
+
+void load_image(Machine *m, const u8 *image, u16 start, u32 end) {
+  core_load(&m->core, image + start, start, end - start);
+}
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+StopReason machine_run(Machine *m, RunBudget budget) {
+  double start = now();
+  if (m->trace != NULL || m->profile != NULL || m->core.history != NULL) {
+    // only the plain loop keeps a history.
+    m->reason = core_run_observed(&m->core, budget, m->trace, m->profile);
+  } else if (m->plain) {
+    m->reason = core_run_plain(&m->core, budget);
+  } else if (m->core.coverage != NULL) {
+    // the jit doesn't keep coverage.
+    m->reason = core_run(&m->core, budget);
+  } else {
+    m->reason = core_run_jit(&m->core, budget);
+  }
+  m->seconds += now() - start;
+  return m->reason;
+}
+
+MemoryRange parse_memory_range(const char *s) {
+  char *colon;
+  unsigned long start = strtoul(s, &colon, 0);
+  if (*colon != ':') {
+    error("Expected start:end for a memory range, found \"%s\".", s);
+  }
+  char *rest;
+  unsigned long end = strtoul(colon + 1, &rest, 0);
+  if (*rest != '\0' || start >= end || end > 0x10000) {
+    error("The memory range \"%s\" has to be inside $0000-$ffff, with the "
+          "end past the start.",
+          s);
+  }
+  return (MemoryRange){start, end};
+}
+
+static void put_field(Writer *w, const char *name, u64 value) {
+  writer_put_str(w, ",\"");
+  writer_put_str(w, name);
+  writer_put_str(w, "\":");
+  writer_put_u64(w, value);
+}
+
+void dump_state_json(Writer *w, Machine *m, MemoryRange *ranges,
+                     uint num_ranges) {
+  Core *c = &m->core;
+
+  writer_put_str(w, "{\"stop\":\"");
+  writer_put_str(w, stop_reason_to_string(m->reason));
+  writer_put_char(w, '"');
+  put_field(w, "pc", c->pc);
+  put_field(w, "a", c->a);
+  put_field(w, "x", c->x);
+  put_field(w, "y", c->y);
+  put_field(w, "sp", c->sp);
+  put_field(w, "status", c->p);
+  put_field(w, "cycles", c->cycles);
+  put_field(w, "instructions", c->instructions);
+  if (m->reason == SR_WATCHPOINT) {
+    put_field(w, "watched", c->watched);
+    writer_put_str(w, c->watched_write ? ",\"access\":\"write\""
+                                       : ",\"access\":\"read\"");
+  }
+
+  // the bytes are one hex string per range, a lot smaller than an array of
+  // numbers.
+  writer_put_str(w, ",\"memory\":[");
+  for (uint i = 0; i < num_ranges; i++) {
+    writer_put_str(w, (i == 0) ? "{\"start\":" : ",{\"start\":");
+    writer_put_u64(w, ranges[i].start);
+    put_field(w, "end", ranges[i].end);
+    writer_put_str(w, ",\"bytes\":\"");
+    for (u32 a = ranges[i].start; a < ranges[i].end; a++) {
+      writer_put_hex8(w, core_peek(c, a));
+    }
+    writer_put_str(w, "\"}");
+  }
+  writer_put_str(w, "]}\n");
+}
+
+void dump_state_text(Writer *w, Machine *m, MemoryRange *ranges,
+                     uint num_ranges) {
+  Core *c = &m->core;
+
+  writer_put_str(w, "stop: ");
+  writer_put_str(w, stop_reason_to_string(m->reason));
+  writer_put_str(w, "\npc: $");
+  writer_put_hex16(w, c->pc);
+  writer_put_str(w, "  a: $");
+  writer_put_hex8(w, c->a);
+  writer_put_str(w, "  x: $");
+  writer_put_hex8(w, c->x);
+  writer_put_str(w, "  y: $");
+  writer_put_hex8(w, c->y);
+  writer_put_str(w, "  sp: $");
+  writer_put_hex8(w, c->sp);
+  writer_put_str(w, "  status: ");
+  for (int bit = 7; bit >= 0; bit--) {
+    writer_put_char(w, '0' + ((c->p >> bit) & 1));
+  }
+  writer_put_str(w, "\ncycles: ");
+  writer_put_u64(w, c->cycles);
+  writer_put_str(w, "  instructions: ");
+  writer_put_u64(w, c->instructions);
+  writer_put_char(w, '\n');
+  if (m->reason == SR_WATCHPOINT) {
+    writer_put_str(w, c->watched_write ? "watched: write of $"
+                                       : "watched: read of $");
+    writer_put_hex16(w, c->watched);
+    writer_put_char(w, '\n');
+  }
+
+  // 16 bytes a row, like a hexdump.
+  for (uint i = 0; i < num_ranges; i++) {
+    for (u32 a = ranges[i].start; a < ranges[i].end; a += 16) {
+      writer_put_char(w, '$');
+      writer_put_hex16(w, a);
+      writer_put_char(w, ':');
+      for (u32 b = a; b < a + 16 && b < ranges[i].end; b++) {
+        writer_put_char(w, ' ');
+        writer_put_hex8(w, core_peek(c, b));
+      }
+      writer_put_char(w, '\n');
+    }
+  }
+}
+
+void print_run_stats(Writer *w, Machine *m) {
+  Core *c = &m->core;
+  char line[256];
+  double seconds = (m->seconds > 0) ? m->seconds : 1e-9;
+  int len = snprintf(line, sizeof(line),
+                     "run: %lu instructions, %lu cycles in %.3fms, %.2fM "
+                     "instructions/sec, %.2fMHz effective\n",
+                     (unsigned long)c->instructions, (unsigned long)c->cycles,
+                     m->seconds * 1000, c->instructions / seconds / 1e6,
+                     c->cycles / seconds / 1e6);
+  writer_put(w, line, len);
+
+  Jit *j = c->jit;
+  if (j != NULL) {
+    len = snprintf(line, sizeof(line),
+                   "jit: %lu blocks compiled, %lu links chained, %lu "
+                   "invalidated, %lu flushes\n",
+                   (unsigned long)j->compiled, (unsigned long)j->chained,
+                   (unsigned long)j->invalidated, (unsigned long)j->flushes);
+    writer_put(w, line, len);
+  }
+}
+
+static StopReason run_source(Machine *m, char *source, RunBudget budget) {
+  static const u8 zeros[0x10000];
+  u8 *image = assemble_source(source);
+
+  // through core_load, so nothing the last program decoded sticks around.
+  core_load(&m->core, zeros, 0, sizeof(zeros));
+  load_image(m, image, layout_origin, layout_end);
+  machine_reset(m, layout_origin);
+  return machine_run(m, budget);
+}
+
+void test_run() {
+  printf("\n\nTESTING RUN\n\n\n");
+
+  static Machine m;
+  machine_init(&m);
+  Core *c = &m.core;
+
+  {
+    StopReason r = run_source(&m, "  lda #$01\n  nop\n  brk\n",
+                              (RunBudget){.cycles = 1000});
+    ASSERT(r == SR_BRK, "stops at the brk");
+    ASSERT(c->instructions == 2 && c->cycles == 4, "counted up to the brk");
+    ASSERT(c->pc == 0x0603, "pc left on the brk");
+  }
+
+  {
+    StopReason r =
+        run_source(&m, "  .fill 100, $ea\n", (RunBudget){.cycles = 10});
+    ASSERT(r == SR_MAX_CYCLES && c->cycles == 10 && c->instructions == 5,
+           "stops once the cycles are used up");
+
+    // the budget is per run, the totals keep going.
+    r = machine_run(&m, (RunBudget){.instructions = 3});
+    ASSERT(r == SR_MAX_INSTRUCTIONS && c->instructions == 8 && c->cycles == 16,
+           "stops once the instructions are used up");
+  }
+
+  {
+    StopReason r = run_source(&m, "  nop\n  .byte $02\n",
+                              (RunBudget){.cycles = 1000});
+    ASSERT(r == SR_ILLEGAL && c->pc == 0x0601,
+           "stops on an illegal opcode");
+  }
+
+  {
+    set_breakpoint(c, 0x0601);
+    set_breakpoint(c, 0x0601);
+    ASSERT(c->num_breakpoints == 1, "a breakpoint is only set once");
+
+    StopReason r =
+        run_source(&m, "  nop\n  nop\n  nop\n  brk\n", (RunBudget){0});
+    ASSERT(r == SR_BREAKPOINT && c->pc == 0x0601 && c->instructions == 1,
+           "stops before the instruction with the breakpoint");
+    r = machine_run(&m, (RunBudget){0});
+    ASSERT(r == SR_BRK && c->instructions == 3, "continues past it");
+
+    clear_breakpoint(c, 0x0601);
+    ASSERT(c->num_breakpoints == 0, "cleared the breakpoint");
+  }
+
+  {
+    MemoryRange range = parse_memory_range("0x0600:0x0603");
+    ASSERT(range.start == 0x0600 && range.end == 0x0603,
+           "parse a memory range");
+
+    run_source(&m, "  lda #$01\n  brk\n", (RunBudget){0});
+    static Writer w;
+    FILE *f = tmpfile();
+    writer_init(&w, fileno(f));
+    dump_state_json(&w, &m, &range, 1);
+    writer_flush(&w);
+
+    char buf[512] = {0};
+    lseek(fileno(f), 0, SEEK_SET);
+    ssize_t len = read(fileno(f), buf, sizeof(buf) - 1);
+    fclose(f);
+    printf("%s", buf);
+
+    const char *expected =
+        "{\"stop\":\"brk\",\"pc\":1538,\"a\":1,\"x\":0,\"y\":0,\"sp\":253,"
+        "\"status\":36,\"cycles\":2,\"instructions\":1,"
+        "\"memory\":[{\"start\":1536,\"end\":1539,\"bytes\":\"a90100\"}]}\n";
+    ASSERT(len == (ssize_t)strlen(expected) && strcmp(buf, expected) == 0,
+           "json state dump");
+  }
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING RUN, SUCCESS!\n\n\n");
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "core.h"
+#include "defines.h"
+#include "writer.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// how many --dump-mem ranges one run can ask for.
+#define DUMP_RANGES_LEN 16
+
+// ten seconds of a 1MHz 6502, for when the run doesn't say.
+#define DEFAULT_MAX_CYCLES 10000000
+
+// the core along with how long it's spent running.
+typedef struct Machine {
+  Core core;
+  bool plain; // step with core_run_plain instead of the decoded cache.
+  struct Trace *trace; // if set, every instruction goes in it, see trace.h.
+  struct Profile *profile; // the same, see profile.h.
+
+  double seconds; // wall time spent in the loop itself.
+  StopReason reason;
+} Machine;
+
+// [start, end), so a range can cover the last byte.
+typedef struct MemoryRange {
+  u32 start;
+  u32 end;
+} MemoryRange;
+
+const char *stop_reason_to_string(StopReason r);
+
+void machine_init(Machine *m);
+// point the pc at start and zero the totals. memory and breakpoints stay.
+void machine_reset(Machine *m, u16 start);
+
+// copy image[start..end) into the core's memory.
+void load_image(Machine *m, const u8 *image, u16 start, u32 end);
+
+// run until something in StopReason happens. a breakpoint on the pc the run
+// starts at doesn't count, so calling this again continues past it.
+StopReason machine_run(Machine *m, RunBudget budget);
+
+// "0x0200:0x0210" or "512:528", end exclusive. errors out on anything
+// outside of the 64K.
+MemoryRange parse_memory_range(const char *s);
+
+// the final registers, the counts and each of the ranges.
+void dump_state_json(Writer *w, Machine *m, MemoryRange *ranges,
+                     uint num_ranges);
+void dump_state_text(Writer *w, Machine *m, MemoryRange *ranges,
+                     uint num_ranges);
+
+// instructions per second and the effective clock speed.
+void print_run_stats(Writer *w, Machine *m);
+
+void test_run();
@@ -0,0 +1,253 @@
+#include "span.h"
+
+#include "ast.h"
+#include "cache.h"
+#include "defines.h"
+#include "layout.h"
+#include "parse.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+DataSpan data_spans[DATA_SPANS_LEN] = {0};
+static uint num_spans = 1; // skip the NULL_SPAN.
+
+SpanIndex new_span() {
+  if (num_spans >= DATA_SPANS_LEN) {
+    error("Too many data directives, the limit is %d.", DATA_SPANS_LEN - 1);
+  }
+
+  DataSpan *s = &data_spans[num_spans];
+  memset(s, 0, sizeof(DataSpan));
+  return num_spans++;
+}
+
+// make room for n more bytes on the end of the span.
+u8 *span_reserve(DataSpan *d, u32 n) {
+  if (d->len + n > 0x10000) {
+    error("A data run can't be bigger than the whole address space.");
+  }
+
+  if (d->len + n > d->cap) {
+    u32 cap = d->cap ? d->cap : 64;
+    while (cap < d->len + n) {
+      cap *= 2;
+    }
+    d->bytes = realloc(d->bytes, cap);
+    d->cap = cap;
+  }
+
+  u8 *dest = d->bytes + d->len;
+  d->len += n;
+  return dest;
+}
+
+void span_add_fixup(DataSpan *d, DataFixup f) {
+  d->fixups = realloc(d->fixups, sizeof(DataFixup) * (d->num_fixups + 1));
+  d->fixups[d->num_fixups++] = f;
+}
+
+void span_append(DataSpan *dest, DataSpan *src) {
+  u32 base = dest->len;
+  u8 *to = span_reserve(dest, src->len);
+  if (src->bytes == NULL) {
+    memset(to, src->fill, src->len);
+  } else {
+    memcpy(to, src->bytes, src->len);
+  }
+
+  for (uint i = 0; i < src->num_fixups; i++) {
+    DataFixup f = src->fixups[i];
+    f.offset += base;
+    if (f.based) {
+      f.addend += base;
+    }
+    span_add_fixup(dest, f);
+  }
+
+  dest->straight = dest->straight && src->straight;
+  dest->cycles += src->cycles;
+}
+
+void span_free(DataSpan *d) {
+  if (d->mapped) {
+    munmap(d->bytes, d->len);
+  } else {
+    free(d->bytes);
+  }
+  free(d->fixups);
+  memset(d, 0, sizeof(DataSpan));
+}
+
+void span_push(SpanIndex s, u8 byte) {
+  *span_reserve(&data_spans[s], 1) = byte;
+}
+
+void span_push_word(SpanIndex s, u16 word) {
+  u8 *dest = span_reserve(&data_spans[s], 2);
+  dest[0] = word & 0xff;
+  dest[1] = word >> 8;
+}
+
+void span_push_label(SpanIndex s, char *name) {
+  DataSpan *d = &data_spans[s];
+  span_add_fixup(d,
+                 (DataFixup){.offset = d->len, .name = name, .kind = FX_WORD});
+  span_push_word(s, 0);
+}
+
+SpanIndex fill_span(u32 len, u8 value) {
+  if (len > 0x10000) {
+    error("A .fill can't be bigger than the whole address space.");
+  }
+
+  SpanIndex s = new_span();
+  data_spans[s].len = len;
+  data_spans[s].fill = value;
+  return s;
+}
+
+SpanIndex incbin_span(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    error("Could not open %s for .incbin.", path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    error("Could not stat %s for .incbin.", path);
+  }
+  if (st.st_size > 0x10000) {
+    error("%s is too big to .incbin, it's %ld bytes.", path,
+          (long)st.st_size);
+  }
+
+  SpanIndex s = new_span();
+  DataSpan *d = &data_spans[s];
+  d->len = st.st_size;
+
+  if (d->len > 0) {
+    void *map = mmap(NULL, d->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      error("Could not map %s for .incbin.", path);
+    }
+    d->bytes = map;
+    d->mapped = true;
+  }
+  note_dependency(path, d->bytes, d->len);
+
+  close(fd);
+  return s;
+}
+
+u32 emit_span(SpanIndex s, u8 *image, u16 address) {
+  DataSpan *d = &data_spans[s];
+  u8 *dest = image + address;
+
+  if (d->bytes == NULL) {
+    memset(dest, d->fill, d->len);
+    return d->len;
+  }
+
+  memcpy(dest, d->bytes, d->len);
+
+  for (uint i = 0; i < d->num_fixups; i++) {
+    DataFixup f = d->fixups[i];
+
+    u32 target = f.addend + (f.based ? address : 0);
+    if (f.name != NULL) {
+      Symbol *sym = lookup_symbol(f.name);
+      if (sym == NULL || sym->type != DT_INT) {
+        if (layout_relocatable) {
+          continue; // the linker fills it in.
+        }
+        error("Undefined label %s used in a data run or macro.", f.name);
+      }
+      target += sym->value;
+    }
+
+    switch (f.kind) {
+    case FX_WORD: {
+      dest[f.offset] = target & 0xff;
+      dest[f.offset + 1] = (target >> 8) & 0xff;
+    } break;
+
+    case FX_BRANCH: {
+      int offset = (int)(target & 0xffff) - (address + f.offset + 1);
+      if (offset < -128 || offset > 127) {
+        error("A branch in a macro at $%04x can't reach $%04x.",
+              address + f.offset - 1, target & 0xffff);
+      }
+      dest[f.offset] = (u8)offset;
+    } break;
+    }
+  }
+
+  return d->len;
+}
+
+void clean_spans() {
+  for (uint i = 1; i < num_spans; i++) {
+    span_free(&data_spans[i]);
+  }
+  num_spans = 1;
+}
+
+void test_spans() {
+  printf("\n\nTESTING DATA SPANS\n\n\n");
+
+  static u8 image[0x10000 + 3];
+
+  {
+    const char *path = "/tmp/6502_incbin_test.bin";
+    FILE *f = fopen(path, "wb");
+    ASSERT(f != NULL, "write the .incbin file");
+    fwrite("\x01\x02\x03", 1, 3, f);
+    fclose(f);
+
+    clean_ast();
+    clean_symtab();
+    clean_spans();
+    NodeIndex root = parse("  jmp start\n"
+                           "table:\n"
+                           "  .byte $01, 2, $ff\n"
+                           "  .word $1234, start\n"
+                           "  .fill 4, $ea\n"
+                           "  .incbin \"/tmp/6502_incbin_test.bin\"\n"
+                           "  .org $0700\n"
+                           "start:\n"
+                           "  lda table\n");
+    layout_program(root, DEFAULT_ORIGIN);
+    remove(path);
+
+    ASSERT(lookup_symbol("table")->value == 0x0603, "label before data");
+    ASSERT(lookup_symbol("start")->value == 0x0700, ".org moves the label");
+    ASSERT(layout_end == 0x0703, "layout ends after the .org");
+
+    memset(image, 0, sizeof(image));
+    emit_layout(image);
+    ASSERT(memcmp(image + 0x0603, "\x01\x02\xff", 3) == 0, ".byte list");
+    ASSERT(memcmp(image + 0x0606, "\x34\x12\x00\x07", 4) == 0,
+           ".word with a label");
+    ASSERT(memcmp(image + 0x060a, "\xea\xea\xea\xea", 4) == 0, ".fill");
+    ASSERT(memcmp(image + 0x060e, "\x01\x02\x03", 3) == 0, ".incbin");
+    ASSERT(image[0x0611] == 0x00, "gap before the .org is left alone");
+    ASSERT(image[0x0700] == 0xAD && image[0x0701] == 0x03 &&
+               image[0x0702] == 0x06,
+           "code after the .org");
+  }
+
+  clean_ast();
+  clean_symtab();
+  clean_spans();
+  clean_layout();
+
+  printf("\n\nDONE TESTING DATA SPANS, SUCCESS!\n\n\n");
+}
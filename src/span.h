@@ -0,0 +1,77 @@
+#pragma once
+
+#include "defines.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// how many .byte/.word/.fill/.incbin directives one program can have.
+#define DATA_SPANS_LEN 4096
+
+// spans are handed around by index, 0 is never a real span.
+typedef u16 SpanIndex;
+#define NULL_SPAN 0
+
+typedef enum FixupKind {
+  FX_WORD = 0, // a little endian address.
+  FX_BRANCH,   // a relative branch offset, from the byte after the slot.
+} FixupKind;
+
+// a slot in the span that can only be filled in once it's been placed. the
+// target is the label's address (if there's a name) plus the addend, plus the
+// span's own address if it's based. based slots are how code in a macro
+// template points at its own labels.
+typedef struct DataFixup {
+  u32 offset;
+  char *name;
+  u16 addend;
+  u8 kind;
+  bool based;
+} DataFixup;
+
+// one run of data bytes, emitted in one go no matter how long it is.
+typedef struct DataSpan {
+  u8 *bytes; // NULL for a .fill, which is just len copies of fill.
+  u32 len;
+  u32 cap;
+  u8 fill;
+  bool mapped; // bytes is an .incbin file mapped straight in, not malloced.
+
+  DataFixup *fixups;
+  uint num_fixups;
+
+  // pre-encoded code from a macro or .rept. straight means it always runs
+  // from the top to the bottom, with nothing in it that jumps, branches,
+  // calls or returns, so the timing pass can just add up its cycles.
+  bool straight;
+  u32 cycles; // worst case, only meaningful if it's straight.
+} DataSpan;
+
+extern DataSpan data_spans[DATA_SPANS_LEN];
+
+SpanIndex new_span();
+
+// the span-pointer versions, for spans that don't live in the table.
+u8 *span_reserve(DataSpan *d, u32 n);
+void span_add_fixup(DataSpan *d, DataFixup f);
+// tack src onto the end of dest, moving its fixups along with it.
+void span_append(DataSpan *dest, DataSpan *src);
+void span_free(DataSpan *d);
+
+void span_push(SpanIndex s, u8 byte);
+void span_push_word(SpanIndex s, u16 word);
+// two bytes for the address of a label that might not be placed yet.
+void span_push_label(SpanIndex s, char *name);
+
+SpanIndex fill_span(u32 len, u8 value);
+// map the whole file in as the span, it never gets copied until it's emitted.
+SpanIndex incbin_span(const char *path);
+
+// copy the span into the image at address with its fixups resolved, returns how
+// many bytes that was.
+u32 emit_span(SpanIndex s, u8 *image, u16 address);
+
+// free or unmap every span.
+void clean_spans();
+
+void test_spans();
@@ -1,6 +1,7 @@
 #include "symtab.h"
 #include "ast.h"
 #include "defines.h"
+#include "util.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -27,10 +28,38 @@ Symbol make_symbol(DataType type, char *name, SymbolValue value) {
 
 // make sure that the symbol names coming from the lexer are null-terminated,
 // else the djb2 hash will probably segfault.
+//
+// collisions are handled by just probing forward to the next slot, and
+// inserting a name that's already in the table replaces the old symbol.
 void insert_symbol(Symbol s) {
-  printf("Inserting the symbol named %s to the symtab with value %lu.\n",
-         s.name, s.value);
-  symtab[djb2(s.name) % SYMTAB_LEN] = s;
+  DEBUG_PRINTF("Inserting the symbol named %s to the symtab with value %lu.\n",
+               s.name, s.value);
+  unsigned long start = djb2(s.name) % SYMTAB_LEN;
+  for (int i = 0; i < SYMTAB_LEN; i++) {
+    Symbol *slot = &symtab[(start + i) % SYMTAB_LEN];
+    if (slot->name == NULL || strcmp(slot->name, s.name) == 0) {
+      *slot = s;
+      return;
+    }
+  }
+
+  error("The symbol table is full, couldn't insert %s.", s.name);
+}
+
+// follow the same probe sequence as insert_symbol. returns NULL if the name
+// isn't in the table.
+Symbol *lookup_symbol(char *name) {
+  unsigned long start = djb2(name) % SYMTAB_LEN;
+  for (int i = 0; i < SYMTAB_LEN; i++) {
+    Symbol *slot = &symtab[(start + i) % SYMTAB_LEN];
+    if (slot->name == NULL) {
+      return NULL;
+    }
+    if (strcmp(slot->name, name) == 0) {
+      return slot;
+    }
+  }
+  return NULL;
 }
 
 // called by the greater clean() function.
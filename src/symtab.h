@@ -32,5 +32,6 @@ extern Symbol symtab[SYMTAB_LEN];
 
 Symbol make_symbol(DataType type, char *name, SymbolValue value);
 void insert_symbol(Symbol s);
+Symbol *lookup_symbol(char *name);
 void clean_symtab();
 void print_symtab();
@@ -0,0 +1,550 @@
+#include "timing.h"
+
+#include "assembler.h"
+#include "defines.h"
+#include "fixture.h"
+#include "layout.h"
+#include "lexer.h"
+#include "parse.h"
+#include "span.h"
+#include "symtab.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+BasicBlock blocks[AST_LEN] = {0};
+uint num_blocks = 0;
+
+// the layout index of the instruction at each address, and the block that
+// starts there. -1 where there isn't one.
+static int entry_at[0x10000];
+static int block_at[0x10000];
+
+// routine results, by entry block, so a routine that's called from all over the
+// place only gets walked once.
+typedef enum RoutineState {
+  RS_NONE = 0,
+  RS_WALKING,
+  RS_DONE,
+} RoutineState;
+
+static u8 routine_state[AST_LEN];
+static u64 routine_cycles[AST_LEN];
+
+static bool ends_block(Lexeme instruction) {
+  switch (instruction) {
+  case JMP:
+  case RTS:
+  case RTI:
+  case BRK:
+    return true;
+  default:
+    return has_addrmode(instruction, Relative);
+  }
+}
+
+// only the reads pay for crossing a page, the stores and read-modify-writes
+// always take the extra cycle and the table already counts it.
+bool can_cross_page(Lexeme instruction, AddrMode mode) {
+  switch (instruction) {
+  case ADC:
+  case AND:
+  case CMP:
+  case EOR:
+  case LDA:
+  case LDX:
+  case LDY:
+  case ORA:
+  case SBC:
+    break;
+  default:
+    return false;
+  }
+
+  return mode == AbsX || mode == AbsY || mode == IndirectIndexed;
+}
+
+static uint page_cross_penalty(LayoutEntry *e) {
+  if (!can_cross_page(e->instruction, e->arg.mode)) {
+    return 0;
+  }
+
+  // the index is at most $ff, so an indexed base at the start of a page never
+  // crosses. an indirect pointer's only known at runtime.
+  if (e->arg.mode != IndirectIndexed && (operand_value(e) & 0xff) == 0) {
+    return 0;
+  }
+  return 1;
+}
+
+// expanded macros and .repts that always run top to bottom are just more code
+// as far as the blocks are concerned.
+static bool is_code(LayoutEntry *e) {
+  return e->kind == EK_INSTRUCTION ||
+         (e->kind == EK_DATA && data_spans[e->span].straight);
+}
+
+static uint page_of(u32 address) { return (address >> 8) & 0xff; }
+
+static bool returns(Lexeme instruction) {
+  return instruction == RTS || instruction == RTI || instruction == BRK;
+}
+
+// does the entry's operand say where execution goes next?
+static bool has_target(LayoutEntry *e) {
+  return (e->instruction == JMP && e->arg.mode == Abs) ||
+         has_addrmode(e->instruction, Relative);
+}
+
+// the extra cycles for each way out of a block that ends in a branch.
+static void cost_branch(BasicBlock *b, LayoutEntry *e) {
+  if (e->relaxed) {
+    // b!xx +3, jmp far. going the original way is the inverted branch falling
+    // through into the JMP, the other way is it hopping over the JMP.
+    b->taken = instruction_cycles(JMP, Abs);
+    b->untaken = 1 + (page_of(e->address + 2) !=
+                      page_of(e->address + RELAXED_BRANCH_LEN));
+    return;
+  }
+
+  b->taken = 1 + (page_of(e->address + 2) != page_of(operand_value(e)));
+}
+
+void build_blocks() {
+  num_blocks = 0;
+  memset(entry_at, -1, sizeof(entry_at));
+  memset(block_at, -1, sizeof(block_at));
+  memset(routine_state, RS_NONE, sizeof(routine_state));
+
+  for (uint i = 0; i < layout_len; i++) {
+    if (is_code(&layout[i])) {
+      entry_at[layout[i].address] = i;
+    }
+  }
+
+  // anything a branch, jump or call can land on starts a block.
+  static bool leader[AST_LEN];
+  memset(leader, 0, sizeof(bool) * layout_len);
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+    if (e->kind != EK_INSTRUCTION) {
+      continue;
+    }
+    if (has_target(e) || (e->instruction == JSR && e->arg.mode == Abs)) {
+      int target = entry_at[operand_value(e) & 0xffff];
+      if (target >= 0) {
+        leader[target] = true;
+      }
+    }
+  }
+
+  int curr = -1;  // the block instructions are going into.
+  int falls = -1; // the block that runs into whichever one starts next.
+  char *label = NULL;
+  uint bound = 0;
+
+  for (uint i = 0; i < layout_len; i++) {
+    LayoutEntry *e = &layout[i];
+
+    if (!is_code(e) && e->kind != EK_LABEL) {
+      // nothing runs off the end of code into data on purpose, so there's no
+      // bound for anything that does.
+      if (falls >= 0) {
+        blocks[falls].into_data = true;
+      }
+      curr = -1;
+      falls = -1;
+      continue;
+    }
+
+    if (e->kind == EK_LABEL) {
+      // labels start a block too, whether or not anything jumps to them. if
+      // there's a few in a row, keep the one with the .bound.
+      if (label == NULL || (bound == 0 && e->bound != 0)) {
+        label = e->name;
+      }
+      if (e->bound != 0) {
+        bound = e->bound;
+      }
+      curr = -1;
+      continue;
+    }
+
+    if (curr < 0 || leader[i]) {
+      curr = num_blocks++;
+      if (falls >= 0) {
+        blocks[falls].next = curr;
+      }
+      falls = curr;
+
+      BasicBlock *b = &blocks[curr];
+      memset(b, 0, sizeof(BasicBlock));
+      b->first = i;
+      b->start = e->address;
+      b->label = label;
+      b->bound = bound;
+      b->exit = LEXEME_NULL;
+      b->next = -1;
+      b->target = -1;
+      block_at[e->address] = curr;
+
+      label = NULL;
+      bound = 0;
+    }
+
+    BasicBlock *b = &blocks[curr];
+    b->last = i;
+    b->end = e->address + e->size;
+    if (e->kind == EK_DATA) {
+      b->cycles += data_spans[e->span].cycles;
+      continue;
+    }
+    b->cycles += instruction_cycles(e->instruction,
+                                    e->relaxed ? Relative : e->arg.mode);
+    b->page_cross += page_cross_penalty(e);
+
+    if (ends_block(e->instruction)) {
+      b->exit = e->instruction;
+      if (has_addrmode(e->instruction, Relative)) {
+        cost_branch(b, e);
+      } else {
+        falls = -1;
+      }
+      curr = -1;
+    }
+  }
+
+  // the targets can point forward, so they only resolve once every block
+  // exists.
+  for (uint i = 0; i < num_blocks; i++) {
+    LayoutEntry *e = &layout[blocks[i].last];
+    if (e->kind == EK_INSTRUCTION && has_target(e)) {
+      blocks[i].target = block_at[operand_value(e) & 0xffff];
+    }
+  }
+}
+
+// everything the walk over one routine needs. it's per call, since walking a
+// routine walks everything it calls before it's done.
+typedef struct RoutineWalk {
+  u8 *color; // 0 not seen yet, 1 on the dfs stack, 2 finished.
+  bool *back_next; // the next/target edge out of the block loops back.
+  bool *back_target;
+  bool *header;    // some edge loops back to this block.
+  int *order;      // finished blocks, successors before predecessors.
+  uint order_len;
+  u64 *mult;    // how many times the block can run per call, from the bounds.
+  u64 *longest; // the worst case from the top of the block to a return.
+} RoutineWalk;
+
+static void dfs(RoutineWalk *w, int b) {
+  w->color[b] = 1;
+
+  int next = blocks[b].next;
+  if (next >= 0) {
+    if (w->color[next] == 1) {
+      w->back_next[b] = true;
+      w->header[next] = true;
+    } else if (w->color[next] == 0) {
+      dfs(w, next);
+    }
+  }
+
+  int target = blocks[b].target;
+  if (target >= 0) {
+    if (w->color[target] == 1) {
+      w->back_target[b] = true;
+      w->header[target] = true;
+    } else if (w->color[target] == 0) {
+      dfs(w, target);
+    }
+  }
+
+  w->color[b] = 2;
+  w->order[w->order_len++] = b;
+}
+
+// every block in a loop runs as many times as the bound on its header says,
+// times the bounds of anything around that.
+static void apply_loop_bounds(RoutineWalk *w) {
+  static bool body[AST_LEN];
+
+  for (uint h_idx = 0; h_idx < w->order_len; h_idx++) {
+    int h = w->order[h_idx];
+    if (!w->header[h]) {
+      continue;
+    }
+    if (blocks[h].bound == 0) {
+      error("The loop at $%04x (%s) needs a .bound before its label.",
+            blocks[h].start, blocks[h].label ? blocks[h].label : "no label");
+    }
+
+    // the natural loop is the header plus everything that gets back to it
+    // without going through it. iterate until nothing else joins, the
+    // ordering only gets the forward edges right in one pass.
+    for (uint i = 0; i < w->order_len; i++) {
+      body[w->order[i]] = false;
+    }
+    body[h] = true;
+
+    bool changed;
+    do {
+      changed = false;
+      for (uint i = 0; i < w->order_len; i++) {
+        int b = w->order[i];
+        if (body[b]) {
+          continue;
+        }
+        int next = blocks[b].next;
+        int target = blocks[b].target;
+        if ((next >= 0 && body[next] && (next != h || w->back_next[b])) ||
+            (target >= 0 && body[target] &&
+             (target != h || w->back_target[b]))) {
+          body[b] = true;
+          changed = true;
+        }
+      }
+    } while (changed);
+
+    for (uint i = 0; i < w->order_len; i++) {
+      if (body[w->order[i]]) {
+        w->mult[w->order[i]] *= blocks[h].bound;
+      }
+    }
+  }
+}
+
+static u64 wcet_from(int entry);
+
+// the worst case of everything the block calls.
+static u64 call_cycles(BasicBlock *b) {
+  u64 cycles = 0;
+
+  for (uint i = b->first; i <= b->last; i++) {
+    LayoutEntry *e = &layout[i];
+    if (e->instruction != JSR) {
+      continue;
+    }
+
+    int callee = block_at[operand_value(e) & 0xffff];
+    if (callee < 0) {
+      error("The JSR at $%04x calls outside the program, it can't be timed.",
+            e->address);
+    }
+    cycles += wcet_from(callee);
+  }
+
+  return cycles;
+}
+
+static u64 wcet_from(int entry) {
+  if (routine_state[entry] == RS_DONE) {
+    return routine_cycles[entry];
+  }
+  if (routine_state[entry] == RS_WALKING) {
+    error("The routine at $%04x ends up calling itself, it can't be bounded.",
+          blocks[entry].start);
+  }
+  routine_state[entry] = RS_WALKING;
+
+  RoutineWalk w = {0};
+  w.color = calloc(num_blocks, sizeof(u8));
+  w.back_next = calloc(num_blocks, sizeof(bool));
+  w.back_target = calloc(num_blocks, sizeof(bool));
+  w.header = calloc(num_blocks, sizeof(bool));
+  w.order = calloc(num_blocks, sizeof(int));
+  w.mult = calloc(num_blocks, sizeof(u64));
+  w.longest = calloc(num_blocks, sizeof(u64));
+
+  dfs(&w, entry);
+
+  for (uint i = 0; i < w.order_len; i++) {
+    int b = w.order[i];
+    w.mult[b] = 1;
+
+    // a jump we can't follow means there's no bound.
+    LayoutEntry *e = &layout[blocks[b].last];
+    if (blocks[b].into_data) {
+      error("The code at $%04x runs straight into data, the routine can't be "
+            "timed.",
+            blocks[b].start);
+    }
+    if (blocks[b].exit != LEXEME_NULL && !returns(blocks[b].exit) &&
+        blocks[b].target < 0) {
+      error("The %s at $%04x goes somewhere that can't be followed, the "
+            "routine can't be timed.",
+            instruction_to_string(blocks[b].exit), e->address);
+    }
+  }
+
+  apply_loop_bounds(&w);
+
+  // longest path over the loop-free graph, with every block weighted by how
+  // many times it can run. the order has successors first, so they're done
+  // already.
+  for (uint i = 0; i < w.order_len; i++) {
+    int b = w.order[i];
+    BasicBlock *bb = &blocks[b];
+    u64 m = w.mult[b];
+
+    u64 cycles = (bb->cycles + bb->page_cross + call_cycles(bb)) * m;
+
+    // going around a loop costs whatever that exit costs, on every trip.
+    u64 around = 0;
+    u64 best = 0;
+    if (bb->next >= 0) {
+      if (w.back_next[b]) {
+        around = bb->untaken;
+      } else {
+        u64 path = bb->untaken * m + w.longest[bb->next];
+        best = path > best ? path : best;
+      }
+    }
+    if (bb->target >= 0) {
+      if (w.back_target[b]) {
+        around = bb->taken > around ? bb->taken : around;
+      } else {
+        u64 path = bb->taken * m + w.longest[bb->target];
+        best = path > best ? path : best;
+      }
+    }
+
+    w.longest[b] = cycles + around * m + best;
+  }
+
+  u64 result = w.longest[entry];
+
+  free(w.color);
+  free(w.back_next);
+  free(w.back_target);
+  free(w.header);
+  free(w.order);
+  free(w.mult);
+  free(w.longest);
+
+  routine_state[entry] = RS_DONE;
+  routine_cycles[entry] = result;
+  return result;
+}
+
+u64 routine_wcet(char *label) {
+  Symbol *s = lookup_symbol(label);
+  if (s == NULL) {
+    error("There's no routine called %s.", label);
+  }
+
+  int entry = block_at[s->value & 0xffff];
+  if (entry < 0) {
+    error("%s doesn't start any code.", label);
+  }
+
+  return wcet_from(entry);
+}
+
+void print_timing(char *label) {
+  for (uint i = 0; i < num_blocks; i++) {
+    BasicBlock *b = &blocks[i];
+    printf("timing: $%04x-$%04x %-12s %3u cycles", b->start,
+           (uint)(b->end - 1) & 0xffff, b->label ? b->label : "", b->cycles);
+    if (b->page_cross) {
+      printf(", +%u page cross", b->page_cross);
+    }
+    if (b->taken || b->untaken) {
+      printf(", %s +%u taken +%u not", instruction_to_string(b->exit),
+             b->taken, b->untaken);
+    }
+    if (b->bound) {
+      printf(", loops at most %u times", b->bound);
+    }
+    printf("\n");
+  }
+
+  printf("timing: %s takes at most %lu cycles\n", label,
+         (unsigned long)routine_wcet(label));
+}
+
+void test_timing() {
+  printf("\n\nTESTING TIMING\n\n\n");
+
+  {
+    clean_ast();
+    clean_symtab();
+    NodeIndex root = parse("main:\n"
+                           "  ldx #$08\n"
+                           ".bound 8\n"
+                           "loop:\n"
+                           "  lda $1234,X\n"
+                           "  sta $1200,X\n"
+                           "  dex\n"
+                           "  bne loop\n"
+                           "  jsr sub\n"
+                           "  rts\n"
+                           "sub:\n"
+                           "  lda $1200,Y\n"
+                           "  rts\n");
+    layout_program(root, DEFAULT_ORIGIN);
+    build_blocks();
+
+    ASSERT(num_blocks == 4, "split into four blocks");
+    ASSERT(blocks[1].bound == 8 && strcmp(blocks[1].label, "loop") == 0,
+           "bound is on the loop block");
+    // lda abs,X 4, sta abs,X 5, dex 2, bne 2.
+    ASSERT(blocks[1].cycles == 13, "loop block base cycles");
+    ASSERT(blocks[1].page_cross == 1, "only the read can cross a page");
+    ASSERT(blocks[1].taken == 1 && blocks[1].untaken == 0,
+           "branch on the same page");
+    ASSERT(blocks[1].target == 1 && blocks[1].next == 2, "loop block edges");
+    ASSERT(blocks[3].page_cross == 0, "base at the start of a page");
+
+    ASSERT(routine_wcet("sub") == 4 + 6, "leaf routine");
+    // ldx, 8 trips through the loop each paying for the taken branch, then
+    // jsr + sub + rts.
+    ASSERT(routine_wcet("main") == 2 + 8 * (13 + 1 + 1) + 6 + 10 + 6,
+           "routine with a loop and a call");
+  }
+
+  {
+    // a branch whose target is on the next page pays for it.
+    clean_ast();
+    clean_symtab();
+    NodeIndex root = parse("  clc\n"
+                           "  bcc over\n"
+                           "  nop\n"
+                           "over:\n"
+                           "  rts\n");
+    layout_program(root, 0x06fc);
+    build_blocks();
+
+    ASSERT(blocks[0].taken == 2, "taken branch across a page");
+  }
+
+  {
+    // the bound goes on the label right after it, or it's an error.
+    ASSERT(assembly_fails(".bound 8\n"
+                          "  ldx #$08\n"
+                          "loop:\n"
+                          "  dex\n"
+                          "  bne loop\n"),
+           "an instruction between .bound and its label");
+    ASSERT(assembly_fails(".bound 8\n"
+                          "  .byte $00\n"
+                          "loop:\n"
+                          "  rts\n"),
+           "and data");
+    ASSERT(!assembly_fails(".bound 8\n"
+                           "\n"
+                           "loop:\n"
+                           "  dex\n"
+                           "  bne loop\n"),
+           "but not a blank line");
+  }
+
+  clean_ast();
+  clean_symtab();
+  clean_layout();
+
+  printf("\n\nDONE TESTING TIMING, SUCCESS!\n\n\n");
+}
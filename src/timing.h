@@ -0,0 +1,53 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+#include "lexer.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// a straight run of instructions, only entered at the top and only left at the
+// bottom. built over the laid out program, so every address is final.
+typedef struct BasicBlock {
+  uint first; // layout indices of the first and last instruction, inclusive.
+  uint last;
+  u16 start;
+  u32 end;     // one past the last byte.
+  char *label; // the label the block starts at, NULL if it doesn't have one.
+  uint bound;  // the .bound on that label, 0 if there wasn't one.
+
+  uint cycles;     // base cycles of everything in the block, from the table.
+  uint page_cross; // worst case extra cycles from indexed reads crossing a
+                   // page boundary.
+  // extra cycles on top of that depending on how the block is left. a taken
+  // branch costs one more, two if it lands on another page.
+  uint untaken;
+  uint taken;
+
+  Lexeme exit; // the branch/jump/return that ends the block, LEXEME_NULL if it
+               // just runs into the next one.
+  int next;    // the block that runs next if the exit isn't taken, or -1.
+  int target;  // where the exit goes when it is taken, -1 if nowhere we know.
+  bool into_data; // runs off the bottom into data or an .org gap.
+} BasicBlock;
+
+extern BasicBlock blocks[AST_LEN];
+extern uint num_blocks;
+
+// can the instruction take an extra cycle when its indexed address crosses a
+// page boundary?
+bool can_cross_page(Lexeme instruction, AddrMode mode);
+
+// split the laid out program into basic blocks and cost each one.
+void build_blocks();
+
+// the worst case number of cycles from a JSR to the routine at label up to its
+// RTS, not counting the JSR itself. loops need a .bound on their header label,
+// and every JSR inside adds the worst case of the routine it calls.
+u64 routine_wcet(char *label);
+
+// dump every block with its costs, then the worst case for the routine.
+void print_timing(char *label);
+
+void test_timing();
@@ -0,0 +1,389 @@
+#include "trace.h"
+
+#include "assembler.h"
+#include "core.h"
+#include "defines.h"
+#include "lexer.h"
+#include "util.h"
+#include "writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static bool is_wide(TraceColumn column) {
+  return column == TC_PC || column == TC_ADDRESS;
+}
+
+static TraceEffect effect_of(DecodeEntry d) {
+  switch (d.instruction) {
+  case PHA:
+  case PHP:
+  case JSR:
+    return TE_PUSH;
+  case PLA:
+  case PLP:
+  case RTS:
+  case RTI:
+    return TE_PULL;
+  case JMP:
+    return TE_NONE;
+  default:
+    break;
+  }
+  switch (d.mode) {
+  case Implicit:
+  case Immediate:
+  case Relative:
+  case Indirect:
+    return TE_NONE;
+  default:
+    break;
+  }
+  switch (d.instruction) {
+  case STA:
+  case STX:
+  case STY:
+  case INC:
+  case DEC:
+  case ASL:
+  case LSR:
+  case ROL:
+  case ROR:
+    return TE_WRITE;
+  default:
+    return TE_READ;
+  }
+}
+
+static uint put_varint(u8 *out, u32 v) {
+  uint len = 0;
+  while (v >= 0x80) {
+    out[len++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  out[len++] = v;
+  return len;
+}
+
+static u32 get_varint(const u8 *in, uint len, uint *at) {
+  u32 v = 0;
+  for (uint shift = 0; *at < len && shift < 32; shift += 7) {
+    u8 b = in[(*at)++];
+    v |= (u32)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+  return v;
+}
+
+static void put_u32(u8 *out, u32 v) {
+  for (uint i = 0; i < 4; i++) {
+    out[i] = v >> (i * 8);
+  }
+}
+
+static u32 get_u32(const u8 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+void trace_open(Trace *t, int fd) {
+  writer_init(&t->out, fd);
+  t->rows = 0;
+  t->total_rows = 0;
+  t->chunks = 0;
+  for (uint i = 0; i < 256; i++) {
+    t->effects[i] = (decode_table[i].instruction != LEXEME_NULL)
+                        ? effect_of(decode_table[i])
+                        : TE_NONE;
+  }
+
+  u8 header[16] = TRACE_MAGIC;
+  put_u32(header + 8, TRACE_VERSION);
+  put_u32(header + 12, TC_COUNT);
+  writer_put(&t->out, (const char *)header, sizeof(header));
+  t->bytes = sizeof(header);
+}
+
+// one column of the chunk into t->encoded, returns how long it came out.
+static uint encode_column(Trace *t, TraceColumn column) {
+  const u16 *values = t->columns[column];
+  u8 *out = t->encoded[column];
+  uint len = 0;
+  u16 last = 0;
+  uint i = 0;
+  while (i < t->rows) {
+    u16 value = values[i++];
+    if (is_wide(column)) {
+      // zigzag, so small steps backwards are small too.
+      int16_t delta = value - last;
+      len += put_varint(out + len, (u16)(delta << 1) ^ (u16)(delta >> 15));
+    } else {
+      out[len++] = (u8)(value - last);
+      if (value == last) {
+        // a register that didn't change is a zero and how many more rows
+        // it didn't change for.
+        uint run = 0;
+        while (i < t->rows && values[i] == last) {
+          run++;
+          i++;
+        }
+        len += put_varint(out + len, run);
+      }
+    }
+    last = value;
+  }
+  return len;
+}
+
+void trace_flush_chunk(Trace *t) {
+  if (t->rows == 0) {
+    return;
+  }
+
+  u8 header[4 + 4 * TC_COUNT];
+  uint lens[TC_COUNT];
+  put_u32(header, t->rows);
+  for (uint c = 0; c < TC_COUNT; c++) {
+    lens[c] = encode_column(t, c);
+    put_u32(header + 4 + 4 * c, lens[c]);
+  }
+  writer_put(&t->out, (const char *)header, sizeof(header));
+  t->bytes += sizeof(header);
+  for (uint c = 0; c < TC_COUNT; c++) {
+    writer_put_large(&t->out, (const char *)t->encoded[c], lens[c]);
+    t->bytes += lens[c];
+  }
+
+  t->total_rows += t->rows;
+  t->chunks++;
+  t->rows = 0;
+}
+
+void trace_close(Trace *t) {
+  trace_flush_chunk(t);
+  writer_flush(&t->out);
+}
+
+void trace_reader_open(TraceReader *r, const char *path, u32 wanted) {
+  r->f = fopen(path, "rb");
+  if (r->f == NULL) {
+    error("Could not open the trace %s.", path);
+  }
+  u8 header[16];
+  if (fread(header, 1, sizeof(header), r->f) != sizeof(header) ||
+      memcmp(header, TRACE_MAGIC, 8) != 0 ||
+      get_u32(header + 8) != TRACE_VERSION) {
+    error("%s isn't a trace from this version.", path);
+  }
+  // a newer file with more columns can still be read, the extra ones are
+  // skipped.
+  r->num_columns = get_u32(header + 12);
+  if (r->num_columns < TC_COUNT) {
+    error("%s has fewer columns than a trace should.", path);
+  }
+  r->wanted = wanted;
+  r->rows = 0;
+}
+
+static void decode_column(TraceReader *r, TraceColumn column, uint len) {
+  const u8 *in = r->encoded;
+  u16 *values = r->columns[column];
+  u16 last = 0;
+  uint at = 0, i = 0;
+  while (i < r->rows && at < len) {
+    if (is_wide(column)) {
+      u16 v = get_varint(in, len, &at);
+      last += (v >> 1) ^ -(v & 1);
+      values[i++] = last;
+      continue;
+    }
+    u8 delta = in[at++];
+    last = (u8)(last + delta);
+    values[i++] = last;
+    if (delta == 0) {
+      uint run = get_varint(in, len, &at);
+      for (; run > 0 && i < r->rows; run--) {
+        values[i++] = last;
+      }
+    }
+  }
+}
+
+bool trace_next_chunk(TraceReader *r) {
+  u8 header[4 * 64];
+  uint header_len = 4 + 4 * r->num_columns;
+  if (r->num_columns >= 64 ||
+      fread(header, 1, header_len, r->f) != header_len) {
+    r->rows = 0;
+    return false;
+  }
+  r->rows = get_u32(header);
+  if (r->rows > TRACE_CHUNK_ROWS) {
+    error("A chunk of the trace has more rows than it can.");
+  }
+  for (uint c = 0; c < r->num_columns; c++) {
+    uint len = get_u32(header + 4 + 4 * c);
+    if (c >= TC_COUNT || !(r->wanted & (1u << c))) {
+      fseek(r->f, len, SEEK_CUR);
+      continue;
+    }
+    if (len > sizeof(r->encoded) || fread(r->encoded, 1, len, r->f) != len) {
+      error("The trace is cut short.");
+    }
+    decode_column(r, c, len);
+  }
+  return true;
+}
+
+void trace_reader_close(TraceReader *r) {
+  fclose(r->f);
+  r->f = NULL;
+}
+
+const char *trace_access_to_string(TraceAccess a) {
+  switch (a) {
+  case TA_NONE:
+    return "none";
+  case TA_READ:
+    return "read";
+  case TA_WRITE:
+    return "write";
+  default:
+    return "unknown";
+  }
+}
+
+// at $0600. ldx #$00, loop: txa, pha, pla, sta $0200,X, inc $10, jsr sub,
+// inx, bne loop, ldy $0200, brk, sub: rts. 256 times around and then some.
+static const u8 trace_program[] = {0xa2, 0x00, 0x8a, 0x48, 0x68, 0x9d,
+                                   0x00, 0x02, 0xe6, 0x10, 0x20, 0x15,
+                                   0x06, 0xe8, 0xd0, 0xf2, 0xac, 0x00,
+                                   0x02, 0x00, 0x00, 0x60};
+
+static void load_trace_program(Core *c) {
+  core_init(c);
+  core_load(c, trace_program, 0x0600, sizeof(trace_program));
+  core_reset(c, 0x0600);
+}
+
+void test_trace() {
+  printf("\n\nTESTING TRACE\n\n\n");
+
+  init_decode_table();
+
+  static Core c, step;
+  static Trace t;
+  static TraceReader r;
+  char path[] = "/tmp/6502-trace-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    error("Couldn't make a file for the trace test.");
+  }
+
+  // run it several times over, so it takes a few chunks.
+  trace_open(&t, fd);
+  load_trace_program(&c);
+  uint runs = 0;
+  while (t.total_rows + t.rows < 3 * TRACE_CHUNK_ROWS) {
+    load_trace_program(&c);
+    core_run_observed(&c, (RunBudget){0}, &t, NULL);
+    runs++;
+  }
+  trace_close(&t);
+  close(fd);
+  ASSERT(t.chunks == 4 && t.total_rows == runs * c.instructions,
+         "a row for every instruction");
+  printf("%lu rows in %lu bytes\n", (unsigned long)t.total_rows,
+         (unsigned long)t.bytes);
+
+  // every row against a core stepped one instruction at a time.
+  trace_reader_open(&r, path, TRACE_ALL_COLUMNS);
+  uint mismatched = 0, rows = 0, writes = 0, pushes = 0;
+  load_trace_program(&step);
+  while (trace_next_chunk(&r)) {
+    for (uint i = 0; i < r.rows; i++, rows++) {
+      if (step.memory[step.pc] == 0x00) {
+        load_trace_program(&step);
+      }
+      u16 pc = step.pc;
+      u64 cycles = step.cycles;
+      core_run_plain(&step, (RunBudget){.instructions = 1});
+
+      u16 *col[TC_COUNT];
+      for (uint k = 0; k < TC_COUNT; k++) {
+        col[k] = &r.columns[k][i];
+      }
+      mismatched += *col[TC_PC] != pc || *col[TC_A] != step.a ||
+                    *col[TC_X] != step.x || *col[TC_Y] != step.y ||
+                    *col[TC_SP] != step.sp || *col[TC_P] != step.p ||
+                    *col[TC_OPCODE] != step.memory[pc] ||
+                    *col[TC_CYCLES] != step.cycles - cycles;
+      if (*col[TC_ACCESS] != TA_NONE) {
+        mismatched += *col[TC_VALUE] != step.memory[*col[TC_ADDRESS]];
+      }
+      writes += *col[TC_OPCODE] == 0x9d && *col[TC_ACCESS] == TA_WRITE &&
+                *col[TC_ADDRESS] == 0x0200 + step.x;
+      pushes += *col[TC_OPCODE] == 0x48 && *col[TC_ACCESS] == TA_WRITE &&
+                *col[TC_ADDRESS] == 0x01fd && *col[TC_VALUE] == step.a;
+    }
+  }
+  trace_reader_close(&r);
+  ASSERT(rows == t.total_rows && mismatched == 0,
+         "reading it back matches stepping it");
+  ASSERT(writes == 256 * runs && pushes == 256 * runs,
+         "the stores and pushes say where they went");
+
+  // only the pcs, everything else stays how it was.
+  memset(r.columns, 0xff, sizeof(r.columns));
+  trace_reader_open(&r, path, 1u << TC_PC);
+  trace_next_chunk(&r);
+  ASSERT(r.columns[TC_PC][0] == 0x0600 && r.columns[TC_PC][1] == 0x0602 &&
+             r.columns[TC_A][0] == 0xffff,
+         "a reader only decodes the columns it wants");
+  trace_reader_close(&r);
+  unlink(path);
+
+  printf("\n\nDONE TESTING TRACE, SUCCESS!\n\n\n");
+}
+
+#define BENCH_TRACE_RUNS 2000
+
+static double bench_runs(Trace *t) {
+  static Core c;
+  struct timespec start, end;
+  u64 instructions = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < BENCH_TRACE_RUNS; i++) {
+    load_trace_program(&c);
+    if (t != NULL) {
+      core_run_observed(&c, (RunBudget){0}, t, NULL);
+    } else {
+      core_run_plain(&c, (RunBudget){0});
+    }
+    instructions += c.instructions;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return instructions / seconds / 1e6;
+}
+
+void bench_trace() {
+  init_decode_table();
+
+  static Trace t;
+  FILE *f = tmpfile();
+  double plain = bench_runs(NULL);
+  trace_open(&t, fileno(f));
+  double traced = bench_runs(&t);
+  trace_close(&t);
+  fclose(f);
+  printf("trace: %.1f MIPS plain, %.1f MIPS traced (%.0f%%), %.2f bytes a "
+         "row\n",
+         plain, traced, traced / plain * 100,
+         (double)t.bytes / t.total_rows);
+}
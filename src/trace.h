@@ -0,0 +1,151 @@
+#pragma once
+
+#include "defines.h"
+#include "pragma.h"
+#include "writer.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// a row for every instruction a run executes, written out in columns for
+// scanning later instead of as text. rows are grouped into chunks of
+// TRACE_CHUNK_ROWS, and each chunk stores every column on its own, delta
+// encoded against the row before, so a reader that only wants the pcs only
+// reads the pcs.
+//
+// the file is the magic, the version and the number of columns, then the
+// chunks. a chunk is the row count and each column's length in bytes (all
+// u32, little endian), then the columns in order. the 16 bit columns are
+// zigzag varints of the difference from the row before, the 8 bit ones are
+// one byte each of the difference, wrapping, except a zero is followed by a
+// varint of how many more rows it's zero for. every chunk starts over from
+// 0, so they can be read on their own.
+
+#define TRACE_MAGIC "6502TRC"
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_ROWS 0x4000
+
+typedef enum TraceColumn {
+  TC_PC = 0, // where the instruction was, everything else is after it ran.
+  TC_OPCODE,
+  TC_A,
+  TC_X,
+  TC_Y,
+  TC_SP,
+  TC_P,
+  TC_CYCLES, // what the instruction took.
+  TC_ACCESS, // a TraceAccess.
+  TC_ADDRESS,
+  TC_VALUE,
+  TC_COUNT,
+} TraceColumn;
+
+#define TRACE_ALL_COLUMNS ((1u << TC_COUNT) - 1)
+
+// the memory an instruction touched, the last byte of it if it was more than
+// one. address and value are 0 for TA_NONE.
+typedef enum TraceAccess {
+  TA_NONE = 0,
+  TA_READ,
+  TA_WRITE,
+} TraceAccess;
+
+// where an opcode's access is, worked out once from the decode table.
+typedef enum TraceEffect {
+  TE_NONE = 0,
+  TE_READ,  // reads the effective address.
+  TE_WRITE, // writes the effective address, stores and read-modify-writes.
+  TE_PUSH,  // writes the stack, the byte just below sp afterwards.
+  TE_PULL,  // reads the stack, the byte at sp afterwards.
+} TraceEffect;
+
+typedef struct Trace {
+  Writer out;
+  u8 effects[256];
+
+  uint rows; // in the chunk being filled.
+  u16 columns[TC_COUNT][TRACE_CHUNK_ROWS];
+  // the chunk's columns, encoded. 3 bytes a row is more than the worst case
+  // for either kind of column.
+  u8 encoded[TC_COUNT][TRACE_CHUNK_ROWS * 3];
+
+  u64 total_rows;
+  u64 chunks;
+  u64 bytes;
+} Trace;
+
+// start a trace file on fd, which isn't closed at the end.
+void trace_open(Trace *t, int fd);
+// write out what's left in the last chunk.
+void trace_close(Trace *t);
+
+void trace_flush_chunk(Trace *t);
+
+// one instruction, called by core_run_observed after it runs. ea is the
+// effective address it used, if it had one.
+static inline ALWAYS_INLINE void trace_add(Trace *t, const u8 *memory, u16 pc,
+                                           u8 opcode, const u8 regs[5],
+                                           u8 cycles, u16 ea) {
+  uint i = t->rows;
+  t->columns[TC_PC][i] = pc;
+  t->columns[TC_OPCODE][i] = opcode;
+  t->columns[TC_A][i] = regs[0];
+  t->columns[TC_X][i] = regs[1];
+  t->columns[TC_Y][i] = regs[2];
+  t->columns[TC_SP][i] = regs[3];
+  t->columns[TC_P][i] = regs[4];
+  t->columns[TC_CYCLES][i] = cycles;
+
+  u8 sp = regs[3];
+  TraceAccess access = TA_NONE;
+  u16 address = 0;
+  switch ((TraceEffect)t->effects[opcode]) {
+  case TE_NONE:
+    break;
+  case TE_READ:
+  case TE_WRITE:
+    access = (t->effects[opcode] == TE_READ) ? TA_READ : TA_WRITE;
+    address = ea;
+    break;
+  case TE_PUSH:
+    access = TA_WRITE;
+    address = 0x100 | (u8)(sp + 1);
+    break;
+  case TE_PULL:
+    access = TA_READ;
+    address = 0x100 | sp;
+    break;
+  }
+  t->columns[TC_ACCESS][i] = access;
+  t->columns[TC_ADDRESS][i] = address;
+  t->columns[TC_VALUE][i] = (access != TA_NONE) ? memory[address] : 0;
+
+  if (++t->rows == TRACE_CHUNK_ROWS) {
+    trace_flush_chunk(t);
+  }
+}
+
+// reads a trace back a chunk at a time, decoding only the columns asked for.
+typedef struct TraceReader {
+  FILE *f;
+  u32 wanted; // a bit per TraceColumn.
+  uint num_columns;
+
+  uint rows; // in the chunk that was just read.
+  u16 columns[TC_COUNT][TRACE_CHUNK_ROWS];
+  u8 encoded[TRACE_CHUNK_ROWS * 3];
+} TraceReader;
+
+// errors out if path isn't a trace. wanted is a bit per column, or
+// TRACE_ALL_COLUMNS.
+void trace_reader_open(TraceReader *r, const char *path, u32 wanted);
+// the next chunk into r->rows and r->columns, false at the end of the file.
+// the columns that weren't wanted are left alone.
+bool trace_next_chunk(TraceReader *r);
+void trace_reader_close(TraceReader *r);
+
+const char *trace_access_to_string(TraceAccess a);
+
+void test_trace();
+void bench_trace();
@@ -10,6 +10,8 @@
 
 #include "util.h"
 
+bool debug_output = true;
+
 void error(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -21,7 +23,7 @@ void error(const char *format, ...) {
 }
 
 int char_to_int(char digit) {
-  printf("Converting %c to an int.\n", digit);
+  DEBUG_PRINTF("Converting %c to an int.\n", digit);
   if (digit >= '0' && digit <= '9') {
     return digit - '0';
   }
@@ -66,7 +68,7 @@ uint hex_to_int(const char *hex_string, uint len) {
   uint ch_value;
   char ch;
 
-  printf("hex string conversion: %s\n", hex_string);
+  DEBUG_PRINTF("hex string conversion: %s\n", hex_string);
   for (int i = 0; i < len; i++) {
     ch = hex_string[len - i -
                     1]; // We start from the least significant character.
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
 
@@ -15,6 +16,17 @@
     }                                                                          \
   } while (0)
 
+// the tracing all through the lexer and parser. it's on by default, the batch
+// modes turn it off so stdout only has what they print themselves.
+extern bool debug_output;
+
+#define DEBUG_PRINTF(...)                                                      \
+  do {                                                                         \
+    if (debug_output) {                                                        \
+      printf(__VA_ARGS__);                                                     \
+    }                                                                          \
+  } while (0)
+
 void error(const char *format, ...) __attribute__((__noreturn__));
 int char_to_int(char digit);
 size_t read_into_buf(const char *path, char *buffer, size_t bufferSize);
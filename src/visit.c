@@ -4,7 +4,9 @@
 #include "cpu.h"
 #include "defines.h"
 #include "lexer.h"
+#include "macro.h"
 #include "mempool.h"
+#include "span.h"
 #include "symtab.h"
 #include <stdio.h>
 
@@ -158,6 +160,26 @@ void visit_print(NodeIndex n_idx) {
     printf("(LABEL: %s)\n", (char *)visit(n.left).as_ptr);
   } break;
 
+  case NT_PRAGMA: {
+    printf("(PRAGMA: [PragmaType %lu])\n", n.data.as_raw_data);
+    if (n.left != NULL_INDEX)
+      visit_print(n.left);
+  } break;
+
+  case NT_DATA: {
+    printf("(DATA: %u bytes)\n", data_spans[n.data.as_raw_data].len);
+  } break;
+
+  case NT_MACRO_CALL: {
+    printf("(MACRO CALL: %s)\n",
+           macros[((MacroCall *)n.data.as_ptr)->macro].name);
+  } break;
+
+  case NT_REPT: {
+    printf("(REPT: %lu)\n", n.data.as_raw_data);
+    visit_print(n.left);
+  } break;
+
   case NT_BLOCK: {
     // block only contains one st list.
     printf("(BLOCK)\n");
@@ -0,0 +1,65 @@
+#include "writer.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define HEX_ROW(hi)                                                            \
+  {hi, '0'}, {hi, '1'}, {hi, '2'}, {hi, '3'}, {hi, '4'}, {hi, '5'},            \
+      {hi, '6'}, {hi, '7'}, {hi, '8'}, {hi, '9'}, {hi, 'a'}, {hi, 'b'},        \
+      {hi, 'c'}, {hi, 'd'}, {hi, 'e'}, {hi, 'f'}
+
+const char hex_pairs[256][2] = {
+    HEX_ROW('0'), HEX_ROW('1'), HEX_ROW('2'), HEX_ROW('3'),
+    HEX_ROW('4'), HEX_ROW('5'), HEX_ROW('6'), HEX_ROW('7'),
+    HEX_ROW('8'), HEX_ROW('9'), HEX_ROW('a'), HEX_ROW('b'),
+    HEX_ROW('c'), HEX_ROW('d'), HEX_ROW('e'), HEX_ROW('f'),
+};
+
+#undef HEX_ROW
+
+void writer_init(Writer *w, int fd) {
+  w->fd = fd;
+  w->len = 0;
+}
+
+// keep calling write() until everything is out, short writes are allowed by
+// posix and do actually happen on pipes.
+static void write_all(int fd, const char *s, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, s, n);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Writer output failed");
+      error("Could not write %lu bytes to fd %d.", n, fd);
+    }
+    s += written;
+    n -= written;
+  }
+}
+
+void writer_flush(Writer *w) {
+  write_all(w->fd, w->buf, w->len);
+  w->len = 0;
+}
+
+void writer_put_large(Writer *w, const char *s, size_t n) {
+  writer_flush(w);
+  write_all(w->fd, s, n);
+}
+
+void writer_put_u64(Writer *w, u64 value) {
+  // 20 digits is enough for the biggest u64.
+  char digits[20];
+  int i = sizeof(digits);
+
+  do {
+    digits[--i] = '0' + (value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  writer_put(w, digits + i, sizeof(digits) - i);
+}
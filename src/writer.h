@@ -0,0 +1,79 @@
+#pragma once
+
+#include "defines.h"
+#include "pragma.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// how much text we batch up before actually hitting the fd with a write().
+#define WRITER_BUF_SIZE (1024 * 64)
+
+// the most any single writer_reserve() call can ask for.
+#define WRITER_MAX_RESERVE 256
+
+// a buffered output sink. all the text output paths (disassembly, listings,
+// reports) go through this instead of printf, so we only pay for a syscall
+// every WRITER_BUF_SIZE bytes and never pay for format string parsing.
+typedef struct Writer {
+  int fd;
+  size_t len; // how much of buf is filled.
+  char buf[WRITER_BUF_SIZE];
+} Writer;
+
+// lowercase hex pairs for every byte value, "00" through "ff". lowercase since
+// that's the only hex the lexer will read back in.
+extern const char hex_pairs[256][2];
+
+void writer_init(Writer *w, int fd);
+void writer_flush(Writer *w);
+// flush, then write() a big chunk directly without going through the buffer.
+void writer_put_large(Writer *w, const char *s, size_t n);
+
+// make sure there's at least n bytes free at the end of the buffer, and return
+// a cursor to them. the caller writes directly into the cursor and then bumps
+// w->len itself.
+static inline ALWAYS_INLINE char *writer_reserve(Writer *w, size_t n) {
+  if (w->len + n > WRITER_BUF_SIZE) {
+    writer_flush(w);
+  }
+  return w->buf + w->len;
+}
+
+static inline ALWAYS_INLINE void writer_put(Writer *w, const char *s,
+                                            size_t n) {
+  if (n > WRITER_MAX_RESERVE) {
+    // too big to be worth batching, write it straight out.
+    writer_put_large(w, s, n);
+    return;
+  }
+  char *c = writer_reserve(w, n);
+  memcpy(c, s, n);
+  w->len += n;
+}
+
+static inline ALWAYS_INLINE void writer_put_str(Writer *w, const char *s) {
+  writer_put(w, s, strlen(s));
+}
+
+static inline ALWAYS_INLINE void writer_put_char(Writer *w, char ch) {
+  char *c = writer_reserve(w, 1);
+  *c = ch;
+  w->len++;
+}
+
+static inline ALWAYS_INLINE void writer_put_hex8(Writer *w, u8 value) {
+  char *c = writer_reserve(w, 2);
+  memcpy(c, hex_pairs[value], 2);
+  w->len += 2;
+}
+
+static inline ALWAYS_INLINE void writer_put_hex16(Writer *w, u16 value) {
+  char *c = writer_reserve(w, 4);
+  memcpy(c, hex_pairs[value >> 8], 2);
+  memcpy(c + 2, hex_pairs[value & 0xff], 2);
+  w->len += 4;
+}
+
+// unsigned decimal.
+void writer_put_u64(Writer *w, u64 value);